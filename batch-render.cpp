@@ -0,0 +1,148 @@
+#include "batch-render.h"
+
+#include <glad/glad.h>
+
+#include <iostream>
+#include <chrono>
+#include <cstring>
+
+#include "raytrace.h"
+#include "image-writer.h"
+#include "util.h"
+#include "profiler.h"
+#include "gpu-profiler.h"
+
+static GLuint createImage(GLenum format, int width, int height) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    return texture;
+}
+
+/*
+ * Frame, primary hit distance and colour moment images, swapped every frame like the render loop's
+ */
+struct BatchImages {
+    GLuint frames[2], depths[2], moments[2];
+    GLuint guide, denoisedFrame;
+};
+
+static GLuint renderView(const CameraView &view, const BatchRenderSettings &settings, BatchImages &images) {
+    /*
+     * Returns the image holding the view, which the GPU may still be rendering.
+     */
+    const int num_groups_x = (settings.width + RAYTRACE_WORKGROUP_SIZE - 1) / RAYTRACE_WORKGROUP_SIZE;
+    const int num_groups_y = (settings.height + RAYTRACE_WORKGROUP_SIZE - 1) / RAYTRACE_WORKGROUP_SIZE;
+    for (int frame = 0; frame < view.numFrames; frame++) {
+        glBindImageTexture(CURR_FRAME_BINDING, images.frames[0], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+        glBindImageTexture(PREV_FRAME_BINDING, images.frames[1], 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+        glBindImageTexture(CURR_DEPTH_BINDING, images.depths[0], 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32F);
+        glBindImageTexture(PREV_DEPTH_BINDING, images.depths[1], 0, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+        glBindImageTexture(CURR_MOMENTS_BINDING, images.moments[0], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+        glBindImageTexture(PREV_MOMENTS_BINDING, images.moments[1], 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+        glBindImageTexture(GUIDE_BINDING, images.guide, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+        raytrace(view.position, view.rotation, RENDER_MODE, frame, num_groups_x, num_groups_y, settings.pipeline);
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+        if (frame == view.numFrames - 1 && settings.denoise) {
+            denoise(images.frames[0], images.depths[0], images.guide, images.moments[0], images.denoisedFrame,
+                    num_groups_x, num_groups_y);
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+            return images.denoisedFrame;
+        }
+        std::swap(images.frames[0], images.frames[1]);
+        std::swap(images.depths[0], images.depths[1]);
+        std::swap(images.moments[0], images.moments[1]);
+    }
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+    return images.frames[1];
+}
+
+void renderCameraPathGPU(const std::vector<CameraView> &views, const std::string &outputPath,
+                         const BatchRenderSettings &settings) {
+    /*
+     * View i is rendered into pixel buffer i % 2 while view i - 1 is waited for, mapped and written from the other.
+     * The GPU time of each view is measured with a timer query around its frames, which does not depend on how
+     * long the CPU spends writing images.
+     */
+    setAdaptiveSampling(false);
+    BatchImages images{};
+    for (int i = 0; i < 2; i++) {
+        images.frames[i] = createImage(GL_RGBA32F, settings.width, settings.height);
+        images.depths[i] = createImage(GL_R32F, settings.width, settings.height);
+        images.moments[i] = createImage(GL_RGBA32F, settings.width, settings.height);
+    }
+    images.guide = createImage(GL_RGBA32F, settings.width, settings.height);
+    images.denoisedFrame = createImage(GL_RGBA32F, settings.width, settings.height);
+    const size_t numPixels = (size_t) settings.width * settings.height;
+    GLuint pixelBuffers[2], timerQueries[2];
+    GLsync fences[2] = {nullptr, nullptr};
+    glGenBuffers(2, pixelBuffers);
+    glGenQueries(2, timerQueries);
+    for (GLuint pixelBuffer : pixelBuffers) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr) (numPixels * sizeof(glm::vec4)), nullptr, GL_STREAM_READ);
+    }
+    checkGLError("(renderCameraPathGPU) allocate images");
+
+    // One untimed frame first, so that the buffers the raytracer allocates on its first frame, and the driver's
+    // own warm-up, do not count towards the first view's time
+    if (!views.empty())
+        renderView({views[0].position, views[0].rotation, 1}, settings, images);
+    glFinish();
+
+    std::vector<glm::vec4> pixels(numPixels);
+    double totalGPUMs = 0.0;
+    auto batchStart = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i <= views.size(); i++) {
+        const size_t slot = i % 2;
+        if (i < views.size()) {
+            glBeginQuery(GL_TIME_ELAPSED, timerQueries[slot]);
+            GLuint image = renderView(views[i], settings, images);
+            glEndQuery(GL_TIME_ELAPSED);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffers[slot]);
+            glBindTexture(GL_TEXTURE_2D, image);
+            glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, nullptr);
+            fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            glFlush();
+        }
+        if (i == 0) {
+            PROFILE_FRAME();
+            continue;
+        }
+        const size_t prevSlot = 1 - slot;
+        while (glClientWaitSync(fences[prevSlot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {}
+        glDeleteSync(fences[prevSlot]);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffers[prevSlot]);
+        const void *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                                              (GLsizeiptr) (numPixels * sizeof(glm::vec4)), GL_MAP_READ_BIT);
+        std::memcpy(pixels.data(), mapped, numPixels * sizeof(glm::vec4));
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        GLuint64 elapsed;
+        glGetQueryObjectui64v(timerQueries[prevSlot], GL_QUERY_RESULT, &elapsed);
+        totalGPUMs += (double) elapsed / 1e6;
+        std::string viewPath = getSequencePath(outputPath, (int) (i - 1));
+        writeImage(viewPath, pixels, settings.width, settings.height);
+        std::cout << "VIEW " << i - 1 << ": " << views[i - 1].numFrames << " FRAMES IN " << (double) elapsed / 1e6
+                  << " ms GPU, WROTE " << viewPath << std::endl;
+        PROFILE_GPU_FRAME();
+        PROFILE_FRAME();
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    checkGLError("(renderCameraPathGPU) render views");
+    std::chrono::duration<double> batchTime = std::chrono::high_resolution_clock::now() - batchStart;
+    std::cout << "RENDERED " << views.size() << " VIEWS AT " << settings.width << "x" << settings.height << " IN "
+              << batchTime.count() << " s, " << totalGPUMs << " ms GPU ("
+              << (double) views.size() / batchTime.count() * 3600.0 << " VIEWS/HOUR)" << std::endl;
+
+    glDeleteBuffers(2, pixelBuffers);
+    glDeleteQueries(2, timerQueries);
+    for (int i = 0; i < 2; i++) {
+        GLuint textures[3] = {images.frames[i], images.depths[i], images.moments[i]};
+        glDeleteTextures(3, textures);
+    }
+    glDeleteTextures(1, &images.guide);
+    glDeleteTextures(1, &images.denoisedFrame);
+}
@@ -0,0 +1,30 @@
+#ifndef OPENGL_RAYTRACER_BATCH_RENDER_H
+#define OPENGL_RAYTRACER_BATCH_RENDER_H
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "camera.h"
+
+struct BatchRenderSettings {
+    int width = 1280;
+    int height = 720;
+    int pipeline = RAYTRACE_PIPELINE;
+    bool denoise = false;
+};
+
+/*
+ * Renders every view of a camera path offscreen, at the view's own number of frames, into a numbered sequence of
+ * images (see getSequencePath), printing each view's GPU time and the throughput of the whole batch.
+ * Needs a GL context in which raytraceInit was given the settings' width and height. Every view starts from
+ * frame 0, so its image does not depend on the views before it, and adaptive sampling is turned off, so every
+ * pixel gets all of the view's frames whatever the pipeline.
+ * Each view is read back through one of two pixel buffers, and written while the GPU renders the next one.
+ */
+extern void renderCameraPathGPU(const std::vector<CameraView>& views, const std::string& outputPath,
+                                const BatchRenderSettings& settings);
+
+#endif //OPENGL_RAYTRACER_BATCH_RENDER_H
@@ -0,0 +1,997 @@
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <thread>
+#include <cstring>
+#include <cmath>
+#include <random>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <limits>
+#include <algorithm>
+#include <tuple>
+
+#include "constants.h"
+#include "obj-reader.h"
+#include "bvh.h"
+#include "bvh-order.h"
+#include "scene-loader.h"
+#include "mesh-geometry.h"
+#include "dynamic-mesh.h"
+#include "cpu-raytrace.h"
+#include "cpu-denoise.h"
+
+/*
+ * Headless benchmarks, run from the build directory as
+ * opengl_raytracer_benchmark <benchmark> [args...]
+ */
+
+static bool sameBVH(const std::vector<BVHNode> &a, const std::vector<BVHNode> &b) {
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(BVHNode)) == 0;
+}
+
+static const std::map<std::string, int> SPLIT_METHODS = {
+        {"ternary", BVH_SPLIT_TERNARY},
+        {"binned", BVH_SPLIT_BINNED},
+        {"sbvh", BVH_SPLIT_SBVH},
+        {"lbvh", BVH_SPLIT_LBVH},
+        {"ploc", BVH_SPLIT_PLOC},
+};
+
+static void benchmarkBVHScaling(const std::vector<std::string> &args) {
+    /*
+     * Builds the BVH of the given OBJ with 1 to N threads,
+     * checking every build against the single-threaded one.
+     */
+    std::string path = args.empty() ? SCENE_FILE_PATH : args[0];
+    int maxThreads = args.size() > 1 ? std::stoi(args[1]) : (int) std::max(1u, std::thread::hardware_concurrency());
+    int splitMethod = args.size() > 2 ? SPLIT_METHODS.at(args[2]) : BVH_SPLIT_METHOD;
+    ObjContents *contents = readObjContents(path);
+    std::cout << "BVH SCALING: " << path << ", " << contents->triangles.size() << " triangles" << std::endl;
+    std::vector<BVHNode> serialNodes;
+    std::vector<glm::uvec3> serialTriangles;
+    std::vector<uint32_t> serialTriangleIndices;
+    double serialTime = 0.0;
+    for (int numThreads = 1; numThreads <= maxThreads; numThreads++) {
+        std::vector<glm::uvec3> triangles = contents->triangles;
+        std::vector<uint32_t> triangleIndices;
+        BVHBuildStats stats;
+        std::vector<BVHNode> nodes = generateBVH(triangles, contents->vertices, triangleIndices,
+                                                 {splitMethod, numThreads, false}, &stats);
+        if (numThreads == 1) {
+            serialNodes = nodes;
+            serialTriangles = triangles;
+            serialTriangleIndices = triangleIndices;
+            serialTime = stats.buildTimeMs;
+        }
+        bool identical = sameBVH(nodes, serialNodes) && triangles == serialTriangles &&
+                         triangleIndices == serialTriangleIndices;
+        std::cout << numThreads << " THREADS: " << stats.buildTimeMs << " ms, SPEED-UP "
+                  << serialTime / stats.buildTimeMs << "x" << (identical ? "" : ", OUTPUT DIFFERS") << std::endl;
+    }
+    delete contents;
+}
+
+static ObjContents *readObjContentsStream(const std::string &filePath) {
+    /*
+     * The line-by-line istringstream reader that readObjContents replaced, kept as the throughput baseline.
+     * Only reads the v and v//vn face forms.
+     */
+    std::ifstream fin(filePath);
+    if (!fin) throw std::runtime_error("Could not open file: " + filePath);
+    auto *res = new ObjContents();
+    unsigned int i1, i2, i3, a, b, c;
+    float x, y, z;
+    std::string line;
+    while (std::getline(fin, line)) {
+        if (line.empty()) continue;
+        std::istringstream iss(line);
+        std::string type;
+        iss >> type;
+        if (type == "v") {
+            if (!(iss >> x >> y >> z)) continue;
+            res->vertices.emplace_back(x, y, z);
+        } else if (type == "f") {
+            if (sscanf(line.c_str(), "f %u//%u %u//%u %u//%u", &i1, &a, &i2, &b, &i3, &c) == 6 ||
+                sscanf(line.c_str(), "f %u %u %u", &i1, &i2, &i3) == 3) {
+                res->triangles.emplace_back(--i1, --i2, --i3);
+            }
+        }
+    }
+    return res;
+}
+
+static void writeSyntheticObj(const std::string &path, size_t targetSize) {
+    /*
+     * Writes a subdivided sphere of roughly targetSize bytes, with v//vn faces so that the baseline reader
+     * can parse it too.
+     */
+    std::ofstream fout(path, std::ios::binary);
+    if (!fout) throw std::runtime_error("Could not open file: " + path);
+    // About 40 bytes per vertex line and 2 triangles of about 45 bytes per vertex
+    int resolution = std::max(2, (int) std::sqrt((double) targetSize / 130.0));
+    std::string buffer;
+    char line[128];
+    for (int i = 0; i <= resolution; i++) {
+        float theta = glm::pi<float>() * (float) i / (float) resolution;
+        for (int j = 0; j <= resolution; j++) {
+            float phi = 2.0f * glm::pi<float>() * (float) j / (float) resolution;
+            buffer.append(line, snprintf(line, sizeof(line), "v %.6f %.6f %.6f\n", std::sin(theta) * std::cos(phi),
+                                         std::cos(theta), std::sin(theta) * std::sin(phi)));
+        }
+        fout << buffer;
+        buffer.clear();
+    }
+    for (int i = 0; i < resolution; i++) {
+        for (int j = 0; j < resolution; j++) {
+            int v0 = i * (resolution + 1) + j + 1, v1 = v0 + 1, v2 = v0 + resolution + 1, v3 = v2 + 1;
+            buffer.append(line, snprintf(line, sizeof(line), "f %d//%d %d//%d %d//%d\nf %d//%d %d//%d %d//%d\n",
+                                         v0, v0, v2, v2, v1, v1, v1, v1, v2, v2, v3, v3));
+        }
+        fout << buffer;
+        buffer.clear();
+    }
+}
+
+template<typename Fn>
+static double getTimeMs(Fn fn) {
+    auto start = std::chrono::high_resolution_clock::now();
+    fn();
+    std::chrono::duration<double, std::milli> time = std::chrono::high_resolution_clock::now() - start;
+    return time.count();
+}
+
+static void benchmarkObjThroughput(const std::vector<std::string> &args) {
+    /*
+     * Compares the parse throughput of readObjContents against the stream reader it replaced,
+     * on the bundled scene and a synthetic file of the given size in MB (256 by default),
+     * or on the OBJ files given after the size.
+     */
+    size_t syntheticSize = (args.empty() ? 256 : std::stoull(args[0])) << 20;
+    std::vector<std::string> paths(args.begin() + std::min<size_t>(1, args.size()), args.end());
+    std::string syntheticPath = "obj-throughput-synthetic.obj";
+    if (paths.empty()) {
+        std::cout << "WRITING " << (syntheticSize >> 20) << " MB SYNTHETIC OBJ" << std::endl;
+        writeSyntheticObj(syntheticPath, syntheticSize);
+        paths = {SCENE_FILE_PATH, syntheticPath};
+    }
+    for (const std::string &path : paths) {
+        double sizeMB = (double) std::filesystem::file_size(path) / (1 << 20);
+        ObjContents *streamContents = nullptr, *contents = nullptr;
+        double streamTime = getTimeMs([&] { streamContents = readObjContentsStream(path); });
+        double time = getTimeMs([&] { contents = readObjContents(path); });
+        bool identical = streamContents->vertices == contents->vertices &&
+                         streamContents->triangles == contents->triangles;
+        std::cout << "OBJ THROUGHPUT: " << path << ", " << sizeMB << " MB, " << contents->vertices.size()
+                  << " vertices, " << contents->triangles.size() << " triangles" << std::endl;
+        std::cout << "  STREAM READER: " << streamTime << " ms, " << sizeMB / streamTime * 1000.0 << " MB/s"
+                  << std::endl;
+        std::cout << "  MAPPED READER: " << time << " ms, " << sizeMB / time * 1000.0 << " MB/s, SPEED-UP "
+                  << streamTime / time << "x" << (identical ? "" : ", OUTPUT DIFFERS") << std::endl;
+        delete streamContents;
+        delete contents;
+    }
+    if (paths.back() == syntheticPath)
+        std::filesystem::remove(syntheticPath);
+}
+
+static void benchmarkSceneStartup(const std::vector<std::string> &args) {
+    /*
+     * Loads the OBJ's mesh with its cache removed, then again from the cache it wrote.
+     */
+    std::string path = args.empty() ? SCENE_FILE_PATH : args[0];
+    std::filesystem::remove(getMeshCachePath(path));
+    MeshLoadStats coldStats, warmStats;
+    delete loadMesh(path, &coldStats);
+    MeshData *warmScene = loadMesh(path, &warmStats);
+    std::cout << "SCENE STARTUP: " << path << ", " << warmScene->numTriangles << " triangles" << std::endl;
+    std::cout << "  COLD: " << coldStats.loadTimeMs << " ms" << std::endl;
+    std::cout << "  WARM: " << warmStats.loadTimeMs << " ms, SPEED-UP " << coldStats.loadTimeMs / warmStats.loadTimeMs
+              << "x" << (warmStats.fromCache ? "" : ", CACHE NOT USED") << std::endl;
+    delete warmScene;
+}
+
+static Scene *createSingleInstanceScene(MeshData *mesh) {
+    std::vector<std::unique_ptr<MeshData>> meshes;
+    meshes.emplace_back(mesh);
+    return createScene(std::move(meshes), {{0, glm::mat4(1.0f)}});
+}
+
+static ObjContents *generateSlivers(int numTriangles) {
+    /*
+     * Long thin triangles in random directions through the cube in front of the camera, like the slivers
+     * of CAD and architectural models. Their bounding boxes are mostly empty and overlap each other heavily.
+     */
+    auto *contents = new ObjContents();
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for (int i = 0; i < numTriangles; i++) {
+        glm::vec3 centre(dist(gen), dist(gen), dist(gen));
+        glm::vec3 along = glm::normalize(glm::vec3(dist(gen), dist(gen), dist(gen)));
+        glm::vec3 across = glm::normalize(glm::cross(along, glm::vec3(dist(gen), dist(gen), dist(gen))));
+        auto first = (unsigned int) contents->vertices.size();
+        contents->vertices.push_back(centre - 0.25f * along);
+        contents->vertices.push_back(centre + 0.25f * along);
+        contents->vertices.push_back(centre - 0.25f * along + 0.01f * across);
+        contents->triangles.emplace_back(first, first + 1, first + 2);
+    }
+    return contents;
+}
+
+static void benchmarkSBVH(const std::vector<std::string> &args) {
+    /*
+     * Builds the given OBJ, or the bundled scene and a scene of slivers, with binned object splits and
+     * with SBVH, then renders both on the CPU to measure the traversal cost per ray.
+     */
+    std::vector<std::pair<std::string, ObjContents *>> scenes;
+    if (args.empty()) {
+        scenes.emplace_back(SCENE_FILE_PATH, readObjContents(SCENE_FILE_PATH));
+        scenes.emplace_back("slivers", generateSlivers(10000));
+    } else {
+        scenes.emplace_back(args[0], readObjContents(args[0]));
+    }
+    CpuRenderSettings settings;
+    settings.width = 320;
+    settings.height = 240;
+    settings.numFrames = 4;
+    for (auto &[name, contents] : scenes) {
+        std::cout << "SBVH: " << name << ", " << contents->triangles.size() << " triangles" << std::endl;
+        for (int splitMethod : {BVH_SPLIT_BINNED, BVH_SPLIT_SBVH}) {
+            BVHBuildStats stats;
+            Scene *scene = createSingleInstanceScene(
+                    buildMesh(*contents, {splitMethod, BVH_BUILD_THREADS, false}, &stats));
+            CpuScene cpuScene = prepareCpuScene(scene);
+            std::cout << (splitMethod == BVH_SPLIT_SBVH ? "  SBVH:   " : "  BINNED: ") << stats.buildTimeMs
+                      << " ms BUILD, SAH COST " << stats.sahCost << ", " << stats.numReferences << " REFERENCES, "
+                      << stats.numSpatialSplits << " SPATIAL SPLITS" << std::endl;
+            for (int layout : {BVH_LAYOUT_BINARY, BVH_LAYOUT_WIDE}) {
+                settings.bvhLayout = layout;
+                CpuRenderStats renderStats;
+                renderCPU(cpuScene, settings, &renderStats);
+                std::cout << (layout == BVH_LAYOUT_WIDE ? "    WIDE:   " : "    BINARY: ")
+                          << renderStats.getMraysPerSecond() << " Mrays/s, "
+                          << (double) renderStats.numBoxTests / (double) renderStats.numRays << " BOX TESTS, "
+                          << (double) renderStats.numTriangleTests / (double) renderStats.numRays
+                          << " TRIANGLE TESTS PER RAY" << std::endl;
+            }
+            delete scene;
+        }
+        delete contents;
+    }
+}
+
+static ObjContents *generateSphere(int numTriangles) {
+    /*
+     * A UV sphere of about numTriangles triangles around the camera, for meshes larger than any bundled scene
+     */
+    auto *contents = new ObjContents();
+    int resolution = std::max(2, (int) std::sqrt((double) numTriangles / 2.0));
+    for (int i = 0; i <= resolution; i++) {
+        float theta = glm::pi<float>() * (float) i / (float) resolution;
+        for (int j = 0; j <= resolution; j++) {
+            float phi = 2.0f * glm::pi<float>() * (float) j / (float) resolution;
+            contents->vertices.emplace_back(std::sin(theta) * std::cos(phi), std::cos(theta),
+                                            std::sin(theta) * std::sin(phi));
+        }
+    }
+    for (int i = 0; i < resolution; i++) {
+        for (int j = 0; j < resolution; j++) {
+            unsigned int v0 = i * (resolution + 1) + j, v1 = v0 + 1, v2 = v0 + resolution + 1, v3 = v2 + 1;
+            contents->triangles.emplace_back(v0, v2, v1);
+            contents->triangles.emplace_back(v1, v2, v3);
+        }
+    }
+    return contents;
+}
+
+static void benchmarkLinearBVH(const std::vector<std::string> &args) {
+    /*
+     * Builds the given OBJ, or a sphere of the given number of triangles, or by default the bundled scene and
+     * a scene of slivers, with binned SAH splits and with the Morton code builders with and without treelet
+     * restructuring, then renders each on the CPU to weigh build time against traversal cost.
+     */
+    std::vector<std::pair<std::string, ObjContents *>> scenes;
+    if (args.empty()) {
+        scenes.emplace_back(SCENE_FILE_PATH, readObjContents(SCENE_FILE_PATH));
+        scenes.emplace_back("slivers", generateSlivers(10000));
+    } else if (std::all_of(args[0].begin(), args[0].end(), ::isdigit)) {
+        scenes.emplace_back("sphere", generateSphere(std::stoi(args[0])));
+    } else {
+        scenes.emplace_back(args[0], readObjContents(args[0]));
+    }
+    struct Builder {
+        std::string name;
+        int splitMethod;
+        bool optimizeTreelets;
+    };
+    const std::vector<Builder> builders = {{"BINNED:        ", BVH_SPLIT_BINNED, false},
+                                           {"LBVH:          ", BVH_SPLIT_LBVH, false},
+                                           {"LBVH+TREELETS: ", BVH_SPLIT_LBVH, true},
+                                           {"PLOC:          ", BVH_SPLIT_PLOC, false},
+                                           {"PLOC+TREELETS: ", BVH_SPLIT_PLOC, true}};
+    CpuRenderSettings settings;
+    settings.width = 320;
+    settings.height = 240;
+    settings.numFrames = 4;
+    for (auto &[name, contents] : scenes) {
+        std::cout << "LINEAR BVH: " << name << ", " << contents->triangles.size() << " triangles" << std::endl;
+        for (const Builder &builder : builders) {
+            BVHBuildOptions options{builder.splitMethod, BVH_BUILD_THREADS, false};
+            options.optimizeTreelets = builder.optimizeTreelets;
+            BVHBuildStats stats;
+            Scene *scene = createSingleInstanceScene(buildMesh(*contents, options, &stats));
+            CpuScene cpuScene = prepareCpuScene(scene);
+            CpuRenderStats renderStats;
+            renderCPU(cpuScene, settings, &renderStats);
+            std::cout << "  " << builder.name << stats.buildTimeMs << " ms BUILD, SAH COST " << stats.sahCost
+                      << ", DEPTH " << stats.depth << ", " << renderStats.getMraysPerSecond() << " Mrays/s, "
+                      << (double) renderStats.numBoxTests / (double) renderStats.numRays << " BOX TESTS, "
+                      << (double) renderStats.numTriangleTests / (double) renderStats.numRays
+                      << " TRIANGLE TESTS PER RAY" << std::endl;
+            delete scene;
+        }
+        delete contents;
+    }
+}
+
+static std::vector<Instance> generateInstanceGrid(const MeshData &mesh, int numInstances) {
+    /*
+     * Lays the instances out on a square grid in front of the camera, each with a random yaw and scale.
+     */
+    glm::vec3 extent = mesh.bvhNodes[0].maxCorner - mesh.bvhNodes[0].minCorner;
+    float spacing = 1.5f * std::max(extent.x, std::max(extent.y, extent.z));
+    int gridSize = (int) std::ceil(std::sqrt((float) numInstances));
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<float> yaw(0.0f, glm::two_pi<float>()), scale(0.7f, 1.3f);
+    std::vector<Instance> instances;
+    for (int i = 0; i < numInstances; i++) {
+        glm::vec3 position((float) (i % gridSize) - (float) (gridSize - 1) * 0.5f, -0.5f,
+                           (float) (i / gridSize) + 1.0f);
+        glm::mat4 transform = glm::translate(glm::mat4(1.0f), position * spacing);
+        transform = glm::rotate(transform, yaw(gen), glm::vec3(0.0f, 1.0f, 0.0f));
+        instances.push_back({0, glm::scale(transform, glm::vec3(scale(gen)))});
+    }
+    return instances;
+}
+
+static void benchmarkInstancing(const std::vector<std::string> &args) {
+    /*
+     * Renders a grid of instances of the given OBJ as an instanced scene, and as a single mesh holding a
+     * transformed copy of every instance, comparing memory, build time, trace speed and the time to move one
+     * instance.
+     */
+    std::string path = args.empty() ? SCENE_FILE_PATH : args[0];
+    int numInstances = args.size() > 1 ? std::stoi(args[1]) : 100;
+    ObjContents *contents = readObjContents(path);
+    BVHBuildStats meshStats, flatStats, tlasStats;
+    std::vector<std::unique_ptr<MeshData>> meshes;
+    meshes.emplace_back(buildMesh(*contents, {BVH_SPLIT_METHOD, BVH_BUILD_THREADS, false}, &meshStats));
+    std::vector<Instance> instances = generateInstanceGrid(*meshes[0], numInstances);
+    Scene *instancedScene = createScene(std::move(meshes), instances);
+    buildTLAS(*instancedScene, &tlasStats);
+
+    auto *flatContents = new ObjContents();
+    for (const Instance &instance : instances) {
+        auto firstVertex = (unsigned int) flatContents->vertices.size();
+        for (const glm::vec3 &vertex : contents->vertices)
+            flatContents->vertices.emplace_back(instance.objectToWorld * glm::vec4(vertex, 1.0f));
+        for (const glm::uvec3 &triangle : contents->triangles)
+            flatContents->triangles.push_back(triangle + firstVertex);
+    }
+    Scene *flatScene = createSingleInstanceScene(
+            buildMesh(*flatContents, {BVH_SPLIT_METHOD, BVH_BUILD_THREADS, false}, &flatStats));
+
+    CpuRenderSettings settings;
+    settings.width = 320;
+    settings.height = 240;
+    settings.numFrames = 4;
+    // Single bounce renders are black where a primary ray hits and sky where it misses
+    CpuRenderSettings silhouetteSettings = settings;
+    silhouetteSettings.numFrames = 1;
+    silhouetteSettings.rayBounces = 1;
+    std::cout << "INSTANCING: " << path << ", " << numInstances << " instances of " << contents->triangles.size()
+              << " triangles" << std::endl;
+    std::vector<glm::vec4> silhouettes[2];
+    for (int i = 0; i < 2; i++) {
+        Scene *scene = i == 0 ? instancedScene : flatScene;
+        size_t bytes = scene->tlasNodes.size() * sizeof(BVHNode) + scene->tlasInstances.size() * sizeof(GPUInstance);
+        for (const std::unique_ptr<MeshData> &mesh : scene->meshes)
+            bytes += mesh->buffer.size();
+        CpuScene cpuScene = prepareCpuScene(scene);
+        CpuRenderStats renderStats;
+        renderCPU(cpuScene, settings, &renderStats);
+        silhouettes[i] = renderCPU(cpuScene, silhouetteSettings);
+        std::cout << (i == 0 ? "  INSTANCED: " : "  FLATTENED: ") << (double) bytes / (1 << 20) << " MB, "
+                  << (i == 0 ? meshStats.buildTimeMs + tlasStats.buildTimeMs : flatStats.buildTimeMs)
+                  << " ms BUILD, " << renderStats.getMraysPerSecond() << " Mrays/s, "
+                  << (double) renderStats.numBoxTests / (double) renderStats.numRays << " BOX TESTS, "
+                  << (double) renderStats.numTriangleTests / (double) renderStats.numRays
+                  << " TRIANGLE TESTS PER RAY" << std::endl;
+    }
+    // Triangle colours are per mesh, so only the silhouettes of the two scenes are expected to match
+    int numMismatches = 0;
+    for (size_t i = 0; i < silhouettes[0].size(); i++)
+        numMismatches += (silhouettes[0][i].x == 0.0f) != (silhouettes[1][i].x == 0.0f);
+    std::cout << "  SILHOUETTE MISMATCHES: " << numMismatches << " OF " << silhouettes[0].size() << " PIXELS"
+              << std::endl;
+
+    // Moving an instance only rebuilds the TLAS, where the flattened mesh would have to be rebuilt
+    const int numMoves = 100;
+    double moveTime = getTimeMs([&] {
+        for (int i = 0; i < numMoves; i++) {
+            Instance &instance = instancedScene->instances[i % numInstances];
+            instance.objectToWorld = glm::translate(instance.objectToWorld, glm::vec3(0.0f, 0.01f, 0.0f));
+            buildTLAS(*instancedScene);
+        }
+    });
+    std::cout << "  MOVE ONE INSTANCE: " << moveTime / numMoves << " ms (TLAS REBUILD), "
+              << flatStats.buildTimeMs << " ms (FLATTENED REBUILD)" << std::endl;
+    delete instancedScene;
+    delete flatScene;
+    delete flatContents;
+    delete contents;
+}
+
+static void deformVertices(const std::vector<glm::vec3> &restVertices, std::vector<glm::vec3> &vertices,
+                           float phase, float twistStart) {
+    /*
+     * Twists the part of the mesh above twistStart (from -0.5 at its bottom to 0.5 at its top) about its
+     * vertical axis, by up to a full turn, and bulges it. Triangles end up far from where the initial build
+     * placed them, which is what degrades a refit BVH.
+     */
+    glm::vec3 minCorner = MAX_VERTEX, maxCorner = MIN_VERTEX;
+    for (const glm::vec3 &vertex : restVertices) {
+        minCorner = min(minCorner, vertex);
+        maxCorner = max(maxCorner, vertex);
+    }
+    glm::vec3 centre = (minCorner + maxCorner) * 0.5f;
+    float height = std::max(maxCorner.y - minCorner.y, 1e-6f);
+    for (size_t i = 0; i < restVertices.size(); i++) {
+        glm::vec3 offset = restVertices[i] - centre;
+        float v = std::max(offset.y / height - twistStart, 0.0f) / (0.5f - twistStart);
+        float angle = glm::two_pi<float>() * std::sin(phase) * v;
+        float bulge = 1.0f + 0.3f * std::sin(2.0f * phase) * std::sin(glm::pi<float>() * v);
+        vertices[i] = centre + glm::vec3(bulge * (offset.x * std::cos(angle) - offset.z * std::sin(angle)), offset.y,
+                                         bulge * (offset.x * std::sin(angle) + offset.z * std::cos(angle)));
+    }
+}
+
+static size_t getUploadBytes(const MeshData &mesh, const MeshUpdate &update) {
+    size_t triangleBytes = mesh.triv0.size_bytes() + mesh.triv1.size_bytes() + mesh.triv2.size_bytes() +
+                           mesh.triangleNormals.size_bytes() + mesh.vertexIndices.size_bytes() +
+                           mesh.quantizedTriangles.size_bytes();
+    return (update.bvhNodes.end - update.bvhNodes.begin) * sizeof(BVHNode) +
+           (update.wideBVHNodes.end - update.wideBVHNodes.begin) *
+           (BVH_LAYOUT == BVH_LAYOUT_COMPRESSED ? sizeof(CompressedBVHNode) : sizeof(WideBVHNode)) +
+           (update.triangleIndices.end - update.triangleIndices.begin) * sizeof(uint32_t) +
+           (update.triangles.end - update.triangles.begin) * triangleBytes / mesh.numTriangles +
+           (update.vertices.end - update.vertices.begin) * sizeof(glm::vec3) +
+           (update.quantizationBlocks.end - update.quantizationBlocks.begin) * sizeof(QuantizationBlock);
+}
+
+static void benchmarkRefit(const std::vector<std::string> &args) {
+    /*
+     * Animates the given OBJ through a twist of the whole mesh and one of its top quarter, updating the BVH every
+     * frame by refitting only, by rebuilding, and by refitting under the quality monitor,
+     * then traces the last frame with each of the resulting BVHs.
+     */
+    std::string path = args.empty() ? SCENE_FILE_PATH : args[0];
+    int numFrames = args.size() > 1 ? std::stoi(args[1]) : 60;
+    ObjContents *contents = readObjContents(path);
+    const std::pair<std::string, float> deformations[] = {{"WHOLE MESH TWIST", -0.5f}, {"TOP QUARTER TWIST", 0.25f}};
+    const std::pair<std::string, MeshUpdateOptions> policies[] = {
+            {"REFIT ONLY", {std::numeric_limits<float>::infinity(), false}},
+            {"FULL REBUILD", {0.0f, false}},
+            {"MONITORED", {}},
+    };
+    CpuRenderSettings settings;
+    settings.width = 320;
+    settings.height = 240;
+    settings.numFrames = 4;
+    CpuRenderSettings silhouetteSettings = settings;
+    silhouetteSettings.numFrames = 1;
+    silhouetteSettings.rayBounces = 1;
+    std::cout << "REFIT: " << path << ", " << contents->triangles.size() << " triangles, " << numFrames
+              << " frames" << std::endl;
+    for (const auto &[deformation, twistStart] : deformations) {
+        std::cout << "  " << deformation << std::endl;
+        std::vector<glm::vec4> referenceSilhouette;
+        for (const auto &[policy, options] : policies) {
+            DynamicMesh *mesh = createDynamicMesh(*contents);
+            std::vector<glm::vec3> vertices = contents->vertices;
+            double updateTime = 0.0, maxUpdateTime = 0.0;
+            float sahCostSum = 0.0f;
+            size_t uploadBytes = 0;
+            int numUpdates[4] = {};
+            for (int frame = 1; frame <= numFrames; frame++) {
+                float phase = glm::half_pi<float>() * (float) frame / (float) numFrames;
+                deformVertices(contents->vertices, vertices, phase, twistStart);
+                MeshUpdate update = updateDynamicMesh(*mesh, vertices, options);
+                updateTime += update.updateTimeMs;
+                maxUpdateTime = std::max(maxUpdateTime, update.updateTimeMs);
+                sahCostSum += update.sahCost;
+                uploadBytes += getUploadBytes(*mesh->meshData, update);
+                numUpdates[update.kind]++;
+            }
+            float finalCost = getBVHCost(mesh->meshData->bvhNodes.first(mesh->numBVHNodes));
+            Scene *scene = createSingleInstanceScene(mesh->meshData);
+            CpuScene cpuScene = prepareCpuScene(scene);
+            CpuRenderStats renderStats;
+            renderCPU(cpuScene, settings, &renderStats);
+            // Every policy ends on the same pose, so the silhouettes must all match the first one
+            std::vector<glm::vec4> silhouette = renderCPU(cpuScene, silhouetteSettings);
+            if (referenceSilhouette.empty())
+                referenceSilhouette = silhouette;
+            int numMismatches = 0;
+            for (size_t i = 0; i < silhouette.size(); i++)
+                numMismatches += (silhouette[i].x == 0.0f) != (referenceSilhouette[i].x == 0.0f);
+            std::cout << "    " << policy << ": " << updateTime / numFrames << " ms PER FRAME (MAX "
+                      << maxUpdateTime << " ms), " << (double) uploadBytes / numFrames / (1 << 20)
+                      << " MB UPLOADED PER FRAME" << std::endl;
+            std::cout << "      " << numUpdates[BVH_UPDATE_REFIT] << " REFITS, "
+                      << numUpdates[BVH_UPDATE_PARTIAL_REBUILD] << " PARTIAL REBUILDS, "
+                      << numUpdates[BVH_UPDATE_FULL_REBUILD] << " FULL REBUILDS, SAH COST "
+                      << sahCostSum / (float) numFrames << " AVERAGE, " << finalCost << " LAST FRAME" << std::endl;
+            std::cout << "      LAST FRAME: " << renderStats.getMraysPerSecond() << " Mrays/s, "
+                      << (double) renderStats.numBoxTests / (double) renderStats.numRays << " BOX TESTS, "
+                      << (double) renderStats.numTriangleTests / (double) renderStats.numRays
+                      << " TRIANGLE TESTS PER RAY, " << numMismatches << " SILHOUETTE MISMATCHES" << std::endl;
+            delete scene;
+            delete mesh;
+        }
+    }
+    delete contents;
+}
+
+struct ImageError {
+    double rms;
+    // Error of the pixel that 99% of pixels are below, which is what noise the eye picks out
+    double percentile99;
+};
+
+static ImageError getImageError(const std::vector<glm::vec4> &image, const std::vector<glm::vec4> &reference) {
+    std::vector<double> pixelErrors(image.size());
+    double squaredError = 0.0;
+    for (size_t i = 0; i < image.size(); i++) {
+        glm::vec3 difference = glm::vec3(image[i]) - glm::vec3(reference[i]);
+        pixelErrors[i] = std::sqrt(dot(difference, difference));
+        squaredError += pixelErrors[i] * pixelErrors[i];
+    }
+    auto percentile = pixelErrors.begin() + (ptrdiff_t) (0.99 * (double) (pixelErrors.size() - 1));
+    std::nth_element(pixelErrors.begin(), percentile, pixelErrors.end());
+    return {std::sqrt(squaredError / (double) image.size()), *percentile};
+}
+
+static double getUniformTimeAtError(const std::vector<ImageError> &errors, const std::vector<double> &times,
+                                    double ImageError::*metric, double error) {
+    /*
+     * Interpolates log-log between the uniform renders around the error, or returns 0 outside their range.
+     */
+    if (error > errors.front().*metric || error < errors.back().*metric)
+        return 0.0;
+    size_t i = 1;
+    while (i + 1 < errors.size() && errors[i].*metric > error)
+        i++;
+    double t = std::log(error / (errors[i - 1].*metric)) / std::log(errors[i].*metric / (errors[i - 1].*metric));
+    return times[i - 1] * std::pow(times[i] / times[i - 1], t);
+}
+
+static void benchmarkAdaptiveSampling(const std::vector<std::string> &args) {
+    /*
+     * Renders the scene with uniform sampling at increasing frame counts and with adaptive sampling at several
+     * thresholds, measuring the error of each against a render with many more frames.
+     * The speed-up of each adaptive render is the time uniform sampling needs for the same error,
+     * interpolated log-log between the uniform renders around it, over the adaptive render's time.
+     */
+    std::string path = args.size() > 0 ? args[0] : SCENE_FILE_PATH;
+    CpuRenderSettings settings;
+    settings.width = args.size() > 1 ? std::stoi(args[1]) : 320;
+    settings.height = args.size() > 2 ? std::stoi(args[2]) : 180;
+    int referenceFrames = args.size() > 3 ? std::stoi(args[3]) : 1024;
+    Scene *scene = loadScene(path);
+    CpuScene cpuScene = prepareCpuScene(scene);
+    CpuRenderSettings referenceSettings = settings;
+    referenceSettings.numFrames = referenceFrames;
+    std::vector<glm::vec4> reference = renderCPU(cpuScene, referenceSettings);
+    std::cout << "ADAPTIVE SAMPLING: " << path << ", " << settings.width << "x" << settings.height << ", "
+              << referenceFrames << " FRAME REFERENCE" << std::endl;
+    std::vector<ImageError> uniformErrors;
+    std::vector<double> uniformTimes;
+    for (int numFrames = 16; numFrames <= referenceFrames / 4; numFrames *= 2) {
+        settings.numFrames = numFrames;
+        CpuRenderStats stats;
+        ImageError error = getImageError(renderCPU(cpuScene, settings, &stats), reference);
+        uniformErrors.push_back(error);
+        uniformTimes.push_back(stats.renderTimeMs);
+        std::cout << "  UNIFORM " << numFrames << " FRAMES: " << stats.renderTimeMs << " ms, RMS ERROR " << error.rms
+                  << ", 99TH PERCENTILE " << error.percentile99 << std::endl;
+    }
+    settings.numFrames = referenceFrames / 4;
+    for (float threshold : {0.04f, 0.02f, 0.01f}) {
+        settings.adaptiveThreshold = threshold;
+        CpuRenderStats stats;
+        ImageError error = getImageError(renderCPU(cpuScene, settings, &stats), reference);
+        std::cout << "  ADAPTIVE THRESHOLD " << threshold << ": " << stats.renderTimeMs << " ms, "
+                  << (double) stats.numSamples / (double) reference.size() << " FRAMES PER PIXEL, RMS ERROR "
+                  << error.rms << ", 99TH PERCENTILE " << error.percentile99 << std::endl;
+        for (auto [name, metric] : {std::pair{"RMS", &ImageError::rms},
+                                    std::pair{"99TH PERCENTILE", &ImageError::percentile99}}) {
+            double uniformTime = getUniformTimeAtError(uniformErrors, uniformTimes, metric, error.*metric);
+            if (uniformTime == 0.0)
+                std::cout << "    " << name << " ERROR OUTSIDE THE UNIFORM RANGE" << std::endl;
+            else
+                std::cout << "    SPEED-UP AT EQUAL " << name << " ERROR " << uniformTime / stats.renderTimeMs << "x"
+                          << std::endl;
+        }
+    }
+    delete scene;
+}
+
+static void benchmarkDenoise(const std::vector<std::string> &args) {
+    /*
+     * Renders the scene raw at increasing frame counts and denoised at a few low ones, measuring the error of each
+     * against a render with many more frames. Each denoised render is matched to the raw frame count with the same
+     * error, interpolated log-log between the raw renders around it.
+     */
+    std::string path = args.size() > 0 ? args[0] : SCENE_FILE_PATH;
+    CpuRenderSettings settings;
+    settings.width = args.size() > 1 ? std::stoi(args[1]) : 320;
+    settings.height = args.size() > 2 ? std::stoi(args[2]) : 180;
+    int referenceFrames = args.size() > 3 ? std::stoi(args[3]) : 1024;
+    CpuDenoiseSettings denoiseSettings;
+    denoiseSettings.width = settings.width;
+    denoiseSettings.height = settings.height;
+    Scene *scene = loadScene(path);
+    CpuScene cpuScene = prepareCpuScene(scene);
+    CpuRenderSettings referenceSettings = settings;
+    referenceSettings.numFrames = referenceFrames;
+    std::vector<glm::vec4> reference = renderCPU(cpuScene, referenceSettings);
+    std::cout << "DENOISE: " << path << ", " << settings.width << "x" << settings.height << ", " << referenceFrames
+              << " FRAME REFERENCE" << std::endl;
+    std::vector<ImageError> rawErrors;
+    std::vector<double> rawFrames;
+    for (int numFrames = 1; numFrames <= referenceFrames / 4; numFrames *= 2) {
+        settings.numFrames = numFrames;
+        CpuRenderStats stats;
+        ImageError error = getImageError(renderCPU(cpuScene, settings, &stats), reference);
+        rawErrors.push_back(error);
+        rawFrames.push_back(numFrames);
+        std::cout << "  RAW " << numFrames << " FRAMES: " << stats.renderTimeMs << " ms, RMS ERROR " << error.rms
+                  << ", 99TH PERCENTILE " << error.percentile99 << std::endl;
+    }
+    for (int numFrames : {1, 2, 4, 8}) {
+        settings.numFrames = numFrames;
+        CpuRenderStats stats;
+        CpuGuideBuffers guides;
+        std::vector<glm::vec4> image = renderCPU(cpuScene, settings, &stats, &guides);
+        std::vector<glm::vec4> denoised;
+        double denoiseTimeMs = getTimeMs([&] {
+            denoised = denoiseCPU(image, guides, denoiseSettings);
+        });
+        ImageError error = getImageError(denoised, reference);
+        std::cout << "  DENOISED " << numFrames << " FRAMES: " << stats.renderTimeMs << " ms + " << denoiseTimeMs
+                  << " ms DENOISING, RMS ERROR " << error.rms << ", 99TH PERCENTILE " << error.percentile99
+                  << std::endl;
+        for (auto [name, metric] : {std::pair{"RMS", &ImageError::rms},
+                                    std::pair{"99TH PERCENTILE", &ImageError::percentile99}}) {
+            double equivalentFrames = getUniformTimeAtError(rawErrors, rawFrames, metric, error.*metric);
+            if (equivalentFrames == 0.0)
+                std::cout << "    " << name << " ERROR OUTSIDE THE RAW RANGE" << std::endl;
+            else
+                std::cout << "    EQUAL " << name << " ERROR TO " << equivalentFrames << " RAW FRAMES" << std::endl;
+        }
+    }
+    delete scene;
+}
+
+static void benchmarkNextEventEstimation(const std::vector<std::string> &args) {
+    /*
+     * Renders the scene with next-event estimation at increasing frame counts, and for each the same scene
+     * without it, as many frames as fit in the same time, measuring the error of both against a render with
+     * many more frames. The frames that fit are estimated from the time per frame of a first render without it.
+     */
+    std::string path = args.size() > 0 ? args[0] : "../models/cornell-box.scene";
+    CpuRenderSettings settings;
+    settings.width = args.size() > 1 ? std::stoi(args[1]) : 320;
+    settings.height = args.size() > 2 ? std::stoi(args[2]) : 180;
+    int referenceFrames = args.size() > 3 ? std::stoi(args[3]) : 1024;
+    Scene *scene = loadScene(path);
+    CpuScene cpuScene = prepareCpuScene(scene);
+    CpuRenderSettings referenceSettings = settings;
+    referenceSettings.numFrames = referenceFrames;
+    referenceSettings.nextEventEstimation = true;
+    std::vector<glm::vec4> reference = renderCPU(cpuScene, referenceSettings);
+    std::cout << "NEXT-EVENT ESTIMATION: " << path << ", " << settings.width << "x" << settings.height << ", "
+              << scene->lights.size() << " LIGHTS, " << referenceFrames << " FRAME REFERENCE" << std::endl;
+    CpuRenderSettings bsdfSettings = settings;
+    bsdfSettings.nextEventEstimation = false;
+    bsdfSettings.numFrames = 4;
+    CpuRenderStats bsdfStats;
+    renderCPU(cpuScene, bsdfSettings, &bsdfStats);
+    double bsdfFrameTimeMs = bsdfStats.renderTimeMs / bsdfSettings.numFrames;
+    settings.nextEventEstimation = true;
+    for (int numFrames = 1; numFrames <= referenceFrames / 16; numFrames *= 4) {
+        settings.numFrames = numFrames;
+        CpuRenderStats stats;
+        ImageError error = getImageError(renderCPU(cpuScene, settings, &stats), reference);
+        bsdfSettings.numFrames = std::max(1, (int) std::lround(stats.renderTimeMs / bsdfFrameTimeMs));
+        ImageError bsdfError = getImageError(renderCPU(cpuScene, bsdfSettings, &bsdfStats), reference);
+        std::cout << "  NEE " << numFrames << " FRAMES: " << stats.renderTimeMs << " ms, RMS ERROR " << error.rms
+                  << ", 99TH PERCENTILE " << error.percentile99 << std::endl;
+        std::cout << "  BSDF ONLY " << bsdfSettings.numFrames << " FRAMES: " << bsdfStats.renderTimeMs
+                  << " ms, RMS ERROR " << bsdfError.rms << ", 99TH PERCENTILE " << bsdfError.percentile99
+                  << std::endl;
+        std::cout << "    RMS ERROR " << bsdfError.rms / error.rms << "x LOWER WITH NEE AT EQUAL TIME" << std::endl;
+    }
+    delete scene;
+}
+
+static void benchmarkSampling(const std::vector<std::string> &args) {
+    /*
+     * Renders the scene with each combination of bounce direction distribution and sample sequence at a few frame
+     * counts, measuring the time per ray traced and the error against a render with many more frames.
+     */
+    std::string path = args.size() > 0 ? args[0] : SCENE_FILE_PATH;
+    CpuRenderSettings settings;
+    settings.width = args.size() > 1 ? std::stoi(args[1]) : 320;
+    settings.height = args.size() > 2 ? std::stoi(args[2]) : 180;
+    int referenceFrames = args.size() > 3 ? std::stoi(args[3]) : 1024;
+    Scene *scene = loadScene(path);
+    CpuScene cpuScene = prepareCpuScene(scene);
+    CpuRenderSettings referenceSettings = settings;
+    referenceSettings.numFrames = referenceFrames;
+    std::vector<glm::vec4> reference = renderCPU(cpuScene, referenceSettings);
+    std::cout << "SAMPLING: " << path << ", " << settings.width << "x" << settings.height << ", " << referenceFrames
+              << " FRAME REFERENCE" << std::endl;
+    for (auto [samplingName, sampling] : {std::pair{"UNIFORM", BSDF_SAMPLING_UNIFORM},
+                                          std::pair{"COSINE", BSDF_SAMPLING_COSINE}}) {
+        for (auto [sequenceName, sequence] : {std::pair{"RANDOM", SAMPLE_SEQUENCE_RANDOM},
+                                              std::pair{"SOBOL", SAMPLE_SEQUENCE_SOBOL}}) {
+            settings.bsdfSampling = sampling;
+            settings.sampleSequence = sequence;
+            std::cout << "  " << samplingName << " DIRECTIONS, " << sequenceName << " SEQUENCE:" << std::endl;
+            for (int numFrames = 4; numFrames <= referenceFrames / 4; numFrames *= 4) {
+                settings.numFrames = numFrames;
+                CpuRenderStats stats;
+                ImageError error = getImageError(renderCPU(cpuScene, settings, &stats), reference);
+                std::cout << "    " << numFrames << " FRAMES: " << stats.renderTimeMs << " ms, "
+                          << stats.renderTimeMs * 1e6 / (double) stats.numRays << " ns PER RAY, "
+                          << (double) stats.numRays / (double) (stats.numSamples) << " RAYS PER PATH, RMS ERROR "
+                          << error.rms << ", 99TH PERCENTILE " << error.percentile99 << std::endl;
+            }
+        }
+    }
+    delete scene;
+}
+
+static void benchmarkGeometryLayouts(const std::vector<std::string> &args) {
+    /*
+     * Builds the given OBJ, or a sphere of the given number of triangles, or by default the bundled scene,
+     * in each geometry layout and renders it on the CPU. Reports the bytes per triangle of the geometry alone
+     * and of the whole mesh with its BVHs, the throughput, and how far each render is from SOUP's,
+     * which only the quantized vertices and the packed colours should move it.
+     */
+    std::string name = args.empty() ? SCENE_FILE_PATH : args[0];
+    ObjContents *contents;
+    if (!args.empty() && std::all_of(args[0].begin(), args[0].end(), ::isdigit)) {
+        name = "sphere";
+        contents = generateSphere(std::stoi(args[0]));
+    } else {
+        contents = readObjContents(name);
+    }
+    CpuRenderSettings settings;
+    settings.width = 320;
+    settings.height = 240;
+    settings.numFrames = 8;
+    std::cout << "GEOMETRY LAYOUTS: " << name << ", " << contents->triangles.size() << " triangles, "
+              << contents->vertices.size() << " vertices" << std::endl;
+    std::vector<glm::vec4> reference;
+    for (int layout : {GEOMETRY_LAYOUT_SOUP, GEOMETRY_LAYOUT_EDGES, GEOMETRY_LAYOUT_INDEXED,
+                       GEOMETRY_LAYOUT_QUANTIZED}) {
+        Scene *scene = createSingleInstanceScene(
+                buildMesh(*contents, {BVH_SPLIT_METHOD, BVH_BUILD_THREADS, false}, nullptr, layout));
+        const MeshData &mesh = *scene->meshes[0];
+        CpuScene cpuScene = prepareCpuScene(scene);
+        CpuRenderStats stats;
+        std::vector<glm::vec4> image = renderCPU(cpuScene, settings, &stats);
+        if (reference.empty())
+            reference = image;
+        ImageError error = getImageError(image, reference);
+        std::cout << "  " << getGeometryLayoutName(layout) << ": "
+                  << (double) getGeometryBytes(mesh) / mesh.numTriangles << " BYTES PER TRIANGLE ("
+                  << (double) mesh.buffer.size() / mesh.numTriangles << " WITH THE BVHS), "
+                  << stats.getMraysPerSecond() << " Mrays/s, RMS DIFFERENCE FROM SOUP " << error.rms
+                  << ", 99TH PERCENTILE " << error.percentile99 << std::endl;
+        delete scene;
+    }
+    delete contents;
+}
+
+static void benchmarkCompressedBVH(const std::vector<std::string> &args) {
+    /*
+     * Builds the given OBJ, or a sphere of the given number of triangles, or by default the bundled scene,
+     * validates its compressed nodes against its wide nodes and renders it on the CPU with each.
+     * Decoded boxes are only ever larger, so the compressed BVH must render the same image with more box
+     * and triangle tests per ray.
+     */
+    std::string name = args.empty() ? SCENE_FILE_PATH : args[0];
+    ObjContents *contents;
+    if (!args.empty() && std::all_of(args[0].begin(), args[0].end(), ::isdigit)) {
+        name = "sphere";
+        contents = generateSphere(std::stoi(args[0]));
+    } else {
+        contents = readObjContents(name);
+    }
+    Scene *scene = createSingleInstanceScene(buildMesh(*contents, {BVH_SPLIT_METHOD, BVH_BUILD_THREADS, false}));
+    CpuScene cpuScene = prepareCpuScene(scene);
+    const CpuMesh &mesh = cpuScene.meshes[0];
+    CompressedBVHValidation validation = validateCompressedBVH(mesh.wideBVHNodes, mesh.compressedBVHNodes);
+    std::cout << "COMPRESSED BVH: " << name << ", " << contents->triangles.size() << " triangles, "
+              << mesh.wideBVHNodes.size() << " NODES, " << validation.numInvalidChildren << " OF "
+              << validation.numChildren << " CHILDREN INVALID, AVERAGE AREA RATIO " << validation.averageAreaRatio
+              << std::endl;
+    CpuRenderSettings settings;
+    settings.width = 320;
+    settings.height = 240;
+    settings.numFrames = 8;
+    std::vector<glm::vec4> reference;
+    for (auto [layoutName, layout, nodeSize] : {std::tuple{"WIDE", BVH_LAYOUT_WIDE, sizeof(WideBVHNode)},
+                                                std::tuple{"COMPRESSED", BVH_LAYOUT_COMPRESSED,
+                                                           sizeof(CompressedBVHNode)}}) {
+        settings.bvhLayout = layout;
+        CpuRenderStats stats;
+        std::vector<glm::vec4> image = renderCPU(cpuScene, settings, &stats);
+        if (reference.empty())
+            reference = image;
+        std::cout << "  " << layoutName << ": " << nodeSize << " BYTES PER NODE, "
+                  << mesh.wideBVHNodes.size() * nodeSize / 1024 << " KB, " << stats.getMraysPerSecond()
+                  << " Mrays/s, " << (double) stats.numBoxTests / (double) stats.numRays << " BOX TESTS, "
+                  << (double) stats.numTriangleTests / (double) stats.numRays << " TRIANGLE TESTS PER RAY, RMS "
+                  << "DIFFERENCE FROM WIDE " << getImageError(image, reference).rms << std::endl;
+    }
+    delete scene;
+    delete contents;
+}
+
+static double getLinesPerRay(const std::vector<std::vector<uint32_t>> &traces,
+                             const std::vector<uint32_t> &newIndices, size_t lineSize) {
+    /*
+     * Average number of distinct lines of the given size that each ray reads, with the node buffer starting
+     * at the start of a line
+     */
+    uint64_t numLines = 0;
+    std::vector<size_t> lines;
+    for (const std::vector<uint32_t> &trace : traces) {
+        lines.clear();
+        for (uint32_t index : trace)
+            lines.push_back(newIndices[index] * sizeof(BVHNode) / lineSize);
+        std::ranges::sort(lines);
+        numLines += std::ranges::unique(lines).begin() - lines.begin();
+    }
+    return (double) numLines / (double) std::max<size_t>(traces.size(), 1);
+}
+
+static void benchmarkNodeOrder(const std::vector<std::string> &args) {
+    /*
+     * Replays the binary BVH traversal of the primary rays, and of one diffuse bounce from each of their hits,
+     * through every node order (see bvh-order.h) of the given OBJ, or a sphere of the given number of triangles,
+     * or by default the bundled scene, and counts the distinct cache lines that each ray reads from the nodes.
+     * The orders only permute the nodes, so every ray reads the same nodes under each of them: the traversals
+     * are recorded once in depth-first order, then mapped through each order's new indices. Each order is also
+     * rendered on the CPU with the binary layout, which must give the same image.
+     */
+    std::string name = args.empty() ? SCENE_FILE_PATH : args[0];
+    ObjContents *contents;
+    if (!args.empty() && std::all_of(args[0].begin(), args[0].end(), ::isdigit)) {
+        name = "sphere";
+        contents = generateSphere(std::stoi(args[0]));
+    } else {
+        contents = readObjContents(name);
+    }
+    std::vector<glm::uvec3> triangles = contents->triangles;
+    std::vector<uint32_t> triangleIndices;
+    std::vector<BVHNode> depthFirstNodes = generateBVH(triangles, contents->vertices, triangleIndices,
+                                                       {BVH_SPLIT_METHOD, BVH_BUILD_THREADS, false});
+    Scene *depthFirstScene = createSingleInstanceScene(
+            serializeMesh(contents->vertices, triangles, depthFirstNodes, {}, triangleIndices));
+    CpuScene depthFirstCpuScene = prepareCpuScene(depthFirstScene);
+    const CpuMesh &mesh = depthFirstCpuScene.meshes[0];
+
+    CpuRenderSettings settings;
+    settings.width = 320;
+    settings.height = 240;
+    settings.numFrames = 4;
+    settings.bvhLayout = BVH_LAYOUT_BINARY;
+    std::vector<std::vector<uint32_t>> primaryTraces, diffuseTraces;
+    std::mt19937 gen(1);
+    std::normal_distribution<float> normal;
+    const float pixelWidth = std::tan(FOV * glm::pi<float>() / 180.0f / 2.0f) * VIEWPORT_DIST * 2.0f /
+                             (float) settings.width;
+    for (int y = 0; y < settings.height; y++) {
+        for (int x = 0; x < settings.width; x++) {
+            glm::vec3 dir = normalize(glm::vec3(((float) x - (float) settings.width / 2.0f) * pixelWidth,
+                                                ((float) y - (float) settings.height / 2.0f) * pixelWidth,
+                                                VIEWPORT_DIST));
+            float dist;
+            int triangle = traceBinaryBVH(mesh, settings.cameraPos, dir, primaryTraces.emplace_back(), &dist);
+            if (triangle < 0)
+                continue;
+            // Cosine weighted about the normal on the side the ray came from
+            glm::vec3 surfaceNormal = getTriangleNormal(*mesh.meshData, triangle);
+            if (dot(surfaceNormal, dir) > 0.0f)
+                surfaceNormal = -surfaceNormal;
+            glm::vec3 bounce = normalize(surfaceNormal + normalize(glm::vec3(normal(gen), normal(gen), normal(gen))));
+            traceBinaryBVH(mesh, settings.cameraPos + dist * dir + 1e-4f * surfaceNormal, bounce,
+                           diffuseTraces.emplace_back());
+        }
+    }
+    auto getReadsPerRay = [](const std::vector<std::vector<uint32_t>> &traces) {
+        size_t numReads = 0;
+        for (const std::vector<uint32_t> &trace : traces)
+            numReads += trace.size();
+        return (double) numReads / (double) std::max<size_t>(traces.size(), 1);
+    };
+    std::cout << "NODE ORDER: " << name << ", " << contents->triangles.size() << " triangles, "
+              << depthFirstNodes.size() << " NODES, " << primaryTraces.size() << " PRIMARY RAYS READING "
+              << getReadsPerRay(primaryTraces) << " NODES EACH, " << diffuseTraces.size()
+              << " DIFFUSE RAYS READING " << getReadsPerRay(diffuseTraces) << " NODES EACH" << std::endl;
+
+    std::vector<glm::vec4> reference;
+    for (int order : {BVH_NODE_ORDER_DEPTH_FIRST, BVH_NODE_ORDER_SIBLINGS, BVH_NODE_ORDER_TREELETS,
+                      BVH_NODE_ORDER_VAN_EMDE_BOAS}) {
+        std::vector<uint32_t> newIndices;
+        std::vector<BVHNode> nodes = orderBVH(depthFirstNodes, order, &newIndices);
+        std::cout << "  " << getBVHNodeOrderName(order) << ": " << nodes.size() * sizeof(BVHNode) / 1024 << " KB";
+        for (size_t lineSize : {64, 128}) {
+            std::cout << ", " << getLinesPerRay(primaryTraces, newIndices, lineSize) << " PRIMARY AND "
+                      << getLinesPerRay(diffuseTraces, newIndices, lineSize) << " DIFFUSE " << lineSize
+                      << " BYTE LINES";
+        }
+        Scene *scene = createSingleInstanceScene(
+                serializeMesh(contents->vertices, triangles, nodes, {}, triangleIndices));
+        CpuRenderStats stats;
+        std::vector<glm::vec4> image = renderCPU(prepareCpuScene(scene), settings, &stats);
+        if (reference.empty())
+            reference = image;
+        std::cout << " PER RAY, " << stats.getMraysPerSecond() << " Mrays/s, RMS DIFFERENCE FROM DEPTH FIRST "
+                  << getImageError(image, reference).rms << std::endl;
+        delete scene;
+    }
+    delete depthFirstScene;
+    delete contents;
+}
+
+int main(int argc, char **argv) {
+    std::map<std::string, std::function<void(const std::vector<std::string> &)>> benchmarks = {
+            {"bvh-scaling", benchmarkBVHScaling},
+            {"obj-throughput", benchmarkObjThroughput},
+            {"scene-startup", benchmarkSceneStartup},
+            {"sbvh", benchmarkSBVH},
+            {"linear-bvh", benchmarkLinearBVH},
+            {"instancing", benchmarkInstancing},
+            {"refit", benchmarkRefit},
+            {"adaptive", benchmarkAdaptiveSampling},
+            {"denoise", benchmarkDenoise},
+            {"nee", benchmarkNextEventEstimation},
+            {"sampling", benchmarkSampling},
+            {"geometry", benchmarkGeometryLayouts},
+            {"compressed-bvh", benchmarkCompressedBVH},
+            {"node-order", benchmarkNodeOrder},
+    };
+    if (argc < 2 || !benchmarks.contains(argv[1])) {
+        std::cout << "Usage: " << argv[0] << " <benchmark> [args...]" << std::endl << "Benchmarks:" << std::endl;
+        for (auto &[name, benchmark] : benchmarks)
+            std::cout << "  " << name << std::endl;
+        return 1;
+    }
+    benchmarks[argv[1]](std::vector<std::string>(argv + 2, argv + argc));
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include "bvh-order.h"
+#include "profiler.h"
+
+#include <algorithm>
+
+static_assert(BVH_NODE_BLOCK_SIZE % (2 * sizeof(BVHNode)) == 0, "BVH_NODE_BLOCK_SIZE must hold whole sibling pairs");
+
+// A leaf of no triangles with an empty box at the origin, so that it adds nothing to getBVHCost
+static const BVHNode PADDING_NODE = {glm::vec3(0.0f), 0, glm::vec3(0.0f), BVH_LEAF_BIT};
+
+/*
+ * The orders below place nodes by giving them the next free index. The sibling pair orders place both children
+ * of an interior node at once, and name the pair by that parent's old index.
+ */
+struct BVHOrderState {
+    std::span<const BVHNode> nodes;
+    std::vector<uint32_t> &newIndices;
+    uint32_t next = 0;
+
+    bool isPair(uint32_t index) const {
+        return !nodes[index].isLeaf();
+    }
+
+    void placePair(uint32_t parent) {
+        newIndices[nodes[parent].leftOrStart] = next++;
+        newIndices[nodes[parent].rightOrCount] = next++;
+    }
+};
+
+static void orderDepthFirst(BVHOrderState &state, uint32_t index) {
+    state.newIndices[index] = state.next++;
+    if (state.isPair(index)) {
+        orderDepthFirst(state, state.nodes[index].leftOrStart);
+        orderDepthFirst(state, state.nodes[index].rightOrCount);
+    }
+}
+
+static void orderSiblings(BVHOrderState &state, uint32_t parent) {
+    state.placePair(parent);
+    for (uint32_t child : {state.nodes[parent].leftOrStart, state.nodes[parent].rightOrCount}) {
+        if (state.isPair(child))
+            orderSiblings(state, child);
+    }
+}
+
+static int getPairCount(const BVHOrderState &state, uint32_t parent, std::vector<int> &counts) {
+    int count = 1;
+    for (uint32_t child : {state.nodes[parent].leftOrStart, state.nodes[parent].rightOrCount}) {
+        if (state.isPair(child))
+            count += getPairCount(state, child, counts);
+    }
+    return counts[parent] = count;
+}
+
+static void orderTreelets(BVHOrderState &state) {
+    /*
+     * Grows each treelet from its root by the pair whose parent has the largest surface area, until it fills
+     * the pairs left in its block, so that no treelet straddles two blocks. Treelets are laid out depth-first from
+     * a stack of roots, where the pairs that a treelet had no room for are pushed smallest first, so that the next
+     * treelet is the most probable one and follows its parent. Pairs whose whole subtree is smaller than a block
+     * are set aside instead, to fill the blocks that treelets leave partly empty, which keeps every block full
+     * without mixing unrelated pairs into a treelet's block.
+     */
+    const size_t pairSize = 2 * sizeof(BVHNode);
+    const int pairsPerBlock = BVH_NODE_BLOCK_SIZE / pairSize;
+    std::vector<int> pairCounts(state.nodes.size());
+    getPairCount(state, 0, pairCounts);
+    auto getArea = [&](uint32_t parent) {
+        return getSA(state.nodes[parent].minCorner, state.nodes[parent].maxCorner);
+    };
+    std::vector<uint32_t> roots{0};
+    // Roots of subtrees of fewer pairs than a block, by their number of pairs
+    std::vector<std::vector<uint32_t>> smallRoots(pairsPerBlock);
+    std::vector<uint32_t> candidates;
+    while (true) {
+        // Pairs left in the block where the next pair goes
+        int capacity = pairsPerBlock - (int) (state.next * sizeof(BVHNode) % BVH_NODE_BLOCK_SIZE / pairSize);
+        int smallSize = capacity < pairsPerBlock || roots.empty() ? std::min(capacity, pairsPerBlock - 1) : 0;
+        while (smallSize > 0 && smallRoots[smallSize].empty())
+            smallSize--;
+        if (smallSize > 0) {
+            orderSiblings(state, smallRoots[smallSize].back());
+            smallRoots[smallSize].pop_back();
+            continue;
+        }
+        if (roots.empty()) {
+            if (std::ranges::all_of(smallRoots, &std::vector<uint32_t>::empty))
+                break;
+            // None of the small subtrees left fits in the block, so the next one starts a new block
+            state.next += 2 * capacity;
+            continue;
+        }
+        candidates.assign(1, roots.back());
+        roots.pop_back();
+        for (; capacity > 0 && !candidates.empty(); capacity--) {
+            auto best = std::ranges::max_element(candidates, {}, getArea);
+            uint32_t parent = *best;
+            *best = candidates.back();
+            candidates.pop_back();
+            state.placePair(parent);
+            for (uint32_t child : {state.nodes[parent].leftOrStart, state.nodes[parent].rightOrCount}) {
+                if (state.isPair(child))
+                    candidates.push_back(child);
+            }
+        }
+        std::ranges::sort(candidates, {}, getArea);
+        for (uint32_t candidate : candidates) {
+            if (pairCounts[candidate] < pairsPerBlock)
+                smallRoots[pairCounts[candidate]].push_back(candidate);
+            else
+                roots.push_back(candidate);
+        }
+    }
+}
+
+static int getPairHeight(const BVHOrderState &state, uint32_t parent, std::vector<int> &heights) {
+    int height = 0;
+    for (uint32_t child : {state.nodes[parent].leftOrStart, state.nodes[parent].rightOrCount}) {
+        if (state.isPair(child))
+            height = std::max(height, getPairHeight(state, child, heights));
+    }
+    return heights[parent] = height + 1;
+}
+
+static void getPairsAtDepth(const BVHOrderState &state, uint32_t parent, int depth, std::vector<uint32_t> &pairs) {
+    if (depth == 0) {
+        pairs.push_back(parent);
+        return;
+    }
+    for (uint32_t child : {state.nodes[parent].leftOrStart, state.nodes[parent].rightOrCount}) {
+        if (state.isPair(child))
+            getPairsAtDepth(state, child, depth - 1, pairs);
+    }
+}
+
+static void orderVanEmdeBoas(BVHOrderState &state, uint32_t parent, int levels, const std::vector<int> &heights) {
+    /*
+     * Lays out the given number of levels of the pair tree below parent: the top half of them, then each subtree
+     * that hangs below the top half, left to right.
+     */
+    levels = std::min(levels, heights[parent]);
+    if (levels == 1) {
+        state.placePair(parent);
+        return;
+    }
+    int topLevels = levels / 2;
+    orderVanEmdeBoas(state, parent, topLevels, heights);
+    std::vector<uint32_t> bottomRoots;
+    getPairsAtDepth(state, parent, topLevels, bottomRoots);
+    for (uint32_t root : bottomRoots)
+        orderVanEmdeBoas(state, root, levels - topLevels, heights);
+}
+
+std::vector<BVHNode> orderBVH(std::span<const BVHNode> nodes, int nodeOrder, std::vector<uint32_t> *newIndices) {
+    PROFILE_SCOPE("ORDER BVH");
+    std::vector<uint32_t> indices(nodes.size(), UINT32_MAX);
+    BVHOrderState state{nodes, indices};
+    if (nodeOrder == BVH_NODE_ORDER_DEPTH_FIRST || nodes[0].isLeaf()) {
+        orderDepthFirst(state, 0);
+    } else {
+        indices[0] = 0;
+        state.next = 2;
+        if (nodeOrder == BVH_NODE_ORDER_SIBLINGS) {
+            orderSiblings(state, 0);
+        } else if (nodeOrder == BVH_NODE_ORDER_TREELETS) {
+            orderTreelets(state);
+        } else {
+            std::vector<int> heights(nodes.size());
+            orderVanEmdeBoas(state, 0, getPairHeight(state, 0, heights), heights);
+        }
+    }
+
+    std::vector<BVHNode> ordered(state.next, PADDING_NODE);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (indices[i] == UINT32_MAX)
+            continue;
+        BVHNode node = nodes[i];
+        if (!node.isLeaf()) {
+            node.leftOrStart = indices[node.leftOrStart];
+            node.rightOrCount = indices[node.rightOrCount];
+        }
+        ordered[indices[i]] = node;
+    }
+    if (newIndices != nullptr)
+        *newIndices = std::move(indices);
+    return ordered;
+}
+
+const char *getBVHNodeOrderName(int nodeOrder) {
+    switch (nodeOrder) {
+        case BVH_NODE_ORDER_DEPTH_FIRST:
+            return "DEPTH FIRST";
+        case BVH_NODE_ORDER_SIBLINGS:
+            return "SIBLINGS";
+        case BVH_NODE_ORDER_TREELETS:
+            return "TREELETS";
+        case BVH_NODE_ORDER_VAN_EMDE_BOAS:
+            return "VAN EMDE BOAS";
+        default:
+            return "UNKNOWN";
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef OPENGL_RAYTRACER_BVH_ORDER_H
+#define OPENGL_RAYTRACER_BVH_ORDER_H
+
+#include <vector>
+#include <span>
+#include <cstdint>
+
+#include "bvh.h"
+
+/*
+ * Memory orders of a binary BVH's nodes. Traversal only follows child indices, so any order renders the same,
+ * and they differ in how many cache lines a ray's traversal touches:
+ * - DEPTH_FIRST is the pre-order that buildBVH writes, where a node's right child follows its whole left subtree.
+ * - SIBLINGS stores every node's two children next to each other, from an even index, so that the one fetch
+ *   of a 64 byte line brings in both of the boxes that traversal tests together.
+ * - TREELETS packs sibling pairs into blocks of BVH_NODE_BLOCK_SIZE bytes, growing each block's treelet from its
+ *   root by the pairs whose parents have the largest surface area, and so are the most likely to be entered.
+ * - VAN_EMDE_BOAS lays the tree of sibling pairs out recursively: the top half of its levels, then each subtree
+ *   below them, so that every subtree of any height is contiguous whatever the cache line size.
+ * Every order but DEPTH_FIRST keeps the root at index 0 and puts an unreachable padding leaf at index 1, which
+ * starts the pairs at an even index. Parents always come before their children.
+ */
+
+/*
+ * Returns the nodes in the given BVH_NODE_ORDER_*, with their child indices remapped.
+ * Nodes that the root cannot reach are dropped. newIndices, when given, receives the new index of every old node,
+ * or UINT32_MAX for the dropped ones.
+ */
+extern std::vector<BVHNode> orderBVH(std::span<const BVHNode> nodes, int nodeOrder,
+                                     std::vector<uint32_t>* newIndices = nullptr);
+
+extern const char* getBVHNodeOrderName(int nodeOrder);
+
+#endif //OPENGL_RAYTRACER_BVH_ORDER_H
@@ -3,13 +3,42 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <cassert>
+#include <atomic>
+#include <memory>
+#include <limits>
+#include <bit>
+#include <string>
+#include <tuple>
+#include <stdexcept>
 
 #include "constants.h"
+#include "task-pool.h"
+#include "profiler.h"
+
+/*
+ * Per-triangle data the builder sorts, with index being the triangle's position in the input.
+ * SBVH builds also use it for triangle references, whose bounds may be clipped to part of the triangle.
+ */
+struct BVHTriangle {
+    glm::vec3 centroid;
+    glm::vec3 minCorner;
+    glm::vec3 maxCorner;
+    uint32_t index;
+};
 
 struct SplitInfo {
     int axis;
     float splitVal;
     float cost;
+    /*
+     * Binned splits partition by bin index rather than by splitVal,
+     * so that partitioning agrees exactly with the binning the cost was computed from.
+     */
+    int bin = -1, numBins = 0;
+    float binMin = 0.0f, binScale = 0.0f;
 };
 
 SplitInfo min(SplitInfo a, SplitInfo b) {
@@ -20,8 +49,86 @@ SplitInfo min(SplitInfo a, SplitInfo b) {
 
 #define NO_AXIS (-1)
 
+struct Bin {
+    glm::vec3 minCorner = MAX_VERTEX;
+    glm::vec3 maxCorner = MIN_VERTEX;
+    int count = 0;
+
+    void add(const Bin &other) {
+        minCorner = min(minCorner, other.minCorner);
+        maxCorner = max(maxCorner, other.maxCorner);
+        count += other.count;
+    }
+};
+
+typedef std::array<std::array<Bin, BVH_SPLIT_BINS>, 3> AxisBins;
+
+struct NodeBounds {
+    glm::vec3 minCorner = MAX_VERTEX, maxCorner = MIN_VERTEX;
+    glm::vec3 centroidMin = MAX_VERTEX, centroidMax = MIN_VERTEX;
+
+    void add(const NodeBounds &other) {
+        minCorner = min(minCorner, other.minCorner);
+        maxCorner = max(maxCorner, other.maxCorner);
+        centroidMin = min(centroidMin, other.centroidMin);
+        centroidMax = max(centroidMax, other.centroidMax);
+    }
+};
+
+struct SpatialBin {
+    glm::vec3 minCorner = MAX_VERTEX;
+    glm::vec3 maxCorner = MIN_VERTEX;
+    int entries = 0, exits = 0;
+};
+
+struct SpatialSplit {
+    int axis = NO_AXIS;
+    float pos = 0.0f;
+    float cost = std::numeric_limits<float>::infinity();
+    // References are classified by the bins they span, like in the binning the cost was computed from
+    int bin = -1;
+    float binMin = 0.0f, binScale = 0.0f;
+    glm::vec3 leftMin, leftMax, rightMin, rightMax;
+    int numLeft = 0, numRight = 0;
+};
 
-static float getSA(glm::vec3 min, glm::vec3 max) {
+/*
+ * State of a single BVH build, so that several builds can run at once.
+ * Nodes covering at least BVH_PARALLEL_SPLIT_THRESHOLD triangles split their bounds, binning
+ * and partition passes into chunks across the pool; below BVH_PARALLEL_TASK_THRESHOLD triangles
+ * subtrees are built serially on whichever thread picked them up.
+ */
+struct BVHBuildContext {
+    std::vector<BVHTriangle> &triangleData;
+    std::vector<BVHTriangle> partitionBuffer;
+    // Needed to clip triangles for spatial splits
+    const std::vector<glm::uvec3> &triangleVertexIndices;
+    const std::vector<glm::vec3> &vertices;
+    /*
+     * Arena the tree is built into, sized for the largest possible tree (2n - 1 nodes for n references).
+     * Children are allocated as adjacent pairs, so the allocation order depends on scheduling
+     * until the tree is rewritten in pre-order at the end of the build.
+     */
+    std::unique_ptr<BVHNode[]> nodes;
+    std::atomic<uint32_t> numNodes = 0;
+    /*
+     * Triangle indices of every leaf, at the leaf's leftOrStart. Leaves of object split builds use
+     * their range of triangleData, SBVH leaves allocate their range as they are created.
+     */
+    std::unique_ptr<uint32_t[]> leafReferences;
+    std::atomic<uint32_t> numLeafReferences = 0;
+    std::atomic<int> numSpatialSplits = 0;
+    float rootArea = 0.0f;
+    int splitMethod;
+    TaskPool &pool;
+};
+
+static bool isParallelNode(BVHBuildContext &ctx, int start, int end) {
+    return end - start + 1 >= BVH_PARALLEL_SPLIT_THRESHOLD && ctx.pool.getNumThreads() > 1;
+}
+
+
+float getSA(glm::vec3 min, glm::vec3 max) {
     /*
      * Gets the surface area of a rectangular prism bounded by the two opposing vertices given
      */
@@ -31,34 +138,115 @@ static float getSA(glm::vec3 min, glm::vec3 max) {
 }
 
 float
-getSplitCost(std::vector<glm::mat4x3> &triangleData, int start, int end, int axis, float splitVal) {
+getSplitCost(std::vector<BVHTriangle> &triangleData, int start, int end, int axis, float splitVal) {
     glm::vec3 leftMin = MAX_VERTEX, rightMin = MAX_VERTEX, leftMax = MIN_VERTEX, rightMax = MIN_VERTEX;
     float numLeft = 0, numRight = 0;
     for (int j = start; j <= end; j++) {
-        if (triangleData[j][0][axis] < splitVal) {
-            leftMin = min(leftMin, triangleData[j][1]);
-            leftMax = max(leftMax, triangleData[j][2]);
+        if (triangleData[j].centroid[axis] < splitVal) {
+            leftMin = min(leftMin, triangleData[j].minCorner);
+            leftMax = max(leftMax, triangleData[j].maxCorner);
             numLeft++;
         } else {
-            rightMin = min(rightMin, triangleData[j][1]);
-            rightMax = max(rightMax, triangleData[j][2]);
+            rightMin = min(rightMin, triangleData[j].minCorner);
+            rightMax = max(rightMax, triangleData[j].maxCorner);
             numRight++;
         }
     }
     leftMax = max(leftMax, leftMin);
     rightMax = max(rightMax, rightMin);
-    return 1.0f + 50.0f * numLeft * getSA(leftMin, leftMax) +
-           50.0f * numRight * getSA(rightMin, rightMax);
+    return BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * numLeft * getSA(leftMin, leftMax) +
+           BVH_INTERSECTION_COST * numRight * getSA(rightMin, rightMax);
+}
+
+static SplitInfo getLeafSplit(const NodeBounds &bounds, int start, int end) {
+    return {NO_AXIS, 0.0f,
+            BVH_INTERSECTION_COST * (float) (end - start + 1) * getSA(bounds.minCorner, bounds.maxCorner)};
+}
+
+static int getBin(float centroid, float binMin, float binScale, int numBins) {
+    return std::clamp((int) ((centroid - binMin) * binScale), 0, numBins - 1);
+}
+
+static bool isLeftOfSplit(const SplitInfo &info, const glm::vec3 &centroid) {
+    if (info.bin != -1)
+        return getBin(centroid[info.axis], info.binMin, info.binScale, info.numBins) <= info.bin;
+    return centroid[info.axis] < info.splitVal;
 }
 
-SplitInfo getSplit(BVHNode *node, std::vector<glm::mat4x3> &triangleData, int start, int end) {
-    SplitInfo info = {NO_AXIS, 0.0f,
-                      50.0f * (float) (end - start + 1) * getSA(node->minCorner, node->maxCorner)};
-    if (node->isLeaf)
-        return info;
+static void binTriangles(std::vector<BVHTriangle> &triangleData, int start, int end, const glm::vec3 &centroidMin,
+                         const glm::vec3 &binScale, int numBins, AxisBins &bins) {
+    for (int j = start; j <= end; j++) {
+        for (int axis = 0; axis < 3; axis++) {
+            Bin &bin = bins[axis][getBin(triangleData[j].centroid[axis], centroidMin[axis], binScale[axis], numBins)];
+            bin.minCorner = min(bin.minCorner, triangleData[j].minCorner);
+            bin.maxCorner = max(bin.maxCorner, triangleData[j].maxCorner);
+            bin.count++;
+        }
+    }
+}
+
+static SplitInfo getBinnedSplit(BVHBuildContext &ctx, std::vector<BVHTriangle> &triangleData,
+                                const NodeBounds &bounds, int start, int end) {
+    /*
+     * Buckets triangle centroids into up to BVH_SPLIT_BINS bins per axis, then sweeps
+     * the bin bounds from both sides so every bin boundary is costed in a single pass.
+     * Small nodes use one bin per triangle, as extra bins could never be filled.
+     */
+    SplitInfo info = getLeafSplit(bounds, start, end);
+    const int numBins = std::min(BVH_SPLIT_BINS, end - start + 1);
+    const glm::vec3 &centroidMin = bounds.centroidMin;
+    glm::vec3 binScale;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = bounds.centroidMax[axis] - centroidMin[axis];
+        binScale[axis] = extent > 1e-6f ? (float) numBins / extent : 0.0f;
+    }
+    AxisBins bins;
+    if (isParallelNode(ctx, start, end)) {
+        std::vector<AxisBins> chunkBins(getNumChunks(ctx.pool, start, end + 1, BVH_PARALLEL_CHUNK_SIZE));
+        parallelForChunks(ctx.pool, start, end + 1, BVH_PARALLEL_CHUNK_SIZE,
+                          [&](int chunk, int chunkStart, int chunkEnd) {
+            binTriangles(triangleData, chunkStart, chunkEnd - 1, centroidMin, binScale, numBins, chunkBins[chunk]);
+        });
+        for (auto &chunk : chunkBins)
+            for (int axis = 0; axis < 3; axis++)
+                for (int i = 0; i < numBins; i++)
+                    bins[axis][i].add(chunk[axis][i]);
+    } else {
+        binTriangles(triangleData, start, end, centroidMin, binScale, numBins, bins);
+    }
     for (int axis = 0; axis < 3; axis++) {
-        float minVal = node->minCorner[axis];
-        float maxVal = node->maxCorner[axis];
+        if (binScale[axis] == 0.0f)
+            continue;
+        // rightCost[i] holds the cost of everything in bins (i, numBins)
+        float rightCost[BVH_SPLIT_BINS];
+        Bin right;
+        for (int i = numBins - 1; i > 0; i--) {
+            right.add(bins[axis][i]);
+            rightCost[i - 1] = right.count == 0 ? -1.0f :
+                               BVH_INTERSECTION_COST * (float) right.count * getSA(right.minCorner, right.maxCorner);
+        }
+        Bin left;
+        for (int i = 0; i < numBins - 1; i++) {
+            left.add(bins[axis][i]);
+            if (left.count == 0 || rightCost[i] < 0.0f)
+                continue;
+            float cost = BVH_TRAVERSAL_COST + rightCost[i] +
+                         BVH_INTERSECTION_COST * (float) left.count * getSA(left.minCorner, left.maxCorner);
+            if (cost < info.cost) {
+                info = {axis, centroidMin[axis] + (float) (i + 1) / binScale[axis], cost,
+                        i, numBins, centroidMin[axis], binScale[axis]};
+            }
+        }
+    }
+    return info;
+}
+
+static SplitInfo getTernarySplit(std::vector<BVHTriangle> &triangleData, const NodeBounds &bounds, int start,
+                                 int end) {
+    SplitInfo info = getLeafSplit(bounds, start, end);
+    for (int axis = 0; axis < 3; axis++) {
+        float minVal = bounds.minCorner[axis];
+        float maxVal = bounds.maxCorner[axis];
         float minDiff = 1e-6;
         for (int i = 0; i < BVH_SPLIT_ITERATIONS && abs(minVal - maxVal) > minDiff; i++) {
             float third = (maxVal - minVal) / 3.0f;
@@ -79,130 +267,1038 @@ SplitInfo getSplit(BVHNode *node, std::vector<glm::mat4x3> &triangleData, int st
     return info;
 }
 
-static int numLeaves = 0;
-static int minLeafSize = (int) 1e9;
-static int maxLeafSize = 0;
-static int totalLeafSize = 0;
-static int numNodesGenerated = 0;
+static SplitInfo getSplit(BVHBuildContext &ctx, const NodeBounds &bounds, int start, int end) {
+    if (ctx.splitMethod == BVH_SPLIT_TERNARY)
+        return getTernarySplit(ctx.triangleData, bounds, start, end);
+    return getBinnedSplit(ctx, ctx.triangleData, bounds, start, end);
+}
 
-static void initBVHGenerationStats() {
-    numLeaves = maxLeafSize = totalLeafSize = numNodesGenerated = 0;
-    minLeafSize = (int) 1e9;
+static void addBounds(std::vector<BVHTriangle> &triangleData, int start, int end, NodeBounds &bounds) {
+    for (int i = start; i <= end; i++) {
+        bounds.minCorner = min(bounds.minCorner, triangleData[i].minCorner);
+        bounds.maxCorner = max(bounds.maxCorner, triangleData[i].maxCorner);
+        bounds.centroidMin = min(bounds.centroidMin, triangleData[i].centroid);
+        bounds.centroidMax = max(bounds.centroidMax, triangleData[i].centroid);
+    }
 }
 
-static BVHNode* generateBVH(std::vector<glm::mat4x3> &triangleData, int start, int end, int nodeId = 0,
-            int depth = 0) {
+static NodeBounds getBounds(BVHBuildContext &ctx, std::vector<BVHTriangle> &triangleData, int start, int end) {
+    NodeBounds bounds;
+    if (!isParallelNode(ctx, start, end)) {
+        addBounds(triangleData, start, end, bounds);
+        return bounds;
+    }
+    std::vector<NodeBounds> chunkBounds(getNumChunks(ctx.pool, start, end + 1, BVH_PARALLEL_CHUNK_SIZE));
+    parallelForChunks(ctx.pool, start, end + 1, BVH_PARALLEL_CHUNK_SIZE,
+                      [&](int chunk, int chunkStart, int chunkEnd) {
+        addBounds(triangleData, chunkStart, chunkEnd - 1, chunkBounds[chunk]);
+    });
+    for (auto &chunk : chunkBounds)
+        bounds.add(chunk);
+    return bounds;
+}
+
+static int partition(BVHBuildContext &ctx, int start, int end, const SplitInfo &info) {
     /*
-     * Recursively generates a BVH from a subarray of triangle data.
+     * Stable partition of the triangles by the split, returning the number of triangles
+     * in the left child. Being stable makes the parallel path produce the same order as the serial one.
+     */
+    auto &triangleData = ctx.triangleData;
+    auto isLeft = [&info](const BVHTriangle &triangle) { return isLeftOfSplit(info, triangle.centroid); };
+    if (!isParallelNode(ctx, start, end)) {
+        auto mid = std::stable_partition(triangleData.begin() + start, triangleData.begin() + end + 1, isLeft);
+        return (int) (mid - triangleData.begin()) - start;
+    }
+    int numChunks = getNumChunks(ctx.pool, start, end + 1, BVH_PARALLEL_CHUNK_SIZE);
+    std::vector<int> numLeft(numChunks + 1, 0), numRight(numChunks + 1, 0);
+    parallelForChunks(ctx.pool, start, end + 1, BVH_PARALLEL_CHUNK_SIZE,
+                      [&](int chunk, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++)
+            numLeft[chunk + 1] += isLeft(triangleData[i]);
+        numRight[chunk + 1] = chunkEnd - chunkStart - numLeft[chunk + 1];
+    });
+    for (int chunk = 0; chunk < numChunks; chunk++) {
+        numLeft[chunk + 1] += numLeft[chunk];
+        numRight[chunk + 1] += numRight[chunk];
+    }
+    int totalLeft = numLeft[numChunks];
+    parallelForChunks(ctx.pool, start, end + 1, BVH_PARALLEL_CHUNK_SIZE,
+                      [&](int chunk, int chunkStart, int chunkEnd) {
+        int left = start + numLeft[chunk], right = start + totalLeft + numRight[chunk];
+        for (int i = chunkStart; i < chunkEnd; i++) {
+            if (isLeft(triangleData[i]))
+                ctx.partitionBuffer[left++] = triangleData[i];
+            else
+                ctx.partitionBuffer[right++] = triangleData[i];
+        }
+    });
+    parallelForChunks(ctx.pool, start, end + 1, BVH_PARALLEL_CHUNK_SIZE,
+                      [&](int, int chunkStart, int chunkEnd) {
+        std::copy(ctx.partitionBuffer.begin() + chunkStart, ctx.partitionBuffer.begin() + chunkEnd,
+                  triangleData.begin() + chunkStart);
+    });
+    return totalLeft;
+}
+
+static void generateBVH(BVHBuildContext &ctx, uint32_t nodeIndex, int start, int end, int depth = 0) {
+    /*
+     * Recursively generates a BVH from a subarray of triangle data into the arena slot nodeIndex.
      * Chooses optimal split axis and split value according to SAH.
-     * Swaps elements such that all nodes' triangles are grouped contiguously.
+     * Partitions elements such that all nodes' triangles are grouped contiguously.
+     * Large subtrees are forked onto the task pool.
      */
-    auto *node = new BVHNode();
-    node->id = nodeId;
-    for (int i = start; i <= end; i++) {
-        node->addTriangle(triangleData[i]);
-    }
-    SplitInfo info = getSplit(node, triangleData, start, end);
-    node->isLeaf = depth == MAX_BVH_DEPTH || info.axis == NO_AXIS;
-    if (!node->isLeaf) {
-        int numInLeftChild = 0;
-        for (int i = start; i <= end; i++) {
-            if (triangleData[i][0][info.axis] < info.splitVal) {
-                std::swap(triangleData[start + numInLeftChild], triangleData[i]);
-                numInLeftChild++;
+    BVHNode &node = ctx.nodes[nodeIndex];
+    NodeBounds bounds = getBounds(ctx, ctx.triangleData, start, end);
+    node.minCorner = bounds.minCorner;
+    node.maxCorner = bounds.maxCorner;
+    SplitInfo info = getSplit(ctx, bounds, start, end);
+    if (depth == MAX_BVH_DEPTH || info.axis == NO_AXIS) {
+        for (int i = start; i <= end; i++)
+            ctx.leafReferences[i] = ctx.triangleData[i].index;
+        node.leftOrStart = start;
+        node.rightOrCount = BVH_LEAF_BIT | (uint32_t) (end - start + 1);
+        return;
+    }
+    int numInLeftChild = partition(ctx, start, end, info);
+    assert(0 < numInLeftChild && numInLeftChild <= end - start);
+    int leftChildEnd = start + numInLeftChild - 1;
+    int rightChildStart = leftChildEnd + 1;
+    uint32_t leftChild = ctx.numNodes.fetch_add(2);
+    node.leftOrStart = leftChild;
+    node.rightOrCount = leftChild + 1;
+    if (end - start + 1 >= BVH_PARALLEL_TASK_THRESHOLD) {
+        TaskGroup group(ctx.pool);
+        group.run([&ctx, leftChild, start, leftChildEnd, depth] {
+            generateBVH(ctx, leftChild, start, leftChildEnd, depth + 1);
+        });
+        generateBVH(ctx, leftChild + 1, rightChildStart, end, depth + 1);
+        group.wait();
+    } else {
+        generateBVH(ctx, leftChild, start, leftChildEnd, depth + 1);
+        generateBVH(ctx, leftChild + 1, rightChildStart, end, depth + 1);
+    }
+}
+
+static bool isEmpty(const BVHTriangle &ref) {
+    return glm::any(glm::greaterThan(ref.minCorner, ref.maxCorner));
+}
+
+static void addPoint(BVHTriangle &ref, const glm::vec3 &point) {
+    ref.minCorner = min(ref.minCorner, point);
+    ref.maxCorner = max(ref.maxCorner, point);
+}
+
+static void splitReference(const BVHBuildContext &ctx, const BVHTriangle &ref, int axis, float pos,
+                           BVHTriangle &left, BVHTriangle &right) {
+    /*
+     * Clips the triangle behind ref against the plane at pos on axis, giving the bounds of its parts on
+     * either side, each intersected with the bounds of ref, which may already be a clipped part.
+     * A side the triangle does not reach is left empty.
+     */
+    left = {glm::vec3(0.0f), MAX_VERTEX, MIN_VERTEX, ref.index};
+    right = left;
+    const glm::uvec3 &triangle = ctx.triangleVertexIndices[ref.index];
+    for (int i = 0; i < 3; i++) {
+        glm::vec3 a = ctx.vertices[triangle[i]];
+        glm::vec3 b = ctx.vertices[triangle[(i + 1) % 3]];
+        if (a[axis] <= pos)
+            addPoint(left, a);
+        if (a[axis] >= pos)
+            addPoint(right, a);
+        if ((a[axis] < pos && pos < b[axis]) || (b[axis] < pos && pos < a[axis])) {
+            glm::vec3 crossing = glm::mix(a, b, (pos - a[axis]) / (b[axis] - a[axis]));
+            crossing[axis] = pos;
+            addPoint(left, crossing);
+            addPoint(right, crossing);
+        }
+    }
+    for (BVHTriangle *part : {&left, &right}) {
+        part->minCorner = max(part->minCorner, ref.minCorner);
+        part->maxCorner = min(part->maxCorner, ref.maxCorner);
+        part->centroid = (part->minCorner + part->maxCorner) * 0.5f;
+    }
+}
+
+static void getSpatialBinRange(const BVHTriangle &ref, int axis, float binMin, float binScale, int &first,
+                               int &last) {
+    first = std::clamp((int) ((ref.minCorner[axis] - binMin) * binScale), 0, BVH_SPATIAL_BINS - 1);
+    last = std::clamp((int) ((ref.maxCorner[axis] - binMin) * binScale), first, BVH_SPATIAL_BINS - 1);
+}
+
+static SpatialSplit getSpatialSplit(const BVHBuildContext &ctx, const std::vector<BVHTriangle> &refs,
+                                    const NodeBounds &bounds) {
+    /*
+     * Splits the node's bounds into BVH_SPATIAL_BINS equal slabs per axis and clips every reference into
+     * each slab it spans, counting it as entering its first slab and exiting its last.
+     * Sweeping the slabs then costs each plane with the references straddling it counted on both sides.
+     */
+    SpatialSplit split;
+    for (int axis = 0; axis < 3; axis++) {
+        float binMin = bounds.minCorner[axis];
+        float extent = bounds.maxCorner[axis] - binMin;
+        if (extent <= 1e-6f)
+            continue;
+        float binScale = (float) BVH_SPATIAL_BINS / extent;
+        float binWidth = extent / (float) BVH_SPATIAL_BINS;
+        std::array<SpatialBin, BVH_SPATIAL_BINS> bins;
+        for (const BVHTriangle &ref : refs) {
+            int first, last;
+            getSpatialBinRange(ref, axis, binMin, binScale, first, last);
+            BVHTriangle remaining = ref;
+            for (int i = first; i <= last && !isEmpty(remaining); i++) {
+                BVHTriangle part = remaining;
+                if (i < last)
+                    splitReference(ctx, remaining, axis, binMin + (float) (i + 1) * binWidth, part, remaining);
+                if (isEmpty(part))
+                    continue;
+                bins[i].minCorner = min(bins[i].minCorner, part.minCorner);
+                bins[i].maxCorner = max(bins[i].maxCorner, part.maxCorner);
             }
+            bins[first].entries++;
+            bins[last].exits++;
+        }
+        // right[i] holds everything in bins (i, BVH_SPATIAL_BINS)
+        std::array<SpatialBin, BVH_SPATIAL_BINS> right;
+        SpatialBin rightOfBin;
+        for (int i = BVH_SPATIAL_BINS - 1; i > 0; i--) {
+            rightOfBin.minCorner = min(rightOfBin.minCorner, bins[i].minCorner);
+            rightOfBin.maxCorner = max(rightOfBin.maxCorner, bins[i].maxCorner);
+            rightOfBin.exits += bins[i].exits;
+            right[i - 1] = rightOfBin;
+        }
+        SpatialBin left;
+        for (int i = 0; i < BVH_SPATIAL_BINS - 1; i++) {
+            left.minCorner = min(left.minCorner, bins[i].minCorner);
+            left.maxCorner = max(left.maxCorner, bins[i].maxCorner);
+            left.entries += bins[i].entries;
+            if (left.entries == 0 || right[i].exits == 0)
+                continue;
+            float cost = BVH_TRAVERSAL_COST +
+                         BVH_INTERSECTION_COST * (float) left.entries * getSA(left.minCorner, left.maxCorner) +
+                         BVH_INTERSECTION_COST * (float) right[i].exits * getSA(right[i].minCorner, right[i].maxCorner);
+            if (cost < split.cost) {
+                split = {axis, binMin + (float) (i + 1) * binWidth, cost, i, binMin, binScale,
+                         left.minCorner, left.maxCorner, right[i].minCorner, right[i].maxCorner,
+                         left.entries, right[i].exits};
+            }
+        }
+    }
+    return split;
+}
+
+static float getObjectSplitOverlap(const std::vector<BVHTriangle> &refs, const SplitInfo &info) {
+    glm::vec3 leftMin = MAX_VERTEX, leftMax = MIN_VERTEX, rightMin = MAX_VERTEX, rightMax = MIN_VERTEX;
+    for (const BVHTriangle &ref : refs) {
+        if (isLeftOfSplit(info, ref.centroid)) {
+            leftMin = min(leftMin, ref.minCorner);
+            leftMax = max(leftMax, ref.maxCorner);
+        } else {
+            rightMin = min(rightMin, ref.minCorner);
+            rightMax = max(rightMax, ref.maxCorner);
         }
-        assert(0 < numInLeftChild && numInLeftChild <= end - start);
-        int leftChildEnd = start + numInLeftChild - 1;
-        int rightChildStart = leftChildEnd + 1;
-        BVHNode *leftChild = generateBVH(triangleData, start, leftChildEnd, nodeId + 1, depth + 1);
-        BVHNode *rightChild = generateBVH(triangleData, rightChildStart, end,
-                                          nodeId + leftChild->treeSize + 1, depth + 1);
-        node->children[0] = leftChild;
-        node->children[1] = rightChild;
-        node->treeSize += leftChild->treeSize + rightChild->treeSize;
+    }
+    glm::vec3 overlapMin = max(leftMin, rightMin), overlapMax = min(leftMax, rightMax);
+    if (glm::any(glm::greaterThan(overlapMin, overlapMax)))
+        return 0.0f;
+    return getSA(overlapMin, overlapMax);
+}
+
+static void partitionSpatial(const BVHBuildContext &ctx, const std::vector<BVHTriangle> &refs,
+                             const SpatialSplit &split, std::vector<BVHTriangle> &left,
+                             std::vector<BVHTriangle> &right) {
+    /*
+     * Sends every reference to the side of the split it lies on, and clips the ones straddling the plane
+     * into both children unless moving them whole into one child is cheaper (reference unsplitting).
+     */
+    float leftArea = getSA(split.leftMin, split.leftMax), rightArea = getSA(split.rightMin, split.rightMax);
+    float splitCost = leftArea * (float) split.numLeft + rightArea * (float) split.numRight;
+    for (const BVHTriangle &ref : refs) {
+        int first, last;
+        getSpatialBinRange(ref, split.axis, split.binMin, split.binScale, first, last);
+        if (last <= split.bin) {
+            left.push_back(ref);
+            continue;
+        }
+        if (first > split.bin) {
+            right.push_back(ref);
+            continue;
+        }
+        float leftCost = getSA(min(split.leftMin, ref.minCorner), max(split.leftMax, ref.maxCorner)) *
+                         (float) split.numLeft + rightArea * (float) (split.numRight - 1);
+        float rightCost = leftArea * (float) (split.numLeft - 1) +
+                          getSA(min(split.rightMin, ref.minCorner), max(split.rightMax, ref.maxCorner)) *
+                          (float) split.numRight;
+        if (leftCost < splitCost && leftCost <= rightCost) {
+            left.push_back(ref);
+        } else if (rightCost < splitCost) {
+            right.push_back(ref);
+        } else {
+            BVHTriangle leftPart, rightPart;
+            splitReference(ctx, ref, split.axis, split.pos, leftPart, rightPart);
+            if (!isEmpty(leftPart))
+                left.push_back(leftPart);
+            if (!isEmpty(rightPart))
+                right.push_back(rightPart);
+            if (isEmpty(leftPart) && isEmpty(rightPart))
+                left.push_back(ref);
+        }
+    }
+}
+
+static void generateSBVH(BVHBuildContext &ctx, uint32_t nodeIndex, std::vector<BVHTriangle> refs,
+                         int64_t duplicationBudget, int depth = 0) {
+    /*
+     * Spatial split BVH (Stich et al. 2009). Like generateBVH, but where the children of the best object
+     * split overlap, also searches for a spatial split, which clips the references straddling the split
+     * plane into both children instead of sending each one whole to the side of its centroid.
+     * Spatial splits spend the node's duplication budget and what is left is shared between the children
+     * by their number of references, so the tree does not depend on the order subtrees are built in.
+     */
+    BVHNode &node = ctx.nodes[nodeIndex];
+    const int numRefs = (int) refs.size();
+    NodeBounds bounds = getBounds(ctx, refs, 0, numRefs - 1);
+    node.minCorner = bounds.minCorner;
+    node.maxCorner = bounds.maxCorner;
+    SplitInfo objectSplit = getBinnedSplit(ctx, refs, bounds, 0, numRefs - 1);
+    std::vector<BVHTriangle> left, right;
+    /*
+     * Where no object split beats a leaf, its children overlap too much to pay off,
+     * so a spatial split is searched for as well.
+     */
+    if (depth < MAX_BVH_DEPTH && numRefs > 1 && duplicationBudget > 0 &&
+        (objectSplit.axis == NO_AXIS ||
+         getObjectSplitOverlap(refs, objectSplit) > SBVH_OVERLAP_THRESHOLD * ctx.rootArea)) {
+        SpatialSplit spatialSplit = getSpatialSplit(ctx, refs, bounds);
+        if (spatialSplit.cost < objectSplit.cost &&
+            spatialSplit.numLeft + spatialSplit.numRight - numRefs <= duplicationBudget) {
+            partitionSpatial(ctx, refs, spatialSplit, left, right);
+            if (left.empty() || right.empty()) {
+                left.clear();
+                right.clear();
+            } else {
+                ctx.numSpatialSplits++;
+            }
+        }
+    }
+    if (left.empty() && (depth == MAX_BVH_DEPTH || objectSplit.axis == NO_AXIS)) {
+        uint32_t start = ctx.numLeafReferences.fetch_add(numRefs);
+        for (int i = 0; i < numRefs; i++)
+            ctx.leafReferences[start + i] = refs[i].index;
+        node.leftOrStart = start;
+        node.rightOrCount = BVH_LEAF_BIT | (uint32_t) numRefs;
+        return;
+    }
+    if (left.empty()) {
+        auto isLeft = [&objectSplit](const BVHTriangle &ref) { return isLeftOfSplit(objectSplit, ref.centroid); };
+        auto mid = std::stable_partition(refs.begin(), refs.end(), isLeft);
+        left.assign(refs.begin(), mid);
+        right.assign(mid, refs.end());
+    }
+    assert(!left.empty() && !right.empty());
+    std::vector<BVHTriangle>().swap(refs);
+    auto numLeft = (int64_t) left.size(), numRight = (int64_t) right.size();
+    int64_t remainingBudget = duplicationBudget - (numLeft + numRight - numRefs);
+    int64_t leftBudget = remainingBudget * numLeft / (numLeft + numRight);
+    int64_t rightBudget = remainingBudget - leftBudget;
+    uint32_t leftChild = ctx.numNodes.fetch_add(2);
+    node.leftOrStart = leftChild;
+    node.rightOrCount = leftChild + 1;
+    if (numRefs >= BVH_PARALLEL_TASK_THRESHOLD) {
+        TaskGroup group(ctx.pool);
+        group.run([&ctx, leftChild, &left, leftBudget, depth] {
+            generateSBVH(ctx, leftChild, std::move(left), leftBudget, depth + 1);
+        });
+        generateSBVH(ctx, leftChild + 1, std::move(right), rightBudget, depth + 1);
+        group.wait();
     } else {
-        node->triangleStart = start;
-        node->triangleEnd = end;
-        numLeaves++;
-        int leafSize = end - start + 1;
-        minLeafSize = std::min(minLeafSize, leafSize);
-        maxLeafSize = std::max(maxLeafSize, leafSize);
-        totalLeafSize += end - start + 1;
+        generateSBVH(ctx, leftChild, std::move(left), leftBudget, depth + 1);
+        generateSBVH(ctx, leftChild + 1, std::move(right), rightBudget, depth + 1);
     }
-    return node;
 }
 
-BVHNode *
-generateBVH(std::vector<glm::uvec3> &triangleVertexIndices, std::vector<glm::vec3> &vertices) {
+/*
+ * The linear builders (BVH_SPLIT_LBVH and BVH_SPLIT_PLOC) sort the triangles along a Morton curve and build a binary
+ * tree with one triangle per leaf, whose leaves take arena slots [n - 1, 2n - 1) and reference triangleData directly.
+ * The tree is then optionally restructured in treelets, and collapsed into multi-triangle leaves by SAH.
+ */
+
+#define MORTON_BITS_PER_AXIS 21
+#define RADIX_BITS 8
+
+struct MortonKey {
+    uint64_t code;
+    uint32_t index;
+};
+
+/*
+ * Per-node state of a linear build, indexed like the arena
+ */
+struct LinearBVH {
+    BVHBuildContext &ctx;
+    std::vector<uint32_t> numTriangles;
+    // Least SAH cost of each subtree, counting that any subtree may be collapsed into a leaf
+    std::vector<float> costs;
+};
+
+static uint64_t expandBits(uint32_t v) {
     /*
-     * Generate BVH from a list of vertex coordinates
-     * and the list of vertex indices for each triangle.
+     * Spreads the low 21 bits of v out to every third bit of the result
      */
-    initBVHGenerationStats();
+    uint64_t x = v & 0x1fffffu;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+static std::vector<MortonKey> getMortonKeys(BVHBuildContext &ctx, const NodeBounds &bounds) {
+    /*
+     * 63 bit Morton codes of the centroids, quantized to a 2^21 grid per axis over the centroid bounds.
+     * 30 bit codes would sort in half the passes, but on meshes of millions of triangles most leaves would share
+     * their code with a neighbour and be split by index alone.
+     */
+    const float gridMax = (float) ((1u << MORTON_BITS_PER_AXIS) - 1);
+    glm::vec3 scale;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = bounds.centroidMax[axis] - bounds.centroidMin[axis];
+        scale[axis] = extent > 1e-6f ? gridMax / extent : 0.0f;
+    }
+    std::vector<MortonKey> keys(ctx.triangleData.size());
+    parallelForChunks(ctx.pool, 0, (int) keys.size(), BVH_PARALLEL_CHUNK_SIZE,
+                      [&](int, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++) {
+            glm::vec3 cell = glm::clamp((ctx.triangleData[i].centroid - bounds.centroidMin) * scale, 0.0f, gridMax);
+            keys[i].code = expandBits((uint32_t) cell.x) << 2 | expandBits((uint32_t) cell.y) << 1 |
+                           expandBits((uint32_t) cell.z);
+            keys[i].index = (uint32_t) i;
+        }
+    });
+    return keys;
+}
+
+static void sortMortonKeys(TaskPool &pool, std::vector<MortonKey> &keys) {
+    /*
+     * LSD radix sort over RADIX_BITS digits. Every chunk counts its digits, and the counts are prefix summed
+     * digit-major so that each chunk scatters into its own slots, which keeps the sort stable and deterministic.
+     * Digits that every key shares are skipped.
+     */
+    const int n = (int) keys.size();
+    const int numDigits = 1 << RADIX_BITS;
+    std::vector<MortonKey> buffer(n);
+    std::vector<std::array<uint32_t, 1 << RADIX_BITS>> offsets(getNumChunks(pool, 0, n, BVH_PARALLEL_CHUNK_SIZE));
+    for (int shift = 0; shift < 3 * MORTON_BITS_PER_AXIS; shift += RADIX_BITS) {
+        parallelForChunks(pool, 0, n, BVH_PARALLEL_CHUNK_SIZE, [&](int chunk, int chunkStart, int chunkEnd) {
+            offsets[chunk].fill(0);
+            for (int i = chunkStart; i < chunkEnd; i++)
+                offsets[chunk][(keys[i].code >> shift) & (numDigits - 1)]++;
+        });
+        uint32_t offset = 0;
+        bool isShared = false;
+        for (int digit = 0; digit < numDigits; digit++) {
+            uint32_t digitStart = offset;
+            for (auto &chunkOffsets : offsets) {
+                uint32_t count = chunkOffsets[digit];
+                chunkOffsets[digit] = offset;
+                offset += count;
+            }
+            isShared |= offset - digitStart == (uint32_t) n;
+        }
+        if (isShared)
+            continue;
+        parallelForChunks(pool, 0, n, BVH_PARALLEL_CHUNK_SIZE, [&](int chunk, int chunkStart, int chunkEnd) {
+            for (int i = chunkStart; i < chunkEnd; i++)
+                buffer[offsets[chunk][(keys[i].code >> shift) & (numDigits - 1)]++] = keys[i];
+        });
+        keys.swap(buffer);
+    }
+}
+
+static float getLinearLeafCost(const LinearBVH &bvh, uint32_t index) {
+    const BVHNode &node = bvh.ctx.nodes[index];
+    return BVH_INTERSECTION_COST * (float) bvh.numTriangles[index] * getSA(node.minCorner, node.maxCorner);
+}
+
+static float getLinearCost(const LinearBVH &bvh, uint32_t index) {
+    const BVHNode &node = bvh.ctx.nodes[index];
+    float leafCost = getLinearLeafCost(bvh, index);
+    if (node.isLeaf())
+        return leafCost;
+    return std::min(leafCost, BVH_TRAVERSAL_COST * getSA(node.minCorner, node.maxCorner) +
+                              bvh.costs[node.leftOrStart] + bvh.costs[node.rightOrCount]);
+}
+
+template<typename Fn>
+static void forEachChild(LinearBVH &bvh, uint32_t index, Fn fn) {
+    /*
+     * Runs fn on both children of an interior node, forking large subtrees onto the task pool
+     */
+    uint32_t left = bvh.ctx.nodes[index].leftOrStart, right = bvh.ctx.nodes[index].rightOrCount;
+    if (bvh.numTriangles[index] >= BVH_PARALLEL_TASK_THRESHOLD) {
+        TaskGroup group(bvh.ctx.pool);
+        group.run([&fn, left] { fn(left); });
+        fn(right);
+        group.wait();
+    } else {
+        fn(left);
+        fn(right);
+    }
+}
+
+static void initLinearLeaves(LinearBVH &bvh, const std::vector<MortonKey> &keys) {
+    const auto n = (uint32_t) keys.size();
+    parallelForChunks(bvh.ctx.pool, 0, (int) n, BVH_PARALLEL_CHUNK_SIZE, [&](int, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++) {
+            const BVHTriangle &triangle = bvh.ctx.triangleData[keys[i].index];
+            bvh.ctx.nodes[n - 1 + i] = {triangle.minCorner, keys[i].index, triangle.maxCorner, BVH_LEAF_BIT | 1u};
+            bvh.numTriangles[n - 1 + i] = 1;
+        }
+    });
+}
+
+static void generateLBVH(LinearBVH &bvh, const std::vector<MortonKey> &keys) {
+    /*
+     * Karras 2012: interior node i covers a range of the sorted keys that starts or ends at key i, and splits it
+     * where the highest differing bit changes, so every node is found independently of the others.
+     * Duplicate codes are told apart by their position. Bounds are left to refitLinearBVH.
+     */
+    const int n = (int) keys.size();
+    auto delta = [&keys, n](int i, int j) {
+        if (j < 0 || j >= n)
+            return -1;
+        uint64_t diff = keys[i].code ^ keys[j].code;
+        if (diff == 0)
+            return 64 + std::countl_zero((uint32_t) (i ^ j));
+        return std::countl_zero(diff);
+    };
+    auto getChild = [n](int key, bool isLeaf) { return (uint32_t) (isLeaf ? n - 1 + key : key); };
+    parallelForChunks(bvh.ctx.pool, 0, n - 1, BVH_PARALLEL_CHUNK_SIZE, [&](int, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++) {
+            int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+            int minDelta = delta(i, i - d);
+            int maxLength = 2;
+            while (delta(i, i + maxLength * d) > minDelta)
+                maxLength *= 2;
+            int length = 0;
+            for (int t = maxLength / 2; t >= 1; t /= 2) {
+                if (delta(i, i + (length + t) * d) > minDelta)
+                    length += t;
+            }
+            int j = i + length * d;
+            int nodeDelta = delta(i, j);
+            int split = 0;
+            for (int t = (length + 1) / 2;; t = (t + 1) / 2) {
+                if (delta(i, i + (split + t) * d) > nodeDelta)
+                    split += t;
+                if (t == 1)
+                    break;
+            }
+            int gamma = i + split * d + std::min(d, 0);
+            BVHNode &node = bvh.ctx.nodes[i];
+            node.leftOrStart = getChild(gamma, std::min(i, j) == gamma);
+            node.rightOrCount = getChild(gamma + 1, std::max(i, j) == gamma + 1);
+            bvh.numTriangles[i] = (uint32_t) std::abs(j - i) + 1;
+        }
+    });
+}
+
+static void generatePLOC(LinearBVH &bvh, const std::vector<MortonKey> &keys) {
+    /*
+     * Meister and Bittner 2018: starting from the leaves in Morton order, every cluster finds the cluster within
+     * PLOC_SEARCH_RADIUS positions whose union with it has the least surface area, and mutual nearest neighbours
+     * merge. Merged clusters keep the position of their left child, so clusters stay spatially sorted as they grow.
+     * Ties go to the nearer position, then to pairs starting at an even position, then to the left, which orders
+     * all pairs so that the closest one is always mutual and every pass merges. Runs of identical clusters, such as
+     * duplicated geometry, then merge in pairs instead of one pair per pass.
+     */
+    BVHBuildContext &ctx = bvh.ctx;
+    const auto n = (uint32_t) keys.size();
+    std::vector<uint32_t> clusters(n), nextClusters, neighbours;
+    // Bounds of the clusters in their order, so that the search reads them sequentially
+    std::vector<BVHBox> boxes(n), nextBoxes;
+    for (uint32_t i = 0; i < n; i++) {
+        clusters[i] = n - 1 + i;
+        boxes[i] = {ctx.nodes[n - 1 + i].minCorner, ctx.nodes[n - 1 + i].maxCorner};
+    }
+    auto isPreferred = [](int i, int j, int other) {
+        int first = std::min(i, j), otherFirst = std::min(i, other);
+        return std::make_tuple(std::abs(j - i), first & 1, first) <
+               std::make_tuple(std::abs(other - i), otherFirst & 1, otherFirst);
+    };
+    // Interior nodes are allocated downwards, so that the last merge, the root, takes slot 0
+    uint32_t nextNode = n - 1;
+    while (clusters.size() > 1) {
+        const int numClusters = (int) clusters.size();
+        neighbours.resize(numClusters);
+        parallelForChunks(ctx.pool, 0, numClusters, BVH_PARALLEL_CHUNK_SIZE,
+                          [&](int, int chunkStart, int chunkEnd) {
+            for (int i = chunkStart; i < chunkEnd; i++) {
+                float bestArea = std::numeric_limits<float>::infinity();
+                int best = i;
+                int end = std::min(numClusters - 1, i + PLOC_SEARCH_RADIUS);
+                for (int j = std::max(0, i - PLOC_SEARCH_RADIUS); j <= end; j++) {
+                    float area = getSA(min(boxes[i].minCorner, boxes[j].minCorner),
+                                       max(boxes[i].maxCorner, boxes[j].maxCorner));
+                    if (j != i && (area < bestArea || (area == bestArea && isPreferred(i, j, best)))) {
+                        bestArea = area;
+                        best = j;
+                    }
+                }
+                neighbours[i] = (uint32_t) best;
+            }
+        });
+        int numChunks = getNumChunks(ctx.pool, 0, numClusters, BVH_PARALLEL_CHUNK_SIZE);
+        std::vector<uint32_t> numMerges(numChunks + 1, 0), numKept(numChunks + 1, 0);
+        parallelForChunks(ctx.pool, 0, numClusters, BVH_PARALLEL_CHUNK_SIZE,
+                          [&](int chunk, int chunkStart, int chunkEnd) {
+            for (int i = chunkStart; i < chunkEnd; i++) {
+                uint32_t j = neighbours[i];
+                bool isMutual = neighbours[j] == (uint32_t) i;
+                numMerges[chunk + 1] += isMutual && (uint32_t) i < j;
+                numKept[chunk + 1] += !isMutual || (uint32_t) i < j;
+            }
+        });
+        for (int chunk = 0; chunk < numChunks; chunk++) {
+            numMerges[chunk + 1] += numMerges[chunk];
+            numKept[chunk + 1] += numKept[chunk];
+        }
+        nextClusters.resize(numKept[numChunks]);
+        nextBoxes.resize(numKept[numChunks]);
+        parallelForChunks(ctx.pool, 0, numClusters, BVH_PARALLEL_CHUNK_SIZE,
+                          [&](int chunk, int chunkStart, int chunkEnd) {
+            uint32_t merge = numMerges[chunk], kept = numKept[chunk];
+            for (int i = chunkStart; i < chunkEnd; i++) {
+                uint32_t j = neighbours[i];
+                if (neighbours[j] != (uint32_t) i) {
+                    nextBoxes[kept] = boxes[i];
+                    nextClusters[kept++] = clusters[i];
+                } else if ((uint32_t) i < j) {
+                    uint32_t index = nextNode - 1 - merge++;
+                    BVHBox box = {min(boxes[i].minCorner, boxes[j].minCorner),
+                                  max(boxes[i].maxCorner, boxes[j].maxCorner)};
+                    ctx.nodes[index] = {box.minCorner, clusters[i], box.maxCorner, clusters[j]};
+                    bvh.numTriangles[index] = bvh.numTriangles[clusters[i]] + bvh.numTriangles[clusters[j]];
+                    nextBoxes[kept] = box;
+                    nextClusters[kept++] = index;
+                }
+            }
+        });
+        nextNode -= numMerges[numChunks];
+        clusters.swap(nextClusters);
+        boxes.swap(nextBoxes);
+    }
+    assert(nextNode == 0 && clusters[0] == 0);
+}
+
+static void refitLinearBVH(LinearBVH &bvh, uint32_t index) {
+    /*
+     * Computes the bounds and costs of the subtree bottom-up
+     */
+    BVHNode &node = bvh.ctx.nodes[index];
+    if (!node.isLeaf()) {
+        forEachChild(bvh, index, [&bvh](uint32_t child) { refitLinearBVH(bvh, child); });
+        const BVHNode &left = bvh.ctx.nodes[node.leftOrStart], &right = bvh.ctx.nodes[node.rightOrCount];
+        node.minCorner = min(left.minCorner, right.minCorner);
+        node.maxCorner = max(left.maxCorner, right.maxCorner);
+    }
+    bvh.costs[index] = getLinearCost(bvh, index);
+}
+
+static void restructureTreelet(LinearBVH &bvh, uint32_t root) {
+    /*
+     * Karras and Aila 2013: grows a treelet below root by repeatedly expanding its leaf of largest area, finds the
+     * topology of least SAH cost over the treelet's leaves by dynamic programming over every subset of them,
+     * and rebuilds the treelet's interior nodes in place if that beats the current topology.
+     */
+    auto &nodes = bvh.ctx.nodes;
+    std::array<uint32_t, BVH_TREELET_SIZE> leaves{nodes[root].leftOrStart, nodes[root].rightOrCount};
+    std::array<uint32_t, BVH_TREELET_SIZE - 1> interiors{root};
+    int numLeaves = 2;
+    while (numLeaves < BVH_TREELET_SIZE) {
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (int i = 0; i < numLeaves; i++) {
+            const BVHNode &leaf = nodes[leaves[i]];
+            float area = getSA(leaf.minCorner, leaf.maxCorner);
+            if (!leaf.isLeaf() && area > largestArea) {
+                largest = i;
+                largestArea = area;
+            }
+        }
+        if (largest == -1)
+            break;
+        interiors[numLeaves - 1] = leaves[largest];
+        leaves[numLeaves++] = nodes[leaves[largest]].rightOrCount;
+        leaves[largest] = nodes[leaves[largest]].leftOrStart;
+    }
+    const int numSubsets = 1 << numLeaves;
+    std::array<BVHBox, 1 << BVH_TREELET_SIZE> boxes;
+    std::array<uint32_t, 1 << BVH_TREELET_SIZE> numTriangles;
+    std::array<float, 1 << BVH_TREELET_SIZE> costs;
+    std::array<uint8_t, 1 << BVH_TREELET_SIZE> leftSubsets;
+    for (int subset = 1; subset < numSubsets; subset++) {
+        int lowest = std::countr_zero((unsigned) subset);
+        int rest = subset & (subset - 1);
+        if (rest == 0) {
+            const BVHNode &leaf = nodes[leaves[lowest]];
+            boxes[subset] = {leaf.minCorner, leaf.maxCorner};
+            numTriangles[subset] = bvh.numTriangles[leaves[lowest]];
+            costs[subset] = bvh.costs[leaves[lowest]];
+            continue;
+        }
+        boxes[subset] = {min(boxes[rest].minCorner, boxes[1 << lowest].minCorner),
+                         max(boxes[rest].maxCorner, boxes[1 << lowest].maxCorner)};
+        numTriangles[subset] = numTriangles[rest] + numTriangles[1 << lowest];
+        // Only left subsets holding the lowest leaf, so that every split is costed once
+        float bestSplit = std::numeric_limits<float>::infinity();
+        for (int others = (rest - 1) & rest;; others = (others - 1) & rest) {
+            int left = others | 1 << lowest;
+            float cost = costs[left] + costs[subset ^ left];
+            if (cost < bestSplit) {
+                bestSplit = cost;
+                leftSubsets[subset] = (uint8_t) left;
+            }
+            if (others == 0)
+                break;
+        }
+        float area = getSA(boxes[subset].minCorner, boxes[subset].maxCorner);
+        costs[subset] = std::min(BVH_INTERSECTION_COST * (float) numTriangles[subset] * area,
+                                 BVH_TRAVERSAL_COST * area + bestSplit);
+    }
+    if (costs[numSubsets - 1] >= bvh.costs[root])
+        return;
+    int numInteriors = 1;
+    auto rebuild = [&](auto &self, int subset, uint32_t index) -> void {
+        std::array<uint32_t, 2> children;
+        std::array<int, 2> childSubsets{leftSubsets[subset], subset ^ leftSubsets[subset]};
+        for (int i = 0; i < 2; i++) {
+            if (std::has_single_bit((unsigned) childSubsets[i])) {
+                children[i] = leaves[std::countr_zero((unsigned) childSubsets[i])];
+            } else {
+                children[i] = interiors[numInteriors++];
+                self(self, childSubsets[i], children[i]);
+            }
+        }
+        nodes[index] = {boxes[subset].minCorner, children[0], boxes[subset].maxCorner, children[1]};
+        bvh.numTriangles[index] = numTriangles[subset];
+        bvh.costs[index] = costs[subset];
+    };
+    rebuild(rebuild, numSubsets - 1, root);
+}
+
+static void optimizeTreelets(LinearBVH &bvh, uint32_t index) {
+    /*
+     * Restructures every treelet rooted at a node of at least BVH_TREELET_MIN_TRIANGLES triangles, bottom-up so
+     * that each treelet's leaves are already optimized. Smaller subtrees are left as built: they make up most of
+     * the nodes but little of the cost.
+     */
+    if (bvh.numTriangles[index] < BVH_TREELET_MIN_TRIANGLES)
+        return;
+    forEachChild(bvh, index, [&bvh](uint32_t child) { optimizeTreelets(bvh, child); });
+    bvh.costs[index] = getLinearCost(bvh, index);
+    restructureTreelet(bvh, index);
+}
+
+static void addLeafReferences(const LinearBVH &bvh, uint32_t index, uint32_t &next) {
+    const BVHNode &node = bvh.ctx.nodes[index];
+    if (node.isLeaf()) {
+        bvh.ctx.leafReferences[next++] = bvh.ctx.triangleData[node.leftOrStart].index;
+        return;
+    }
+    addLeafReferences(bvh, node.leftOrStart, next);
+    addLeafReferences(bvh, node.rightOrCount, next);
+}
+
+static void collapseLinearBVH(LinearBVH &bvh, uint32_t index, int depth = 0) {
     /*
-     * Converts the given triangle data into a 4x3 matrix with rows being:
-     * triangle midpoint
-     * triangle min point
-     * triangle max point
-     * the original vertex indices (converted to float + small padding to prevent floating point
-     * errors)
+     * Turns every subtree that is cheaper as a leaf, or that reaches MAX_BVH_DEPTH, into a leaf
+     * referencing all of its triangles
      */
-    std::vector<glm::mat4x3> triangleData(triangleVertexIndices.size());
-    for (int i = 0; i < triangleVertexIndices.size(); i++) {
+    BVHNode &node = bvh.ctx.nodes[index];
+    if (node.isLeaf() || depth == MAX_BVH_DEPTH || getLinearLeafCost(bvh, index) <= bvh.costs[index]) {
+        uint32_t numTriangles = bvh.numTriangles[index];
+        uint32_t start = bvh.ctx.numLeafReferences.fetch_add(numTriangles), next = start;
+        addLeafReferences(bvh, index, next);
+        node.leftOrStart = start;
+        node.rightOrCount = BVH_LEAF_BIT | numTriangles;
+        return;
+    }
+    forEachChild(bvh, index, [&bvh, depth](uint32_t child) { collapseLinearBVH(bvh, child, depth + 1); });
+}
+
+static void generateLinearBVH(BVHBuildContext &ctx, bool shouldOptimizeTreelets) {
+    const auto n = (uint32_t) ctx.triangleData.size();
+    NodeBounds bounds = getBounds(ctx, ctx.triangleData, 0, (int) n - 1);
+    std::vector<MortonKey> keys = getMortonKeys(ctx, bounds);
+    sortMortonKeys(ctx.pool, keys);
+    LinearBVH bvh{ctx, std::vector<uint32_t>(2 * n - 1), std::vector<float>(2 * n - 1)};
+    initLinearLeaves(bvh, keys);
+    if (ctx.splitMethod == BVH_SPLIT_PLOC)
+        generatePLOC(bvh, keys);
+    else
+        generateLBVH(bvh, keys);
+    std::vector<MortonKey>().swap(keys);
+    refitLinearBVH(bvh, 0);
+    if (shouldOptimizeTreelets) {
+        for (int pass = 0; pass < BVH_TREELET_PASSES; pass++)
+            optimizeTreelets(bvh, 0);
+    }
+    collapseLinearBVH(bvh, 0);
+    ctx.numNodes = 2 * n - 1;
+}
+
+static uint32_t writePreOrder(const BVHBuildContext &ctx, uint32_t arenaIndex, std::vector<BVHNode> &nodes,
+                              std::vector<uint32_t> &triangleIndices, BVHBuildStats &stats, int depth = 0) {
+    /*
+     * Copies the subtree at arenaIndex into nodes, and the triangle indices of its leaves into
+     * triangleIndices, in pre-order, independently of the order in which the subtrees finished building.
+     * Also collects the tree statistics.
+     */
+    auto id = (uint32_t) nodes.size();
+    const BVHNode &node = ctx.nodes[arenaIndex];
+    nodes.push_back(node);
+    stats.depth = std::max(stats.depth, depth);
+    if (node.isLeaf()) {
+        int leafSize = (int) node.getTriangleCount();
+        nodes[id].leftOrStart = (uint32_t) triangleIndices.size();
+        triangleIndices.insert(triangleIndices.end(), ctx.leafReferences.get() + node.leftOrStart,
+                               ctx.leafReferences.get() + node.leftOrStart + leafSize);
+        stats.numLeaves++;
+        stats.minLeafSize = std::min(stats.minLeafSize, leafSize);
+        stats.maxLeafSize = std::max(stats.maxLeafSize, leafSize);
+        stats.numReferences += leafSize;
+    } else {
+        uint32_t left = writePreOrder(ctx, node.leftOrStart, nodes, triangleIndices, stats, depth + 1);
+        uint32_t right = writePreOrder(ctx, node.rightOrCount, nodes, triangleIndices, stats, depth + 1);
+        nodes[id].leftOrStart = left;
+        nodes[id].rightOrCount = right;
+    }
+    return id;
+}
+
+float getBVHCost(std::span<const BVHNode> nodes) {
+    /*
+     * Gets the SAH cost of the whole tree, i.e. the expected cost of tracing a ray
+     * that hits the root's bounding box.
+     */
+    float cost = 0.0f;
+    for (const BVHNode &node : nodes) {
+        if (node.isLeaf())
+            cost += BVH_INTERSECTION_COST * (float) node.getTriangleCount() * getSA(node.minCorner, node.maxCorner);
+        else
+            cost += BVH_TRAVERSAL_COST * getSA(node.minCorner, node.maxCorner);
+    }
+    return cost / getSA(nodes[0].minCorner, nodes[0].maxCorner);
+}
+
+static void setLeafBounds(BVHNode &leaf, std::span<const uint32_t> triangleIndices,
+                          const std::vector<glm::uvec3> &triangleVertexIndices,
+                          const std::vector<glm::vec3> &vertices) {
+    leaf.minCorner = MAX_VERTEX;
+    leaf.maxCorner = MIN_VERTEX;
+    for (uint32_t i = leaf.leftOrStart; i < leaf.leftOrStart + leaf.getTriangleCount(); i++) {
+        const glm::uvec3 &triangle = triangleVertexIndices[triangleIndices[i]];
+        for (int j = 0; j < 3; j++) {
+            leaf.minCorner = min(leaf.minCorner, vertices[triangle[j]]);
+            leaf.maxCorner = max(leaf.maxCorner, vertices[triangle[j]]);
+        }
+    }
+}
+
+void refitBVH(std::span<BVHNode> nodes, std::span<const uint32_t> triangleIndices,
+              const std::vector<glm::uvec3> &triangleVertexIndices, const std::vector<glm::vec3> &vertices,
+              TaskPool *pool) {
+    /*
+     * Leaves only read triangles, so they can all be refit at once.
+     * Interior nodes then take the union of their children, which is a cheap serial pass.
+     */
+    auto refitLeaves = [&](int, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++) {
+            if (nodes[i].isLeaf())
+                setLeafBounds(nodes[i], triangleIndices, triangleVertexIndices, vertices);
+        }
+    };
+    if (pool != nullptr)
+        parallelForChunks(*pool, 0, (int) nodes.size(), BVH_PARALLEL_CHUNK_SIZE, refitLeaves);
+    else
+        refitLeaves(0, 0, (int) nodes.size());
+    for (int i = (int) nodes.size() - 1; i >= 0; i--) {
+        BVHNode &node = nodes[i];
+        if (node.isLeaf())
+            continue;
+        const BVHNode &left = nodes[node.leftOrStart];
+        const BVHNode &right = nodes[node.rightOrCount];
+        node.minCorner = min(left.minCorner, right.minCorner);
+        node.maxCorner = max(left.maxCorner, right.maxCorner);
+    }
+}
+
+static void reorderTriangles(std::vector<glm::uvec3> &triangleVertexIndices, std::vector<uint32_t> &triangleIndices) {
+    /*
+     * Renumbers the triangles in the order the leaves first reference them, so that leaves read
+     * the triangle buffers close to sequentially.
+     */
+    const uint32_t unassigned = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> newIndices(triangleVertexIndices.size(), unassigned);
+    std::vector<glm::uvec3> sortedTriangles;
+    sortedTriangles.reserve(triangleVertexIndices.size());
+    for (uint32_t &index : triangleIndices) {
+        if (newIndices[index] == unassigned) {
+            newIndices[index] = (uint32_t) sortedTriangles.size();
+            sortedTriangles.push_back(triangleVertexIndices[index]);
+        }
+        index = newIndices[index];
+    }
+    assert(sortedTriangles.size() == triangleVertexIndices.size());
+    triangleVertexIndices = std::move(sortedTriangles);
+}
+
+static std::vector<BVHNode> buildBVH(std::vector<BVHTriangle> &triangleData,
+                                     const std::vector<glm::uvec3> &triangleVertexIndices,
+                                     const std::vector<glm::vec3> &vertices, std::vector<uint32_t> &primitiveIndices,
+                                     const BVHBuildOptions &options, TaskPool &pool, BVHBuildStats &buildStats) {
+    /*
+     * Builds the tree over triangleData and writes it out in pre-order, with the primitive indices of the leaves
+     * in primitiveIndices. Fills in every statistic except the build time.
+     */
+    const size_t numTriangles = triangleData.size();
+    if (numTriangles == 0)
+        throw std::runtime_error("Cannot build a BVH over no primitives");
+    const auto duplicationBudget = (int64_t) (options.splitMethod == BVH_SPLIT_SBVH ?
+                                              options.duplicationBudget * (float) numTriangles : 0.0f);
+    const size_t maxReferences = numTriangles + duplicationBudget;
+    BVHBuildContext ctx{triangleData, {}, triangleVertexIndices, vertices,
+                        std::make_unique_for_overwrite<BVHNode[]>(2 * maxReferences - 1), 1,
+                        std::make_unique_for_overwrite<uint32_t[]>(maxReferences), 0, 0, 0.0f,
+                        options.splitMethod, pool};
+    if (options.splitMethod == BVH_SPLIT_LBVH || options.splitMethod == BVH_SPLIT_PLOC) {
+        generateLinearBVH(ctx, options.optimizeTreelets);
+    } else if (options.splitMethod == BVH_SPLIT_SBVH) {
+        NodeBounds rootBounds = getBounds(ctx, triangleData, 0, (int) numTriangles - 1);
+        ctx.rootArea = getSA(rootBounds.minCorner, rootBounds.maxCorner);
+        generateSBVH(ctx, 0, std::move(triangleData), duplicationBudget);
+    } else {
+        if (numTriangles >= BVH_PARALLEL_SPLIT_THRESHOLD && pool.getNumThreads() > 1)
+            ctx.partitionBuffer.resize(numTriangles);
+        generateBVH(ctx, 0, 0, (int) numTriangles - 1);
+    }
+    std::vector<BVHNode> nodes;
+    nodes.reserve(ctx.numNodes);
+    primitiveIndices.clear();
+    primitiveIndices.reserve(maxReferences);
+    writePreOrder(ctx, 0, nodes, primitiveIndices, buildStats);
+    buildStats.numNodes = (int) nodes.size();
+    buildStats.numTriangles = (int) numTriangles;
+    buildStats.numSpatialSplits = ctx.numSpatialSplits;
+    buildStats.sahCost = getBVHCost(nodes);
+    return nodes;
+}
+
+static void printBVHStats(const BVHBuildOptions &options, int numThreads, const BVHBuildStats &buildStats) {
+    if (options.splitMethod == BVH_SPLIT_TERNARY)
+        std::cout << "BVH SPLIT METHOD: TERNARY (" << BVH_SPLIT_ITERATIONS << " ITERATIONS)" << std::endl;
+    else if (options.splitMethod == BVH_SPLIT_SBVH)
+        std::cout << "BVH SPLIT METHOD: SBVH (" << BVH_SPLIT_BINS << " OBJECT BINS, " << BVH_SPATIAL_BINS
+                  << " SPATIAL BINS, " << options.duplicationBudget * 100.0f << "% DUPLICATION BUDGET)" << std::endl;
+    else if (options.splitMethod == BVH_SPLIT_LBVH || options.splitMethod == BVH_SPLIT_PLOC)
+        std::cout << "BVH SPLIT METHOD: " << (options.splitMethod == BVH_SPLIT_LBVH ? "LBVH" : "PLOC") << " ("
+                  << 3 * MORTON_BITS_PER_AXIS << " BIT MORTON CODES"
+                  << (options.splitMethod == BVH_SPLIT_PLOC ?
+                      ", SEARCH RADIUS " + std::to_string(PLOC_SEARCH_RADIUS) : "")
+                  << (options.optimizeTreelets ? ", TREELETS OF " + std::to_string(BVH_TREELET_SIZE) : "") << ")"
+                  << std::endl;
+    else
+        std::cout << "BVH SPLIT METHOD: BINNED (" << BVH_SPLIT_BINS << " BINS)" << std::endl;
+    std::cout << "BVH BUILD THREADS: " << numThreads << std::endl;
+    std::cout << "BVH BUILD TIME: " << buildStats.buildTimeMs << " ms" << std::endl;
+    std::cout << "BVH SAH COST: " << buildStats.sahCost << std::endl;
+    std::cout << "GENERATED " << buildStats.numNodes << " BVH NODES ("
+              << buildStats.numNodes * sizeof(BVHNode) / 1024 << " KB)" << std::endl;
+    std::cout << "BVH DEPTH: " << buildStats.depth << std::endl;
+    std::cout << "NUM LEAVES: " << buildStats.numLeaves << std::endl;
+    std::cout << "MIN LEAF SIZE: " << buildStats.minLeafSize << std::endl;
+    std::cout << "MAX LEAF SIZE: " << buildStats.maxLeafSize << std::endl;
+    std::cout << "NUM TRIANGLES: " << buildStats.numTriangles << std::endl;
+    if (options.splitMethod == BVH_SPLIT_SBVH) {
+        std::cout << "SPATIAL SPLITS: " << buildStats.numSpatialSplits << std::endl;
+        std::cout << "TRIANGLE REFERENCES: " << buildStats.numReferences << " (+"
+                  << 100.0f * (float) (buildStats.numReferences - buildStats.numTriangles) /
+                     (float) buildStats.numTriangles << "%)" << std::endl;
+    }
+    std::cout << "AVERAGE LEAF SIZE: " << (float) buildStats.numReferences / (float) buildStats.numLeaves << std::endl;
+}
+
+std::vector<BVHNode> generateBVH(TaskPool &pool, std::vector<glm::uvec3> &triangleVertexIndices,
+                                 const std::vector<glm::vec3> &vertices, std::vector<uint32_t> &triangleIndices,
+                                 const BVHBuildOptions &options, BVHBuildStats *stats) {
+    /*
+     * Generate BVH from a list of vertex coordinates
+     * and the list of vertex indices for each triangle.
+     */
+    PROFILE_SCOPE("BUILD BVH");
+    auto buildStart = std::chrono::high_resolution_clock::now();
+    std::vector<BVHTriangle> triangleData(triangleVertexIndices.size());
+    for (size_t i = 0; i < triangleVertexIndices.size(); i++) {
         glm::vec3 v1 = vertices[triangleVertexIndices[i][0]];
         glm::vec3 v2 = vertices[triangleVertexIndices[i][1]];
         glm::vec3 v3 = vertices[triangleVertexIndices[i][2]];
-        triangleData[i][0] = (v1 + v2 + v3) / 3.0f;
-        triangleData[i][1] = min(v1, min(v2, v3));
-        triangleData[i][2] = max(v1, max(v2, v3));
-        triangleData[i][3] = (glm::vec3) triangleVertexIndices[i] + glm::vec3(0.2f, 0.2f, 0.2f);
-    }
-    BVHNode *res = generateBVH(triangleData, 0, (int) triangleData.size() - 1);
-    for (int i = 0; i < triangleData.size(); i++) {
-        triangleVertexIndices[i] = triangleData[i][3];
-    }
-    numNodesGenerated = res->treeSize;
-    std::cout << "GENERATED " << numNodesGenerated << " BVH NODES" << std::endl;
-    std::cout << "NUM LEAVES: " << numLeaves << std::endl;
-    std::cout << "MIN LEAF SIZE: " << minLeafSize << std::endl;
-    std::cout << "MAX LEAF SIZE: " << maxLeafSize << std::endl;
-    std::cout << "NUM TRIANGLES: " << totalLeafSize << std::endl;
-    std::cout << "AVERAGE LEAF SIZE: " << (float) totalLeafSize / (float) numLeaves << std::endl;
-    return res;
-}
-
-static void serialiseBVHNode(std::vector<glm::mat3> &v, int &i, BVHNode *node) {
-    assert(i == node->id);
-    glm::vec3 childData;
-    if (node->isLeaf) {
-        childData.x = 1.0f;
-        childData.y = (float) node->triangleStart;
-        childData.z = (float) node->triangleEnd;
-    } else {
-        childData.x = 0.0f;
-        childData.y = (float) node->children[0]->id;
-        childData.z = (float) node->children[1]->id;
-    }
-    v[i++] = glm::mat3(node->minCorner, node->maxCorner, childData);
-    if (!node->isLeaf) {
-        serialiseBVHNode(v, i, node->children[0]);
-        serialiseBVHNode(v, i, node->children[1]);
+        triangleData[i].centroid = (v1 + v2 + v3) / 3.0f;
+        triangleData[i].minCorner = min(v1, min(v2, v3));
+        triangleData[i].maxCorner = max(v1, max(v2, v3));
+        triangleData[i].index = (uint32_t) i;
     }
+    BVHBuildStats buildStats;
+    std::vector<BVHNode> nodes = buildBVH(triangleData, triangleVertexIndices, vertices, triangleIndices, options,
+                                          pool, buildStats);
+    if (options.reorderTriangles)
+        reorderTriangles(triangleVertexIndices, triangleIndices);
+    std::chrono::duration<double, std::milli> buildTime = std::chrono::high_resolution_clock::now() - buildStart;
+    buildStats.buildTimeMs = buildTime.count();
+    if (stats != nullptr)
+        *stats = buildStats;
+    if (options.printStats)
+        printBVHStats(options, pool.getNumThreads(), buildStats);
+    return nodes;
 }
 
-std::vector<glm::mat3> serialiseBVH(BVHNode *root) {
-    std::vector<glm::mat3> v(numNodesGenerated);
-    int i = 0;
-    serialiseBVHNode(v, i, root);
-    assert(i == numNodesGenerated);
-    return v;
+std::vector<BVHNode> generateBVH(std::vector<glm::uvec3> &triangleVertexIndices, const std::vector<glm::vec3> &vertices,
+                                 std::vector<uint32_t> &triangleIndices, const BVHBuildOptions &options,
+                                 BVHBuildStats *stats) {
+    TaskPool pool(options.numThreads);
+    return generateBVH(pool, triangleVertexIndices, vertices, triangleIndices, options, stats);
 }
 
-void freeBVH(BVHNode *node) {
-    if (!node->isLeaf) {
-        freeBVH(node->children[0]);
-        freeBVH(node->children[1]);
+std::vector<BVHNode> generateBVH(TaskPool &pool, const std::vector<BVHBox> &boxes, std::vector<uint32_t> &boxIndices,
+                                 const BVHBuildOptions &options, BVHBuildStats *stats) {
+    /*
+     * Boxes have no triangle to clip, so SBVH builds fall back to binned object splits.
+     */
+    PROFILE_SCOPE("BUILD BVH");
+    auto buildStart = std::chrono::high_resolution_clock::now();
+    std::vector<BVHTriangle> boxData(boxes.size());
+    for (size_t i = 0; i < boxes.size(); i++) {
+        boxData[i].centroid = (boxes[i].minCorner + boxes[i].maxCorner) * 0.5f;
+        boxData[i].minCorner = boxes[i].minCorner;
+        boxData[i].maxCorner = boxes[i].maxCorner;
+        boxData[i].index = (uint32_t) i;
     }
-    free(node);
+    BVHBuildOptions boxOptions = options;
+    if (boxOptions.splitMethod == BVH_SPLIT_SBVH)
+        boxOptions.splitMethod = BVH_SPLIT_BINNED;
+    BVHBuildStats buildStats;
+    std::vector<BVHNode> nodes = buildBVH(boxData, {}, {}, boxIndices, boxOptions, pool, buildStats);
+    std::chrono::duration<double, std::milli> buildTime = std::chrono::high_resolution_clock::now() - buildStart;
+    buildStats.buildTimeMs = buildTime.count();
+    if (stats != nullptr)
+        *stats = buildStats;
+    if (boxOptions.printStats)
+        printBVHStats(boxOptions, pool.getNumThreads(), buildStats);
+    return nodes;
+}
+
+std::vector<BVHNode> generateBVH(const std::vector<BVHBox> &boxes, std::vector<uint32_t> &boxIndices,
+                                 const BVHBuildOptions &options, BVHBuildStats *stats) {
+    TaskPool pool(options.numThreads);
+    return generateBVH(pool, boxes, boxIndices, options, stats);
 }
@@ -4,30 +4,120 @@
 #include "glm/glm.hpp"
 
 #include <vector>
+#include <span>
 #include <cmath>
+#include <cstdint>
+
+#include "constants.h"
+
+class TaskPool;
 
 #define MIN_VERTEX glm::vec3{-1e9, -1e9, -1e9}
 #define MAX_VERTEX glm::vec3{1e9, 1e9, 1e9}
 
+#define BVH_LEAF_BIT 0x80000000u
+
+/*
+ * 32 byte node, matching the std430 layout of BVHNode in raytrace-common.glsl.
+ * Interior nodes hold the indices of their two children.
+ * Leaves hold the start of their range in the triangle index list and BVH_LEAF_BIT | their triangle count.
+ */
 struct BVHNode {
-    int id;
-    glm::vec3 minCorner = MAX_VERTEX;
-    glm::vec3 maxCorner = MIN_VERTEX;
-    BVHNode* children[2];
-    int triangleStart, triangleEnd;
-    bool isLeaf = false;
-    int treeSize = 1;
-
-    void addTriangle(glm::mat4x3& triangleData) {
-        minCorner = min(minCorner, triangleData[1]);
-        maxCorner = max(maxCorner, triangleData[2]);
+    glm::vec3 minCorner;
+    uint32_t leftOrStart;
+    glm::vec3 maxCorner;
+    uint32_t rightOrCount;
+
+    bool isLeaf() const {
+        return (rightOrCount & BVH_LEAF_BIT) != 0;
     }
+
+    uint32_t getTriangleCount() const {
+        return rightOrCount & ~BVH_LEAF_BIT;
+    }
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode must match the shader's 32 byte node");
+
+struct BVHBuildOptions {
+    int splitMethod = BVH_SPLIT_METHOD;
+    // 0 uses every hardware thread
+    int numThreads = BVH_BUILD_THREADS;
+    bool printStats = true;
+    // Only used by BVH_SPLIT_SBVH
+    float duplicationBudget = SBVH_DUPLICATION_BUDGET;
+    // Without reordering, triangleVertexIndices is left as it is and only triangleIndices describes the leaves,
+    // so that meshes which are rebuilt while animating keep every per-triangle buffer in place
+    bool reorderTriangles = true;
+    // Only used by BVH_SPLIT_LBVH and BVH_SPLIT_PLOC
+    bool optimizeTreelets = BVH_OPTIMIZE_TREELETS;
 };
 
-extern BVHNode* generateBVH(std::vector<glm::uvec3>& triangleVertexIndices, std::vector<glm::vec3>& vertices);
+struct BVHBuildStats {
+    int numNodes = 0;
+    int numLeaves = 0;
+    int minLeafSize = (int) 1e9;
+    int maxLeafSize = 0;
+    int numTriangles = 0;
+    // Triangle index list entries, which exceed numTriangles where spatial splits duplicated references
+    int numReferences = 0;
+    int numSpatialSplits = 0;
+    int depth = 0;
+    double buildTimeMs = 0.0;
+    float sahCost = 0.0f;
+};
+
+/*
+ * Builds a BVH over the given triangles, returning its nodes in pre-order with the root at index 0.
+ * Leaves reference their triangles through a range of triangleIndices.
+ * Unless options.reorderTriangles is false, reorders triangleVertexIndices in the order the leaves first reference
+ * them, so that without spatial splits triangleIndices is the identity and every leaf covers a contiguous range
+ * of triangles. Throws if there are no triangles.
+ */
+extern std::vector<BVHNode> generateBVH(std::vector<glm::uvec3>& triangleVertexIndices,
+                                        const std::vector<glm::vec3>& vertices,
+                                        std::vector<uint32_t>& triangleIndices,
+                                        const BVHBuildOptions& options = {}, BVHBuildStats* stats = nullptr);
+
+/*
+ * Builds on the threads of the given pool, ignoring options.numThreads, so that frequent rebuilds do not start
+ * and join a pool each time.
+ */
+extern std::vector<BVHNode> generateBVH(TaskPool& pool, std::vector<glm::uvec3>& triangleVertexIndices,
+                                        const std::vector<glm::vec3>& vertices,
+                                        std::vector<uint32_t>& triangleIndices,
+                                        const BVHBuildOptions& options = {}, BVHBuildStats* stats = nullptr);
+
+struct BVHBox {
+    glm::vec3 minCorner;
+    glm::vec3 maxCorner;
+};
+
+/*
+ * Builds a BVH over axis-aligned boxes, such as the world bounds of instances, in the same node format.
+ * Leaves reference their boxes through a range of boxIndices. Throws if there are no boxes.
+ */
+extern std::vector<BVHNode> generateBVH(const std::vector<BVHBox>& boxes, std::vector<uint32_t>& boxIndices,
+                                        const BVHBuildOptions& options = {}, BVHBuildStats* stats = nullptr);
+
+/*
+ * As above, on the threads of the given pool.
+ */
+extern std::vector<BVHNode> generateBVH(TaskPool& pool, const std::vector<BVHBox>& boxes,
+                                        std::vector<uint32_t>& boxIndices, const BVHBuildOptions& options = {},
+                                        BVHBuildStats* stats = nullptr);
+
+/*
+ * Recomputes the bounds of every node from moved vertices in O(n), keeping the tree's topology and triangle ranges.
+ * Children must come after their parents, as in the pre-order generateBVH returns, so that one backwards pass
+ * finishes every child before its parent. Leaf bounds are computed in parallel when a pool is given.
+ */
+extern void refitBVH(std::span<BVHNode> nodes, std::span<const uint32_t> triangleIndices,
+                     const std::vector<glm::uvec3>& triangleVertexIndices, const std::vector<glm::vec3>& vertices,
+                     TaskPool* pool = nullptr);
 
-extern std::vector<glm::mat3> serialiseBVH(BVHNode* node);
+extern float getBVHCost(std::span<const BVHNode> nodes);
 
-extern void freeBVH(BVHNode* node);
+extern float getSA(glm::vec3 min, glm::vec3 max);
 
 #endif //OPENGL_RAYTRACER_BVH_H
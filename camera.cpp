@@ -0,0 +1,50 @@
+#include "camera.h"
+
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <numbers>
+#include <stdexcept>
+
+#include "constants.h"
+
+glm::mat3 getCameraRotation(double pitch, double yaw) {
+    glm::mat3 xRotation = glm::mat3(
+            1.0f, 0.0f, 0.0f,
+            0.0f, cos(pitch), -sin(pitch),
+            0.0f, sin(pitch), cos(pitch)
+    );
+    glm::mat3 yRotation = glm::mat3(
+            cos(yaw), 0.0f, sin(yaw),
+            0.0f, 1.0f, 0.0f,
+            -sin(yaw), 0.0f, cos(yaw)
+    );
+    return yRotation * xRotation;
+}
+
+std::vector<CameraView> readCameraPath(const std::string &filePath) {
+    std::ifstream fin(filePath);
+    if (!fin)
+        throw std::runtime_error("Could not open file: " + filePath);
+    std::vector<CameraView> views;
+    std::string line;
+    for (int lineNumber = 1; std::getline(fin, line); lineNumber++) {
+        std::istringstream iss(line);
+        std::string first;
+        if (!(iss >> first) || first.starts_with("#"))
+            continue;
+        glm::vec3 position;
+        double yaw, pitch;
+        int samplesPerPixel;
+        iss.str(line);
+        iss.clear();
+        std::string rest;
+        if (!(iss >> position.x >> position.y >> position.z >> yaw >> pitch >> samplesPerPixel) ||
+            samplesPerPixel <= 0 || iss >> rest)
+            throw std::runtime_error("Malformed line " + std::to_string(lineNumber) + " in file: " + filePath);
+        double degrees = std::numbers::pi / 180.0;
+        views.push_back({position, getCameraRotation(pitch * degrees, yaw * degrees),
+                         (samplesPerPixel + (int) RAYS_PER_PIXEL - 1) / (int) RAYS_PER_PIXEL});
+    }
+    return views;
+}
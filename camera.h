@@ -0,0 +1,33 @@
+#ifndef OPENGL_RAYTRACER_CAMERA_H
+#define OPENGL_RAYTRACER_CAMERA_H
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+
+/*
+ * Gets the camera rotation for the given pitch (about the x axis) and yaw (about the y axis), in radians.
+ * The camera looks down +z when both are 0.
+ */
+extern glm::mat3 getCameraRotation(double pitch, double yaw);
+
+/*
+ * One fixed viewpoint of a batch render
+ */
+struct CameraView {
+    glm::vec3 position;
+    glm::mat3 rotation;
+    // Frames accumulated for the view, each tracing RAYS_PER_PIXEL rays per pixel
+    int numFrames;
+};
+
+/*
+ * Reads a camera path file, with one view per line and angles in degrees:
+ *   # comment
+ *   <x> <y> <z> <yaw> <pitch> <samples per pixel>
+ * The samples per pixel are rounded up to whole frames.
+ */
+extern std::vector<CameraView> readCameraPath(const std::string& filePath);
+
+#endif //OPENGL_RAYTRACER_CAMERA_H
@@ -1,6 +1,17 @@
 #ifndef OPENGL_RAYTRACER_CONSTANTS_H
 #define OPENGL_RAYTRACER_CONSTANTS_H
 
+// Image units, separate from the buffer bindings
+#define CURR_DEPTH_BINDING 0
+#define PREV_DEPTH_BINDING 1
+#define CURR_MOMENTS_BINDING 2
+#define PREV_MOMENTS_BINDING 3
+#define GUIDE_BINDING 4
+// The only unit the raytracer leaves free, which the denoiser's passes write to
+#define DENOISE_OUTPUT_BINDING 7
+// Texture unit of the raster pre-pass's primary hits, above the denoiser's units 0 to 4
+#define PRIMARY_HIT_TEXTURE_UNIT 5
+
 #define TRIANGLE_NORMAL_SSBO_BINDING 2
 #define BVH_BINDING 3
 #define TRIANGLE_COLOUR_SSBO_BINDING 4
@@ -10,22 +21,186 @@
 #define TRI_V0_SSBO_BINDING 7
 #define TRI_V1_SSBO_BINDING 8
 #define TRI_V2_SSBO_BINDING 9
+#define WIDE_BVH_BINDING 10
+#define TRIANGLE_INDEX_SSBO_BINDING 11
+#define TLAS_BINDING 12
+#define INSTANCE_SSBO_BINDING 13
+#define PATH_SSBO_BINDING 14
+#define HIT_SSBO_BINDING 15
+#define RAY_QUEUE_SSBO_BINDING 16
+#define WAVEFRONT_COUNTER_SSBO_BINDING 17
+#define ADAPTIVE_PIXEL_SSBO_BINDING 18
+#define LIGHT_SSBO_BINDING 19
+#define VERTEX_SSBO_BINDING 20
+#define VERTEX_INDEX_SSBO_BINDING 21
+#define QUANTIZED_TRIANGLE_SSBO_BINDING 22
+#define QUANTIZATION_BLOCK_SSBO_BINDING 23
+#define PACKED_COLOUR_SSBO_BINDING 24
+#define COMPRESSED_BVH_BINDING 25
 
 #define SCENE_FILE_PATH "../models/teapot.obj"
+#define SCENE_FILE_EXTENSION ".scene"
+#define MESH_CACHE_EXTENSION ".cache"
+// Chrome trace that builds with PROFILING defined write when they exit (see profiler.h)
+#define PROFILE_TRACE_PATH "trace.json"
 
 #define RENDER_MODE 1
 #define TRIANGLE_TEST_MODE 2
 #define BOX_TEST_MODE 3
 #define REFLECTIONS_TEST_MODE 4
 
+#define BVH_SPLIT_TERNARY 1
+#define BVH_SPLIT_BINNED 2
+#define BVH_SPLIT_SBVH 3
+#define BVH_SPLIT_LBVH 4
+#define BVH_SPLIT_PLOC 5
+
+#define BVH_LAYOUT_BINARY 1
+#define BVH_LAYOUT_WIDE 2
+#define BVH_LAYOUT_COMPRESSED 3
+
+#define BVH_NODE_ORDER_DEPTH_FIRST 1
+#define BVH_NODE_ORDER_SIBLINGS 2
+#define BVH_NODE_ORDER_TREELETS 3
+#define BVH_NODE_ORDER_VAN_EMDE_BOAS 4
+
+#define GEOMETRY_LAYOUT_SOUP 1
+#define GEOMETRY_LAYOUT_EDGES 2
+#define GEOMETRY_LAYOUT_INDEXED 3
+#define GEOMETRY_LAYOUT_QUANTIZED 4
+
+#define RAYTRACE_PIPELINE_MEGAKERNEL 1
+#define RAYTRACE_PIPELINE_WAVEFRONT 2
+
+#define BSDF_SAMPLING_UNIFORM 1
+#define BSDF_SAMPLING_COSINE 2
+
+#define SAMPLE_SEQUENCE_RANDOM 1
+#define SAMPLE_SEQUENCE_SOBOL 2
+
 const float FOV = 90.0f;
 const float VIEWPORT_DIST = 0.1f;
 const unsigned int RAY_BOUNCES = 100;
 const unsigned int RAYS_PER_PIXEL = 1;
 const float CAMERA_MOVE_SPEED = 2.0f;
 const int MAX_BVH_DEPTH = 32;
+const int BVH_SPLIT_METHOD = BVH_SPLIT_BINNED;
 const int BVH_SPLIT_ITERATIONS = 64;
+const int BVH_SPLIT_BINS = 32;
+const int BVH_SPATIAL_BINS = 32;
+// Extra triangle references SBVH spatial splits may add, as a fraction of the triangle count
+const float SBVH_DUPLICATION_BUDGET = 0.3f;
+// Spatial splits are only searched for where the object split's children overlap by more than this
+// fraction of the root's surface area
+const float SBVH_OVERLAP_THRESHOLD = 1e-5f;
+// Clusters on each side of a cluster that BVH_SPLIT_PLOC searches for its nearest neighbour
+const int PLOC_SEARCH_RADIUS = 8;
+// Whether the linear builders (LBVH, PLOC) restructure their trees in treelets to recover SAH quality
+const bool BVH_OPTIMIZE_TREELETS = true;
+// Leaves per restructured treelet, at most 8 so that subsets of them fit in a byte
+const int BVH_TREELET_SIZE = 7;
+const int BVH_TREELET_MIN_TRIANGLES = 32;
+const int BVH_TREELET_PASSES = 1;
+const float BVH_TRAVERSAL_COST = 1.0f;
+const float BVH_INTERSECTION_COST = 50.0f;
+// BVH_LAYOUT_COMPRESSED traverses the wide BVH from nodes of half the size, whose child bounds are 8 bit grid
+// coordinates (CompressedBVHNode in wide-bvh.h)
+const int BVH_LAYOUT = BVH_LAYOUT_WIDE;
+// Memory order of the binary nodes of static meshes (see bvh-order.h). Dynamic meshes and the TLAS stay depth-first,
+// since their refits and partial rebuilds rely on each subtree following its root
+const int BVH_NODE_ORDER = BVH_NODE_ORDER_TREELETS;
+// Bytes of the blocks that BVH_NODE_ORDER_TREELETS packs each treelet into, a multiple of two 32 byte nodes
+const int BVH_NODE_BLOCK_SIZE = 128;
+// The wide node layouts (WideBVHNode and CompressedBVHNode, raytrace-common.glsl) are fixed to 4 children
+const int BVH_WIDTH = 4;
+// How meshes store their triangles (see MeshData in scene.h). INDEXED and QUANTIZED take about a third of the memory
+// of SOUP and EDGES, and pack the colours and derive the normals instead of storing them.
+const int GEOMETRY_LAYOUT = GEOMETRY_LAYOUT_SOUP;
+// Consecutive triangles that share one quantization grid origin in GEOMETRY_LAYOUT_QUANTIZED
+const int QUANTIZATION_BLOCK_SIZE = 16;
+const int BVH_BUILD_THREADS = 0;
+const int BVH_PARALLEL_TASK_THRESHOLD = 4096;
+const int BVH_PARALLEL_SPLIT_THRESHOLD = 1 << 16;
+const int BVH_PARALLEL_CHUNK_SIZE = 1 << 14;
+// Builder of dynamic meshes' full and partial rebuilds, which must not be SBVH. BVH_SPLIT_LBVH or BVH_SPLIT_PLOC
+// rebuild huge meshes several times faster, for a worse tree than binning
+const int BVH_REBUILD_SPLIT_METHOD = BVH_SPLIT_BINNED;
+// Dynamic meshes rebuild once the SAH cost of their refit BVH exceeds this multiple of the cost after the last rebuild
+const float BVH_REBUILD_THRESHOLD = 1.3f;
+// Depth of the subtrees that dynamic meshes monitor and rebuild on their own
+const int BVH_PARTIAL_REBUILD_DEPTH = 4;
+// Fraction of the triangles in degraded subtrees past which a partial rebuild becomes a full one
+const float BVH_PARTIAL_REBUILD_MAX_FRACTION = 0.5f;
 const int RAYTRACE_WORKGROUP_SIZE = 16;
+const int RAYTRACE_PIPELINE = RAYTRACE_PIPELINE_MEGAKERNEL;
+// Must match WAVEFRONT_WORKGROUP_SIZE in wavefront-common.glsl
+const int WAVEFRONT_WORKGROUP_SIZE = 64;
+// Bounces between reads of the wavefront's ray count, which stop the bounce loop once every path has ended
+const unsigned int WAVEFRONT_QUEUE_READBACK_INTERVAL = 8;
+// Frames of history that pixels keep while the camera moves
+const unsigned int TEMPORAL_MAX_HISTORY = 8;
+// Relative difference in primary hit distance past which a reprojected pixel counts as disoccluded
+const float TEMPORAL_DEPTH_TOLERANCE = 0.05f;
+// Standard error of a pixel's mean colour, summed over the channels, below which adaptive sampling stops tracing it.
+// 0 disables adaptive sampling, which is the default: converged pixels stop improving at the threshold, and on the
+// teapot 0.02 is only 1.1x faster than uniform sampling at equal error (benchmark adaptive), and 0.01 slower.
+const float ADAPTIVE_SAMPLING_THRESHOLD = 0.0f;
+// Frames every pixel gets before its error estimate is trusted
+const int ADAPTIVE_SAMPLING_WARMUP_FRAMES = 8;
+// Frames after which the GPU stops tracing a pixel however noisy it is
+const int ADAPTIVE_SAMPLING_MAX_FRAMES = 4096;
+// Iterations of the denoiser's à-trous filter, each spreading its 5x5 kernel twice as far as the one before
+const int DENOISE_ITERATIONS = 5;
+// Edge-stopping strengths of the denoiser: how many standard errors of a pixel's luminance a neighbour may differ by,
+// the power of the cosine between their normals, and how many times its depth gradient their depths may differ by
+const float DENOISE_SIGMA_LUMINANCE = 4.0f;
+const float DENOISE_SIGMA_NORMAL = 128.0f;
+const float DENOISE_SIGMA_DEPTH = 4.0f;
+// Frames of history below which the denoiser estimates a pixel's variance from its neighbours instead
+const int DENOISE_MIN_HISTORY = 4;
+// How bounce directions are distributed over the hemisphere: in proportion to the cosine term of the Lambertian
+// BSDF, or uniformly
+const int BSDF_SAMPLING = BSDF_SAMPLING_COSINE;
+// Numbers that paths sample their bounces and lights with: independent random numbers, or an Owen scrambled Sobol
+// sequence per pixel, which spreads each pixel's samples more evenly
+const int SAMPLE_SEQUENCE = SAMPLE_SEQUENCE_SOBOL;
+// Russian roulette keeps a path with the largest channel of its throughput as probability, at most this much
+const float RUSSIAN_ROULETTE_MAX_CONTINUE = 0.95f;
+// Samples a light at every bounce and weighs it against hitting the light by chance with multiple importance sampling
+const bool NEXT_EVENT_ESTIMATION = true;
+// Rasterizes the scene's triangle IDs before tracing each frame, and starts the render mode's paths from the triangle
+// each pixel sees instead of tracing their camera rays
+const bool RASTER_PRIMARY_HITS = true;
+// Near plane of that raster pass, whose depth buffer loses precision as it shrinks. Pixels covered by triangles
+// nearer than this start from what lies behind them.
+const float RASTER_NEAR_PLANE = 0.01f;
+// GPU time per frame that dynamic resolution lowers the render resolution to hold while the camera moves.
+// 0 always renders at the native resolution.
+const float DYNAMIC_RESOLUTION_TARGET_MS = 1000.0f / 60.0f;
+// Smallest fraction of the native width and height that frames are rendered at
+const float DYNAMIC_RESOLUTION_MIN_SCALE = 0.25f;
+// Steps the scale moves in, so that small changes in frame time do not resize every frame
+const float DYNAMIC_RESOLUTION_SCALE_STEP = 1.0f / 16.0f;
+// Fraction of the target that the predicted frame time must stay under before the scale is raised a step
+const float DYNAMIC_RESOLUTION_HEADROOM = 0.85f;
+// Frames the camera must stand still before rendering returns to the native resolution
+const int DYNAMIC_RESOLUTION_SETTLE_FRAMES = 4;
+// Frame timer queries in flight, which the render loop reads back without waiting for the GPU
+const int FRAME_TIMER_QUERIES = 4;
+// Frames between the render loop's printouts of the GPU time per frame
+const int RAYTRACE_TIMING_INTERVAL = 100;
+// Scopes kept for the Chrome trace of a profiled build, past which they are only summarised
+const size_t PROFILE_TRACE_MAX_EVENTS = 1 << 20;
+// GPU scopes waiting to be read back, past which new ones go untimed rather than waiting for the GPU
+const size_t GPU_PROFILE_MAX_SCOPES = 1024;
+// Persistently mapped staging memory that mesh updates are copied through on their way to the GPU
+const size_t RAYTRACE_UPLOAD_BUFFER_SIZE = 1 << 26;
+const unsigned int TRIANGLE_COLOUR_SEED = 1;
+const int OBJ_READER_THREADS = 0;
+const size_t OBJ_READER_CHUNK_SIZE = 1 << 22;
+// Bump whenever the mesh cache layout changes
+const unsigned int MESH_CACHE_VERSION = 5;
+const size_t MESH_HASH_CHUNK_SIZE = 1 << 22;
 
 const glm::vec3 CAMERA_START_POS(0.0f, 0.0f, -2.0f);
 
@@ -0,0 +1,194 @@
+#include "cpu-denoise.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "task-pool.h"
+#include "profiler.h"
+
+#define CPU_DENOISE_MIN_ROWS 8
+
+static const glm::vec3 LUMINANCE(0.2126f, 0.7152f, 0.0722f);
+
+/*
+ * Everything the passes read of one pixel besides the colour
+ */
+struct CpuDenoiseGuide {
+    float depth;
+    glm::vec3 normal;
+    // Albedo the colour is divided by while it is filtered
+    glm::vec3 albedo;
+};
+
+static float getLuminance(glm::vec3 colour) {
+    return dot(colour, LUMINANCE);
+}
+
+static glm::vec3 getDemodulationAlbedo(glm::vec3 albedo) {
+    /*
+     * Same as getDemodulationAlbedo in denoise-common.glsl, which unpacks the albedo from the guide image first.
+     */
+    return max(albedo, glm::vec3(0.01f));
+}
+
+static glm::vec2 getDepthGradient(const std::vector<CpuDenoiseGuide> &guides, int x, int y,
+                                  const CpuDenoiseSettings &settings) {
+    /*
+     * Same as getDepthGradient in denoise-common.glsl
+     */
+    float depth = guides[y * settings.width + x].depth;
+    glm::vec2 gradient(INFINITY);
+    const glm::ivec2 neighbours[4] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+    for (int i = 0; i < 4; i++) {
+        int nx = x + neighbours[i].x, ny = y + neighbours[i].y;
+        if (nx < 0 || ny < 0 || nx >= settings.width || ny >= settings.height)
+            continue;
+        float neighbourDepth = guides[ny * settings.width + nx].depth;
+        if (!std::isinf(neighbourDepth))
+            gradient[i / 2] = std::min(gradient[i / 2], std::abs(neighbourDepth - depth));
+    }
+    return {std::isinf(gradient.x) ? 0.0f : gradient.x, std::isinf(gradient.y) ? 0.0f : gradient.y};
+}
+
+static float getEdgeWeight(const CpuDenoiseGuide &guide, glm::vec2 depthGradient, glm::ivec2 offset,
+                           const CpuDenoiseGuide &neighbour, const CpuDenoiseSettings &settings) {
+    /*
+     * Same as getEdgeWeight in denoise-common.glsl
+     */
+    float depthScale = settings.sigmaDepth * dot(glm::vec2(abs(offset)), depthGradient) + 1e-3f * guide.depth;
+    float depthWeight = std::exp(-std::abs(guide.depth - neighbour.depth) / depthScale);
+    float normalWeight = std::pow(std::max(dot(guide.normal, neighbour.normal), 0.0f), settings.sigmaNormal);
+    return depthWeight * normalWeight;
+}
+
+static glm::vec4 preparePixel(const std::vector<glm::vec4> &image, const CpuGuideBuffers &guideBuffers,
+                              const std::vector<CpuDenoiseGuide> &guides, int x, int y,
+                              const CpuDenoiseSettings &settings) {
+    /*
+     * Same as denoise-prepare.glsl
+     */
+    const int pixelIndex = y * settings.width + x;
+    const CpuDenoiseGuide &guide = guides[pixelIndex];
+    glm::vec3 colour(image[pixelIndex]);
+    if (std::isinf(guide.depth))
+        return {colour, 0.0f};
+    int numFrames = std::max(guideBuffers.numFrames[pixelIndex], 1);
+    if (numFrames >= DENOISE_MIN_HISTORY) {
+        glm::vec3 variance = max(guideBuffers.colourMoments[pixelIndex] - colour * colour, glm::vec3(0.0f));
+        return {colour / guide.albedo, getLuminance(variance / (guide.albedo * guide.albedo)) / (float) numFrames};
+    }
+    glm::vec2 depthGradient = getDepthGradient(guides, x, y, settings);
+    float sumWeight = 0.0f, sumLuminance = 0.0f, sumLuminanceSquared = 0.0f;
+    for (int dy = -3; dy <= 3; dy++) {
+        for (int dx = -3; dx <= 3; dx++) {
+            int nx = x + dx, ny = y + dy;
+            if (nx < 0 || ny < 0 || nx >= settings.width || ny >= settings.height)
+                continue;
+            const CpuDenoiseGuide &neighbour = guides[ny * settings.width + nx];
+            if (std::isinf(neighbour.depth))
+                continue;
+            float weight = getEdgeWeight(guide, depthGradient, {dx, dy}, neighbour, settings);
+            float luminance = getLuminance(glm::vec3(image[ny * settings.width + nx]) / neighbour.albedo);
+            sumWeight += weight;
+            sumLuminance += weight * luminance;
+            sumLuminanceSquared += weight * luminance * luminance;
+        }
+    }
+    float meanLuminance = sumLuminance / sumWeight;
+    return {colour / guide.albedo, std::max(sumLuminanceSquared / sumWeight - meanLuminance * meanLuminance, 0.0f)};
+}
+
+static float getFilteredVariance(const std::vector<glm::vec4> &input, const std::vector<CpuDenoiseGuide> &guides,
+                                 int x, int y, const CpuDenoiseSettings &settings) {
+    const float kernel[2] = {1.0f / 2.0f, 1.0f / 4.0f};
+    float sumVariance = 0.0f, sumWeight = 0.0f;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            int nx = x + dx, ny = y + dy;
+            if (nx < 0 || ny < 0 || nx >= settings.width || ny >= settings.height ||
+                std::isinf(guides[ny * settings.width + nx].depth))
+                continue;
+            float weight = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+            sumVariance += weight * input[ny * settings.width + nx].w;
+            sumWeight += weight;
+        }
+    }
+    return sumVariance / sumWeight;
+}
+
+static glm::vec4 filterPixel(const std::vector<glm::vec4> &input, const std::vector<CpuDenoiseGuide> &guides, int x,
+                             int y, int stepSize, const CpuDenoiseSettings &settings) {
+    /*
+     * Same as denoise-atrous.glsl, apart from multiplying the albedo back in
+     */
+    const float kernel[3] = {3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+    const int pixelIndex = y * settings.width + x;
+    const CpuDenoiseGuide &guide = guides[pixelIndex];
+    const glm::vec4 &centre = input[pixelIndex];
+    if (std::isinf(guide.depth))
+        return centre;
+    glm::vec2 depthGradient = getDepthGradient(guides, x, y, settings);
+    float luminance = getLuminance(glm::vec3(centre));
+    float luminanceScale = settings.sigmaLuminance * std::sqrt(getFilteredVariance(input, guides, x, y, settings)) +
+                           1e-6f;
+    glm::vec3 sumColour(0.0f);
+    float sumVariance = 0.0f, sumWeight = 0.0f;
+    for (int dy = -2; dy <= 2; dy++) {
+        for (int dx = -2; dx <= 2; dx++) {
+            glm::ivec2 offset = glm::ivec2(dx, dy) * stepSize;
+            int nx = x + offset.x, ny = y + offset.y;
+            if (nx < 0 || ny < 0 || nx >= settings.width || ny >= settings.height)
+                continue;
+            const CpuDenoiseGuide &neighbourGuide = guides[ny * settings.width + nx];
+            if (std::isinf(neighbourGuide.depth))
+                continue;
+            const glm::vec4 &neighbour = input[ny * settings.width + nx];
+            float weight = kernel[std::abs(dx)] * kernel[std::abs(dy)] *
+                           getEdgeWeight(guide, depthGradient, offset, neighbourGuide, settings) *
+                           std::exp(-std::abs(luminance - getLuminance(glm::vec3(neighbour))) / luminanceScale);
+            sumColour += weight * glm::vec3(neighbour);
+            sumVariance += weight * weight * neighbour.w;
+            sumWeight += weight;
+        }
+    }
+    return {sumColour / sumWeight, sumVariance / (sumWeight * sumWeight)};
+}
+
+std::vector<glm::vec4> denoiseCPU(const std::vector<glm::vec4> &image, const CpuGuideBuffers &guideBuffers,
+                                  const CpuDenoiseSettings &settings) {
+    /*
+     * Runs the passes one after the other over the whole image, each splitting the rows between the threads.
+     */
+    PROFILE_SCOPE("DENOISE CPU");
+    std::vector<CpuDenoiseGuide> guides(image.size());
+    for (size_t i = 0; i < image.size(); i++) {
+        guides[i] = {guideBuffers.depths[i], guideBuffers.normals[i],
+                     getDemodulationAlbedo(guideBuffers.albedos[i])};
+    }
+    TaskPool pool(settings.numThreads);
+    std::vector<glm::vec4> input(image.size()), output(image.size());
+    auto runPass = [&](const std::function<glm::vec4(int, int)> &pass) {
+        parallelForChunks(pool, 0, settings.height, CPU_DENOISE_MIN_ROWS, [&](int, int rowStart, int rowEnd) {
+            for (int y = rowStart; y < rowEnd; y++) {
+                for (int x = 0; x < settings.width; x++)
+                    output[y * settings.width + x] = pass(x, y);
+            }
+        });
+        std::swap(input, output);
+    };
+    runPass([&](int x, int y) {
+        return preparePixel(image, guideBuffers, guides, x, y, settings);
+    });
+    for (int i = 0; i < settings.numIterations; i++) {
+        runPass([&](int x, int y) {
+            return filterPixel(input, guides, x, y, 1 << i, settings);
+        });
+    }
+    for (size_t i = 0; i < input.size(); i++) {
+        if (!std::isinf(guides[i].depth))
+            input[i] = glm::vec4(glm::vec3(input[i]) * guides[i].albedo, 1.0f);
+        else
+            input[i].w = 1.0f;
+    }
+    return input;
+}
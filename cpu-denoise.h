@@ -0,0 +1,33 @@
+#ifndef OPENGL_RAYTRACER_CPU_DENOISE_H
+#define OPENGL_RAYTRACER_CPU_DENOISE_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+#include "constants.h"
+#include "cpu-raytrace.h"
+
+/*
+ * CPU port of the denoiser's passes (denoise-prepare.glsl and denoise-atrous.glsl), for denoising headless renders
+ * and as a reference for the GPU output.
+ */
+
+struct CpuDenoiseSettings {
+    int width = 1280;
+    int height = 720;
+    int numIterations = DENOISE_ITERATIONS;
+    float sigmaLuminance = DENOISE_SIGMA_LUMINANCE;
+    float sigmaNormal = DENOISE_SIGMA_NORMAL;
+    float sigmaDepth = DENOISE_SIGMA_DEPTH;
+    // 0 uses every hardware thread
+    int numThreads = 0;
+};
+
+/*
+ * Filters an image rendered by renderCPU, guided by the buffers the same render filled in.
+ */
+extern std::vector<glm::vec4> denoiseCPU(const std::vector<glm::vec4>& image, const CpuGuideBuffers& guides,
+                                         const CpuDenoiseSettings& settings);
+
+#endif //OPENGL_RAYTRACER_CPU_DENOISE_H
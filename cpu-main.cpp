@@ -0,0 +1,148 @@
+#include <glm/glm.hpp>
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <numbers>
+#include <chrono>
+#include <future>
+
+#include "constants.h"
+#include "scene-loader.h"
+#include "cpu-raytrace.h"
+#include "cpu-denoise.h"
+#include "camera.h"
+#include "image-writer.h"
+#include "profiler.h"
+
+/*
+ * Headless renderer using the CPU backend, run from the build directory as
+ * opengl_raytracer_cpu [--scene SCENE_FILE_PATH] [--width 1280] [--height 720] [--frames 16] [--bounces 100]
+ *                      [--threads 0] [--layout wide|binary|compressed] [--mode render|triangles|boxes|reflections]
+ *                      [--pitch 0] [--yaw 0] [--adaptive 0] [--budget 0] [--denoise 0] [--nee 1]
+ *                      [--sampling cosine|uniform] [--sequence sobol|random] [--views VIEWS_FILE]
+ *                      [--output render.ppm]
+ * The scene is a scene file or an OBJ file, as for loadScene. Angles are in degrees.
+ * Writes a .pfm or .png instead of a .ppm if the output path ends in one.
+ * --adaptive sets the adaptive sampling threshold, with --frames then the most frames a pixel gets,
+ * and --budget caps the average frames per pixel. --denoise 1 filters the render with the denoiser before writing it.
+ * --nee 0 turns off next-event estimation, leaving lights to be found by the bounces alone.
+ * --sampling and --sequence choose how bounce directions are distributed and the numbers they are drawn from.
+ * --views renders every view of a camera path file (see readCameraPath) instead of the single --pitch and --yaw view,
+ * at the view's own samples per pixel, into a numbered sequence of --output images (render-0000.ppm and so on).
+ */
+
+static std::vector<glm::vec4> renderImage(const CpuScene &scene, const CpuRenderSettings &settings, bool denoise,
+                                          CpuRenderStats *stats) {
+    CpuGuideBuffers guides;
+    std::vector<glm::vec4> image = renderCPU(scene, settings, stats, denoise ? &guides : nullptr);
+    if (denoise) {
+        CpuDenoiseSettings denoiseSettings;
+        denoiseSettings.width = settings.width;
+        denoiseSettings.height = settings.height;
+        denoiseSettings.numThreads = settings.numThreads;
+        auto denoiseStart = std::chrono::high_resolution_clock::now();
+        image = denoiseCPU(image, guides, denoiseSettings);
+        std::chrono::duration<double, std::milli> denoiseTime =
+                std::chrono::high_resolution_clock::now() - denoiseStart;
+        std::cout << "DENOISED IN " << denoiseTime.count() << " ms" << std::endl;
+    }
+    return image;
+}
+
+static void renderCameraPath(const CpuScene &scene, CpuRenderSettings settings, bool denoise,
+                             const std::string &viewsPath, const std::string &outputPath) {
+    /*
+     * Each image is written on its own thread while the next view renders, with at most one write in flight.
+     */
+    std::vector<CameraView> views = readCameraPath(viewsPath);
+    std::future<void> pendingWrite;
+    auto batchStart = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < views.size(); i++) {
+        settings.cameraPos = views[i].position;
+        settings.cameraRotation = views[i].rotation;
+        settings.numFrames = views[i].numFrames;
+        CpuRenderStats stats;
+        std::vector<glm::vec4> image = renderImage(scene, settings, denoise, &stats);
+        if (pendingWrite.valid())
+            pendingWrite.get();
+        std::string viewPath = getSequencePath(outputPath, (int) i);
+        pendingWrite = std::async(std::launch::async, [viewPath, image = std::move(image), width = settings.width,
+                                                        height = settings.height] {
+            writeImage(viewPath, image, width, height);
+        });
+        std::cout << "VIEW " << i << ": " << settings.numFrames << " FRAMES IN " << stats.renderTimeMs << " ms ("
+                  << stats.getMraysPerSecond() << " Mrays/s), WRITING " << viewPath << std::endl;
+        PROFILE_FRAME();
+    }
+    if (pendingWrite.valid())
+        pendingWrite.get();
+    std::chrono::duration<double> batchTime = std::chrono::high_resolution_clock::now() - batchStart;
+    std::cout << "RENDERED " << views.size() << " VIEWS AT " << settings.width << "x" << settings.height << " IN "
+              << batchTime.count() << " s (" << (double) views.size() / batchTime.count() * 3600.0 << " VIEWS/HOUR)"
+              << std::endl;
+}
+
+int main(int argc, char **argv) {
+    std::map<std::string, std::string> args;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string key = argv[i];
+        if (!key.starts_with("--")) {
+            std::cout << "Unexpected argument: " << key << std::endl;
+            return 1;
+        }
+        args[key.substr(2)] = argv[i + 1];
+    }
+    auto getArg = [&args](const std::string &key, const std::string &defaultValue) {
+        return args.contains(key) ? args[key] : defaultValue;
+    };
+    const std::map<std::string, int> renderModes = {{"render", RENDER_MODE}, {"triangles", TRIANGLE_TEST_MODE},
+                                                    {"boxes", BOX_TEST_MODE}, {"reflections", REFLECTIONS_TEST_MODE}};
+    CpuRenderSettings settings;
+    settings.width = std::stoi(getArg("width", std::to_string(settings.width)));
+    settings.height = std::stoi(getArg("height", std::to_string(settings.height)));
+    settings.numFrames = std::stoi(getArg("frames", std::to_string(settings.numFrames)));
+    settings.rayBounces = std::stoul(getArg("bounces", std::to_string(settings.rayBounces)));
+    settings.numThreads = std::stoi(getArg("threads", std::to_string(settings.numThreads)));
+    const std::map<std::string, int> bvhLayouts = {{"binary", BVH_LAYOUT_BINARY}, {"wide", BVH_LAYOUT_WIDE},
+                                                   {"compressed", BVH_LAYOUT_COMPRESSED}};
+    settings.bvhLayout = bvhLayouts.at(getArg("layout", "wide"));
+    settings.renderMode = renderModes.at(getArg("mode", "render"));
+    double degrees = std::numbers::pi / 180.0;
+    settings.cameraRotation = getCameraRotation(std::stod(getArg("pitch", "0")) * degrees,
+                                                std::stod(getArg("yaw", "0")) * degrees);
+    settings.adaptiveThreshold = std::stof(getArg("adaptive", "0"));
+    settings.adaptiveSampleBudget = std::stof(getArg("budget", "0"));
+    settings.nextEventEstimation = getArg("nee", std::to_string(settings.nextEventEstimation)) != "0";
+    if (args.contains("sampling"))
+        settings.bsdfSampling = args["sampling"] == "uniform" ? BSDF_SAMPLING_UNIFORM : BSDF_SAMPLING_COSINE;
+    if (args.contains("sequence"))
+        settings.sampleSequence = args["sequence"] == "random" ? SAMPLE_SEQUENCE_RANDOM : SAMPLE_SEQUENCE_SOBOL;
+    bool denoise = getArg("denoise", "0") != "0" && settings.renderMode == RENDER_MODE;
+    std::string outputPath = getArg("output", "render.ppm");
+
+    Scene *sceneData = loadScene(getArg("scene", SCENE_FILE_PATH));
+    CpuScene scene = prepareCpuScene(sceneData);
+    if (args.contains("views")) {
+        renderCameraPath(scene, settings, denoise, args["views"], outputPath);
+        PROFILE_WRITE(PROFILE_TRACE_PATH);
+        delete sceneData;
+        return 0;
+    }
+    CpuRenderStats stats;
+    std::vector<glm::vec4> image = renderImage(scene, settings, denoise, &stats);
+    writeImage(outputPath, image, settings.width, settings.height);
+    std::cout << "RENDERED " << settings.width << "x" << settings.height << ", " << settings.numFrames
+              << " FRAMES IN " << stats.renderTimeMs << " ms" << std::endl;
+    if (settings.adaptiveThreshold > 0.0f) {
+        std::cout << "ADAPTIVE SAMPLING: " << (double) stats.numSamples / (double) image.size()
+                  << " FRAMES PER PIXEL ON AVERAGE, " << stats.numAdaptiveRounds << " ROUNDS" << std::endl;
+    }
+    std::cout << "RAYS: " << stats.numRays << " (" << stats.getMraysPerSecond() << " Mrays/s)" << std::endl;
+    std::cout << "BOX TESTS PER RAY: " << (double) stats.numBoxTests / (double) stats.numRays << std::endl;
+    std::cout << "TRIANGLE TESTS PER RAY: " << (double) stats.numTriangleTests / (double) stats.numRays << std::endl;
+    std::cout << "WROTE " << outputPath << std::endl;
+    PROFILE_WRITE(PROFILE_TRACE_PATH);
+    delete sceneData;
+    return 0;
+}
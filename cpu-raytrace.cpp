@@ -0,0 +1,906 @@
+#include "cpu-raytrace.h"
+
+#include <cmath>
+#include <chrono>
+#include <numbers>
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+
+#include "task-pool.h"
+#include "wide-bvh.h"
+#include "mesh-geometry.h"
+#include "profiler.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define CPU_RAYTRACE_SSE
+#include <immintrin.h>
+#endif
+
+#define MAX_BVH_TRAVERSAL_STACK_SIZE 128
+#define MAX_TLAS_TRAVERSAL_STACK_SIZE 64
+#define CPU_RAYTRACE_TILE_SIZE 16
+#define CPU_ADAPTIVE_BLOCK_SIZE 256
+
+static const float EPS = 1e-4f;
+static const float INF = std::numeric_limits<float>::infinity();
+
+struct CpuRay {
+    glm::vec3 origin, dir, invDir;
+};
+
+struct CpuHitInfo {
+    float dist;
+    // Index into the triangles of the instance's mesh
+    int triangleIndex;
+    // Index into the scene's tlasInstances
+    int instanceIndex;
+};
+
+/*
+ * Per-ray state that raytrace-common.glsl keeps in globals
+ */
+struct CpuTraceState {
+    uint32_t randSeed = 0;
+    // Index of the path's sample in its pixel's sequence, and the hash of its pixel that scrambles the sequence
+    uint32_t sampleIndex = 0;
+    uint32_t sampleSeed = 0;
+    uint64_t numRays = 0;
+    int numBoxTests = 0;
+    int numTriangleTests = 0;
+    int numReflections = 0;
+    // Set while tracing shadow rays, which stop at the first triangle they hit rather than the closest
+    bool anyHit = false;
+    // First hit of the primary ray, which getColour records for the denoiser's guides
+    CpuHitInfo primaryHit{INF, -1, -1};
+    // When set, the binary BVH traversal appends the index of every node whose box it reads or that it enters
+    std::vector<uint32_t> *nodeTrace = nullptr;
+};
+
+CpuScene prepareCpuScene(const Scene *scene) {
+    PROFILE_SCOPE("PREPARE CPU SCENE");
+    CpuScene cpuScene{scene, {}};
+    for (const std::unique_ptr<MeshData> &meshData : scene->meshes) {
+        CpuMesh &mesh = cpuScene.meshes.emplace_back(meshData.get());
+        if (meshData->wideBVHNodes.empty())
+            mesh.wideBVHNodes = collapseBVH(meshData->bvhNodes, false);
+        else
+            mesh.wideBVHNodes.assign(meshData->wideBVHNodes.begin(), meshData->wideBVHNodes.end());
+        mesh.compressedBVHNodes.resize(mesh.wideBVHNodes.size());
+        compressBVH(mesh.wideBVHNodes, mesh.compressedBVHNodes);
+    }
+    return cpuScene;
+}
+
+#ifndef CPU_RAYTRACE_SSE
+/*
+ * Same as getRayTriangleDistance in raytrace-common.glsl
+ */
+template<int GeometryLayout>
+static float getRayTriangleDistance(const MeshData &meshData, const CpuRay &ray, int triangleIndex) {
+    TriangleEdges triangle = getTriangleEdges<GeometryLayout>(meshData, triangleIndex);
+    glm::vec3 a = triangle.v0;
+    glm::vec3 edge1 = triangle.edge1;
+    glm::vec3 edge2 = triangle.edge2;
+    glm::vec3 ray_cross_e2 = cross(ray.dir, edge2);
+    float det = dot(edge1, ray_cross_e2);
+
+    if (std::abs(det) < EPS)
+        return INF;
+
+    float inv_det = 1.0f / det;
+    glm::vec3 s = ray.origin - a;
+    float u = inv_det * dot(s, ray_cross_e2);
+
+    if (u < -EPS || u > 1.0f + EPS)
+        return INF;
+
+    glm::vec3 s_cross_e1 = cross(s, edge1);
+    float v = inv_det * dot(ray.dir, s_cross_e1);
+
+    if (v < -EPS || u + v > 1.0f + EPS)
+        return INF;
+
+    float t = inv_det * dot(edge2, s_cross_e1);
+    return t > EPS ? t : INF;
+}
+#endif
+
+static float rayBoundingBoxDist(const CpuRay &ray, const glm::vec3 &boxMin, const glm::vec3 &boxMax) {
+    glm::vec3 tMin = (boxMin - ray.origin) * ray.invDir;
+    glm::vec3 tMax = (boxMax - ray.origin) * ray.invDir;
+    glm::vec3 t1 = min(tMin, tMax);
+    glm::vec3 t2 = max(tMin, tMax);
+    float tNear = std::max(std::max(t1.x, t1.y), t1.z);
+    float tFar = std::min(std::min(t2.x, t2.y), t2.z);
+    bool hit = tFar >= tNear && tFar > EPS;
+    return hit ? tNear > EPS ? tNear : 0 : INF;
+}
+
+template<int GeometryLayout>
+static void intersectLeaf(const MeshData &meshData, const CpuRay &ray, int triangleStart, int triangleEnd,
+                          CpuHitInfo &info, CpuTraceState &state) {
+#ifdef CPU_RAYTRACE_SSE
+    /*
+     * Möller-Trumbore against four triangles at once, with the triangles decoded from the mesh's geometry layout
+     * and transposed into one register per coordinate. Lanes past the end of the leaf repeat its last triangle,
+     * which cannot change the result.
+     */
+    const __m128 eps = _mm_set1_ps(EPS), onePlusEps = _mm_set1_ps(1.0f + EPS), minusEps = _mm_set1_ps(-EPS);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const __m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+    const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+    for (int first = triangleStart; first < triangleEnd; first += 4) {
+        int lane[4];
+        for (int i = 0; i < 4; i++)
+            lane[i] = (int) meshData.triangleIndices[std::min(first + i, triangleEnd - 1)];
+        TriangleEdges tri[4];
+        for (int i = 0; i < 4; i++)
+            tri[i] = getTriangleEdges<GeometryLayout>(meshData, lane[i]);
+        __m128 ax = _mm_setr_ps(tri[0].v0.x, tri[1].v0.x, tri[2].v0.x, tri[3].v0.x);
+        __m128 ay = _mm_setr_ps(tri[0].v0.y, tri[1].v0.y, tri[2].v0.y, tri[3].v0.y);
+        __m128 az = _mm_setr_ps(tri[0].v0.z, tri[1].v0.z, tri[2].v0.z, tri[3].v0.z);
+        __m128 e1x = _mm_setr_ps(tri[0].edge1.x, tri[1].edge1.x, tri[2].edge1.x, tri[3].edge1.x);
+        __m128 e1y = _mm_setr_ps(tri[0].edge1.y, tri[1].edge1.y, tri[2].edge1.y, tri[3].edge1.y);
+        __m128 e1z = _mm_setr_ps(tri[0].edge1.z, tri[1].edge1.z, tri[2].edge1.z, tri[3].edge1.z);
+        __m128 e2x = _mm_setr_ps(tri[0].edge2.x, tri[1].edge2.x, tri[2].edge2.x, tri[3].edge2.x);
+        __m128 e2y = _mm_setr_ps(tri[0].edge2.y, tri[1].edge2.y, tri[2].edge2.y, tri[3].edge2.y);
+        __m128 e2z = _mm_setr_ps(tri[0].edge2.z, tri[1].edge2.z, tri[2].edge2.z, tri[3].edge2.z);
+        // p = dir x e2
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 valid = _mm_cmpge_ps(_mm_and_ps(det, absMask), eps);
+        __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+        __m128 sx = _mm_sub_ps(ox, ax), sy = _mm_sub_ps(oy, ay), sz = _mm_sub_ps(oz, az);
+        __m128 u = _mm_mul_ps(invDet, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)),
+                                                 _mm_mul_ps(sz, pz)));
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, minusEps), _mm_cmple_ps(u, onePlusEps)));
+        // q = s x e1
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        __m128 v = _mm_mul_ps(invDet, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+                                                 _mm_mul_ps(dz, qz)));
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, minusEps),
+                                             _mm_cmple_ps(_mm_add_ps(u, v), onePlusEps)));
+        __m128 t = _mm_mul_ps(invDet, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                                                 _mm_mul_ps(e2z, qz)));
+        valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, eps));
+        int mask = _mm_movemask_ps(valid);
+        if (mask == 0)
+            continue;
+        alignas(16) float dists[4];
+        _mm_store_ps(dists, t);
+        for (int i = 0; i < 4; i++) {
+            if ((mask & (1 << i)) && dists[i] < info.dist) {
+                info.dist = dists[i];
+                info.triangleIndex = lane[i];
+            }
+        }
+        if (state.anyHit && info.triangleIndex != -1) {
+            info.dist = 0.0f;
+            return;
+        }
+    }
+#else
+    for (int i = triangleStart; i < triangleEnd; i++) {
+        int triangleIndex = (int) meshData.triangleIndices[i];
+        float triangleDist = getRayTriangleDistance<GeometryLayout>(meshData, ray, triangleIndex);
+        if (triangleDist < info.dist) {
+            info.dist = triangleDist;
+            info.triangleIndex = triangleIndex;
+            if (state.anyHit) {
+                // Every node left on the traversal stacks is at least 0 away, so they are all skipped
+                info.dist = 0.0f;
+                return;
+            }
+        }
+    }
+#endif
+}
+
+static void intersectLeaf(const MeshData &meshData, const CpuRay &ray, int triangleStart, int triangleEnd,
+                          CpuHitInfo &info, CpuTraceState &state) {
+    /*
+     * Picks the layout's decoder once per leaf rather than once per triangle.
+     */
+    state.numTriangleTests += triangleEnd - triangleStart;
+    dispatchGeometryLayout(meshData, [&](auto layout) {
+        intersectLeaf<layout.value>(meshData, ray, triangleStart, triangleEnd, info, state);
+    });
+}
+
+static void intersectMeshBinary(const CpuMesh &mesh, const CpuRay &ray, CpuHitInfo &info, CpuTraceState &state) {
+    std::span<const BVHNode> bvh = mesh.meshData->bvhNodes;
+    state.numBoxTests++;
+    float rootDist = rayBoundingBoxDist(ray, bvh[0].minCorner, bvh[0].maxCorner);
+    if (state.nodeTrace != nullptr)
+        state.nodeTrace->push_back(0);
+    if (rootDist >= info.dist)
+        return;
+    uint32_t stack[MAX_BVH_TRAVERSAL_STACK_SIZE];
+    float dist[MAX_BVH_TRAVERSAL_STACK_SIZE];
+    int i = 0;
+    stack[0] = 0;
+    dist[0] = rootDist;
+    while (i > -1) {
+        uint32_t bvhIndex = stack[i];
+        if (dist[i--] >= info.dist)
+            continue;
+        const BVHNode &node = bvh[bvhIndex];
+        if (state.nodeTrace != nullptr)
+            state.nodeTrace->push_back(bvhIndex);
+        if (node.isLeaf()) {
+            int triangleStart = (int) node.leftOrStart;
+            intersectLeaf(*mesh.meshData, ray, triangleStart, triangleStart + (int) node.getTriangleCount(),
+                          info, state);
+            continue;
+        }
+        uint32_t child1 = node.leftOrStart, child2 = node.rightOrCount;
+        if (state.nodeTrace != nullptr)
+            state.nodeTrace->insert(state.nodeTrace->end(), {child1, child2});
+        state.numBoxTests += 2;
+        float d1 = rayBoundingBoxDist(ray, bvh[child1].minCorner, bvh[child1].maxCorner);
+        float d2 = rayBoundingBoxDist(ray, bvh[child2].minCorner, bvh[child2].maxCorner);
+        if (d1 < d2) {
+            std::swap(d1, d2);
+            std::swap(child1, child2);
+        }
+        // Push the further child first so the nearer one is popped next
+        if (d1 < info.dist) {
+            stack[++i] = child1;
+            dist[i] = d1;
+        }
+        if (d2 < info.dist) {
+            stack[++i] = child2;
+            dist[i] = d2;
+        }
+    }
+}
+
+#ifdef CPU_RAYTRACE_SSE
+/*
+ * A wide node's child bounds, one register per axis and side
+ */
+struct WideChildBounds {
+    __m128 minX, minY, minZ, maxX, maxY, maxZ;
+};
+
+static WideChildBounds loadChildBounds(const WideBVHNode &node) {
+    return {_mm_loadu_ps(&node.minX.x), _mm_loadu_ps(&node.minY.x), _mm_loadu_ps(&node.minZ.x),
+            _mm_loadu_ps(&node.maxX.x), _mm_loadu_ps(&node.maxY.x), _mm_loadu_ps(&node.maxZ.x)};
+}
+
+static __m128 decodeQuantizedBounds(uint32_t bytes, __m128 origin, __m128 scale) {
+    // Widens the four children's bytes to 32 bits with SSE2's unpacks
+    __m128i zero = _mm_setzero_si128();
+    __m128i words = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int) bytes), zero), zero);
+    return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(words), scale));
+}
+
+static WideChildBounds loadChildBounds(const CompressedBVHNode &node) {
+    /*
+     * Decodes the bounds the same way as decodeCompressedBVHNode, so that they are just as conservative
+     */
+    __m128 origin[3], scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        origin[axis] = _mm_set1_ps(node.origin[axis]);
+        scale[axis] = _mm_castsi128_ps(_mm_set1_epi32((int) (((node.exponents >> (8 * axis)) & 0xFFu) << 23)));
+    }
+    return {decodeQuantizedBounds(node.quantizedMin[0], origin[0], scale[0]),
+            decodeQuantizedBounds(node.quantizedMin[1], origin[1], scale[1]),
+            decodeQuantizedBounds(node.quantizedMin[2], origin[2], scale[2]),
+            decodeQuantizedBounds(node.quantizedMax[0], origin[0], scale[0]),
+            decodeQuantizedBounds(node.quantizedMax[1], origin[1], scale[1]),
+            decodeQuantizedBounds(node.quantizedMax[2], origin[2], scale[2])};
+}
+#endif
+
+static uint32_t getChildCount(const WideBVHNode &node, int slot) {
+    return node.counts[slot];
+}
+
+static uint32_t getChildCount(const CompressedBVHNode &node, int slot) {
+    return getCompressedChildCount(node, slot);
+}
+
+template<typename Node>
+static int getWideChildDistances(const Node &node, const CpuRay &ray, float maxDist, float dist[4],
+                                 CpuTraceState &state) {
+    /*
+     * Tests the ray against all four child boxes, returning a mask of the children hit closer than maxDist
+     */
+    int numChildren = 0;
+    while (numChildren < 4 && node.children[numChildren] != WIDE_BVH_EMPTY_SLOT)
+        numChildren++;
+    state.numBoxTests += numChildren;
+#ifdef CPU_RAYTRACE_SSE
+    WideChildBounds bounds = loadChildBounds(node);
+    __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+    __m128 ix = _mm_set1_ps(ray.invDir.x), iy = _mm_set1_ps(ray.invDir.y), iz = _mm_set1_ps(ray.invDir.z);
+    __m128 tMinX = _mm_mul_ps(_mm_sub_ps(bounds.minX, ox), ix);
+    __m128 tMaxX = _mm_mul_ps(_mm_sub_ps(bounds.maxX, ox), ix);
+    __m128 tMinY = _mm_mul_ps(_mm_sub_ps(bounds.minY, oy), iy);
+    __m128 tMaxY = _mm_mul_ps(_mm_sub_ps(bounds.maxY, oy), iy);
+    __m128 tMinZ = _mm_mul_ps(_mm_sub_ps(bounds.minZ, oz), iz);
+    __m128 tMaxZ = _mm_mul_ps(_mm_sub_ps(bounds.maxZ, oz), iz);
+    __m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(tMinX, tMaxX), _mm_min_ps(tMinY, tMaxY)),
+                              _mm_min_ps(tMinZ, tMaxZ));
+    __m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(tMinX, tMaxX), _mm_max_ps(tMinY, tMaxY)),
+                             _mm_max_ps(tMinZ, tMaxZ));
+    __m128 eps = _mm_set1_ps(EPS);
+    __m128 d = _mm_and_ps(tNear, _mm_cmpgt_ps(tNear, eps));
+    __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(tFar, tNear), _mm_cmpgt_ps(tFar, eps)),
+                            _mm_cmplt_ps(d, _mm_set1_ps(maxDist)));
+    _mm_storeu_ps(dist, d);
+    return _mm_movemask_ps(hit) & ((1 << numChildren) - 1);
+#else
+    WideBVHNode bounds;
+    if constexpr (std::is_same_v<Node, CompressedBVHNode>)
+        bounds = decodeCompressedBVHNode(node);
+    else
+        bounds = node;
+    int mask = 0;
+    for (int slot = 0; slot < numChildren; slot++) {
+        dist[slot] = rayBoundingBoxDist(ray, {bounds.minX[slot], bounds.minY[slot], bounds.minZ[slot]},
+                                        {bounds.maxX[slot], bounds.maxY[slot], bounds.maxZ[slot]});
+        if (dist[slot] < maxDist)
+            mask |= 1 << slot;
+    }
+    return mask;
+#endif
+}
+
+/*
+ * Traverses either the wide nodes or the compressed nodes, which have the same children
+ */
+template<typename Node>
+static void intersectMeshWide(const MeshData &meshData, const std::vector<Node> &nodes, const CpuRay &ray,
+                              CpuHitInfo &info, CpuTraceState &state) {
+    uint32_t stackChild[MAX_BVH_TRAVERSAL_STACK_SIZE];
+    uint32_t stackCount[MAX_BVH_TRAVERSAL_STACK_SIZE];
+    float stackDist[MAX_BVH_TRAVERSAL_STACK_SIZE];
+    int i = 0;
+    stackChild[0] = 0;
+    stackCount[0] = 0;
+    stackDist[0] = 0.0f;
+    while (i > -1) {
+        uint32_t child = stackChild[i];
+        uint32_t count = stackCount[i];
+        if (stackDist[i--] >= info.dist)
+            continue;
+        if (count & BVH_LEAF_BIT) {
+            intersectLeaf(meshData, ray, (int) child, (int) (child + (count & ~BVH_LEAF_BIT)), info, state);
+            continue;
+        }
+        const Node &node = nodes[child];
+        float dist[4];
+        int mask = getWideChildDistances(node, ray, info.dist, dist, state);
+        // Insertion sort the hit children by decreasing distance, so the nearest is pushed last
+        float hitDist[4];
+        int hitSlot[4];
+        int numHits = 0;
+        for (int slot = 0; slot < 4; slot++) {
+            if (!(mask & (1 << slot)))
+                continue;
+            int j = numHits++;
+            for (; j > 0 && hitDist[j - 1] < dist[slot]; j--) {
+                hitDist[j] = hitDist[j - 1];
+                hitSlot[j] = hitSlot[j - 1];
+            }
+            hitDist[j] = dist[slot];
+            hitSlot[j] = slot;
+        }
+        for (int j = 0; j < numHits; j++) {
+            stackChild[++i] = node.children[hitSlot[j]];
+            stackCount[i] = getChildCount(node, hitSlot[j]);
+            stackDist[i] = hitDist[j];
+        }
+    }
+}
+
+static const CpuMesh &getInstanceMesh(const CpuScene &scene, int instanceIndex) {
+    return scene.meshes[scene.scene->instances[scene.scene->tlasInstanceIndices[instanceIndex]].meshIndex];
+}
+
+static void intersectInstance(const CpuScene &scene, const CpuRenderSettings &settings, const CpuRay &ray,
+                              int instanceIndex, CpuHitInfo &info, CpuTraceState &state) {
+    /*
+     * Same as intersectInstance in raytrace-common.glsl, keeping the object space direction unnormalized
+     * so that hit distances stay comparable across instances.
+     */
+    const glm::mat4 &worldToObject = scene.scene->tlasInstances[instanceIndex].worldToObject;
+    CpuRay objectRay;
+    objectRay.origin = worldToObject * glm::vec4(ray.origin, 1.0f);
+    objectRay.dir = glm::mat3(worldToObject) * ray.dir;
+    objectRay.invDir = 1.0f / objectRay.dir;
+    float prevDist = info.dist;
+    const CpuMesh &mesh = getInstanceMesh(scene, instanceIndex);
+    if (settings.bvhLayout == BVH_LAYOUT_WIDE)
+        intersectMeshWide(*mesh.meshData, mesh.wideBVHNodes, objectRay, info, state);
+    else if (settings.bvhLayout == BVH_LAYOUT_COMPRESSED)
+        intersectMeshWide(*mesh.meshData, mesh.compressedBVHNodes, objectRay, info, state);
+    else
+        intersectMeshBinary(mesh, objectRay, info, state);
+    // Instances of the same mesh share triangle indices, so only a nearer hit tells that this instance was hit
+    if (info.dist < prevDist)
+        info.instanceIndex = instanceIndex;
+}
+
+static CpuHitInfo traceRay(const CpuScene &scene, const CpuRenderSettings &settings, const CpuRay &ray,
+                           float maxDist, CpuTraceState &state) {
+    /*
+     * Traverses the TLAS like the binary BVH, entering the instances of each leaf it reaches.
+     * A hit in one instance's mesh can only be replaced by a nearer hit in another, so the triangle index
+     * always belongs to the mesh of info.instanceIndex. Only hits closer than maxDist count.
+     */
+    state.numRays++;
+    std::span<const BVHNode> tlas = scene.scene->tlasNodes;
+    CpuHitInfo info{maxDist, -1, -1};
+    state.numBoxTests++;
+    float rootDist = rayBoundingBoxDist(ray, tlas[0].minCorner, tlas[0].maxCorner);
+    if (rootDist >= maxDist)
+        return info;
+    uint32_t stack[MAX_TLAS_TRAVERSAL_STACK_SIZE];
+    float dist[MAX_TLAS_TRAVERSAL_STACK_SIZE];
+    int i = 0;
+    stack[0] = 0;
+    dist[0] = rootDist;
+    while (i > -1) {
+        uint32_t tlasIndex = stack[i];
+        if (dist[i--] >= info.dist)
+            continue;
+        const BVHNode &node = tlas[tlasIndex];
+        if (node.isLeaf()) {
+            for (uint32_t j = node.leftOrStart; j < node.leftOrStart + node.getTriangleCount(); j++)
+                intersectInstance(scene, settings, ray, (int) j, info, state);
+            continue;
+        }
+        uint32_t child1 = node.leftOrStart, child2 = node.rightOrCount;
+        state.numBoxTests += 2;
+        float d1 = rayBoundingBoxDist(ray, tlas[child1].minCorner, tlas[child1].maxCorner);
+        float d2 = rayBoundingBoxDist(ray, tlas[child2].minCorner, tlas[child2].maxCorner);
+        if (d1 < d2) {
+            std::swap(d1, d2);
+            std::swap(child1, child2);
+        }
+        if (d1 < info.dist) {
+            stack[++i] = child1;
+            dist[i] = d1;
+        }
+        if (d2 < info.dist) {
+            stack[++i] = child2;
+            dist[i] = d2;
+        }
+    }
+    return info;
+}
+
+static CpuHitInfo getHitInfo(const CpuScene &scene, const CpuRenderSettings &settings, const CpuRay &ray,
+                             CpuTraceState &state) {
+    return traceRay(scene, settings, ray, INF, state);
+}
+
+/*
+ * Same as isOccluded in raytrace-common.glsl
+ */
+static bool isOccluded(const CpuScene &scene, const CpuRenderSettings &settings, const CpuRay &ray, float maxDist,
+                       CpuTraceState &state) {
+    state.anyHit = true;
+    CpuHitInfo info = traceRay(scene, settings, ray, maxDist, state);
+    state.anyHit = false;
+    return info.triangleIndex != -1;
+}
+
+static glm::vec3 sampleSkybox(glm::vec3 dir) {
+    glm::vec3 skyGroundColour = glm::vec3(0.6392156862f, 0.5803921f, 0.6392156862f);
+    glm::vec3 skyColourHorizon = glm::vec3(1.0f, 1.0f, 1.0f);
+    glm::vec3 skyColourZenith = glm::vec3(0.486274509f, 0.71372549f, 234.0f / 255.0f);
+    float skyGradientT = std::pow(glm::smoothstep(0.0f, 0.4f, dir.y), 0.35f);
+    float groundToSkyT = glm::smoothstep(-0.01f, 0.0f, dir.y);
+    glm::vec3 skyGradient = mix(skyColourHorizon, skyColourZenith, skyGradientT);
+    return mix(skyGroundColour, skyGradient, groundToSkyT);
+}
+
+static float rand(CpuTraceState &state) {
+    state.randSeed = state.randSeed * 747796405u + 2891336453u;
+    uint32_t result = ((state.randSeed >> ((state.randSeed >> 28u) + 4u)) ^ state.randSeed) * 277803737u;
+    result = (result >> 22u) ^ result;
+    return (float) result / 4294967295.0f;
+}
+
+static uint32_t hash(uint32_t x) {
+    uint32_t state = x * 747796405u + 2891336453u;
+    uint32_t result = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (result >> 22u) ^ result;
+}
+
+static uint32_t reverseBits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+static uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+    return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+static glm::uvec2 getReversedSobol(uint32_t index) {
+    /*
+     * Same as getReversedSobol in raytrace-common.glsl
+     */
+    uint32_t y = index;
+    y ^= (y >> 1) & 0x55555555u;
+    y ^= (y >> 2) & 0x33333333u;
+    y ^= (y >> 4) & 0x0F0F0F0Fu;
+    y ^= (y >> 8) & 0x00FF00FFu;
+    y ^= (y >> 16) & 0x0000FFFFu;
+    return {index, y};
+}
+
+static glm::vec2 sample2D(const CpuRenderSettings &settings, uint32_t dimension, CpuTraceState &state) {
+    /*
+     * Same as sample2D in raytrace-common.glsl
+     */
+    if (settings.sampleSequence != SAMPLE_SEQUENCE_SOBOL) {
+        float u = rand(state);
+        return {u, rand(state)};
+    }
+    uint32_t seed = hash(state.sampleSeed ^ hash(dimension));
+    glm::uvec2 reversed = getReversedSobol(nestedUniformScramble(state.sampleIndex, seed));
+    uint32_t x = reverseBits(laineKarrasPermutation(reversed.x, hash(seed)));
+    uint32_t y = reverseBits(laineKarrasPermutation(reversed.y, hash(seed + 1u)));
+    return glm::vec2((float) (x >> 8), (float) (y >> 8)) / 16777216.0f;
+}
+
+static float getBsdfPdf(const CpuRenderSettings &settings, float cosTheta) {
+    return settings.bsdfSampling == BSDF_SAMPLING_COSINE ? cosTheta / std::numbers::pi_v<float>
+                                                         : 1.0f / (2.0f * std::numbers::pi_v<float>);
+}
+
+static glm::vec3 sampleBsdf(const CpuRenderSettings &settings, glm::vec3 normal, glm::vec2 u) {
+    /*
+     * Same as sampleBsdf in raytrace-common.glsl
+     */
+    float cosTheta = settings.bsdfSampling == BSDF_SAMPLING_COSINE ? std::sqrt(1.0f - u.x) : u.x;
+    float sinTheta = std::sqrt(std::max(1.0f - cosTheta * cosTheta, 0.0f));
+    float phi = 2.0f * std::numbers::pi_v<float> * u.y;
+    float signZ = normal.z >= 0.0f ? 1.0f : -1.0f;
+    float a = -1.0f / (signZ + normal.z);
+    float b = normal.x * normal.y * a;
+    glm::vec3 tangent(1.0f + signZ * normal.x * normal.x * a, signZ * b, -signZ * normal.x);
+    glm::vec3 bitangent(b, signZ + normal.y * normal.y * a, -normal.y);
+    return tangent * (sinTheta * std::cos(phi)) + bitangent * (sinTheta * std::sin(phi)) + normal * cosTheta;
+}
+
+/*
+ * Same as getHitNormal in raytrace-common.glsl
+ */
+static glm::vec3 getHitNormal(const CpuScene &scene, const CpuHitInfo &info, glm::vec3 dir) {
+    const MeshData &meshData = *getInstanceMesh(scene, info.instanceIndex).meshData;
+    // Normals transform by the inverse transpose of the object to world matrix
+    glm::mat3 worldToObject = scene.scene->tlasInstances[info.instanceIndex].worldToObject;
+    glm::vec3 normal = normalize(transpose(worldToObject) * getTriangleNormal(meshData, info.triangleIndex));
+    if (dot(normal, dir) > 0)
+        normal = -normal;
+    return normal;
+}
+
+static float getLightPdf(const Scene &scene, glm::vec3 emission, float dist, float cosLight) {
+    /*
+     * Same as getLightPdf in raytrace-common.glsl
+     */
+    return getLightLuminance(emission) / scene.totalLightPower * dist * dist / cosLight;
+}
+
+static float getPowerHeuristic(float pdf, float otherPdf) {
+    return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}
+
+static glm::vec3 sampleLight(const CpuScene &scene, const CpuRenderSettings &settings, glm::vec3 position,
+                             glm::vec3 normal, glm::vec3 albedo, unsigned int bounce, CpuTraceState &state) {
+    /*
+     * Same as sampleLight in raytrace-common.glsl
+     */
+    const std::vector<SceneLight> &lights = scene.scene->lights;
+    float u = rand(state) * (float) lights.size();
+    uint32_t lightIndex = std::min((uint32_t) u, (uint32_t) lights.size() - 1);
+    if (u - std::floor(u) >= lights[lightIndex].aliasThreshold)
+        lightIndex = lights[lightIndex].alias;
+    const SceneLight &light = lights[lightIndex];
+    glm::vec2 point = sample2D(settings, bounce * 2u, state);
+    float s = std::sqrt(point.x);
+    float t = point.y;
+    glm::vec3 lightPos = light.v0 * (1.0f - s) + light.v1 * (s * (1.0f - t)) + light.v2 * (s * t);
+    float dist = length(lightPos - position);
+    CpuRay shadowRay;
+    shadowRay.origin = position;
+    shadowRay.dir = (lightPos - position) / dist;
+    shadowRay.invDir = 1.0f / shadowRay.dir;
+    float cosSurface = dot(normal, shadowRay.dir);
+    float cosLight = std::abs(dot(normalize(cross(light.v1 - light.v0, light.v2 - light.v0)), shadowRay.dir));
+    if (cosSurface <= 0.0f || cosLight <= 0.0f || isOccluded(scene, settings, shadowRay, dist * (1.0f - 1e-3f), state))
+        return glm::vec3(0.0f);
+    float lightPdf = getLightPdf(*scene.scene, light.emission, dist, cosLight);
+    return albedo / std::numbers::pi_v<float> * light.emission * cosSurface / lightPdf *
+           getPowerHeuristic(lightPdf, getBsdfPdf(settings, cosSurface));
+}
+
+static glm::vec3 getColour(const CpuScene &scene, const CpuRenderSettings &settings, CpuRay ray,
+                           CpuTraceState &state) {
+    /*
+     * Same as getColour in raytrace.glsl, with bouncePath inlined
+     */
+    const bool nextEventEstimation = settings.nextEventEstimation && !scene.scene->lights.empty();
+    glm::vec3 rayColour(1.0f);
+    glm::vec3 result(0.0f);
+    float bsdfPdf = 0.0f;
+    for (unsigned int i = 0; i < settings.rayBounces; i++) {
+        CpuHitInfo info = getHitInfo(scene, settings, ray, state);
+        if (i == 0)
+            state.primaryHit = info;
+        if (info.dist < INF) {
+            const MeshData &meshData = *getInstanceMesh(scene, info.instanceIndex).meshData;
+            glm::vec3 normal = getHitNormal(scene, info, ray.dir);
+            glm::vec3 emission(scene.scene->tlasInstances[info.instanceIndex].emission);
+            if (emission != glm::vec3(0.0f)) {
+                float weight = 1.0f;
+                if (nextEventEstimation && i > 0) {
+                    weight = getPowerHeuristic(bsdfPdf, getLightPdf(*scene.scene, emission, info.dist,
+                                                                    dot(normal, -ray.dir)));
+                }
+                result += emission * rayColour * weight;
+            }
+            ray.origin += ray.dir * info.dist;
+            glm::vec3 albedo = getTriangleColour(meshData, info.triangleIndex);
+            if (nextEventEstimation)
+                result += sampleLight(scene, settings, ray.origin, normal, albedo, i, state) * rayColour;
+            ray.dir = sampleBsdf(settings, normal, sample2D(settings, i * 2u + 1u, state));
+            ray.invDir = 1.0f / ray.dir;
+            float cosTheta = dot(normal, ray.dir);
+            bsdfPdf = getBsdfPdf(settings, cosTheta);
+            if (settings.bsdfSampling == BSDF_SAMPLING_COSINE)
+                rayColour *= albedo;
+            else
+                rayColour *= albedo / std::numbers::pi_v<float> * cosTheta / bsdfPdf;
+            if (i > 2) {
+                float continueProb = std::min(std::max({rayColour.r, rayColour.g, rayColour.b}),
+                                              RUSSIAN_ROULETTE_MAX_CONTINUE);
+                if (rand(state) >= continueProb)
+                    break;
+                rayColour /= continueProb;
+            }
+        } else {
+            result += sampleSkybox(ray.dir) * rayColour;
+            break;
+        }
+        state.numReflections++;
+    }
+    return result;
+}
+
+static glm::vec4 getTestModeColour(const CpuRenderSettings &settings, const CpuTraceState &state) {
+    if (settings.renderMode == TRIANGLE_TEST_MODE)
+        return (float) std::min(500, state.numTriangleTests) / 500.0f * glm::vec4(1.0f, 1.0f, 0.0f, 0.0f);
+    if (settings.renderMode == BOX_TEST_MODE)
+        return (float) std::min(1000, state.numBoxTests) / 1000.0f * glm::vec4(0.0f, 1.0f, 1.0f, 1.0f);
+    return (float) std::min((int) settings.rayBounces, state.numReflections) / (float) settings.rayBounces *
+           glm::vec4(1.0f);
+}
+
+/*
+ * Accumulated colour, in the image, and second moment of the colour of one pixel, from which adaptive sampling
+ * estimates the pixel's error
+ */
+struct CpuPixel {
+    glm::vec4 colour{0.0f};
+    glm::vec3 colourMoment{0.0f};
+    int numFrames = 0;
+};
+
+static float getColourVariance(const CpuPixel &pixel) {
+    glm::vec3 mean(pixel.colour);
+    glm::vec3 variance = max(pixel.colourMoment - mean * mean, glm::vec3(0.0f));
+    return variance.x + variance.y + variance.z;
+}
+
+static bool isConverged(const std::vector<CpuPixel> &pixels, int x, int y, const CpuRenderSettings &settings) {
+    /*
+     * Same test as the adaptive classify stage: the standard error of the pixel's mean colour, summed over the
+     * channels, falls below the threshold. The variance is averaged over the pixel's 3x3 neighbourhood, as a few
+     * frames of one pixel easily miss its rare bright paths and would stop it early at a wrong colour.
+     */
+    const CpuPixel &pixel = pixels[y * settings.width + x];
+    if (pixel.numFrames >= settings.numFrames)
+        return true;
+    if (pixel.numFrames < settings.adaptiveWarmupFrames)
+        return false;
+    float variance = 0.0f;
+    int numNeighbours = 0;
+    for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, settings.height - 1); ny++) {
+        for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, settings.width - 1); nx++) {
+            variance += getColourVariance(pixels[ny * settings.width + nx]);
+            numNeighbours++;
+        }
+    }
+    variance /= (float) numNeighbours;
+    return std::sqrt(variance / (float) pixel.numFrames) <= settings.adaptiveThreshold;
+}
+
+static void storeGuides(const CpuScene &scene, const CpuHitInfo &primaryHit, glm::vec3 primaryDir, size_t pixelIndex,
+                        CpuGuideBuffers &guides) {
+    guides.depths[pixelIndex] = primaryHit.dist;
+    if (primaryHit.dist < INF) {
+        const MeshData &meshData = *getInstanceMesh(scene, primaryHit.instanceIndex).meshData;
+        guides.normals[pixelIndex] = getHitNormal(scene, primaryHit, primaryDir);
+        guides.albedos[pixelIndex] = getTriangleColour(meshData, primaryHit.triangleIndex);
+    }
+}
+
+static void renderPixel(const CpuScene &scene, const CpuRenderSettings &settings, int x, int y, int numFrames,
+                        CpuPixel &pixel, uint64_t counters[3], CpuGuideBuffers *guides) {
+    const float fov = FOV * std::numbers::pi_v<float> / 180.0f;
+    const auto width = (float) settings.width, height = (float) settings.height;
+    const float pixelWidth = std::tan(fov / 2.0f) * VIEWPORT_DIST * 2.0f / width;
+    auto pixelIndex = (uint32_t) ((float) y * width + (float) x);
+    CpuRay ray;
+    ray.origin = settings.cameraPos;
+    ray.dir = normalize(settings.cameraRotation * glm::vec3(
+            ((float) x - width / 2.0f) * pixelWidth,
+            ((float) y - height / 2.0f) * pixelWidth,
+            VIEWPORT_DIST));
+    ray.invDir = 1.0f / ray.dir;
+    for (int frameEnd = pixel.numFrames + numFrames; pixel.numFrames < frameEnd; pixel.numFrames++) {
+        const int frame = pixel.numFrames;
+        CpuTraceState state;
+        state.randSeed = pixelIndex + (uint32_t) frame * 745621u;
+        state.sampleSeed = hash(pixelIndex);
+        glm::vec3 colour(0.0f);
+        for (unsigned int i = 0; i < RAYS_PER_PIXEL; i++) {
+            state.sampleIndex = (uint32_t) frame * RAYS_PER_PIXEL + i;
+            colour += getColour(scene, settings, ray, state);
+        }
+        colour /= (float) RAYS_PER_PIXEL;
+        pixel.colour = (pixel.colour * (float) frame + glm::vec4(colour, 1.0f)) / (float) (frame + 1);
+        pixel.colourMoment = (pixel.colourMoment * (float) frame + colour * colour) / (float) (frame + 1);
+        if (settings.renderMode != RENDER_MODE)
+            pixel.colour = getTestModeColour(settings, state);
+        if (frame == 0 && guides != nullptr)
+            storeGuides(scene, state.primaryHit, ray.dir, pixelIndex, *guides);
+        counters[0] += state.numRays;
+        counters[1] += state.numBoxTests;
+        counters[2] += state.numTriangleTests;
+    }
+}
+
+static void renderTile(const CpuScene &scene, const CpuRenderSettings &settings, int tileX, int tileY,
+                       int numFrames, std::vector<CpuPixel> &pixels, std::atomic<uint64_t> counters[3],
+                       CpuGuideBuffers *guides) {
+    uint64_t tileCounters[3] = {0, 0, 0};
+    for (int y = tileY; y < std::min(settings.height, tileY + CPU_RAYTRACE_TILE_SIZE); y++) {
+        for (int x = tileX; x < std::min(settings.width, tileX + CPU_RAYTRACE_TILE_SIZE); x++)
+            renderPixel(scene, settings, x, y, numFrames, pixels[y * settings.width + x], tileCounters, guides);
+    }
+    for (int i = 0; i < 3; i++)
+        counters[i] += tileCounters[i];
+}
+
+static void renderAdaptive(const CpuScene &scene, const CpuRenderSettings &settings, TaskPool &pool,
+                           std::vector<CpuPixel> &pixels, std::atomic<uint64_t> counters[3], CpuRenderStats &stats) {
+    /*
+     * After the warm-up frames, every round compacts the pixels that have not converged into a list
+     * and traces one more frame for each, until none are left or the sample budget is spent.
+     * A round that would exceed the budget only traces the first pixels of the list.
+     */
+    const auto sampleBudget = (uint64_t) (settings.adaptiveSampleBudget * (double) pixels.size());
+    uint64_t numSamples = stats.numSamples;
+    std::vector<int> activePixels(pixels.size());
+    for (int i = 0; i < (int) pixels.size(); i++)
+        activePixels[i] = i;
+    while (sampleBudget == 0 || numSamples < sampleBudget) {
+        // Converged pixels are never revisited, so each round only checks the pixels that were still active
+        std::erase_if(activePixels, [&](int i) {
+            return isConverged(pixels, i % settings.width, i / settings.width, settings);
+        });
+        if (activePixels.empty())
+            break;
+        if (sampleBudget != 0 && numSamples + activePixels.size() > sampleBudget)
+            activePixels.resize(sampleBudget - numSamples);
+        TaskGroup group(pool);
+        for (size_t begin = 0; begin < activePixels.size(); begin += CPU_ADAPTIVE_BLOCK_SIZE) {
+            group.run([&, begin] {
+                uint64_t blockCounters[3] = {0, 0, 0};
+                size_t end = std::min(activePixels.size(), begin + CPU_ADAPTIVE_BLOCK_SIZE);
+                for (size_t i = begin; i < end; i++) {
+                    int pixelIndex = activePixels[i];
+                    renderPixel(scene, settings, pixelIndex % settings.width, pixelIndex / settings.width, 1,
+                                pixels[pixelIndex], blockCounters, nullptr);
+                }
+                for (int j = 0; j < 3; j++)
+                    counters[j] += blockCounters[j];
+            });
+        }
+        group.wait();
+        numSamples += activePixels.size();
+        stats.numAdaptiveRounds++;
+    }
+    stats.numSamples = numSamples;
+}
+
+std::vector<glm::vec4> renderCPU(const CpuScene &scene, const CpuRenderSettings &settings, CpuRenderStats *stats,
+                                 CpuGuideBuffers *guides) {
+    /*
+     * Splits the image into tiles, each of which is a task on a work-stealing pool.
+     * With adaptive sampling, the tiles only render the warm-up frames.
+     */
+    PROFILE_SCOPE("RENDER CPU");
+    auto renderStart = std::chrono::high_resolution_clock::now();
+    const bool adaptive = settings.adaptiveThreshold > 0.0f && settings.renderMode == RENDER_MODE;
+    const int tileFrames = adaptive ? std::min(settings.adaptiveWarmupFrames, settings.numFrames) : settings.numFrames;
+    std::vector<CpuPixel> pixels(settings.width * settings.height);
+    std::atomic<uint64_t> counters[3] = {0, 0, 0};
+    CpuRenderStats renderStats;
+    if (guides != nullptr) {
+        guides->depths.assign(pixels.size(), INF);
+        guides->normals.assign(pixels.size(), glm::vec3(0.0f));
+        guides->albedos.assign(pixels.size(), glm::vec3(0.0f));
+    }
+    renderStats.numSamples = (uint64_t) tileFrames * pixels.size();
+    {
+        TaskPool pool(settings.numThreads);
+        TaskGroup group(pool);
+        for (int tileY = 0; tileY < settings.height; tileY += CPU_RAYTRACE_TILE_SIZE) {
+            for (int tileX = 0; tileX < settings.width; tileX += CPU_RAYTRACE_TILE_SIZE) {
+                group.run([&, tileX, tileY] {
+                    renderTile(scene, settings, tileX, tileY, tileFrames, pixels, counters, guides);
+                });
+            }
+        }
+        group.wait();
+        if (adaptive)
+            renderAdaptive(scene, settings, pool, pixels, counters, renderStats);
+    }
+    std::vector<glm::vec4> image(pixels.size());
+    for (size_t i = 0; i < pixels.size(); i++)
+        image[i] = pixels[i].colour;
+    if (guides != nullptr) {
+        guides->colourMoments.resize(pixels.size());
+        guides->numFrames.resize(pixels.size());
+        for (size_t i = 0; i < pixels.size(); i++) {
+            guides->colourMoments[i] = pixels[i].colourMoment;
+            guides->numFrames[i] = pixels[i].numFrames;
+        }
+    }
+    std::chrono::duration<double, std::milli> renderTime = std::chrono::high_resolution_clock::now() - renderStart;
+    if (stats != nullptr) {
+        *stats = {renderTime.count(), counters[0], counters[1], counters[2], renderStats.numSamples,
+                  renderStats.numAdaptiveRounds};
+    }
+    return image;
+}
+
+int traceBinaryBVH(const CpuMesh &mesh, glm::vec3 origin, glm::vec3 dir, std::vector<uint32_t> &nodeTrace,
+                   float *hitDist) {
+    CpuRay ray{origin, dir, 1.0f / dir};
+    CpuHitInfo info{INF, -1, -1};
+    CpuTraceState state;
+    state.nodeTrace = &nodeTrace;
+    intersectMeshBinary(mesh, ray, info, state);
+    if (hitDist != nullptr)
+        *hitDist = info.dist;
+    return info.triangleIndex;
+}
@@ -0,0 +1,105 @@
+#ifndef OPENGL_RAYTRACER_CPU_RAYTRACE_H
+#define OPENGL_RAYTRACER_CPU_RAYTRACE_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cstdint>
+
+#include "constants.h"
+#include "scene-loader.h"
+
+/*
+ * CPU port of the megakernel (raytrace.glsl and raytrace-common.glsl), for machines without a GPU
+ * and as a reference for the GPU output. Needs no window or GL context.
+ */
+
+struct CpuRenderSettings {
+    int width = 1280;
+    int height = 720;
+    // Number of frames accumulated per pixel, each tracing RAYS_PER_PIXEL rays as the GPU does.
+    // With adaptive sampling, the most a pixel gets.
+    int numFrames = 16;
+    unsigned int rayBounces = RAY_BOUNCES;
+    int renderMode = RENDER_MODE;
+    int bvhLayout = BVH_LAYOUT_WIDE;
+    // 0 uses every hardware thread
+    int numThreads = 0;
+    glm::vec3 cameraPos = CAMERA_START_POS;
+    glm::mat3 cameraRotation = glm::mat3(1.0f);
+    // Relative standard error of a pixel's luminance at which adaptive sampling stops sampling it, 0 to sample
+    // every pixel numFrames times
+    float adaptiveThreshold = 0.0f;
+    int adaptiveWarmupFrames = ADAPTIVE_SAMPLING_WARMUP_FRAMES;
+    // Average frames per pixel after which adaptive sampling stops, however many pixels are left, 0 for no limit
+    float adaptiveSampleBudget = 0.0f;
+    bool nextEventEstimation = NEXT_EVENT_ESTIMATION;
+    int bsdfSampling = BSDF_SAMPLING;
+    int sampleSequence = SAMPLE_SEQUENCE;
+};
+
+struct CpuRenderStats {
+    double renderTimeMs = 0.0;
+    uint64_t numRays = 0;
+    uint64_t numBoxTests = 0;
+    uint64_t numTriangleTests = 0;
+    // Frames rendered over all pixels
+    uint64_t numSamples = 0;
+    int numAdaptiveRounds = 0;
+
+    double getMraysPerSecond() const {
+        return (double) numRays / renderTimeMs / 1000.0;
+    }
+};
+
+/*
+ * Per-pixel inputs of the denoiser (see cpu-denoise.h), in the image's layout. The GPU keeps the same in its depth,
+ * guide and moment images.
+ */
+struct CpuGuideBuffers {
+    // Distance to the primary ray's first hit, infinite for the sky, whose normal and albedo are zero
+    std::vector<float> depths;
+    // Normal of the primary hit, facing the camera
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec3> albedos;
+    // Second moment of each pixel's colour over the frames it accumulated
+    std::vector<glm::vec3> colourMoments;
+    std::vector<int> numFrames;
+};
+
+/*
+ * MeshData plus the wide BVH, which the mesh only contains when it was built with a wide layout,
+ * and its compressed nodes, so that every BVH layout can be traced whatever BVH_LAYOUT is.
+ */
+struct CpuMesh {
+    const MeshData *meshData;
+    std::vector<WideBVHNode> wideBVHNodes;
+    std::vector<CompressedBVHNode> compressedBVHNodes;
+};
+
+/*
+ * The scene's TLAS and instances are read from the scene itself, so a rebuilt TLAS is picked up by the next render.
+ */
+struct CpuScene {
+    const Scene *scene;
+    std::vector<CpuMesh> meshes;
+};
+
+extern CpuScene prepareCpuScene(const Scene* scene);
+
+/*
+ * Renders the scene into a width * height image, stored from the bottom row up like the GPU's frame textures.
+ * Also fills guides, when given, for denoising the image.
+ */
+extern std::vector<glm::vec4> renderCPU(const CpuScene& scene, const CpuRenderSettings& settings,
+                                        CpuRenderStats* stats = nullptr, CpuGuideBuffers* guides = nullptr);
+
+/*
+ * Traces one ray through the mesh's binary BVH alone, in the mesh's object space, appending to nodeTrace the index
+ * of every node that the traversal reads, in the order it reads them. Returns the index of the nearest triangle hit,
+ * or -1 on a miss.
+ */
+extern int traceBinaryBVH(const CpuMesh& mesh, glm::vec3 origin, glm::vec3 dir, std::vector<uint32_t>& nodeTrace,
+                          float* hitDist = nullptr);
+
+#endif //OPENGL_RAYTRACER_CPU_RAYTRACE_H
@@ -0,0 +1,297 @@
+#include "dynamic-mesh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <span>
+#include <stdexcept>
+#include <limits>
+
+#include "bvh.h"
+#include "wide-bvh.h"
+#include "scene-loader.h"
+#include "mesh-geometry.h"
+#include "profiler.h"
+
+struct BVHQuality {
+    float cost = 0.0f;
+    float topCost = 0.0f;
+    std::vector<float> subtreeCosts;
+    std::vector<uint32_t> subtreeTriangles;
+};
+
+void DirtyRange::add(size_t rangeBegin, size_t rangeEnd) {
+    if (rangeBegin >= rangeEnd)
+        return;
+    if (isEmpty()) {
+        begin = rangeBegin;
+        end = rangeEnd;
+        return;
+    }
+    begin = std::min(begin, rangeBegin);
+    end = std::max(end, rangeEnd);
+}
+
+template<typename T>
+static std::span<T> getWritable(std::span<const T> section) {
+    /*
+     * A dynamic mesh's sections view the buffer of a MeshData that serializeMesh allocated, never a mapped cache,
+     * so they can be written in place.
+     */
+    return {const_cast<T *>(section.data()), section.size()};
+}
+
+static BVHBuildOptions getRebuildOptions(const DynamicMesh &mesh) {
+    /*
+     * Rebuilds never use SBVH, which would change the length of the triangle index list.
+     */
+    static_assert(BVH_REBUILD_SPLIT_METHOD != BVH_SPLIT_SBVH);
+    return {BVH_REBUILD_SPLIT_METHOD, mesh.pool->getNumThreads(), false, 0.0f, false};
+}
+
+static float getNodeCost(const BVHNode &node) {
+    if (node.isLeaf())
+        return BVH_INTERSECTION_COST * (float) node.getTriangleCount() * getSA(node.minCorner, node.maxCorner);
+    return BVH_TRAVERSAL_COST * getSA(node.minCorner, node.maxCorner);
+}
+
+template<typename Fn>
+static void visitSubtree(std::span<const BVHNode> nodes, uint32_t root, Fn fn) {
+    std::vector<uint32_t> stack = {root};
+    while (!stack.empty()) {
+        uint32_t index = stack.back();
+        stack.pop_back();
+        const BVHNode &node = nodes[index];
+        fn(index, node);
+        if (!node.isLeaf()) {
+            stack.push_back(node.rightOrCount);
+            stack.push_back(node.leftOrStart);
+        }
+    }
+}
+
+static BVHQuality getQuality(const DynamicMesh &mesh) {
+    /*
+     * Gets the SAH cost of the whole tree and of every monitored subtree, each relative to its own root box,
+     * and the part of the tree's cost that comes from the nodes above the subtrees.
+     */
+    std::span<const BVHNode> nodes = mesh.meshData->bvhNodes.first(mesh.numBVHNodes);
+    BVHQuality quality;
+    quality.cost = getBVHCost(nodes);
+    float subtreeCostSum = 0.0f;
+    for (const MonitoredSubtree &subtree : mesh.subtrees) {
+        float cost = 0.0f;
+        uint32_t numTriangles = 0;
+        visitSubtree(nodes, subtree.root, [&](uint32_t, const BVHNode &node) {
+            cost += getNodeCost(node);
+            if (node.isLeaf())
+                numTriangles += node.getTriangleCount();
+        });
+        const BVHNode &root = nodes[subtree.root];
+        subtreeCostSum += cost;
+        quality.subtreeCosts.push_back(cost / getSA(root.minCorner, root.maxCorner));
+        quality.subtreeTriangles.push_back(numTriangles);
+    }
+    quality.topCost = quality.cost - subtreeCostSum / getSA(nodes[0].minCorner, nodes[0].maxCorner);
+    return quality;
+}
+
+static void resetMonitor(DynamicMesh &mesh) {
+    /*
+     * Picks the interior nodes at BVH_PARTIAL_REBUILD_DEPTH as the monitored subtrees,
+     * and makes the current costs the baseline that later updates are compared against.
+     */
+    std::span<const BVHNode> nodes = mesh.meshData->bvhNodes;
+    mesh.subtrees.clear();
+    std::vector<std::pair<uint32_t, int>> stack = {{0, 0}};
+    while (!stack.empty()) {
+        auto [index, depth] = stack.back();
+        stack.pop_back();
+        const BVHNode &node = nodes[index];
+        if (node.isLeaf())
+            continue;
+        if (depth == BVH_PARTIAL_REBUILD_DEPTH) {
+            mesh.subtrees.push_back({index, 0.0f});
+            continue;
+        }
+        stack.emplace_back(node.rightOrCount, depth + 1);
+        stack.emplace_back(node.leftOrStart, depth + 1);
+    }
+    BVHQuality quality = getQuality(mesh);
+    mesh.builtCost = quality.cost;
+    mesh.builtTopCost = quality.topCost;
+    for (size_t i = 0; i < mesh.subtrees.size(); i++)
+        mesh.subtrees[i].builtCost = quality.subtreeCosts[i];
+}
+
+static void collapseDynamicBVH(DynamicMesh &mesh, MeshUpdate &update) {
+    if (mesh.meshData->wideBVHNodes.empty())
+        return;
+    std::vector<WideBVHNode> wideBVHNodes = collapseBVH(mesh.meshData->bvhNodes.first(mesh.numBVHNodes), false);
+    std::ranges::copy(wideBVHNodes, getWritable(mesh.meshData->wideBVHNodes).begin());
+    mesh.numWideBVHNodes = (uint32_t) wideBVHNodes.size();
+    update.wideBVHNodes.add(0, wideBVHNodes.size());
+}
+
+static void rebuildBVH(DynamicMesh &mesh, MeshUpdate &update) {
+    std::vector<uint32_t> triangleIndices;
+    std::vector<BVHNode> bvhNodes = generateBVH(*mesh.pool, mesh.triangles, mesh.vertices, triangleIndices,
+                                                getRebuildOptions(mesh));
+    std::ranges::copy(bvhNodes, getWritable(mesh.meshData->bvhNodes).begin());
+    std::ranges::copy(triangleIndices, getWritable(mesh.meshData->triangleIndices).begin());
+    mesh.numBVHNodes = (uint32_t) bvhNodes.size();
+    update.bvhNodes.add(0, bvhNodes.size());
+    update.triangleIndices.add(0, triangleIndices.size());
+}
+
+static bool rebuildSubtree(DynamicMesh &mesh, uint32_t root, MeshUpdate &update) {
+    /*
+     * The subtree's leaves cover a contiguous range of the triangle index list, which the new subtree reuses.
+     * The root keeps its index, so its parent is unchanged, and the other nodes take the old subtree's indices
+     * in ascending order, then fresh ones past numBVHNodes. Pre-order assigns parents before children,
+     * so every child still comes after its parent. Old nodes that are left over become empty leaves.
+     * Returns false, changing nothing, if the new subtree does not fit in the BVH section.
+     */
+    std::span<BVHNode> nodes = getWritable(mesh.meshData->bvhNodes);
+    std::span<uint32_t> triangleIndices = getWritable(mesh.meshData->triangleIndices);
+    std::vector<uint32_t> freeNodes;
+    uint32_t first = std::numeric_limits<uint32_t>::max(), numTriangles = 0;
+    visitSubtree(nodes, root, [&](uint32_t index, const BVHNode &node) {
+        if (index != root)
+            freeNodes.push_back(index);
+        if (node.isLeaf() && node.getTriangleCount() > 0) {
+            first = std::min(first, node.leftOrStart);
+            numTriangles += node.getTriangleCount();
+        }
+    });
+    std::vector<glm::uvec3> subtreeTriangles(numTriangles);
+    for (uint32_t i = 0; i < numTriangles; i++)
+        subtreeTriangles[i] = mesh.triangles[triangleIndices[first + i]];
+    std::vector<uint32_t> subtreeIndices;
+    std::vector<BVHNode> subtreeNodes = generateBVH(*mesh.pool, subtreeTriangles, mesh.vertices, subtreeIndices,
+                                                    getRebuildOptions(mesh));
+    if (freeNodes.size() + (nodes.size() - mesh.numBVHNodes) < subtreeNodes.size() - 1)
+        return false;
+
+    std::vector<uint32_t> newTriangleIndices(numTriangles);
+    for (uint32_t i = 0; i < numTriangles; i++)
+        newTriangleIndices[i] = triangleIndices[first + subtreeIndices[i]];
+    std::ranges::copy(newTriangleIndices, triangleIndices.begin() + first);
+    std::sort(freeNodes.begin(), freeNodes.end());
+    while (freeNodes.size() < subtreeNodes.size() - 1)
+        freeNodes.push_back(mesh.numBVHNodes++);
+    std::vector<uint32_t> newIndices(subtreeNodes.size());
+    newIndices[0] = root;
+    for (size_t i = 1; i < subtreeNodes.size(); i++)
+        newIndices[i] = freeNodes[i - 1];
+    for (size_t i = 0; i < subtreeNodes.size(); i++) {
+        BVHNode node = subtreeNodes[i];
+        if (node.isLeaf()) {
+            node.leftOrStart += first;
+        } else {
+            node.leftOrStart = newIndices[node.leftOrStart];
+            node.rightOrCount = newIndices[node.rightOrCount];
+        }
+        nodes[newIndices[i]] = node;
+    }
+    for (size_t i = subtreeNodes.size() - 1; i < freeNodes.size(); i++)
+        nodes[freeNodes[i]] = {MAX_VERTEX, 0, MIN_VERTEX, BVH_LEAF_BIT};
+    update.bvhNodes.add(root, mesh.numBVHNodes);
+    update.triangleIndices.add(first, first + numTriangles);
+    return true;
+}
+
+DynamicMesh *createDynamicMesh(const ObjContents &contents) {
+    /*
+     * A binary BVH over n triangles has at most 2n - 1 nodes, and its wide collapse at most one node
+     * per binary interior node, so the sections are sized for those bounds.
+     */
+    if (contents.triangles.empty())
+        throw std::runtime_error("Dynamic mesh has no triangles");
+    auto *mesh = new DynamicMesh;
+    mesh->triangles = contents.triangles;
+    mesh->vertices = contents.vertices;
+    mesh->pool = std::make_unique<TaskPool>(BVH_BUILD_THREADS);
+    std::vector<uint32_t> triangleIndices;
+    std::vector<BVHNode> bvhNodes = generateBVH(*mesh->pool, mesh->triangles, mesh->vertices, triangleIndices,
+                                                getRebuildOptions(*mesh));
+    std::vector<WideBVHNode> wideBVHNodes;
+    if (BVH_LAYOUT != BVH_LAYOUT_BINARY)
+        wideBVHNodes = collapseBVH(bvhNodes, false);
+    const size_t numTriangles = mesh->triangles.size();
+    mesh->meshData = serializeMesh(mesh->vertices, mesh->triangles, bvhNodes, wideBVHNodes, triangleIndices,
+                                   2 * numTriangles - 1,
+                                   wideBVHNodes.empty() ? 0 : std::max<size_t>(numTriangles - 1, 1));
+    mesh->numBVHNodes = (uint32_t) bvhNodes.size();
+    mesh->numWideBVHNodes = (uint32_t) wideBVHNodes.size();
+    resetMonitor(*mesh);
+    return mesh;
+}
+
+MeshUpdate updateDynamicMesh(DynamicMesh &mesh, const std::vector<glm::vec3> &vertices,
+                             const MeshUpdateOptions &options) {
+    /*
+     * Refits first, which is enough while the SAH cost stays under the threshold.
+     * Past it, only the degraded subtrees are rebuilt, unless the nodes above them degraded too,
+     * or the degraded subtrees hold too much of the mesh for a partial rebuild to be worth it.
+     */
+    PROFILE_SCOPE("UPDATE DYNAMIC MESH");
+    auto updateStart = std::chrono::high_resolution_clock::now();
+    if (vertices.size() != mesh.vertices.size())
+        throw std::runtime_error("Dynamic mesh updates must keep the number of vertices");
+    mesh.vertices = vertices;
+    MeshData &meshData = *mesh.meshData;
+    MeshUpdate update;
+    writeMeshGeometry(*mesh.pool, meshData, mesh.vertices, mesh.triangles);
+    // Indexed triangles keep their vertex indices, and only the vertices move
+    if (meshData.geometryLayout == GEOMETRY_LAYOUT_INDEXED)
+        update.vertices.add(0, meshData.vertices.size());
+    else
+        update.triangles.add(0, meshData.numTriangles);
+    update.quantizationBlocks.add(0, meshData.quantizationBlocks.size());
+    refitBVH(getWritable(meshData.bvhNodes).first(mesh.numBVHNodes), meshData.triangleIndices, mesh.triangles,
+             mesh.vertices, mesh.pool.get());
+    update.bvhNodes.add(0, mesh.numBVHNodes);
+
+    BVHQuality quality = getQuality(mesh);
+    if (quality.cost > options.rebuildThreshold * mesh.builtCost) {
+        std::vector<size_t> degraded;
+        uint32_t numDegradedTriangles = 0;
+        for (size_t i = 0; i < mesh.subtrees.size(); i++) {
+            if (quality.subtreeCosts[i] > options.rebuildThreshold * mesh.subtrees[i].builtCost) {
+                degraded.push_back(i);
+                numDegradedTriangles += quality.subtreeTriangles[i];
+            }
+        }
+        bool partial = options.partialRebuilds && !degraded.empty() &&
+                       quality.topCost <= options.rebuildThreshold * mesh.builtTopCost &&
+                       (float) numDegradedTriangles <= BVH_PARTIAL_REBUILD_MAX_FRACTION * (float) meshData.numTriangles;
+        for (size_t i = 0; partial && i < degraded.size(); i++) {
+            partial = rebuildSubtree(mesh, mesh.subtrees[degraded[i]].root, update);
+            update.numRebuiltSubtrees++;
+        }
+        if (partial) {
+            update.kind = BVH_UPDATE_PARTIAL_REBUILD;
+            quality = getQuality(mesh);
+            mesh.builtCost = quality.cost;
+            for (size_t i : degraded)
+                mesh.subtrees[i].builtCost = quality.subtreeCosts[i];
+        } else {
+            update.kind = BVH_UPDATE_FULL_REBUILD;
+            update.numRebuiltSubtrees = 0;
+            rebuildBVH(mesh, update);
+            resetMonitor(mesh);
+        }
+        collapseDynamicBVH(mesh, update);
+    } else if (!meshData.wideBVHNodes.empty()) {
+        refitWideBVH(getWritable(meshData.wideBVHNodes).first(mesh.numWideBVHNodes), meshData.triangleIndices,
+                     mesh.triangles, mesh.vertices, mesh.pool.get());
+        update.wideBVHNodes.add(0, mesh.numWideBVHNodes);
+    }
+    if (!meshData.compressedBVHNodes.empty())
+        compressBVH(meshData.wideBVHNodes.first(mesh.numWideBVHNodes),
+                    getWritable(meshData.compressedBVHNodes).first(mesh.numWideBVHNodes), mesh.pool.get());
+    update.sahCost = getBVHCost(meshData.bvhNodes.first(mesh.numBVHNodes));
+    std::chrono::duration<double, std::milli> updateTime = std::chrono::high_resolution_clock::now() - updateStart;
+    update.updateTimeMs = updateTime.count();
+    return update;
+}
@@ -0,0 +1,103 @@
+#ifndef OPENGL_RAYTRACER_DYNAMIC_MESH_H
+#define OPENGL_RAYTRACER_DYNAMIC_MESH_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+#include "constants.h"
+#include "obj-reader.h"
+#include "scene.h"
+#include "task-pool.h"
+
+#define BVH_UPDATE_REFIT 1
+#define BVH_UPDATE_PARTIAL_REBUILD 2
+#define BVH_UPDATE_FULL_REBUILD 3
+
+/*
+ * Half-open range of changed elements in one of a mesh's buffers
+ */
+struct DirtyRange {
+    size_t begin = 0;
+    size_t end = 0;
+
+    void add(size_t rangeBegin, size_t rangeEnd);
+
+    bool isEmpty() const {
+        return begin >= end;
+    }
+};
+
+/*
+ * What one update changed, counted in elements of the matching MeshData buffer.
+ * triangles covers the geometry sections with one element per triangle: triv0, triv1, triv2 and the normals,
+ * or the vertex indices, or the quantized triangles. wideBVHNodes also covers the compressed nodes, one per wide node.
+ * The colours never change.
+ */
+struct MeshUpdate {
+    int kind = BVH_UPDATE_REFIT;
+    DirtyRange bvhNodes;
+    DirtyRange wideBVHNodes;
+    DirtyRange triangleIndices;
+    DirtyRange triangles;
+    DirtyRange vertices;
+    DirtyRange quantizationBlocks;
+    int numRebuiltSubtrees = 0;
+    float sahCost = 0.0f;
+    double updateTimeMs = 0.0;
+};
+
+struct MeshUpdateOptions {
+    // SAH cost, relative to the cost after the last rebuild, past which the degraded part of the BVH is rebuilt
+    float rebuildThreshold = BVH_REBUILD_THRESHOLD;
+    // Without partial rebuilds, any degradation past the threshold rebuilds the whole BVH
+    bool partialRebuilds = true;
+};
+
+/*
+ * Subtree at BVH_PARTIAL_REBUILD_DEPTH, which a partial rebuild can replace without touching the rest of the tree
+ */
+struct MonitoredSubtree {
+    uint32_t root;
+    // SAH cost of the subtree relative to its own root box, when it was last built
+    float builtCost;
+};
+
+/*
+ * A mesh whose vertices move every frame while its triangles stay the same, such as a skinned character.
+ * Every update refits the BVH, and a quality monitor rebuilds the subtrees, or the whole tree, whose SAH cost
+ * has degraded past the rebuild threshold since they were last built.
+ * Triangles are never reordered, and the BVH sections of meshData have room for the largest tree the triangles
+ * can have, so every update is written in place and the GPU only needs the changed ranges (see uploadMeshUpdate).
+ */
+struct DynamicMesh {
+    // Not owned: usually handed to createScene, which must keep it alive while the mesh is updated
+    MeshData *meshData = nullptr;
+    std::vector<glm::uvec3> triangles;
+    std::vector<glm::vec3> vertices;
+    // Nodes in use at the start of each BVH section. Partial rebuilds may leave unreachable empty leaves among them.
+    uint32_t numBVHNodes = 0;
+    uint32_t numWideBVHNodes = 0;
+    std::vector<MonitoredSubtree> subtrees;
+    // SAH costs when the BVH was last rebuilt, of the whole tree and of the nodes above the monitored subtrees
+    float builtCost = 0.0f;
+    float builtTopCost = 0.0f;
+    std::unique_ptr<TaskPool> pool;
+};
+
+/*
+ * Builds the mesh in its initial pose, returning a DynamicMesh that writes into a new MeshData.
+ */
+extern DynamicMesh* createDynamicMesh(const ObjContents& contents);
+
+/*
+ * Moves the mesh's vertices to new positions, of which there must be as many as before, and updates its BVH.
+ * The root box moves with the vertices, so scenes instancing the mesh also need buildTLAS afterwards.
+ */
+extern MeshUpdate updateDynamicMesh(DynamicMesh& mesh, const std::vector<glm::vec3>& vertices,
+                                    const MeshUpdateOptions& options = {});
+
+#endif //OPENGL_RAYTRACER_DYNAMIC_MESH_H
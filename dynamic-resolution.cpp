@@ -0,0 +1,86 @@
+#include "dynamic-resolution.h"
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <cmath>
+
+static GLuint frameTimerQueries[FRAME_TIMER_QUERIES];
+static float frameTimerScales[FRAME_TIMER_QUERIES];
+// Frames timed and frames read back since the start. The difference is the number of queries in flight.
+static size_t numFramesTimed = 0, numFramesRead = 0;
+static bool frameTimerActive = false;
+
+void beginFrameTimer(float renderScale) {
+    if (frameTimerQueries[0] == 0)
+        glGenQueries(FRAME_TIMER_QUERIES, frameTimerQueries);
+    if (numFramesTimed - numFramesRead == FRAME_TIMER_QUERIES)
+        return;
+    size_t i = numFramesTimed % FRAME_TIMER_QUERIES;
+    frameTimerScales[i] = renderScale;
+    glBeginQuery(GL_TIME_ELAPSED, frameTimerQueries[i]);
+    frameTimerActive = true;
+}
+
+void endFrameTimer() {
+    if (!frameTimerActive)
+        return;
+    glEndQuery(GL_TIME_ELAPSED);
+    frameTimerActive = false;
+    numFramesTimed++;
+}
+
+bool readFrameTimer(FrameTiming *timing) {
+    /*
+     * Queries finish in order, so the oldest unread one being unavailable means every later one is too.
+     */
+    bool read = false;
+    while (numFramesRead < numFramesTimed) {
+        size_t i = numFramesRead % FRAME_TIMER_QUERIES;
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(frameTimerQueries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available == GL_FALSE)
+            break;
+        GLuint64 elapsed;
+        glGetQueryObjectui64v(frameTimerQueries[i], GL_QUERY_RESULT, &elapsed);
+        *timing = {(double) elapsed / 1e6, frameTimerScales[i]};
+        numFramesRead++;
+        read = true;
+    }
+    return read;
+}
+
+glm::ivec2 updateDynamicResolution(DynamicResolution &resolution, bool cameraMoved, const FrameTiming *timing) {
+    if (DYNAMIC_RESOLUTION_TARGET_MS <= 0.0f) {
+        resolution.scale = 1.0f;
+    } else if (!cameraMoved) {
+        if (++resolution.staticFrames >= DYNAMIC_RESOLUTION_SETTLE_FRAMES)
+            resolution.scale = 1.0f;
+    } else {
+        resolution.staticFrames = 0;
+        if (timing != nullptr && timing->gpuMs > 0.0) {
+            /*
+             * Frame time grows with the number of pixels, the square of the scale. The timing is a few frames old
+             * and may have been measured at another scale, so predictions start from the scale it was measured at.
+             * Frames over the target drop straight to the largest step predicted to hold it, while frames under it
+             * only climb a step at a time, and only with some headroom left, so the scale does not flip between two
+             * steps whose frame times straddle the target.
+             */
+            auto target = (double) DYNAMIC_RESOLUTION_TARGET_MS;
+            if (timing->gpuMs > target) {
+                double holdingScale = timing->renderScale * std::sqrt(target / timing->gpuMs);
+                float steppedScale = (float) std::floor(holdingScale / DYNAMIC_RESOLUTION_SCALE_STEP) *
+                                     DYNAMIC_RESOLUTION_SCALE_STEP;
+                resolution.scale = std::min(resolution.scale, steppedScale);
+            } else {
+                float raisedScale = resolution.scale + DYNAMIC_RESOLUTION_SCALE_STEP;
+                double ratio = raisedScale / timing->renderScale;
+                if (timing->gpuMs * ratio * ratio <= DYNAMIC_RESOLUTION_HEADROOM * target)
+                    resolution.scale = raisedScale;
+            }
+            resolution.scale = std::clamp(resolution.scale, DYNAMIC_RESOLUTION_MIN_SCALE, 1.0f);
+        }
+    }
+    return {std::max(1, (int) std::lround(resolution.nativeWidth * resolution.scale)),
+            std::max(1, (int) std::lround(resolution.nativeHeight * resolution.scale))};
+}
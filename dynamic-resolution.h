@@ -0,0 +1,48 @@
+#ifndef OPENGL_RAYTRACER_DYNAMIC_RESOLUTION_H
+#define OPENGL_RAYTRACER_DYNAMIC_RESOLUTION_H
+
+#include <glm/glm.hpp>
+
+#include "constants.h"
+
+/*
+ * GPU time of one finished frame, and the scale of the native resolution it was rendered at
+ */
+struct FrameTiming {
+    double gpuMs;
+    float renderScale;
+};
+
+/*
+ * Times the GPU work between the two calls with a timer query, one frame at a time. Frames whose queries would
+ * outnumber FRAME_TIMER_QUERIES go untimed rather than waiting for the GPU.
+ */
+extern void beginFrameTimer(float renderScale);
+extern void endFrameTimer();
+
+/*
+ * Gets the latest frame that the GPU has finished since the last call, without waiting for it.
+ * Returns false when none has.
+ */
+extern bool readFrameTimer(FrameTiming* timing);
+
+/*
+ * Frame-time controller: while the camera moves, the render resolution follows the measured GPU time to hold
+ * DYNAMIC_RESOLUTION_TARGET_MS, and once the camera has stood still for DYNAMIC_RESOLUTION_SETTLE_FRAMES it returns
+ * to the native resolution, so that the accumulated frames converge at full quality.
+ */
+struct DynamicResolution {
+    int nativeWidth;
+    int nativeHeight;
+    // Fraction of the native width and height, a multiple of DYNAMIC_RESOLUTION_SCALE_STEP
+    float scale = 1.0f;
+    int staticFrames = 0;
+};
+
+/*
+ * Updates the scale for the next frame from whether the camera moved since the last one and the latest finished
+ * frame's timing, if any, and returns the resolution to render the next frame at.
+ */
+extern glm::ivec2 updateDynamicResolution(DynamicResolution& resolution, bool cameraMoved, const FrameTiming* timing);
+
+#endif //OPENGL_RAYTRACER_DYNAMIC_RESOLUTION_H
@@ -0,0 +1,97 @@
+#include "gpu-profiler.h"
+
+#ifdef PROFILING
+
+#include <glad/glad.h>
+
+#include <deque>
+#include <vector>
+#include <string>
+
+struct PendingGPUScope {
+    std::string path;
+    uint32_t frame;
+    // Timestamps of the scope's start and end
+    GLuint queries[2];
+    bool ended;
+};
+
+// Scopes issued and not yet read, oldest first, the numGPUScopesRead + 1th at the front
+static std::deque<PendingGPUScope> pendingGPUScopes;
+static uint64_t numGPUScopesIssued = 0, numGPUScopesRead = 0;
+static std::vector<GLuint> freeGPUQueries;
+// The GPU scopes that are open, joined by '/'
+static std::string gpuScopePath = "GPU";
+// Profile time minus GPU time
+static int64_t gpuClockOffsetNs = 0;
+static bool gpuClockCalibrated = false;
+
+static GLuint issueTimestamp() {
+    GLuint query;
+    if (freeGPUQueries.empty()) {
+        glGenQueries(1, &query);
+    } else {
+        query = freeGPUQueries.back();
+        freeGPUQueries.pop_back();
+    }
+    glQueryCounter(query, GL_TIMESTAMP);
+    return query;
+}
+
+GPUProfileScope::GPUProfileScope(const char *name) : parentPathLength(gpuScopePath.size()), id(UINT64_MAX) {
+    /*
+     * The GPU clock is tied to the profile's clock once, by reading both at once, which GL_TIMESTAMP's glGet
+     * does without waiting for the GPU.
+     */
+    gpuScopePath += '/';
+    gpuScopePath += name;
+    if (pendingGPUScopes.size() == GPU_PROFILE_MAX_SCOPES)
+        return;
+    if (!gpuClockCalibrated) {
+        GLint64 gpuTime;
+        glGetInteger64v(GL_TIMESTAMP, &gpuTime);
+        gpuClockOffsetNs = getProfileTimeNs() - gpuTime;
+        gpuClockCalibrated = true;
+    }
+    id = numGPUScopesIssued++;
+    pendingGPUScopes.push_back({gpuScopePath, getProfileFrame(), {issueTimestamp(), 0}, false});
+}
+
+GPUProfileScope::~GPUProfileScope() {
+    gpuScopePath.resize(parentPathLength);
+    if (id == UINT64_MAX)
+        return;
+    PendingGPUScope &scope = pendingGPUScopes[id - numGPUScopesRead];
+    scope.queries[1] = issueTimestamp();
+    scope.ended = true;
+}
+
+void readGPUProfileScopes() {
+    /*
+     * Queries finish in the order they were issued, so the first unfinished one means every later one is too.
+     * Its end timestamp is the later of the two, so checking it alone is enough.
+     */
+    while (!pendingGPUScopes.empty() && pendingGPUScopes.front().ended) {
+        PendingGPUScope &scope = pendingGPUScopes.front();
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(scope.queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available == GL_FALSE)
+            break;
+        GLuint64 times[2];
+        for (int i = 0; i < 2; i++) {
+            glGetQueryObjectui64v(scope.queries[i], GL_QUERY_RESULT, &times[i]);
+            freeGPUQueries.push_back(scope.queries[i]);
+        }
+        recordProfileEvent(scope.path, PROFILE_GPU_TRACK, (int64_t) times[0] + gpuClockOffsetNs,
+                           (int64_t) (times[1] - times[0]), scope.frame);
+        pendingGPUScopes.pop_front();
+        numGPUScopesRead++;
+    }
+}
+
+void finishGPUProfileScopes() {
+    glFinish();
+    readGPUProfileScopes();
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef OPENGL_RAYTRACER_GPU_PROFILER_H
+#define OPENGL_RAYTRACER_GPU_PROFILER_H
+
+#include "profiler.h"
+
+/*
+ * GPU passes timed into the profile of profiler.h, for builds with PROFILING defined.
+ *
+ * PROFILE_GPU_SCOPE("NAME") brackets the GL commands issued in the rest of the enclosing block with timestamp
+ * queries. PROFILE_GPU_FRAME(), called once a frame, reads them back only once the GPU has finished them,
+ * so timing never stalls the pipeline, while PROFILE_GPU_FINISH() waits for the rest before the profile is written.
+ * GPU scopes nest among themselves, under GPU/ in the summary, and count towards the frame they were issued in.
+ */
+
+#ifdef PROFILING
+
+#define PROFILE_GPU_SCOPE(name) GPUProfileScope PROFILE_CONCAT(gpuProfileScope, __LINE__)(name)
+#define PROFILE_GPU_FRAME() readGPUProfileScopes()
+#define PROFILE_GPU_FINISH() finishGPUProfileScopes()
+
+class GPUProfileScope {
+public:
+    explicit GPUProfileScope(const char* name);
+    ~GPUProfileScope();
+
+    GPUProfileScope(const GPUProfileScope&) = delete;
+    GPUProfileScope& operator=(const GPUProfileScope&) = delete;
+
+private:
+    size_t parentPathLength;
+    // Number of GPU scopes issued before this one, or UINT64_MAX if too many were waiting to be read to time it
+    uint64_t id;
+};
+
+/*
+ * Records every finished GPU scope, in the order they were issued, up to the first unfinished one
+ */
+extern void readGPUProfileScopes();
+
+/*
+ * Waits for the GPU to finish every scope and records them, before writing the profile
+ */
+extern void finishGPUProfileScopes();
+
+#else
+
+#define PROFILE_GPU_SCOPE(name) ((void) 0)
+#define PROFILE_GPU_FRAME() ((void) 0)
+#define PROFILE_GPU_FINISH() ((void) 0)
+
+#endif
+
+#endif //OPENGL_RAYTRACER_GPU_PROFILER_H
@@ -0,0 +1,132 @@
+#include "image-writer.h"
+#include "profiler.h"
+
+#include <fstream>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <array>
+
+static void writePFM(std::ofstream &fout, const std::vector<glm::vec4> &pixels, int width, int height) {
+    // Negative scale marks the data as little-endian, rows go from the bottom up like the image
+    fout << "PF\n" << width << " " << height << "\n-1.0\n";
+    std::vector<float> row(3 * width);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const glm::vec4 &pixel = pixels[y * width + x];
+            row[3 * x] = pixel.r;
+            row[3 * x + 1] = pixel.g;
+            row[3 * x + 2] = pixel.b;
+        }
+        fout.write(reinterpret_cast<const char *>(row.data()), (std::streamsize) (row.size() * sizeof(float)));
+    }
+}
+
+static void getRowBytes(const std::vector<glm::vec4> &pixels, int width, int y, uint8_t *row) {
+    for (int x = 0; x < width; x++) {
+        const glm::vec4 &pixel = pixels[y * width + x];
+        for (int c = 0; c < 3; c++)
+            row[3 * x + c] = (uint8_t) (std::clamp(pixel[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+}
+
+static void writePPM(std::ofstream &fout, const std::vector<glm::vec4> &pixels, int width, int height) {
+    fout << "P6\n" << width << " " << height << "\n255\n";
+    std::vector<uint8_t> row(3 * width);
+    for (int y = height - 1; y >= 0; y--) {
+        getRowBytes(pixels, width, y, row.data());
+        fout.write(reinterpret_cast<const char *>(row.data()), (std::streamsize) row.size());
+    }
+}
+
+static uint32_t getCRC32(const std::vector<uint8_t> &data) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> entries{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t entry = i;
+            for (int bit = 0; bit < 8; bit++)
+                entry = entry & 1 ? 0xEDB88320u ^ (entry >> 1) : entry >> 1;
+            entries[i] = entry;
+        }
+        return entries;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (uint8_t byte : data)
+        crc = table[(crc ^ byte) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static void appendBigEndian(std::vector<uint8_t> &bytes, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        bytes.push_back((uint8_t) (value >> shift));
+}
+
+static void writePNGChunk(std::ofstream &fout, const char *type, const std::vector<uint8_t> &data) {
+    // The CRC covers the type and the data but not the length
+    std::vector<uint8_t> chunk;
+    appendBigEndian(chunk, (uint32_t) data.size());
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    appendBigEndian(chunk, getCRC32(std::vector<uint8_t>(chunk.begin() + 4, chunk.end())));
+    fout.write(reinterpret_cast<const char *>(chunk.data()), (std::streamsize) chunk.size());
+}
+
+static void writePNG(std::ofstream &fout, const std::vector<glm::vec4> &pixels, int width, int height) {
+    /*
+     * The image data is a zlib stream of stored (uncompressed) deflate blocks, so no compressor is needed.
+     * Rows go from the top down, each starting with filter type 0, which leaves the row's bytes as they are.
+     */
+    const size_t rowSize = 1 + 3 * (size_t) width;
+    std::vector<uint8_t> rows(rowSize * height, 0);
+    for (int y = height - 1; y >= 0; y--)
+        getRowBytes(pixels, width, y, &rows[(height - 1 - y) * rowSize + 1]);
+    const size_t MAX_BLOCK_SIZE = 65535;
+    std::vector<uint8_t> data = {0x78, 0x01};
+    for (size_t start = 0; start < rows.size(); start += MAX_BLOCK_SIZE) {
+        auto size = (uint16_t) std::min(MAX_BLOCK_SIZE, rows.size() - start);
+        bool last = start + size == rows.size();
+        data.insert(data.end(), {(uint8_t) last, (uint8_t) size, (uint8_t) (size >> 8), (uint8_t) ~size,
+                                 (uint8_t) (~size >> 8)});
+        data.insert(data.end(), rows.begin() + (std::ptrdiff_t) start, rows.begin() + (std::ptrdiff_t) (start + size));
+    }
+    uint32_t adlerLow = 1, adlerHigh = 0;
+    for (uint8_t byte : rows) {
+        adlerLow = (adlerLow + byte) % 65521;
+        adlerHigh = (adlerHigh + adlerLow) % 65521;
+    }
+    appendBigEndian(data, adlerHigh << 16 | adlerLow);
+
+    const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    fout.write(reinterpret_cast<const char *>(signature), sizeof(signature));
+    // 8 bits per channel, colour type 2 (RGB), and the default compression, filtering and no interlacing
+    std::vector<uint8_t> header;
+    appendBigEndian(header, (uint32_t) width);
+    appendBigEndian(header, (uint32_t) height);
+    header.insert(header.end(), {8, 2, 0, 0, 0});
+    writePNGChunk(fout, "IHDR", header);
+    writePNGChunk(fout, "IDAT", data);
+    writePNGChunk(fout, "IEND", {});
+}
+
+void writeImage(const std::string &filePath, const std::vector<glm::vec4> &pixels, int width, int height) {
+    PROFILE_SCOPE("WRITE IMAGE");
+    std::ofstream fout(filePath, std::ios::binary);
+    if (!fout) throw std::runtime_error("Could not open file: " + filePath);
+    if (filePath.ends_with(".pfm"))
+        writePFM(fout, pixels, width, height);
+    else if (filePath.ends_with(".png"))
+        writePNG(fout, pixels, width, height);
+    else
+        writePPM(fout, pixels, width, height);
+}
+
+std::string getSequencePath(const std::string &filePath, int index) {
+    size_t extension = filePath.find_last_of('.');
+    size_t directory = filePath.find_last_of("/\\");
+    if (extension == std::string::npos || (directory != std::string::npos && extension < directory))
+        extension = filePath.size();
+    char number[16];
+    std::snprintf(number, sizeof(number), "-%04d", index);
+    return filePath.substr(0, extension) + number + filePath.substr(extension);
+}
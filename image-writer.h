@@ -0,0 +1,22 @@
+#ifndef OPENGL_RAYTRACER_IMAGE_WRITER_H
+#define OPENGL_RAYTRACER_IMAGE_WRITER_H
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+
+/*
+ * Images are stored row by row starting from the bottom row, as OpenGL textures are.
+ * The format is picked from the file extension: .pfm writes 32-bit floats, .png an uncompressed 8-bit PNG
+ * and anything else an 8-bit binary PPM, both of the colours clamped to [0, 1].
+ */
+extern void writeImage(const std::string& filePath, const std::vector<glm::vec4>& pixels, int width, int height);
+
+/*
+ * Path of one image of a numbered sequence, with the index inserted before the extension: render.pfm becomes
+ * render-0007.pfm.
+ */
+extern std::string getSequencePath(const std::string& filePath, int index);
+
+#endif //OPENGL_RAYTRACER_IMAGE_WRITER_H
@@ -3,11 +3,18 @@
 #include <glm/glm.hpp>
 
 #include <iostream>
+#include <map>
+#include <string>
 
 #include "util.h"
 #include "raytrace.h"
 #include "constants.h"
 #include "bvh.h"
+#include "camera.h"
+#include "dynamic-resolution.h"
+#include "batch-render.h"
+#include "profiler.h"
+#include "gpu-profiler.h"
 
 /*
  * Disclaimer: boilerplate to render two triangles on the screen
@@ -21,6 +28,8 @@ static double prevMouseX, prevMouseY;
 static int screenWidth, screenHeight;
 static GLFWwindow* window;
 static int renderMode = RENDER_MODE;
+static int pipeline = RAYTRACE_PIPELINE;
+static bool denoising = false;
 static bool clearAccumulatedFrames = false;
 
 void processInput(double &prevTime);
@@ -30,25 +39,12 @@ static void updateCameraRotation() {
     glfwGetCursorPos(window, &mouseX, &mouseY);
     double dx = mouseX - prevMouseX;
     double dy = mouseY - prevMouseY;
-    if (abs(dx) > 0.001f || abs(dy) > 0.001f) {
-        clearAccumulatedFrames = true;
-    }
     cameraPitch -= dy * std::numbers::pi / screenHeight;
     cameraYaw -= dx * std::numbers::pi / screenWidth;
     cameraPitch = std::max(-std::numbers::pi / 2.0f, std::min(std::numbers::pi / 2.0f, cameraPitch));
     prevMouseX = mouseX;
     prevMouseY = mouseY;
-    glm::mat3 xRotation = glm::mat3(
-            1.0f, 0.0f, 0.0f,
-            0.0f, cos(cameraPitch), -sin(cameraPitch),
-            0.0f, sin(cameraPitch), cos(cameraPitch)
-    );
-    glm::mat3 yRotation = glm::mat3(
-            cos(cameraYaw), 0.0f, sin(cameraYaw),
-            0.0f, 1.0f, 0.0f,
-            -sin(cameraYaw), 0.0f, cos(cameraYaw)
-    );
-    cameraRotation = yRotation * xRotation;
+    cameraRotation = getCameraRotation(cameraPitch, cameraYaw);
 }
 
 static std::pair<int, std::pair<int, int>> configScreenSpaceQuad() {
@@ -83,11 +79,11 @@ static std::pair<int, std::pair<int, int>> configScreenSpaceQuad() {
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-static GLuint generateScreenSpaceTexture() {
+static GLuint generateScreenSpaceTexture(GLenum format = GL_RGBA32F) {
     GLuint tex;
     glGenTextures(1, &tex);
     glBindTexture(GL_TEXTURE_2D, tex);
-    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F,
+    glTexStorage2D(GL_TEXTURE_2D, 1, format,
                    screenWidth, screenHeight);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -104,17 +100,74 @@ static void deleteGLEntities(std::pair<GLuint, std::pair<GLuint, GLuint>> vertex
     glfwTerminate();
 }
 
-int main() {
+static int renderBatch(const Scene *scene, std::map<std::string, std::string> &args) {
+    /*
+     * Renders offscreen, in a hidden window that only provides the GL context
+     */
+    auto getArg = [&args](const std::string &key, const std::string &defaultValue) {
+        return args.contains(key) ? args[key] : defaultValue;
+    };
+    BatchRenderSettings settings;
+    settings.width = std::stoi(getArg("width", std::to_string(settings.width)));
+    settings.height = std::stoi(getArg("height", std::to_string(settings.height)));
+    if (args.contains("pipeline")) {
+        settings.pipeline = args["pipeline"] == "wavefront" ? RAYTRACE_PIPELINE_WAVEFRONT
+                                                            : RAYTRACE_PIPELINE_MEGAKERNEL;
+    }
+    settings.denoise = getArg("denoise", "0") != "0";
+    std::vector<CameraView> views = readCameraPath(args["views"]);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    window = glfwCreateWindow(settings.width, settings.height, "opengl raytracer", nullptr, nullptr);
+    if (window == nullptr) {
+        std::cout << "Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return -1;
+    }
+    glfwMakeContextCurrent(window);
+    if (!gladLoadGLLoader((GLADloadproc) glfwGetProcAddress)) {
+        std::cout << "Failed to initialize GLAD" << std::endl;
+        return -1;
+    }
+    double startTime = glfwGetTime();
+    GLuint raytraceProgram = raytraceInit(scene, settings.width, settings.height);
+    std::cout << "Raytracer initialised in " << glfwGetTime() - startTime << " seconds" << std::endl;
+    renderCameraPathGPU(views, getArg("output", "render.png"), settings);
+    PROFILE_GPU_FINISH();
+    PROFILE_WRITE(PROFILE_TRACE_PATH);
+    glDeleteProgram(raytraceProgram);
+    glfwTerminate();
+    return 0;
+}
+
+/*
+ * Run from the build directory as opengl_raytracer [--scene SCENE_FILE_PATH] to explore the scene fullscreen, or as
+ * opengl_raytracer --views VIEWS_FILE [--scene SCENE_FILE_PATH] [--width 1280] [--height 720]
+ *                  [--pipeline megakernel|wavefront] [--denoise 0] [--output render.png]
+ * to render every view of a camera path file (see readCameraPath) into a numbered sequence of images
+ * (render-0000.png and so on) without showing a window, loading the scene and building its BVH once for all of them.
+ */
+int main(int argc, char **argv) {
     std::ios_base::sync_with_stdio(false);
     std::cin.tie(nullptr);
     std::cout.tie(nullptr);
-    SceneData* sceneData = loadScene();
+    std::map<std::string, std::string> args;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string key = argv[i];
+        if (!key.starts_with("--")) {
+            std::cout << "Unexpected argument: " << key << std::endl;
+            return 1;
+        }
+        args[key.substr(2)] = argv[i + 1];
+    }
+    Scene* scene = loadScene(args.contains("scene") ? args["scene"] : SCENE_FILE_PATH);
     // glfw: initialize and configure
     // ------------------------------
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    if (args.contains("views"))
+        return renderBatch(scene, args);
     // glfw window creation
     // --------------------
     GLFWmonitor *monitor = glfwGetPrimaryMonitor();
@@ -163,10 +216,20 @@ int main() {
     glUseProgram(drawProgram);
     GLuint currentFrame = generateScreenSpaceTexture();
     GLuint prevFrame = generateScreenSpaceTexture();
+    // Primary hit distances, which camera motion reprojects the accumulated frame with
+    GLuint currentDepth = generateScreenSpaceTexture(GL_R32F);
+    GLuint prevDepth = generateScreenSpaceTexture(GL_R32F);
+    // Second moments of the accumulated colours, which adaptive sampling estimates each pixel's noise from
+    GLuint currentMoments = generateScreenSpaceTexture();
+    GLuint prevMoments = generateScreenSpaceTexture();
+    // Normals and albedos of the primary hits, which guide the denoiser, and the denoised frame that is displayed
+    GLuint guide = generateScreenSpaceTexture();
+    GLuint denoisedFrame = generateScreenSpaceTexture();
     glUniform1i(glGetUniformLocation(drawProgram, "outputTexture"), 0);
+    DynamicResolution resolution{screenWidth, screenHeight};
 
     double startTime = glfwGetTime();
-    GLuint raytraceProgram = raytraceInit(sceneData, screenWidth, screenHeight);
+    GLuint raytraceProgram = raytraceInit(scene, screenWidth, screenHeight);
     std::cout << "Raytracer initialised in " << glfwGetTime() - startTime << " seconds" << std::endl;
     glUseProgram(raytraceProgram);
     checkGLError("(main) after raytraceInit()");
@@ -178,30 +241,107 @@ int main() {
     std::cout << "BEGAN RENDER LOOP" << std::endl;
     glUseProgram(drawProgram);
     glfwGetCursorPos(window, &prevMouseX, &prevMouseY);
-    const int num_groups_x = (screenWidth + RAYTRACE_WORKGROUP_SIZE - 1) / RAYTRACE_WORKGROUP_SIZE;
-    const int num_groups_y = (screenHeight + RAYTRACE_WORKGROUP_SIZE - 1) / RAYTRACE_WORKGROUP_SIZE;
+    glm::vec3 prevCameraPos = cameraPos;
+    glm::mat3 prevCameraRotation = cameraRotation;
+    FrameTiming lastTiming{0.0, 1.0f};
     while (!glfwWindowShouldClose(window)) {
+        PROFILE_SCOPE("FRAME");
         clearAccumulatedFrames = false;
         processInput(prevTime);
         updateCameraRotation();
         if (clearAccumulatedFrames)
             frameCount = 0;
+        /*
+         * The whole frame is timed, from the raytracer to the blit, and the resolution follows the latest frame
+         * the GPU has finished. Changing it needs no reset, as the raytracer reprojects across the change.
+         */
+        bool cameraMoved = cameraPos != prevCameraPos || cameraRotation != prevCameraRotation;
+        prevCameraPos = cameraPos;
+        prevCameraRotation = cameraRotation;
+        FrameTiming timing{};
+        bool timed = readFrameTimer(&timing);
+        if (timed)
+            lastTiming = timing;
+        glm::ivec2 renderSize = updateDynamicResolution(resolution, cameraMoved, timed ? &timing : nullptr);
+        setRenderResolution(renderSize.x, renderSize.y);
+        const int num_groups_x = (renderSize.x + RAYTRACE_WORKGROUP_SIZE - 1) / RAYTRACE_WORKGROUP_SIZE;
+        const int num_groups_y = (renderSize.y + RAYTRACE_WORKGROUP_SIZE - 1) / RAYTRACE_WORKGROUP_SIZE;
+        beginFrameTimer(resolution.scale);
         glBindImageTexture(CURR_FRAME_BINDING, currentFrame, 0, GL_FALSE,
                            0, GL_WRITE_ONLY, GL_RGBA32F);
         glBindImageTexture(PREV_FRAME_BINDING, prevFrame, 0, GL_FALSE,
                            0, GL_READ_ONLY, GL_RGBA32F);
-        raytrace(cameraPos, cameraRotation, renderMode, frameCount, num_groups_x, num_groups_y);
-        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-        glBindTexture(GL_TEXTURE_2D, currentFrame);
-        glUseProgram(drawProgram);
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, nullptr);
-        glfwSwapBuffers(window);
+        glBindImageTexture(CURR_DEPTH_BINDING, currentDepth, 0, GL_FALSE,
+                           0, GL_READ_WRITE, GL_R32F);
+        glBindImageTexture(PREV_DEPTH_BINDING, prevDepth, 0, GL_FALSE,
+                           0, GL_READ_ONLY, GL_R32F);
+        glBindImageTexture(CURR_MOMENTS_BINDING, currentMoments, 0, GL_FALSE,
+                           0, GL_WRITE_ONLY, GL_RGBA32F);
+        glBindImageTexture(PREV_MOMENTS_BINDING, prevMoments, 0, GL_FALSE,
+                           0, GL_READ_ONLY, GL_RGBA32F);
+        glBindImageTexture(GUIDE_BINDING, guide, 0, GL_FALSE,
+                           0, GL_WRITE_ONLY, GL_RGBA32F);
+        // The test modes' counters are displayed as they are
+        bool denoiseFrame = denoising && renderMode == RENDER_MODE;
+        if (totalFrames % RAYTRACE_TIMING_INTERVAL == 0) {
+            RaytraceTimings timings;
+            raytrace(cameraPos, cameraRotation, renderMode, frameCount, num_groups_x, num_groups_y, pipeline,
+                     &timings);
+            if (denoiseFrame) {
+                glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+                denoise(currentFrame, currentDepth, guide, currentMoments, denoisedFrame, num_groups_x, num_groups_y,
+                        &timings);
+                std::cout << "DENOISE: " << timings.denoiseMs << " ms" << std::endl;
+            }
+            if (pipeline == RAYTRACE_PIPELINE_WAVEFRONT) {
+                std::cout << "WAVEFRONT: " << timings.totalMs << " ms (RASTER " << timings.rasterMs
+                          << " ms, GENERATE " << timings.generateMs
+                          << " ms, EXTEND " << timings.extendMs << " ms, SHADE " << timings.shadeMs
+                          << " ms, COMPACT " << timings.compactMs << " ms, RESOLVE " << timings.resolveMs
+                          << " ms, " << timings.numBounces << " BOUNCES)" << std::endl;
+            } else {
+                std::cout << "MEGAKERNEL: " << timings.totalMs << " ms";
+                if (timings.rasterMs > 0.0)
+                    std::cout << " (RASTER " << timings.rasterMs << " ms)";
+                if (timings.classifyMs > 0.0)
+                    std::cout << " (ADAPTIVE CLASSIFY " << timings.classifyMs << " ms)";
+                std::cout << std::endl;
+            }
+            std::cout << "RESOLUTION: " << renderSize.x << "x" << renderSize.y << " (LAST FRAME " << lastTiming.gpuMs
+                      << " ms AT " << lastTiming.renderScale << "x)" << std::endl;
+        } else {
+            raytrace(cameraPos, cameraRotation, renderMode, frameCount, num_groups_x, num_groups_y, pipeline);
+            if (denoiseFrame) {
+                glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+                denoise(currentFrame, currentDepth, guide, currentMoments, denoisedFrame, num_groups_x, num_groups_y);
+            }
+        }
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+        {
+            PROFILE_SCOPE("BLIT");
+            PROFILE_GPU_SCOPE("BLIT");
+            glBindTexture(GL_TEXTURE_2D, denoiseFrame ? denoisedFrame : currentFrame);
+            glUseProgram(drawProgram);
+            glUniform2i(glGetUniformLocation(drawProgram, "u_RenderSize"), renderSize.x, renderSize.y);
+            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, nullptr);
+        }
+        endFrameTimer();
+        {
+            PROFILE_SCOPE("SWAP BUFFERS");
+            glfwSwapBuffers(window);
+        }
         std::swap(currentFrame, prevFrame);
+        std::swap(currentDepth, prevDepth);
+        std::swap(currentMoments, prevMoments);
         glfwPollEvents();
         frameCount++;
         totalFrames++;
+        PROFILE_GPU_FRAME();
+        PROFILE_FRAME();
     }
     std::cout << "Average FPS: " << totalFrames / (glfwGetTime() - startTime) << "\n";
+    PROFILE_GPU_FINISH();
+    PROFILE_WRITE(PROFILE_TRACE_PATH);
     deleteGLEntities(vertexArrayAndBuffers, {drawProgram, raytraceProgram});
     return 0;
 }
@@ -214,19 +354,15 @@ void processInput(double& prevTime) {
         glfwSetWindowShouldClose(window, true);
     }
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
-        clearAccumulatedFrames = true;
         cameraPos += cameraRotation * glm::vec3(0.0f, 0.0f, CAMERA_MOVE_SPEED * deltaTime);
     }
     if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) {
-        clearAccumulatedFrames = true;
         cameraPos += cameraRotation * glm::vec3(0.0f, 0.0f, -CAMERA_MOVE_SPEED * deltaTime);
     }
     if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) {
-        clearAccumulatedFrames = true;
         cameraPos += cameraRotation * glm::vec3(-CAMERA_MOVE_SPEED * deltaTime, 0.0f, 0.0f);
     }
     if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) {
-        clearAccumulatedFrames = true;
         cameraPos += cameraRotation * glm::vec3(CAMERA_MOVE_SPEED * deltaTime, 0.0f, 0.0f);
     }
     if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS) {
@@ -245,4 +381,19 @@ void processInput(double& prevTime) {
         clearAccumulatedFrames = true;
         renderMode = REFLECTIONS_TEST_MODE;
     }
+    if (glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS) {
+        clearAccumulatedFrames = true;
+        pipeline = RAYTRACE_PIPELINE_MEGAKERNEL;
+    }
+    if (glfwGetKey(window, GLFW_KEY_N) == GLFW_PRESS) {
+        clearAccumulatedFrames = true;
+        pipeline = RAYTRACE_PIPELINE_WAVEFRONT;
+    }
+    // The denoiser only changes what is displayed, so the accumulated frames are kept
+    if (glfwGetKey(window, GLFW_KEY_F) == GLFW_PRESS) {
+        denoising = true;
+    }
+    if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS) {
+        denoising = false;
+    }
 }
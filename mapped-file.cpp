@@ -0,0 +1,86 @@
+#include "mapped-file.h"
+
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string &filePath) {
+    fileHandle = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                             FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+        fileHandle = nullptr;
+        throw std::runtime_error("Could not open file: " + filePath);
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(fileHandle, &fileSize)) {
+        CloseHandle(fileHandle);
+        throw std::runtime_error("Could not read the size of file: " + filePath);
+    }
+    size = (size_t) fileSize.QuadPart;
+    // Empty files cannot be mapped, they are left as a null view of size 0
+    if (size == 0)
+        return;
+    mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mappingHandle != nullptr)
+        data = (const char *) MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    if (data == nullptr) {
+        if (mappingHandle != nullptr)
+            CloseHandle(mappingHandle);
+        CloseHandle(fileHandle);
+        throw std::runtime_error("Could not map file: " + filePath);
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (data != nullptr)
+        UnmapViewOfFile(data);
+    if (mappingHandle != nullptr)
+        CloseHandle(mappingHandle);
+    if (fileHandle != nullptr)
+        CloseHandle(fileHandle);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string &filePath) {
+    int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Could not open file: " + filePath);
+    struct stat fileStat{};
+    if (fstat(fd, &fileStat) != 0) {
+        close(fd);
+        throw std::runtime_error("Could not read the size of file: " + filePath);
+    }
+    size = (size_t) fileStat.st_size;
+    // Empty files cannot be mapped, they are left as a null view of size 0
+    if (size > 0) {
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Could not map file: " + filePath);
+        }
+        // The file is read front to back by each parser thread
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        data = (const char *) mapping;
+    }
+    // The mapping keeps its own reference to the file
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data != nullptr)
+        munmap((void *) data, size);
+}
+
+#endif
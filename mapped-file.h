@@ -0,0 +1,31 @@
+#ifndef OPENGL_RAYTRACER_MAPPED_FILE_H
+#define OPENGL_RAYTRACER_MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+
+/*
+ * Read-only memory mapping of a whole file, unmapped on destruction.
+ * Pages are loaded by the OS on first access, so threads can read different parts of the file in parallel.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &filePath);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *getData() const { return data; }
+    size_t getSize() const { return size; }
+
+private:
+    const char *data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    void *fileHandle = nullptr;
+    void *mappingHandle = nullptr;
+#endif
+};
+
+#endif //OPENGL_RAYTRACER_MAPPED_FILE_H
@@ -0,0 +1,144 @@
+#include "mesh-geometry.h"
+
+#include <algorithm>
+#include <cmath>
+#include <span>
+#include <limits>
+
+#include "bvh.h"
+
+// Largest grid offset that the vertices of a block are quantized to, a little under 2^16 - 1 to leave room for rounding
+static const double MAX_QUANTIZED_OFFSET = 65532.0;
+
+template<typename T>
+static std::span<T> getWritable(std::span<const T> section) {
+    /*
+     * The sections are only written while they view a buffer that serializeMesh allocated, never a mapped cache.
+     */
+    return {const_cast<T *>(section.data()), section.size()};
+}
+
+static void writeVertexTriangles(TaskPool &pool, MeshData &mesh, const std::vector<glm::vec3> &vertices,
+                                 const std::vector<glm::uvec3> &triangles) {
+    /*
+     * SOUP and EDGES: the first vertex, then either the other two vertices or the edges to them, and the normal.
+     */
+    std::span<glm::vec4> triv0 = getWritable(mesh.triv0);
+    std::span<glm::vec4> triv1 = getWritable(mesh.triv1);
+    std::span<glm::vec4> triv2 = getWritable(mesh.triv2);
+    std::span<glm::vec4> normals = getWritable(mesh.triangleNormals);
+    const bool edges = mesh.geometryLayout == GEOMETRY_LAYOUT_EDGES;
+    parallelForChunks(pool, 0, (int) triangles.size(), BVH_PARALLEL_CHUNK_SIZE, [&](int, int chunkStart,
+                                                                                   int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++) {
+            glm::vec3 a = vertices[triangles[i].x];
+            glm::vec3 b = vertices[triangles[i].y];
+            glm::vec3 c = vertices[triangles[i].z];
+            triv0[i] = glm::vec4(a, 0.0f);
+            triv1[i] = glm::vec4(edges ? b - a : b, 0.0f);
+            triv2[i] = glm::vec4(edges ? c - a : c, 0.0f);
+            normals[i] = glm::vec4(normalize(cross(a - b, a - c)), 0.0f);
+        }
+    });
+}
+
+static void writeQuantizedTriangles(TaskPool &pool, MeshData &mesh, const std::vector<glm::vec3> &vertices,
+                                    const std::vector<glm::uvec3> &triangles) {
+    /*
+     * Picks the finest grid step that fits every block's vertices within 16 bit offsets of the block's origin,
+     * then stores each vertex as the grid point nearest it. Grid points are counted from the mesh's min corner,
+     * so a vertex maps to the same point, and decodes to the same position, in every block that uses it,
+     * which keeps the quantized mesh watertight. The step is also kept large enough for every grid point to fit
+     * in 32 bits, which only coarsens meshes over 2^15 times larger than their largest block.
+     */
+    std::span<QuantizedTriangle> quantizedTriangles = getWritable(mesh.quantizedTriangles);
+    std::span<QuantizationBlock> blocks = getWritable(mesh.quantizationBlocks);
+    const int numTriangles = (int) triangles.size();
+    const int numBlocks = (int) blocks.size();
+    glm::vec3 meshMin = MAX_VERTEX, meshMax = MIN_VERTEX;
+    for (const glm::vec3 &vertex : vertices) {
+        meshMin = min(meshMin, vertex);
+        meshMax = max(meshMax, vertex);
+    }
+    std::vector<float> blockSpans(numBlocks);
+    parallelForChunks(pool, 0, numBlocks, BVH_PARALLEL_CHUNK_SIZE / QUANTIZATION_BLOCK_SIZE,
+                      [&](int, int chunkStart, int chunkEnd) {
+        for (int block = chunkStart; block < chunkEnd; block++) {
+            glm::vec3 blockMin = MAX_VERTEX, blockMax = MIN_VERTEX;
+            int end = std::min(numTriangles, (block + 1) * QUANTIZATION_BLOCK_SIZE);
+            for (int i = block * QUANTIZATION_BLOCK_SIZE; i < end; i++) {
+                for (int corner = 0; corner < 3; corner++) {
+                    blockMin = min(blockMin, vertices[triangles[i][corner]]);
+                    blockMax = max(blockMax, vertices[triangles[i][corner]]);
+                }
+            }
+            glm::vec3 span = blockMax - blockMin;
+            blockSpans[block] = std::max(std::max(span.x, span.y), span.z);
+        }
+    });
+    glm::vec3 meshSpan = meshMax - meshMin;
+    double maxBlockSpan = numBlocks == 0 ? 0.0 : *std::max_element(blockSpans.begin(), blockSpans.end());
+    double maxMeshSpan = std::max(std::max(meshSpan.x, meshSpan.y), meshSpan.z);
+    auto step = (float) std::max(maxBlockSpan / MAX_QUANTIZED_OFFSET, maxMeshSpan / (double) (1u << 31));
+    if (!(step > 0.0f))
+        step = 1.0f;
+
+    parallelForChunks(pool, 0, numBlocks, BVH_PARALLEL_CHUNK_SIZE / QUANTIZATION_BLOCK_SIZE,
+                      [&](int, int chunkStart, int chunkEnd) {
+        glm::uvec3 gridPoints[3 * QUANTIZATION_BLOCK_SIZE];
+        for (int block = chunkStart; block < chunkEnd; block++) {
+            int first = block * QUANTIZATION_BLOCK_SIZE;
+            int count = std::min(numTriangles - first, QUANTIZATION_BLOCK_SIZE);
+            glm::uvec3 gridOrigin(std::numeric_limits<uint32_t>::max());
+            for (int i = 0; i < 3 * count; i++) {
+                glm::dvec3 offset = glm::dvec3(vertices[triangles[first + i / 3][i % 3]] - meshMin) / (double) step;
+                gridPoints[i] = glm::uvec3(glm::round(offset));
+                gridOrigin = min(gridOrigin, gridPoints[i]);
+            }
+            blocks[block] = {meshMin, step, gridOrigin, 0};
+            for (int i = 0; i < count; i++) {
+                QuantizedTriangle &triangle = quantizedTriangles[first + i];
+                for (int j = 0; j < 9; j++)
+                    triangle.coords[j] = (uint16_t) (gridPoints[3 * i + j / 3][j % 3] - gridOrigin[j % 3]);
+                triangle.padding = 0;
+            }
+        }
+    });
+}
+
+void writeMeshGeometry(TaskPool &pool, MeshData &mesh, const std::vector<glm::vec3> &vertices,
+                       const std::vector<glm::uvec3> &triangles) {
+    switch (mesh.geometryLayout) {
+        case GEOMETRY_LAYOUT_INDEXED:
+            std::ranges::copy(vertices, getWritable(mesh.vertices).begin());
+            std::ranges::copy(triangles, getWritable(mesh.vertexIndices).begin());
+            break;
+        case GEOMETRY_LAYOUT_QUANTIZED:
+            writeQuantizedTriangles(pool, mesh, vertices, triangles);
+            break;
+        default:
+            writeVertexTriangles(pool, mesh, vertices, triangles);
+    }
+}
+
+size_t getGeometryBytes(const MeshData &mesh) {
+    return mesh.triv0.size_bytes() + mesh.triv1.size_bytes() + mesh.triv2.size_bytes() +
+           mesh.triangleNormals.size_bytes() + mesh.triangleColours.size_bytes() + mesh.vertices.size_bytes() +
+           mesh.vertexIndices.size_bytes() + mesh.quantizedTriangles.size_bytes() +
+           mesh.quantizationBlocks.size_bytes() + mesh.packedColours.size_bytes();
+}
+
+const char *getGeometryLayoutName(int geometryLayout) {
+    switch (geometryLayout) {
+        case GEOMETRY_LAYOUT_SOUP:
+            return "SOUP";
+        case GEOMETRY_LAYOUT_EDGES:
+            return "EDGES";
+        case GEOMETRY_LAYOUT_INDEXED:
+            return "INDEXED";
+        case GEOMETRY_LAYOUT_QUANTIZED:
+            return "QUANTIZED";
+        default:
+            return "UNKNOWN";
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef OPENGL_RAYTRACER_MESH_GEOMETRY_H
+#define OPENGL_RAYTRACER_MESH_GEOMETRY_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include <vector>
+#include <type_traits>
+#include <cstddef>
+
+#include "constants.h"
+#include "scene.h"
+#include "task-pool.h"
+
+/*
+ * A triangle as the intersection test takes it: its first vertex and its edges to the other two
+ */
+struct TriangleEdges {
+    glm::vec3 v0, edge1, edge2;
+};
+
+/*
+ * Writes the triangles into the geometry sections of the mesh's layout, which must already be sized for them.
+ * The colours are left untouched, since they never change once the mesh is serialized.
+ */
+extern void writeMeshGeometry(TaskPool& pool, MeshData& mesh, const std::vector<glm::vec3>& vertices,
+                              const std::vector<glm::uvec3>& triangles);
+
+/*
+ * Bytes of the mesh's geometry sections, normals and colours included, leaving out the BVHs and the triangle index list
+ */
+extern size_t getGeometryBytes(const MeshData& mesh);
+
+extern const char* getGeometryLayoutName(int geometryLayout);
+
+/*
+ * The decoders below are inline, since the CPU raytracer calls them for every triangle it tests.
+ * They decode the same way as geometry-common.glsl.
+ */
+
+inline glm::vec3 getQuantizedVertex(const MeshData& mesh, int triangleIndex, int corner) {
+    const QuantizedTriangle& triangle = mesh.quantizedTriangles[triangleIndex];
+    const QuantizationBlock& block = mesh.quantizationBlocks[triangleIndex / QUANTIZATION_BLOCK_SIZE];
+    glm::uvec3 coords(triangle.coords[3 * corner], triangle.coords[3 * corner + 1], triangle.coords[3 * corner + 2]);
+    return block.meshMin + block.step * glm::vec3(block.gridOrigin + coords);
+}
+
+template<int GeometryLayout>
+inline TriangleEdges getTriangleEdges(const MeshData& mesh, int triangleIndex) {
+    if constexpr (GeometryLayout == GEOMETRY_LAYOUT_EDGES) {
+        return {mesh.triv0[triangleIndex], mesh.triv1[triangleIndex], mesh.triv2[triangleIndex]};
+    } else if constexpr (GeometryLayout == GEOMETRY_LAYOUT_INDEXED) {
+        glm::uvec3 triangle = mesh.vertexIndices[triangleIndex];
+        glm::vec3 a = mesh.vertices[triangle.x];
+        return {a, mesh.vertices[triangle.y] - a, mesh.vertices[triangle.z] - a};
+    } else if constexpr (GeometryLayout == GEOMETRY_LAYOUT_QUANTIZED) {
+        glm::vec3 a = getQuantizedVertex(mesh, triangleIndex, 0);
+        return {a, getQuantizedVertex(mesh, triangleIndex, 1) - a, getQuantizedVertex(mesh, triangleIndex, 2) - a};
+    } else {
+        glm::vec3 a = mesh.triv0[triangleIndex];
+        return {a, glm::vec3(mesh.triv1[triangleIndex]) - a, glm::vec3(mesh.triv2[triangleIndex]) - a};
+    }
+}
+
+/*
+ * Calls fn with the mesh's geometry layout as a template argument, for loops that decode many of its triangles
+ */
+template<typename Fn>
+inline void dispatchGeometryLayout(const MeshData& mesh, Fn fn) {
+    switch (mesh.geometryLayout) {
+        case GEOMETRY_LAYOUT_EDGES:
+            return fn(std::integral_constant<int, GEOMETRY_LAYOUT_EDGES>());
+        case GEOMETRY_LAYOUT_INDEXED:
+            return fn(std::integral_constant<int, GEOMETRY_LAYOUT_INDEXED>());
+        case GEOMETRY_LAYOUT_QUANTIZED:
+            return fn(std::integral_constant<int, GEOMETRY_LAYOUT_QUANTIZED>());
+        default:
+            return fn(std::integral_constant<int, GEOMETRY_LAYOUT_SOUP>());
+    }
+}
+
+inline TriangleEdges getTriangleEdges(const MeshData& mesh, int triangleIndex) {
+    TriangleEdges triangle;
+    dispatchGeometryLayout(mesh, [&](auto layout) {
+        triangle = getTriangleEdges<layout.value>(mesh, triangleIndex);
+    });
+    return triangle;
+}
+
+/*
+ * Unit normal of the triangle, which the layouts without stored normals take from its edges
+ */
+inline glm::vec3 getTriangleNormal(const MeshData& mesh, int triangleIndex) {
+    if (!mesh.triangleNormals.empty())
+        return mesh.triangleNormals[triangleIndex];
+    TriangleEdges triangle = getTriangleEdges(mesh, triangleIndex);
+    return normalize(cross(triangle.edge1, triangle.edge2));
+}
+
+inline glm::vec3 getTriangleColour(const MeshData& mesh, int triangleIndex) {
+    if (!mesh.triangleColours.empty())
+        return mesh.triangleColours[triangleIndex];
+    return glm::unpackUnorm4x8(mesh.packedColours[triangleIndex]);
+}
+
+#endif //OPENGL_RAYTRACER_MESH_GEOMETRY_H
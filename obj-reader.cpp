@@ -1,40 +1,189 @@
 #include "obj-reader.h"
-#include "glad/glad.h"
+#include "mapped-file.h"
+#include "task-pool.h"
+#include "profiler.h"
 
-#include <iostream>
-#include <fstream>
-#include <sstream>
-#include <regex>
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
 
-#define VERTEX_TYPE "v"
-#define FACE_TYPE "f"
-#define COMMENT_TYPE "#"
+/*
+ * Negative face indices are relative to the vertices read so far, which a chunk only knows once every
+ * earlier chunk has been parsed. Until then they are stored as a 31-bit signed offset from the chunk's
+ * first vertex, marked with this bit.
+ */
+#define OBJ_RELATIVE_INDEX_BIT 0x80000000u
 
-ObjContents *readObjContents(const std::string &filePath) {
-    std::ifstream fin(filePath);
-    if (!fin) throw std::runtime_error("Could not open file: " + filePath);
+struct ObjChunk {
+    std::vector<glm::vec3> vertices;
+    std::vector<glm::uvec3> triangles;
+    bool hasError = false;
+};
+
+static bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char *skipBlanks(const char *p, const char *lineEnd) {
+    while (p < lineEnd && isBlank(*p))
+        p++;
+    return p;
+}
+
+static bool parseFloat(const char *&p, const char *lineEnd, float &value) {
+    p = skipBlanks(p, lineEnd);
+    // from_chars does not accept an explicit plus sign
+    if (p < lineEnd && *p == '+')
+        p++;
+    auto [end, error] = std::from_chars(p, lineEnd, value);
+    if (error != std::errc())
+        return false;
+    p = end;
+    return true;
+}
+
+static bool parseFaceVertex(const char *&p, const char *lineEnd, uint32_t numChunkVertices, uint32_t &index) {
+    /*
+     * Reads the vertex index of one v, v/vt, v//vn or v/vt/vn token and skips the rest of the token.
+     */
+    p = skipBlanks(p, lineEnd);
+    int64_t value;
+    auto [end, error] = std::from_chars(p, lineEnd, value);
+    if (error != std::errc())
+        return false;
+    p = end;
+    while (p < lineEnd && !isBlank(*p))
+        p++;
+    if (value > 0 && value <= OBJ_RELATIVE_INDEX_BIT) {
+        index = (uint32_t) (value - 1);
+    } else if (value < 0 && value >= -(int64_t) (OBJ_RELATIVE_INDEX_BIT >> 1)) {
+        auto offset = (int32_t) ((int64_t) numChunkVertices + value);
+        index = ((uint32_t) offset & ~OBJ_RELATIVE_INDEX_BIT) | OBJ_RELATIVE_INDEX_BIT;
+    } else {
+        // 0 is not a valid OBJ index
+        return false;
+    }
+    return true;
+}
+
+static void parseFace(const char *p, const char *lineEnd, ObjChunk &chunk) {
+    // Fan triangulates the face around its first vertex
+    auto numChunkVertices = (uint32_t) chunk.vertices.size();
+    uint32_t first = 0, previous = 0, current = 0;
+    int numFaceVertices = 0;
+    while (skipBlanks(p, lineEnd) < lineEnd) {
+        if (!parseFaceVertex(p, lineEnd, numChunkVertices, current)) {
+            chunk.hasError = true;
+            return;
+        }
+        if (numFaceVertices == 0)
+            first = current;
+        else if (numFaceVertices >= 2)
+            chunk.triangles.emplace_back(first, previous, current);
+        previous = current;
+        numFaceVertices++;
+    }
+}
+
+static void parseChunk(const char *p, const char *end, ObjChunk &chunk) {
+    while (p < end) {
+        auto *newline = (const char *) std::memchr(p, '\n', end - p);
+        const char *lineEnd = newline == nullptr ? end : newline;
+        p = skipBlanks(p, lineEnd);
+        // A single character followed by a blank, which excludes vt, vn, vp and other statements
+        if (lineEnd - p >= 2 && isBlank(p[1])) {
+            if (p[0] == 'v') {
+                const char *q = p + 2;
+                glm::vec3 vertex;
+                // Dropping a vertex would shift the index of every later one, so the file is rejected instead
+                if (parseFloat(q, lineEnd, vertex.x) && parseFloat(q, lineEnd, vertex.y) &&
+                    parseFloat(q, lineEnd, vertex.z))
+                    chunk.vertices.push_back(vertex);
+                else
+                    chunk.hasError = true;
+            } else if (p[0] == 'f') {
+                parseFace(p + 2, lineEnd, chunk);
+            }
+        }
+        p = lineEnd + 1;
+    }
+}
+
+static std::vector<size_t> getChunkBoundaries(const char *data, size_t size, size_t numChunks) {
+    /*
+     * Splits the file into roughly equal chunks, moving every boundary to the start of the next line.
+     * Chunks may be empty if a line is longer than a chunk.
+     */
+    std::vector<size_t> boundaries(numChunks + 1, size);
+    boundaries[0] = 0;
+    for (size_t i = 1; i < numChunks; i++) {
+        size_t boundary = std::max(boundaries[i - 1], i * (size / numChunks));
+        if (boundary > 0 && boundary < size && data[boundary - 1] != '\n') {
+            auto *newline = (const char *) std::memchr(data + boundary, '\n', size - boundary);
+            boundary = newline == nullptr ? size : newline - data + 1;
+        }
+        boundaries[i] = boundary;
+    }
+    return boundaries;
+}
+
+ObjContents *readObjContents(const std::string &filePath, int numThreads) {
+    PROFILE_SCOPE("PARSE OBJ");
+    MappedFile file(filePath);
+    TaskPool pool(numThreads);
+    size_t numChunks = std::clamp(file.getSize() / OBJ_READER_CHUNK_SIZE, (size_t) 1,
+                                  (size_t) (4 * pool.getNumThreads()));
+    std::vector<size_t> boundaries = getChunkBoundaries(file.getData(), file.getSize(), numChunks);
+    std::vector<ObjChunk> chunks(numChunks);
+    parallelForChunks(pool, 0, (int) numChunks, 1, [&](int, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++)
+            parseChunk(file.getData() + boundaries[i], file.getData() + boundaries[i + 1], chunks[i]);
+    });
+
+    /*
+     * Merges the chunks in file order, resolving relative indices against the number of vertices
+     * in the chunks before them and checking every index against the final vertex count.
+     */
+    std::vector<size_t> vertexOffsets(numChunks + 1, 0), triangleOffsets(numChunks + 1, 0);
+    for (size_t i = 0; i < numChunks; i++) {
+        vertexOffsets[i + 1] = vertexOffsets[i] + chunks[i].vertices.size();
+        triangleOffsets[i + 1] = triangleOffsets[i] + chunks[i].triangles.size();
+    }
+    if (vertexOffsets[numChunks] >= OBJ_RELATIVE_INDEX_BIT)
+        throw std::runtime_error("Too many vertices in file: " + filePath);
     auto *res = new ObjContents();
-    res->vertices = std::vector<glm::vec3>();
-    res->triangles = std::vector<glm::uvec3>();
-    GLuint i1, i2, i3, a, b, c;
-    GLfloat x, y, z;
-    std::string line;
-    while (std::getline(fin, line)) {
-        if (line.empty()) continue;
-        std::istringstream iss(line);
-        std::string type;
-        iss >> type;
-        if (type == COMMENT_TYPE)
-            continue;
-        else if (type == VERTEX_TYPE) {
-            if (!(iss >> x >> y >> z)) continue; // skip malformed line
-            res->vertices.emplace_back(x, y, z);
-        } else if (type == FACE_TYPE) {
-            if (sscanf(line.c_str(), "f %d//%d %d//%d %d//%d", &i1, &a, &i2, &b, &i3, &c) == 6 ||
-                sscanf(line.c_str(), "f %d %d %d", &i1, &i2, &i3) == 3) {
-                res->triangles.emplace_back(--i1, --i2, --i3);
+    res->vertices.resize(vertexOffsets[numChunks]);
+    res->triangles.resize(triangleOffsets[numChunks]);
+    auto numVertices = (int64_t) vertexOffsets[numChunks];
+    parallelForChunks(pool, 0, (int) numChunks, 1, [&](int, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++) {
+            ObjChunk &chunk = chunks[i];
+            std::copy(chunk.vertices.begin(), chunk.vertices.end(), res->vertices.begin() + vertexOffsets[i]);
+            glm::uvec3 *triangles = res->triangles.data() + triangleOffsets[i];
+            for (size_t t = 0; t < chunk.triangles.size(); t++) {
+                for (int v = 0; v < 3; v++) {
+                    uint32_t index = chunk.triangles[t][v];
+                    int64_t resolved = index;
+                    if (index & OBJ_RELATIVE_INDEX_BIT)
+                        resolved = (int64_t) vertexOffsets[i] + ((int32_t) (index << 1) >> 1);
+                    if (resolved < 0 || resolved >= numVertices) {
+                        chunk.hasError = true;
+                        resolved = 0;
+                    }
+                    triangles[t][v] = (uint32_t) resolved;
+                }
             }
+            chunk.vertices = {};
+            chunk.triangles = {};
+        }
+    });
+    for (const ObjChunk &chunk : chunks) {
+        if (chunk.hasError) {
+            delete res;
+            throw std::runtime_error("Malformed vertex or face in file: " + filePath);
         }
     }
     return res;
-}
\ No newline at end of file
+}
@@ -5,11 +5,21 @@
 #include <string>
 #include "glm/glm.hpp"
 
+#include "constants.h"
+
 struct ObjContents {
     std::vector<glm::vec3> vertices;
     std::vector<glm::uvec3> triangles;
 };
 
-extern ObjContents* readObjContents(const std::string& filePath);
+/*
+ * Reads the vertices and faces of an OBJ file, ignoring every other statement.
+ * Faces may use any of the v, v/vt, v//vn and v/vt/vn forms with positive or negative (relative) indices,
+ * and faces with more than 3 vertices are fan triangulated.
+ * Throws if a vertex or face cannot be parsed or a face index is out of range.
+ * The file is memory mapped and split at line boundaries into chunks that are parsed in parallel.
+ * numThreads = 0 uses every hardware thread.
+ */
+extern ObjContents* readObjContents(const std::string& filePath, int numThreads = OBJ_READER_THREADS);
 
 #endif //OPENGL_RAYTRACER_OBJ_READER_H
@@ -0,0 +1,195 @@
+#include "profiler.h"
+
+#ifdef PROFILING
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+struct ProfileEvent {
+    std::string path;
+    int track;
+    int64_t startNs;
+    int64_t durationNs;
+};
+
+struct ScopeTimes {
+    uint64_t numCalls = 0;
+    int64_t totalNs = 0;
+    // Summed time of the scope's calls in each frame, indexed by frame
+    std::vector<float> frameMs;
+};
+
+/*
+ * Orders paths by their scope names one level at a time, so that every scope is followed by the scopes nested in it
+ */
+struct ProfilePathOrder {
+    bool operator()(const std::string &a, const std::string &b) const {
+        auto getOrder = [](char c) {
+            return c == '/' ? '\1' : c;
+        };
+        return std::ranges::lexicographical_compare(a, b, {}, getOrder, getOrder);
+    }
+};
+
+static std::mutex profileMutex;
+static std::vector<ProfileEvent> profileEvents;
+static uint64_t numDroppedEvents = 0;
+static std::map<std::string, ScopeTimes, ProfilePathOrder> scopeTimes;
+static std::vector<float> frameTimesMs;
+static int64_t lastFrameEndNs = -1;
+static std::atomic<uint32_t> profileFrame = 0;
+static std::atomic<int> numThreadTracks = PROFILE_GPU_TRACK;
+static const int64_t profileStartNs = getProfileTimeNs();
+
+// The scopes open on this thread, joined by '/', and the thread's track in the Chrome trace
+thread_local std::string scopePath;
+thread_local const int threadTrack = ++numThreadTracks;
+
+int64_t getProfileTimeNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint32_t getProfileFrame() {
+    return profileFrame;
+}
+
+ProfileScope::ProfileScope(const char *name) : parentPathLength(scopePath.size()), frame(profileFrame) {
+    if (!scopePath.empty())
+        scopePath += '/';
+    scopePath += name;
+    startNs = getProfileTimeNs();
+}
+
+ProfileScope::~ProfileScope() {
+    int64_t endNs = getProfileTimeNs();
+    recordProfileEvent(scopePath, threadTrack, startNs, endNs - startNs, frame);
+    scopePath.resize(parentPathLength);
+}
+
+void recordProfileEvent(const std::string &path, int track, int64_t startNs, int64_t durationNs, uint32_t frame) {
+    std::lock_guard lock(profileMutex);
+    if (profileEvents.size() < PROFILE_TRACE_MAX_EVENTS)
+        profileEvents.push_back({path, track, startNs, durationNs});
+    else
+        numDroppedEvents++;
+    ScopeTimes &times = scopeTimes[path];
+    times.numCalls++;
+    times.totalNs += durationNs;
+    if (times.frameMs.size() <= frame)
+        times.frameMs.resize(frame + 1, 0.0f);
+    times.frameMs[frame] += (float) ((double) durationNs / 1e6);
+}
+
+void endProfileFrame() {
+    int64_t now = getProfileTimeNs();
+    std::lock_guard lock(profileMutex);
+    if (lastFrameEndNs >= 0)
+        frameTimesMs.push_back((float) ((double) (now - lastFrameEndNs) / 1e6));
+    lastFrameEndNs = now;
+    profileFrame++;
+}
+
+static float getPercentile(std::vector<float> values, double percentile) {
+    auto nth = values.begin() + (ptrdiff_t) std::lround(percentile * (double) (values.size() - 1));
+    std::ranges::nth_element(values, nth);
+    return *nth;
+}
+
+static void printPercentiles(const std::vector<float> &values) {
+    std::cout << "P50 " << getPercentile(values, 0.5) << " ms, P95 " << getPercentile(values, 0.95) << " ms, P99 "
+              << getPercentile(values, 0.99) << " ms";
+}
+
+static void writeJsonString(std::ostream &out, const std::string &text) {
+    out << '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\')
+            out << '\\';
+        out << c;
+    }
+    out << '"';
+}
+
+static void writeChromeTrace(const std::string &tracePath) {
+    /*
+     * Complete events ("ph": "X") in microseconds since the program started, one track per thread plus the GPU's.
+     * Each event is named after its innermost scope, with the whole path in its arguments.
+     */
+    std::ofstream fout(tracePath);
+    fout << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    for (int track = PROFILE_GPU_TRACK; track <= numThreadTracks; track++) {
+        std::string trackName = track == PROFILE_GPU_TRACK ? "GPU" : "CPU THREAD " + std::to_string(track);
+        fout << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << track
+             << ", \"args\": {\"name\": \"" << trackName << "\"}},\n";
+    }
+    for (size_t i = 0; i < profileEvents.size(); i++) {
+        const ProfileEvent &event = profileEvents[i];
+        fout << "{\"name\": ";
+        writeJsonString(fout, event.path.substr(event.path.find_last_of('/') + 1));
+        fout << ", \"cat\": \"" << (event.track == PROFILE_GPU_TRACK ? "GPU" : "CPU") << "\", \"ph\": \"X\", \"ts\": "
+             << (double) (event.startNs - profileStartNs) / 1e3 << ", \"dur\": " << (double) event.durationNs / 1e3
+             << ", \"pid\": 1, \"tid\": " << event.track << ", \"args\": {\"path\": ";
+        writeJsonString(fout, event.path);
+        fout << "}}" << (i + 1 < profileEvents.size() ? ",\n" : "\n");
+    }
+    fout << "]}\n";
+    if (!fout) {
+        std::cout << "COULD NOT WRITE PROFILE TRACE " << tracePath << std::endl;
+        return;
+    }
+    std::cout << "WROTE PROFILE TRACE " << tracePath << " (" << profileEvents.size() << " EVENTS";
+    if (numDroppedEvents > 0)
+        std::cout << ", " << numDroppedEvents << " MORE DROPPED PAST PROFILE_TRACE_MAX_EVENTS";
+    std::cout << ")" << std::endl;
+}
+
+void writeProfile(const std::string &tracePath) {
+    /*
+     * Scopes that ran in a single frame, such as the loading phases, only get their total. The others get
+     * percentiles over the frames they ran in.
+     */
+    std::lock_guard lock(profileMutex);
+    std::cout << "PROFILE: " << profileFrame << " FRAMES";
+    if (!frameTimesMs.empty()) {
+        std::cout << ", FRAME TIME ";
+        printPercentiles(frameTimesMs);
+    }
+    std::cout << std::endl;
+    // Scopes that only hold other scopes, such as GPU, are printed as headings the first time they are needed
+    std::set<std::string> headings;
+    for (const auto &[path, times] : scopeTimes) {
+        for (size_t i = path.find('/'); i != std::string::npos; i = path.find('/', i + 1)) {
+            std::string parent = path.substr(0, i);
+            if (!scopeTimes.contains(parent) && headings.insert(parent).second) {
+                auto parentDepth = (size_t) std::ranges::count(parent, '/');
+                std::cout << std::string(2 * parentDepth + 2, ' ') << parent.substr(parent.find_last_of('/') + 1)
+                          << ":" << std::endl;
+            }
+        }
+        auto depth = (size_t) std::ranges::count(path, '/');
+        std::cout << std::string(2 * depth + 2, ' ') << path.substr(path.find_last_of('/') + 1) << ": "
+                  << times.numCalls << " CALLS, " << (double) times.totalNs / 1e6 << " ms";
+        std::vector<float> frameMs;
+        std::ranges::copy_if(times.frameMs, std::back_inserter(frameMs), [](float ms) {
+            return ms > 0.0f;
+        });
+        if (frameMs.size() > 1) {
+            std::cout << ", PER FRAME ";
+            printPercentiles(frameMs);
+            std::cout << " OVER " << frameMs.size() << " FRAMES";
+        }
+        std::cout << std::endl;
+    }
+    writeChromeTrace(tracePath);
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef OPENGL_RAYTRACER_PROFILER_H
+#define OPENGL_RAYTRACER_PROFILER_H
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <cstdint>
+
+#include "constants.h"
+
+/*
+ * Scoped timers for builds with PROFILING defined (cmake -DPROFILING=ON). Without it every macro below expands
+ * to nothing, and nothing is measured or stored.
+ *
+ * PROFILE_SCOPE("NAME") times the rest of the enclosing block on the calling thread. Scopes nest, and each one
+ * is summarised under the path of the scopes it is nested in, e.g. LOAD SCENE/LOAD MESH/BUILD BVH.
+ * PROFILE_FRAME() ends a frame: every scope's time is summed per frame, so that the summary gives the 50th, 95th
+ * and 99th percentile of each scope's time per frame, as well as of the time between frames.
+ * PROFILE_WRITE(path) prints the summary and writes every timed scope as a Chrome trace to path, which
+ * chrome://tracing and ui.perfetto.dev open. GPU passes are timed into the same profile by gpu-profiler.h.
+ */
+
+#ifdef PROFILING
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_FRAME() endProfileFrame()
+#define PROFILE_WRITE(path) writeProfile(path)
+
+// Track of the Chrome trace that GPU passes are drawn on, apart from the CPU threads' tracks
+#define PROFILE_GPU_TRACK 0
+
+class ProfileScope {
+public:
+    explicit ProfileScope(const char* name);
+    ~ProfileScope();
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    size_t parentPathLength;
+    // Frame that the scope started in, which its time counts towards
+    uint32_t frame;
+    int64_t startNs;
+};
+
+/*
+ * Nanoseconds on the steady clock that every profiled time is measured on
+ */
+extern int64_t getProfileTimeNs();
+
+/*
+ * Index of the current frame, which is the number of PROFILE_FRAME calls so far
+ */
+extern uint32_t getProfileFrame();
+
+/*
+ * Records a span that was measured elsewhere, such as on the GPU, into the given track and frame's times.
+ * Safe to call from any thread.
+ */
+extern void recordProfileEvent(const std::string& path, int track, int64_t startNs, int64_t durationNs,
+                               uint32_t frame);
+
+extern void endProfileFrame();
+
+extern void writeProfile(const std::string& tracePath);
+
+#else
+
+#define PROFILE_SCOPE(name) ((void) 0)
+#define PROFILE_FRAME() ((void) 0)
+#define PROFILE_WRITE(path) ((void) 0)
+
+#endif
+
+#endif //OPENGL_RAYTRACER_PROFILER_H
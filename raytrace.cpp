@@ -4,84 +4,750 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include <iostream>
+#include <map>
 #include <vector>
-#include <random>
+#include <span>
+#include <cstring>
+#include <stdexcept>
+#include <cmath>
+#include <cstddef>
 
 #include "constants.h"
 #include "util.h"
-#include "obj-reader.h"
+#include "profiler.h"
+#include "gpu-profiler.h"
 
-static GLuint raytraceProgram;
+/*
+ * The raytracing programs of one render mode. Each mode compiles its own variant of the shaders, so the render mode
+ * pays for none of the test modes' counters, and switching modes switches programs instead of branching in them.
+ */
+struct RaytracePrograms {
+    GLuint megakernel;
+    GLuint wavefrontGenerate, wavefrontExtend, wavefrontShade, wavefrontCompact, wavefrontResolve;
+    GLuint adaptiveClassify;
+};
 
-template<typename T>
-void initSSBO(std::vector<T> &data, unsigned int binding) {
+// Variants by render mode, compiled the first time a mode is rendered
+static std::map<int, RaytracePrograms> raytracePrograms;
+static GLuint denoisePrepareProgram, denoiseAtrousProgram;
+// Resolution that the screen-sized buffers are allocated at, and the resolution frames are currently rendered at
+static int raytraceNativeWidth, raytraceNativeHeight;
+static int raytraceScreenWidth, raytraceScreenHeight;
+
+// Camera pose of the last frame, which the next one reprojects its history from
+static glm::vec3 prevCameraPos;
+static glm::mat3 prevCameraRotation;
+static int prevScreenWidth, prevScreenHeight;
+static bool hasPrevCamera = false;
+
+static GLuint tlasSSBO = 0, instanceSSBO = 0, lightSSBO = 0;
+static GLuint bvhSSBO = 0, wideBVHSSBO = 0, compressedBVHSSBO = 0, triangleIndexSSBO = 0;
+static GLuint triv0SSBO = 0, triv1SSBO = 0, triv2SSBO = 0, triangleNormalSSBO = 0;
+static GLuint vertexSSBO = 0, vertexIndexSSBO = 0, quantizedTriangleSSBO = 0, quantizationBlockSSBO = 0;
+// Geometry layout of every mesh of the scene, which the shaders are compiled for
+static int geometryLayout = GEOMETRY_LAYOUT;
+
+/*
+ * Persistently mapped staging ring that mesh updates are copied through. The CPU writes each changed range
+ * at the head of the ring, and the GPU copies it into the mesh buffer from there.
+ */
+static GLuint uploadBuffer = 0;
+static std::byte *uploadMemory = nullptr;
+static size_t uploadHead = 0;
+
+/*
+ * Wavefront state, matching wavefront-common.glsl. Paths are numbered pixelIndex * RAYS_PER_PIXEL + sample.
+ */
+struct WavefrontPath {
+    glm::vec3 origin;
+    uint32_t bounce;
+    glm::vec3 dir;
+    uint32_t randSeed;
+    glm::vec3 throughput;
+    uint32_t numBoxTests;
+    glm::vec3 radiance;
+    uint32_t numTriangleTests;
+    float bsdfPdf;
+    uint32_t sampleIndex;
+    uint32_t padding[2];
+};
+static_assert(sizeof(WavefrontPath) == 80, "WavefrontPath must match the std430 layout of Path");
+
+struct WavefrontCounters {
+    uint32_t queueSizes[2];
+    uint32_t padding[2];
+    glm::uvec4 dispatchArgs[2];
+};
+
+// Size of HitInfo in raytrace-common.glsl
+const size_t WAVEFRONT_HIT_SIZE = 12;
+
+static GLuint pathSSBO = 0, hitSSBO = 0, rayQueueSSBO = 0, wavefrontCounterSSBO = 0;
+
+// Dispatch arguments followed by the pixels adaptive sampling still traces, matching AdaptivePixelBuffer
+static GLuint adaptivePixelSSBO = 0;
+static bool adaptiveSamplingEnabled = true;
+static uint32_t numWavefrontPaths = 0;
+
+// Colour and variance that the denoiser's passes ping-pong between, allocated with the first denoised frame
+static GLuint denoiseTextures[2] = {0, 0};
+
+/*
+ * Raster pre-pass of the primary hits, drawing every instance in TLAS order, so that its index in the instance
+ * buffer is the one traversal finds. Its framebuffer is allocated with the first frame that uses it.
+ */
+struct RasterInstance {
+    glm::mat4 objectToWorld;
+    uint32_t triangleOffset;
+    uint32_t geometryOffset;
+    uint32_t numTriangles;
+};
+static std::vector<RasterInstance> rasterInstances;
+static bool primaryRasterEnabled = false;
+static GLuint primaryHitProgram = 0, primaryHitVAO = 0;
+static GLuint primaryHitFramebuffer = 0, primaryHitTexture = 0, primaryHitDepth = 0;
+
+// Timestamp queries of the frame being timed, with the timing that the time since the previous timestamp adds to
+static std::vector<GLuint> timestampQueries;
+static std::vector<double RaytraceTimings::*> timestampStages;
+
+static GLuint initSSBO(size_t size, const void *data, unsigned int binding, GLenum usage) {
     GLuint ssbo;
     glGenBuffers(1, &ssbo);
     checkGLError("(initSSBO, binding " + std::to_string(binding) + ") glGenBuffers");
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
     checkGLError("(initSSBO, binding " + std::to_string(binding) + ") glBindBuffer");
-    glBufferData(GL_SHADER_STORAGE_BUFFER, data.size() * sizeof(T), data.data(), GL_STATIC_DRAW);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr) size, data, usage);
     checkGLError("(initSSBO, binding " + std::to_string(binding) + ") glBufferData");
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, ssbo);
     checkGLError("(initSSBO, binding " + std::to_string(binding) + ") glBindBufferBase");
+    return ssbo;
+}
+
+template<typename T>
+static GLuint initMeshSSBO(const Scene *scene, std::span<const T> MeshData::*buffer, unsigned int binding) {
+    /*
+     * Concatenates one buffer of every mesh, in mesh order, which is the order the scene's MeshOffsets count in.
+     * The buffer lives as long as the scene, and dynamic meshes update their part of it in place.
+     */
+    size_t size = 0;
+    for (const std::unique_ptr<MeshData> &mesh : scene->meshes)
+        size += ((*mesh).*buffer).size_bytes();
+    if (size == 0)
+        return 0;
+    GLuint ssbo = initSSBO(size, nullptr, binding, GL_STATIC_DRAW);
+    size_t offset = 0;
+    for (const std::unique_ptr<MeshData> &mesh : scene->meshes) {
+        std::span<const T> data = (*mesh).*buffer;
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, (GLintptr) offset, (GLsizeiptr) data.size_bytes(), data.data());
+        offset += data.size_bytes();
+    }
+    checkGLError("(initMeshSSBO, binding " + std::to_string(binding) + ") glBufferSubData");
+    return ssbo;
 }
 
-void runComputeShader(GLuint shader, int num_groups_x, int num_groups_y, int num_groups_z) {
-    GLuint program = glCreateProgram();
-    glAttachShader(program, shader);
-    glLinkProgram(program);
+static void initUploadBuffer() {
+    /*
+     * Persistent mapping needs GL_ARB_buffer_storage, which the 4.3 context only has as an extension.
+     * Without it, uploadRange falls back to glBufferSubData.
+     */
+    if (uploadBuffer != 0 || !GLAD_GL_ARB_buffer_storage)
+        return;
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &uploadBuffer);
+    glBindBuffer(GL_COPY_READ_BUFFER, uploadBuffer);
+    glBufferStorage(GL_COPY_READ_BUFFER, RAYTRACE_UPLOAD_BUFFER_SIZE, nullptr, flags);
+    uploadMemory = (std::byte *) glMapBufferRange(GL_COPY_READ_BUFFER, 0, RAYTRACE_UPLOAD_BUFFER_SIZE, flags);
+    checkGLError("(initUploadBuffer) glMapBufferRange");
+}
+
+static void waitForUploads() {
+    /*
+     * Copies complete in order, so once a fence issued after the last one signals, the whole ring is free again.
+     */
+    GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {}
+    glDeleteSync(fence);
+}
+
+static void uploadRange(GLuint ssbo, size_t offset, const void *data, size_t size) {
+    glBindBuffer(GL_COPY_WRITE_BUFFER, ssbo);
+    if (uploadMemory == nullptr || size > RAYTRACE_UPLOAD_BUFFER_SIZE) {
+        glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr) offset, (GLsizeiptr) size, data);
+        return;
+    }
+    if (uploadHead + size > RAYTRACE_UPLOAD_BUFFER_SIZE) {
+        waitForUploads();
+        uploadHead = 0;
+    }
+    std::memcpy(uploadMemory + uploadHead, data, size);
+    glBindBuffer(GL_COPY_READ_BUFFER, uploadBuffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (GLintptr) uploadHead, (GLintptr) offset,
+                        (GLsizeiptr) size);
+    // Keeps the copy sources aligned, which drivers copy fastest
+    uploadHead += (size + 255) / 256 * 256;
+}
+
+template<typename T>
+static void uploadMeshRange(GLuint ssbo, std::span<const T> data, uint32_t meshOffset, const DirtyRange &range) {
+    // Sections of the other geometry layouts are empty
+    if (range.isEmpty() || data.empty())
+        return;
+    uploadRange(ssbo, (meshOffset + range.begin) * sizeof(T), data.data() + range.begin,
+                (range.end - range.begin) * sizeof(T));
+}
+
+void uploadMeshUpdate(const Scene *scene, uint32_t meshIndex, const MeshUpdate &update) {
+    PROFILE_SCOPE("UPLOAD MESH UPDATE");
+    initUploadBuffer();
+    const MeshData &mesh = *scene->meshes[meshIndex];
+    const MeshOffsets &offsets = scene->meshOffsets[meshIndex];
+    uploadMeshRange(bvhSSBO, mesh.bvhNodes, offsets.bvhOffset, update.bvhNodes);
+    if (BVH_LAYOUT == BVH_LAYOUT_COMPRESSED)
+        uploadMeshRange(compressedBVHSSBO, mesh.compressedBVHNodes, offsets.wideBVHOffset, update.wideBVHNodes);
+    else
+        uploadMeshRange(wideBVHSSBO, mesh.wideBVHNodes, offsets.wideBVHOffset, update.wideBVHNodes);
+    uploadMeshRange(triangleIndexSSBO, mesh.triangleIndices, offsets.triangleIndexOffset, update.triangleIndices);
+    uploadMeshRange(triv0SSBO, mesh.triv0, offsets.triangleOffset, update.triangles);
+    uploadMeshRange(triv1SSBO, mesh.triv1, offsets.triangleOffset, update.triangles);
+    uploadMeshRange(triv2SSBO, mesh.triv2, offsets.triangleOffset, update.triangles);
+    uploadMeshRange(triangleNormalSSBO, mesh.triangleNormals, offsets.triangleOffset, update.triangles);
+    uploadMeshRange(vertexSSBO, mesh.vertices, offsets.geometryOffset, update.vertices);
+    uploadMeshRange(vertexIndexSSBO, mesh.vertexIndices, offsets.triangleOffset, update.triangles);
+    uploadMeshRange(quantizedTriangleSSBO, mesh.quantizedTriangles, offsets.triangleOffset, update.triangles);
+    uploadMeshRange(quantizationBlockSSBO, mesh.quantizationBlocks, offsets.geometryOffset,
+                    update.quantizationBlocks);
+    checkGLError("(uploadMeshUpdate) upload ranges");
+}
+
+void uploadTLAS(const Scene *scene) {
+    PROFILE_SCOPE("UPLOAD TLAS");
+    glDeleteBuffers(1, &tlasSSBO);
+    glDeleteBuffers(1, &instanceSSBO);
+    tlasSSBO = initSSBO(scene->tlasNodes.size() * sizeof(BVHNode), scene->tlasNodes.data(), TLAS_BINDING,
+                        GL_DYNAMIC_DRAW);
+    instanceSSBO = initSSBO(scene->tlasInstances.size() * sizeof(GPUInstance), scene->tlasInstances.data(),
+                            INSTANCE_SSBO_BINDING, GL_DYNAMIC_DRAW);
+    rasterInstances.clear();
+    for (uint32_t instanceIndex : scene->tlasInstanceIndices) {
+        const Instance &instance = scene->instances[instanceIndex];
+        const MeshOffsets &offsets = scene->meshOffsets[instance.meshIndex];
+        rasterInstances.push_back({instance.objectToWorld, offsets.triangleOffset, offsets.geometryOffset,
+                                   (uint32_t) scene->meshes[instance.meshIndex]->numTriangles});
+    }
+    // The light count and total power, padded to the 16 byte alignment of the lights that follow them
+    std::vector<std::byte> lightData(16 + scene->lights.size() * sizeof(SceneLight));
+    auto numLights = (uint32_t) scene->lights.size();
+    std::memcpy(lightData.data(), &numLights, sizeof(uint32_t));
+    std::memcpy(lightData.data() + sizeof(uint32_t), &scene->totalLightPower, sizeof(float));
+    std::memcpy(lightData.data() + 16, scene->lights.data(), scene->lights.size() * sizeof(SceneLight));
+    glDeleteBuffers(1, &lightSSBO);
+    lightSSBO = initSSBO(lightData.size(), lightData.data(), LIGHT_SSBO_BINDING, GL_DYNAMIC_DRAW);
+}
+
+void initBuffers(const Scene* scene) {
+    PROFILE_SCOPE("UPLOAD SCENE");
+    bvhSSBO = initMeshSSBO(scene, &MeshData::bvhNodes, BVH_BINDING);
+    // The compressed layout only traverses the compressed nodes, which are laid out at the wide nodes' offsets
+    if (BVH_LAYOUT == BVH_LAYOUT_COMPRESSED)
+        compressedBVHSSBO = initMeshSSBO(scene, &MeshData::compressedBVHNodes, COMPRESSED_BVH_BINDING);
+    else
+        wideBVHSSBO = initMeshSSBO(scene, &MeshData::wideBVHNodes, WIDE_BVH_BINDING);
+    triangleIndexSSBO = initMeshSSBO(scene, &MeshData::triangleIndices, TRIANGLE_INDEX_SSBO_BINDING);
+    triv0SSBO = initMeshSSBO(scene, &MeshData::triv0, TRI_V0_SSBO_BINDING);
+    triv1SSBO = initMeshSSBO(scene, &MeshData::triv1, TRI_V1_SSBO_BINDING);
+    triv2SSBO = initMeshSSBO(scene, &MeshData::triv2, TRI_V2_SSBO_BINDING);
+    initMeshSSBO(scene, &MeshData::triangleColours, TRIANGLE_COLOUR_SSBO_BINDING);
+    triangleNormalSSBO = initMeshSSBO(scene, &MeshData::triangleNormals, TRIANGLE_NORMAL_SSBO_BINDING);
+    vertexSSBO = initMeshSSBO(scene, &MeshData::vertices, VERTEX_SSBO_BINDING);
+    vertexIndexSSBO = initMeshSSBO(scene, &MeshData::vertexIndices, VERTEX_INDEX_SSBO_BINDING);
+    quantizedTriangleSSBO = initMeshSSBO(scene, &MeshData::quantizedTriangles, QUANTIZED_TRIANGLE_SSBO_BINDING);
+    quantizationBlockSSBO = initMeshSSBO(scene, &MeshData::quantizationBlocks, QUANTIZATION_BLOCK_SSBO_BINDING);
+    initMeshSSBO(scene, &MeshData::packedColours, PACKED_COLOUR_SSBO_BINDING);
+    uploadTLAS(scene);
+}
+
+static GLuint compileRaytraceProgram(const std::string &stagePath, int renderMode) {
+    /*
+     * Every raytracing program is geometry-common.glsl and raytrace-common.glsl followed by its own stage,
+     * with the wavefront stages also sharing wavefront-common.glsl. The configuration that sets loop bounds and
+     * picks code paths is compiled in as #defines rather than passed as uniforms, so the compiler can unroll
+     * and drop code for it.
+     */
+    std::vector<std::string> paths = {"../shaders/geometry-common.glsl", "../shaders/raytrace-common.glsl"};
+    if (stagePath.find("wavefront") != std::string::npos)
+        paths.emplace_back("../shaders/wavefront-common.glsl");
+    paths.push_back(stagePath);
+    std::string defines = getShaderDefines({{"SHADER_RENDER_MODE", renderMode},
+                                            {"RAYS_PER_PIXEL", RAYS_PER_PIXEL},
+                                            {"RAY_BOUNCES", RAY_BOUNCES},
+                                            {"BVH_LAYOUT", BVH_LAYOUT},
+                                            {"GEOMETRY_LAYOUT", geometryLayout},
+                                            {"NEXT_EVENT_ESTIMATION", NEXT_EVENT_ESTIMATION},
+                                            {"BSDF_SAMPLING", BSDF_SAMPLING},
+                                            {"SAMPLE_SEQUENCE", SAMPLE_SEQUENCE},
+                                            {"PRIMARY_RASTER", primaryRasterEnabled && renderMode == RENDER_MODE}});
+    return generateProgram(importAndCompileShader(paths, GL_COMPUTE_SHADER, defines));
+}
+
+static GLuint compileDenoiseProgram(const std::string &passPath) {
+    PROFILE_SCOPE("COMPILE SHADERS");
+    return generateProgram(importAndCompileShader(std::vector<std::string>{"../shaders/denoise-common.glsl", passPath},
+                                                  GL_COMPUTE_SHADER));
+}
+
+static void setSceneUniforms(GLuint program) {
     glUseProgram(program);
-    glDispatchCompute(num_groups_x, num_groups_y, num_groups_z);
-    glDeleteProgram(program);
-}
-
-void initBuffers(SceneData* sceneData) {
-    initSSBO(sceneData->alignedBVHNodes, BVH_BINDING);
-    initSSBO(sceneData->triv0, TRI_V0_SSBO_BINDING);
-    initSSBO(sceneData->triv1, TRI_V1_SSBO_BINDING);
-    initSSBO(sceneData->triv2, TRI_V2_SSBO_BINDING);
-    int numTriangles = sceneData->numTriangles;
-    std::vector<glm::vec4> triangleColours(numTriangles);
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
-    for (int i = 0; i < numTriangles; i++) {
-        triangleColours[i] = glm::vec4(dist(gen)
-                , dist(gen), dist(gen), 1.0f);
-    }
-    initSSBO(triangleColours, TRIANGLE_COLOUR_SSBO_BINDING);
-    std::vector<glm::vec4> triangleNormals = std::vector<glm::vec4>(numTriangles);
-    initSSBO(triangleNormals, TRIANGLE_NORMAL_SSBO_BINDING);
-    GLuint normalShader = importAndCompileShader("../shaders/normals.glsl", GL_COMPUTE_SHADER);
-    runComputeShader(normalShader, numTriangles, 1, 1);
-}
-
-GLuint raytraceInit(SceneData* sceneData, int screenWidth, int screenHeight) {
-    GLuint raytraceShader = importAndCompileShader("../shaders/raytrace.glsl", GL_COMPUTE_SHADER);
-    raytraceProgram = generateProgram(raytraceShader);
-    glUseProgram(raytraceProgram);
-    initBuffers(sceneData);
-    checkGLError("(raytraceInit) initBuffers()");
-    glUniform1f(glGetUniformLocation(raytraceProgram, "u_ScreenWidth"),
-                static_cast<GLfloat>(screenWidth));
-    glUniform1f(glGetUniformLocation(raytraceProgram, "u_ScreenHeight"),
-                static_cast<GLfloat>(screenHeight));
-    glUniform1f(glGetUniformLocation(raytraceProgram, "u_FOV"),
+    glUniform1f(glGetUniformLocation(program, "u_ScreenWidth"),
+                static_cast<GLfloat>(raytraceScreenWidth));
+    glUniform1f(glGetUniformLocation(program, "u_ScreenHeight"),
+                static_cast<GLfloat>(raytraceScreenHeight));
+    glUniform1f(glGetUniformLocation(program, "u_FOV"),
                 static_cast<GLfloat>(FOV * std::numbers::pi / 180.f));
-    glUniform1f(glGetUniformLocation(raytraceProgram, "u_ViewportDist"), VIEWPORT_DIST);
-    glUniform1ui(glGetUniformLocation(raytraceProgram, "u_RaysPerPixel"), RAYS_PER_PIXEL);
-    glUniform1ui(glGetUniformLocation(raytraceProgram, "u_RayBounces"), RAY_BOUNCES);
-    checkGLError("(raytraceInit) set uniforms");
-    return raytraceProgram;
-};
+    glUniform1f(glGetUniformLocation(program, "u_ViewportDist"), VIEWPORT_DIST);
+    glUniform1ui(glGetUniformLocation(program, "u_TemporalMaxHistory"), TEMPORAL_MAX_HISTORY);
+    glUniform1f(glGetUniformLocation(program, "u_TemporalDepthTolerance"), TEMPORAL_DEPTH_TOLERANCE);
+    glUniform1f(glGetUniformLocation(program, "u_AdaptiveThreshold"), ADAPTIVE_SAMPLING_THRESHOLD);
+    glUniform1ui(glGetUniformLocation(program, "u_AdaptiveWarmupFrames"), ADAPTIVE_SAMPLING_WARMUP_FRAMES);
+    glUniform1ui(glGetUniformLocation(program, "u_AdaptiveMaxFrames"), ADAPTIVE_SAMPLING_MAX_FRAMES);
+    glUniform1f(glGetUniformLocation(program, "u_RussianRouletteMaxContinue"), RUSSIAN_ROULETTE_MAX_CONTINUE);
+    glUniform1ui(glGetUniformLocation(program, "u_NumPaths"),
+                 (GLuint) (raytraceScreenWidth * raytraceScreenHeight * RAYS_PER_PIXEL));
+}
+
+static bool viewChanged(glm::vec3 cameraPos, glm::mat3 cameraRotation) {
+    return cameraPos != prevCameraPos || cameraRotation != prevCameraRotation ||
+           raytraceScreenWidth != prevScreenWidth || raytraceScreenHeight != prevScreenHeight;
+}
 
-void raytrace(glm::vec3 cameraPos, glm::mat3 cameraRotation, int renderMode, int frameCount, int num_groups_x, int num_groups_y) {
-    glUseProgram(raytraceProgram);
-    glUniform3f(glGetUniformLocation(raytraceProgram, "cameraPos"), cameraPos.x, cameraPos.y,
+static void setFrameUniforms(GLuint program, glm::vec3 cameraPos, glm::mat3 cameraRotation, int frameCount) {
+    glUseProgram(program);
+    glUniform3f(glGetUniformLocation(program, "cameraPos"), cameraPos.x, cameraPos.y,
                 cameraPos.z);
-    glUniformMatrix3fv(glGetUniformLocation(raytraceProgram, "cameraRotation"), 1, GL_FALSE,
+    glUniformMatrix3fv(glGetUniformLocation(program, "cameraRotation"), 1, GL_FALSE,
                        glm::value_ptr(cameraRotation));
-    glUniform1ui(glGetUniformLocation(raytraceProgram, "renderMode"), renderMode);
-    glUniform1ui(glGetUniformLocation(raytraceProgram, "frameCount"), frameCount);
+    glUniform1ui(glGetUniformLocation(program, "frameCount"), frameCount);
+    glUniform3f(glGetUniformLocation(program, "prevCameraPos"), prevCameraPos.x, prevCameraPos.y,
+                prevCameraPos.z);
+    glUniformMatrix3fv(glGetUniformLocation(program, "prevCameraRotation"), 1, GL_FALSE,
+                       glm::value_ptr(prevCameraRotation));
+    glUniform2f(glGetUniformLocation(program, "prevScreenSize"), (GLfloat) prevScreenWidth,
+                (GLfloat) prevScreenHeight);
+    glUniform1ui(glGetUniformLocation(program, "cameraMoved"), viewChanged(cameraPos, cameraRotation));
+}
+
+static const RaytracePrograms &getRaytracePrograms(int renderMode) {
+    auto it = raytracePrograms.find(renderMode);
+    if (it != raytracePrograms.end())
+        return it->second;
+    PROFILE_SCOPE("COMPILE SHADERS");
+    RaytracePrograms programs{};
+    programs.megakernel = compileRaytraceProgram("../shaders/raytrace.glsl", renderMode);
+    programs.wavefrontGenerate = compileRaytraceProgram("../shaders/wavefront-generate.glsl", renderMode);
+    programs.wavefrontExtend = compileRaytraceProgram("../shaders/wavefront-extend.glsl", renderMode);
+    programs.wavefrontShade = compileRaytraceProgram("../shaders/wavefront-shade.glsl", renderMode);
+    programs.wavefrontCompact = compileRaytraceProgram("../shaders/wavefront-compact.glsl", renderMode);
+    programs.wavefrontResolve = compileRaytraceProgram("../shaders/wavefront-resolve.glsl", renderMode);
+    programs.adaptiveClassify = compileRaytraceProgram("../shaders/adaptive-classify.glsl", renderMode);
+    for (GLuint program : {programs.megakernel, programs.wavefrontGenerate, programs.wavefrontExtend,
+                           programs.wavefrontShade, programs.wavefrontCompact, programs.wavefrontResolve,
+                           programs.adaptiveClassify})
+        setSceneUniforms(program);
+    checkGLError("(getRaytracePrograms) compile variant");
+    return raytracePrograms.emplace(renderMode, programs).first->second;
+}
+
+static void initPrimaryRaster() {
+    /*
+     * The vertex shader reads the triangle buffers, which GL 4.3 lets drivers leave vertex shaders without.
+     * The render mode then traces its camera rays as the test modes always do.
+     */
+    GLint maxVertexStorageBlocks = 0;
+    glGetIntegerv(GL_MAX_VERTEX_SHADER_STORAGE_BLOCKS, &maxVertexStorageBlocks);
+    if (maxVertexStorageBlocks < 3) {
+        std::cout << "PRIMARY HIT RASTER DISABLED: " << maxVertexStorageBlocks
+                  << " STORAGE BLOCKS IN VERTEX SHADERS" << std::endl;
+        return;
+    }
+    PROFILE_SCOPE("COMPILE SHADERS");
+    std::vector<std::string> vertexPaths = {"../shaders/geometry-common.glsl", "../shaders/primary-hits.vert"};
+    std::string vertexDefines = getShaderDefines({{"GEOMETRY_LAYOUT", geometryLayout}});
+    primaryHitProgram = generateProgram(importAndCompileShader(vertexPaths, GL_VERTEX_SHADER, vertexDefines),
+                                        importAndCompileShader("../shaders/primary-hits.frag", GL_FRAGMENT_SHADER));
+    // Vertices are pulled from the triangle buffers, so the vertex array has no attributes
+    glGenVertexArrays(1, &primaryHitVAO);
+    primaryRasterEnabled = true;
+}
+
+GLuint raytraceInit(const Scene* scene, int screenWidth, int screenHeight) {
+    PROFILE_SCOPE("RAYTRACE INIT");
+    raytraceNativeWidth = raytraceScreenWidth = screenWidth;
+    raytraceNativeHeight = raytraceScreenHeight = screenHeight;
+    // The shaders decode one layout, so a scene cannot mix them
+    geometryLayout = scene->meshes.front()->geometryLayout;
+    for (const std::unique_ptr<MeshData> &mesh : scene->meshes) {
+        if (mesh->geometryLayout != geometryLayout)
+            throw std::runtime_error("Scene mixes geometry layouts " + std::to_string(geometryLayout) + " and " +
+                                     std::to_string(mesh->geometryLayout));
+    }
+    if (RASTER_PRIMARY_HITS)
+        initPrimaryRaster();
+    denoisePrepareProgram = compileDenoiseProgram("../shaders/denoise-prepare.glsl");
+    denoiseAtrousProgram = compileDenoiseProgram("../shaders/denoise-atrous.glsl");
+    initBuffers(scene);
+    checkGLError("(raytraceInit) initBuffers()");
+    for (GLuint program : {denoisePrepareProgram, denoiseAtrousProgram}) {
+        glUseProgram(program);
+        glUniform1f(glGetUniformLocation(program, "u_SigmaLuminance"), DENOISE_SIGMA_LUMINANCE);
+        glUniform1f(glGetUniformLocation(program, "u_SigmaNormal"), DENOISE_SIGMA_NORMAL);
+        glUniform1f(glGetUniformLocation(program, "u_SigmaDepth"), DENOISE_SIGMA_DEPTH);
+    }
+    glUseProgram(denoisePrepareProgram);
+    glUniform1ui(glGetUniformLocation(denoisePrepareProgram, "u_MinHistory"), DENOISE_MIN_HISTORY);
+    checkGLError("(raytraceInit) set uniforms");
+    // The other modes' variants wait until they are first rendered
+    return getRaytracePrograms(RENDER_MODE).megakernel;
+};
+
+void setRenderResolution(int width, int height) {
+    if (width == raytraceScreenWidth && height == raytraceScreenHeight)
+        return;
+    raytraceScreenWidth = width;
+    raytraceScreenHeight = height;
+    for (const auto &[renderMode, programs] : raytracePrograms) {
+        for (GLuint program : {programs.megakernel, programs.wavefrontGenerate, programs.wavefrontExtend,
+                               programs.wavefrontShade, programs.wavefrontCompact, programs.wavefrontResolve,
+                               programs.adaptiveClassify})
+            setSceneUniforms(program);
+    }
+    checkGLError("(setRenderResolution) set uniforms");
+}
+
+void setAdaptiveSampling(bool enabled) {
+    adaptiveSamplingEnabled = enabled;
+}
+
+static void initWavefrontBuffers() {
+    /*
+     * Allocated on the first wavefront frame, so the megakernel never pays for them, with room for the paths
+     * of the native resolution. Each path takes 80 bytes of state, 12 of hit and 8 of queue entries.
+     */
+    numWavefrontPaths = (uint32_t) (raytraceScreenWidth * raytraceScreenHeight * RAYS_PER_PIXEL);
+    if (pathSSBO != 0)
+        return;
+    const size_t maxPaths = (size_t) raytraceNativeWidth * raytraceNativeHeight * RAYS_PER_PIXEL;
+    pathSSBO = initSSBO(maxPaths * sizeof(WavefrontPath), nullptr, PATH_SSBO_BINDING, GL_DYNAMIC_COPY);
+    hitSSBO = initSSBO(maxPaths * WAVEFRONT_HIT_SIZE, nullptr, HIT_SSBO_BINDING, GL_DYNAMIC_COPY);
+    rayQueueSSBO = initSSBO(2 * maxPaths * sizeof(uint32_t), nullptr, RAY_QUEUE_SSBO_BINDING, GL_DYNAMIC_COPY);
+    wavefrontCounterSSBO = initSSBO(sizeof(WavefrontCounters), nullptr, WAVEFRONT_COUNTER_SSBO_BINDING,
+                                    GL_DYNAMIC_COPY);
+}
+
+static void markTimestamp(RaytraceTimings *timings, double RaytraceTimings::*stage) {
+    if (timings == nullptr)
+        return;
+    size_t i = timestampStages.size();
+    if (i == timestampQueries.size()) {
+        timestampQueries.emplace_back();
+        glGenQueries(1, &timestampQueries.back());
+    }
+    glQueryCounter(timestampQueries[i], GL_TIMESTAMP);
+    timestampStages.push_back(stage);
+}
+
+static void readTimestamps(RaytraceTimings *timings) {
+    /*
+     * Waits for the frame to finish on the GPU, so timing a frame stops the CPU from running ahead of it.
+     */
+    if (timings == nullptr)
+        return;
+    std::vector<GLuint64> times(timestampStages.size());
+    for (size_t i = 0; i < times.size(); i++)
+        glGetQueryObjectui64v(timestampQueries[i], GL_QUERY_RESULT, &times[i]);
+    for (size_t i = 1; i < times.size(); i++) {
+        if (timestampStages[i] != nullptr)
+            timings->*timestampStages[i] += (double) (times[i] - times[i - 1]) / 1e6;
+    }
+    timings->totalMs += (double) (times.back() - times.front()) / 1e6;
+    timestampStages.clear();
+}
+
+static glm::mat4 getPrimaryRasterWorldToClip(glm::vec3 cameraPos, glm::mat3 cameraRotation) {
+    /*
+     * Projects the camera ray of pixel (x, y), which getCameraRay aims at the pixel's corner, onto the pixel's centre
+     * (x + 0.5, y + 0.5), where the raster samples it. Camera space looks down +z, and the far plane is at infinity.
+     */
+    const float width = (float) raytraceScreenWidth, height = (float) raytraceScreenHeight;
+    const float focalLength = 1.0f / std::tan(FOV * (float) std::numbers::pi / 360.0f);
+    glm::mat4 projection(0.0f);
+    projection[0][0] = focalLength;
+    projection[1][1] = focalLength * width / height;
+    projection[2][0] = 1.0f / width;
+    projection[2][1] = 1.0f / height;
+    projection[2][2] = 1.0f;
+    projection[2][3] = 1.0f;
+    projection[3][2] = -2.0f * RASTER_NEAR_PLANE;
+    glm::mat4 view = glm::mat4(glm::inverse(cameraRotation));
+    view[3] = view * glm::vec4(-cameraPos, 1.0f);
+    return projection * view;
+}
+
+static void rasterPrimaryHits(glm::vec3 cameraPos, glm::mat3 cameraRotation) {
+    /*
+     * Draws the triangle and instance index of every pixel's nearest triangle, which the raytracing programs read
+     * from texture unit PRIMARY_HIT_TEXTURE_UNIT, leaving the framebuffer, viewport and vertex array as they were.
+     */
+    PROFILE_GPU_SCOPE("RASTER");
+    if (primaryHitFramebuffer == 0) {
+        glGenTextures(1, &primaryHitTexture);
+        glBindTexture(GL_TEXTURE_2D, primaryHitTexture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_RG32UI, raytraceNativeWidth, raytraceNativeHeight);
+        // Integer textures are incomplete with the default linear filters, and read as 0
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glGenRenderbuffers(1, &primaryHitDepth);
+        glBindRenderbuffer(GL_RENDERBUFFER, primaryHitDepth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, raytraceNativeWidth, raytraceNativeHeight);
+        glGenFramebuffers(1, &primaryHitFramebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, primaryHitFramebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, primaryHitTexture, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, primaryHitDepth);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "Primary hit framebuffer is incomplete" << std::endl;
+    }
+    GLint viewport[4], prevFramebuffer, prevVAO;
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &prevFramebuffer);
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &prevVAO);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, primaryHitFramebuffer);
+    glViewport(0, 0, raytraceScreenWidth, raytraceScreenHeight);
+    const GLuint noHit[4] = {0, 0, 0, 0};
+    const GLfloat farDepth = 1.0f;
+    glClearBufferuiv(GL_COLOR, 0, noHit);
+    glClearBufferfv(GL_DEPTH, 0, &farDepth);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+    glUseProgram(primaryHitProgram);
+    glBindVertexArray(primaryHitVAO);
+    const glm::mat4 worldToClip = getPrimaryRasterWorldToClip(cameraPos, cameraRotation);
+    for (size_t i = 0; i < rasterInstances.size(); i++) {
+        const RasterInstance &instance = rasterInstances[i];
+        glm::mat4 objectToClip = worldToClip * instance.objectToWorld;
+        glUniformMatrix4fv(glGetUniformLocation(primaryHitProgram, "u_ObjectToClip"), 1, GL_FALSE,
+                           glm::value_ptr(objectToClip));
+        glUniform1ui(glGetUniformLocation(primaryHitProgram, "u_TriangleOffset"), instance.triangleOffset);
+        glUniform1ui(glGetUniformLocation(primaryHitProgram, "u_GeometryOffset"), instance.geometryOffset);
+        glUniform1ui(glGetUniformLocation(primaryHitProgram, "u_InstanceIndex"), (GLuint) i);
+        glDrawArrays(GL_TRIANGLES, 0, (GLsizei) (3 * instance.numTriangles));
+    }
+    glDisable(GL_DEPTH_TEST);
+    glBindVertexArray(prevVAO);
+    glBindFramebuffer(GL_FRAMEBUFFER, prevFramebuffer);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    glActiveTexture(GL_TEXTURE0 + PRIMARY_HIT_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, primaryHitTexture);
+    glActiveTexture(GL_TEXTURE0);
+    checkGLError("(rasterPrimaryHits) draw instances");
+}
+
+static void raytraceWavefront(const RaytracePrograms &programs, int num_groups_x, int num_groups_y,
+                              RaytraceTimings *timings) {
+    /*
+     * Every bounce extends the queued rays, shades their hits, then compacts the survivors into the other queue,
+     * whose size the next bounce's indirect dispatches take from the GPU without a round trip.
+     * The queue size is only read back every WAVEFRONT_QUEUE_READBACK_INTERVAL bounces, to stop early
+     * once every path has ended without stalling on each bounce.
+     */
+    initWavefrontBuffers();
+    const GLuint numPathGroups = (numWavefrontPaths + WAVEFRONT_WORKGROUP_SIZE - 1) / WAVEFRONT_WORKGROUP_SIZE;
+    WavefrontCounters counters{{numWavefrontPaths, 0}, {0, 0}, {{numPathGroups, 1, 1, 0}, {0, 1, 1, 0}}};
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, wavefrontCounterSSBO);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), &counters);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, wavefrontCounterSSBO);
+
+    {
+        PROFILE_GPU_SCOPE("GENERATE");
+        glUseProgram(programs.wavefrontGenerate);
+        glDispatchCompute(numPathGroups, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        markTimestamp(timings, &RaytraceTimings::generateMs);
+    }
+
+    const GLuint zero = 0;
+    for (unsigned int bounce = 0; bounce < RAY_BOUNCES; bounce++) {
+        PROFILE_GPU_SCOPE("BOUNCE");
+        const GLuint queue = bounce % 2;
+        const auto dispatchArgsOffset = (GLintptr) (offsetof(WavefrontCounters, dispatchArgs) +
+                                                    queue * sizeof(glm::uvec4));
+        for (GLuint program : {programs.wavefrontExtend, programs.wavefrontShade, programs.wavefrontCompact}) {
+            glUseProgram(program);
+            glUniform1ui(glGetUniformLocation(program, "u_QueueIndex"), queue);
+        }
+        glUseProgram(programs.wavefrontExtend);
+        glDispatchComputeIndirect(dispatchArgsOffset);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        markTimestamp(timings, &RaytraceTimings::extendMs);
+
+        glUseProgram(programs.wavefrontShade);
+        glDispatchComputeIndirect(dispatchArgsOffset);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        markTimestamp(timings, &RaytraceTimings::shadeMs);
+
+        // Empties the other queue for the survivors
+        glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, (GLintptr) ((1 - queue) * sizeof(uint32_t)),
+                             sizeof(uint32_t), GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+        glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI,
+                             (GLintptr) (offsetof(WavefrontCounters, dispatchArgs) +
+                                         (1 - queue) * sizeof(glm::uvec4)),
+                             sizeof(uint32_t), GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+        glUseProgram(programs.wavefrontCompact);
+        glDispatchComputeIndirect(dispatchArgsOffset);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+        markTimestamp(timings, &RaytraceTimings::compactMs);
+        if (timings != nullptr)
+            timings->numBounces++;
+
+        if ((bounce + 1) % WAVEFRONT_QUEUE_READBACK_INTERVAL == 0) {
+            uint32_t queueSize;
+            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, (GLintptr) ((1 - queue) * sizeof(uint32_t)),
+                               sizeof(uint32_t), &queueSize);
+            if (queueSize == 0)
+                break;
+        }
+    }
+
+    // The shade stage wrote the primary hit distances
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    PROFILE_GPU_SCOPE("RESOLVE");
+    glUseProgram(programs.wavefrontResolve);
     glDispatchCompute(num_groups_x, num_groups_y, 1);
+    markTimestamp(timings, &RaytraceTimings::resolveMs);
+    checkGLError("(raytraceWavefront) dispatch stages");
+}
+
+static void raytraceAdaptive(const RaytracePrograms &programs, int num_groups_x, int num_groups_y,
+                             RaytraceTimings *timings) {
+    /*
+     * The classify pass lists the pixels that have not converged and sizes the megakernel's indirect dispatch,
+     * so converged pixels cost one pass over the screen and no rays.
+     */
+    if (adaptivePixelSSBO == 0) {
+        adaptivePixelSSBO = initSSBO(sizeof(glm::uvec4) + raytraceNativeWidth * raytraceNativeHeight * sizeof(uint32_t),
+                                     nullptr, ADAPTIVE_PIXEL_SSBO_BINDING, GL_DYNAMIC_COPY);
+    }
+    {
+        PROFILE_GPU_SCOPE("ADAPTIVE CLASSIFY");
+        const glm::uvec4 emptyDispatch(0, 1, 1, 0);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, adaptivePixelSSBO);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(emptyDispatch), &emptyDispatch);
+        glUseProgram(programs.adaptiveClassify);
+        glDispatchCompute(num_groups_x, num_groups_y, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+        markTimestamp(timings, &RaytraceTimings::classifyMs);
+    }
+    glUseProgram(programs.megakernel);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, adaptivePixelSSBO);
+    glDispatchComputeIndirect(0);
+}
+
+void raytrace(glm::vec3 cameraPos, glm::mat3 cameraRotation, int renderMode, int frameCount, int num_groups_x,
+              int num_groups_y, int pipeline, RaytraceTimings *timings) {
+    PROFILE_SCOPE("RAYTRACE");
+    PROFILE_GPU_SCOPE("RAYTRACE");
+    if (timings != nullptr)
+        *timings = {};
+    if (!hasPrevCamera) {
+        prevCameraPos = cameraPos;
+        prevCameraRotation = cameraRotation;
+        prevScreenWidth = raytraceScreenWidth;
+        prevScreenHeight = raytraceScreenHeight;
+        hasPrevCamera = true;
+    }
+    const RaytracePrograms &programs = getRaytracePrograms(renderMode);
+    markTimestamp(timings, nullptr);
+    if (primaryRasterEnabled && renderMode == RENDER_MODE) {
+        rasterPrimaryHits(cameraPos, cameraRotation);
+        markTimestamp(timings, &RaytraceTimings::rasterMs);
+    }
+    if (pipeline == RAYTRACE_PIPELINE_WAVEFRONT) {
+        PROFILE_GPU_SCOPE("WAVEFRONT");
+        setFrameUniforms(programs.wavefrontGenerate, cameraPos, cameraRotation, frameCount);
+        setFrameUniforms(programs.wavefrontResolve, cameraPos, cameraRotation, frameCount);
+        // The wavefront stages trace every pixel, without adaptive sampling
+        raytraceWavefront(programs, num_groups_x, num_groups_y, timings);
+    } else {
+        /*
+         * Classifying pixels compares them with the same pixel of the previous frame, so adaptive sampling waits
+         * for the camera and the render resolution to stand still, and for the warm-up frames before any pixel can
+         * have converged.
+         */
+        bool adaptive = adaptiveSamplingEnabled && ADAPTIVE_SAMPLING_THRESHOLD > 0.0f && renderMode == RENDER_MODE &&
+                        !viewChanged(cameraPos, cameraRotation) &&
+                        frameCount >= ADAPTIVE_SAMPLING_WARMUP_FRAMES;
+        PROFILE_GPU_SCOPE("MEGAKERNEL");
+        setFrameUniforms(programs.megakernel, cameraPos, cameraRotation, frameCount);
+        glUniform1ui(glGetUniformLocation(programs.megakernel, "u_AdaptiveSampling"), adaptive);
+        if (adaptive)
+            raytraceAdaptive(programs, num_groups_x, num_groups_y, timings);
+        else
+            glDispatchCompute(num_groups_x, num_groups_y, 1);
+        markTimestamp(timings, nullptr);
+    }
+    readTimestamps(timings);
+    prevCameraPos = cameraPos;
+    prevCameraRotation = cameraRotation;
+    prevScreenWidth = raytraceScreenWidth;
+    prevScreenHeight = raytraceScreenHeight;
+}
+
+static void bindTextures(std::initializer_list<std::pair<GLuint, GLuint>> units) {
+    for (auto [unit, texture] : units) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, texture);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void denoise(GLuint frame, GLuint depth, GLuint guide, GLuint moments, GLuint output, int num_groups_x,
+             int num_groups_y, RaytraceTimings *timings) {
+    /*
+     * The prepare pass divides out the albedo and estimates the variance, then every à-trous iteration reads the
+     * previous pass's result and doubles the step between the filter's taps. The last iteration multiplies the
+     * albedo back in and writes output instead of a ping-pong texture.
+     */
+    PROFILE_SCOPE("DENOISE");
+    PROFILE_GPU_SCOPE("DENOISE");
+    if (denoiseTextures[0] == 0) {
+        glGenTextures(2, denoiseTextures);
+        for (GLuint texture : denoiseTextures) {
+            glBindTexture(GL_TEXTURE_2D, texture);
+            glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, raytraceNativeWidth, raytraceNativeHeight);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        }
+    }
+    markTimestamp(timings, nullptr);
+    for (GLuint program : {denoisePrepareProgram, denoiseAtrousProgram}) {
+        glUseProgram(program);
+        glUniform2i(glGetUniformLocation(program, "u_ScreenSize"), raytraceScreenWidth, raytraceScreenHeight);
+    }
+    bindTextures({{0, frame}, {1, depth}, {2, guide}, {3, moments}});
+    glBindImageTexture(DENOISE_OUTPUT_BINDING, denoiseTextures[0], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glUseProgram(denoisePrepareProgram);
+    glDispatchCompute(num_groups_x, num_groups_y, 1);
+    glUseProgram(denoiseAtrousProgram);
+    for (int i = 0; i < DENOISE_ITERATIONS; i++) {
+        bool last = i == DENOISE_ITERATIONS - 1;
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        bindTextures({{4, denoiseTextures[i % 2]}});
+        glBindImageTexture(DENOISE_OUTPUT_BINDING, last ? output : denoiseTextures[(i + 1) % 2], 0, GL_FALSE, 0,
+                           GL_WRITE_ONLY, GL_RGBA32F);
+        glUniform1i(glGetUniformLocation(denoiseAtrousProgram, "u_StepSize"), 1 << i);
+        glUniform1ui(glGetUniformLocation(denoiseAtrousProgram, "u_Remodulate"), last);
+        glDispatchCompute(num_groups_x, num_groups_y, 1);
+    }
+    markTimestamp(timings, &RaytraceTimings::denoiseMs);
+    readTimestamps(timings);
+    checkGLError("(denoise) dispatch passes");
 }
@@ -4,9 +4,78 @@
 #include "glm/vec3.hpp"
 #include "glm/fwd.hpp"
 #include "glad/glad.h"
+#include "constants.h"
 #include "scene-loader.h"
+#include "dynamic-mesh.h"
 
-extern GLuint raytraceInit(SceneData* sceneData, int screenWidth, int screenHeight);
-extern void raytrace(glm::vec3 cameraPos, glm::mat3 cameraRotation, int renderMode, int frameCount, int num_groups_x, int num_groups_y);
+extern GLuint raytraceInit(const Scene* scene, int screenWidth, int screenHeight);
+
+/*
+ * Renders the following frames at a resolution up to the one raytraceInit was given, into the bottom left corner
+ * of the screen-sized images. The next frame reprojects the previous one across the change like across a camera move.
+ */
+extern void setRenderResolution(int width, int height);
+
+/*
+ * Lets the megakernel stop tracing converged pixels, or makes every frame trace every pixel. Enabled until turned
+ * off, but only has an effect when ADAPTIVE_SAMPLING_THRESHOLD is above 0.
+ */
+extern void setAdaptiveSampling(bool enabled);
+
+/*
+ * Replaces the GPU copy of the TLAS, instances and lights, after buildTLAS has rebuilt them.
+ * The mesh buffers are left as they are.
+ */
+extern void uploadTLAS(const Scene* scene);
+
+/*
+ * Copies the ranges that a dynamic mesh update changed into the scene's mesh buffers,
+ * through a persistently mapped staging buffer where the driver supports one.
+ */
+extern void uploadMeshUpdate(const Scene* scene, uint32_t meshIndex, const MeshUpdate& update);
+
+/*
+ * GPU time of one frame in milliseconds. The stage times are only filled in by the wavefront pipeline,
+ * summed over its bounces, apart from classifyMs, the megakernel's adaptive sampling pass, and rasterMs.
+ */
+struct RaytraceTimings {
+    double totalMs = 0.0;
+    double classifyMs = 0.0;
+    // Raster pre-pass of the primary hits, in the render mode of either pipeline
+    double rasterMs = 0.0;
+    double generateMs = 0.0;
+    double extendMs = 0.0;
+    double shadeMs = 0.0;
+    double compactMs = 0.0;
+    double resolveMs = 0.0;
+    // Added by denoise, which also adds its time to totalMs
+    double denoiseMs = 0.0;
+    int numBounces = 0;
+};
+
+/*
+ * Renders one frame with the given pipeline (RAYTRACE_PIPELINE_MEGAKERNEL or RAYTRACE_PIPELINE_WAVEFRONT).
+ * Besides the frame images, the primary hit distance images must be bound to CURR_DEPTH_BINDING (read and write)
+ * and PREV_DEPTH_BINDING, and the colour moment images to CURR_MOMENTS_BINDING and PREV_MOMENTS_BINDING,
+ * all swapped every frame like the frames, and the denoiser's guide image to GUIDE_BINDING.
+ * Once the camera stands still, the megakernel only traces the pixels that adaptive sampling has not found
+ * converged, if it is enabled (see setAdaptiveSampling). The previous frame is reprojected from the camera pose
+ * and render resolution of the last call, and a frameCount of 0 discards it.
+ * With RASTER_PRIMARY_HITS, the render mode first rasterizes the primary hits, which rebinds texture unit
+ * PRIMARY_HIT_TEXTURE_UNIT and needs vertex shaders to read storage buffers, or traces its camera rays without them.
+ * Passing timings waits for the frame to finish on the GPU and measures it with timestamp queries.
+ */
+extern void raytrace(glm::vec3 cameraPos, glm::mat3 cameraRotation, int renderMode, int frameCount, int num_groups_x,
+                     int num_groups_y, int pipeline = RAYTRACE_PIPELINE, RaytraceTimings* timings = nullptr);
+
+/*
+ * Filters the frame that raytrace just rendered into output, a screen-sized RGBA32F texture, with an edge-aware
+ * à-trous wavelet filter guided by the frame's depth, guide and moment images. The accumulated frame itself is left
+ * as it is, so that the next frame keeps accumulating the unfiltered colour. Rebinds texture units 0 to 4
+ * and image unit DENOISE_OUTPUT_BINDING, and needs an image access barrier after raytrace.
+ * Passing timings, which raytrace has filled in, adds the passes' GPU time to them.
+ */
+extern void denoise(GLuint frame, GLuint depth, GLuint guide, GLuint moments, GLuint output, int num_groups_x,
+                    int num_groups_y, RaytraceTimings* timings = nullptr);
 
 #endif //OPENGL_RAYTRACER_RAYTRACE_H
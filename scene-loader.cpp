@@ -2,29 +2,466 @@
 #include "constants.h"
 #include "obj-reader.h"
 #include "bvh.h"
+#include "bvh-order.h"
+#include "wide-bvh.h"
+#include "task-pool.h"
+#include "mesh-geometry.h"
+#include "profiler.h"
 
-SceneData* loadScene()
-{
-    ObjContents *contents = readObjContents(SCENE_FILE_PATH);
-    std::vector<glm::vec3> triangleVertices = contents->vertices;
-    std::vector<glm::uvec3> triangles = contents->triangles;
-    auto bvh = generateBVH(triangles, triangleVertices);
-    auto bvhNodes = serialiseBVH(bvh);
-    std::vector<AlignedMat3> alignedBVHNodes(bvhNodes.size());
-    for (int i = 0; i < bvhNodes.size(); i++) {
-        alignedBVHNodes[i] = AlignedMat3{
-                glm::vec4(bvhNodes[i][0], 0.0f),
-                glm::vec4(bvhNodes[i][1], 0.0f),
-                glm::vec4(bvhNodes[i][2], 0.0f) };
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <map>
+#include <stdexcept>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+/*
+ * Mesh cache layout: a MeshCacheHeader followed by one section per MeshData buffer,
+ * each starting at a multiple of MESH_CACHE_ALIGNMENT so that it can be used in place once mapped.
+ * The geometry sections of the other layouts than the mesh's are empty.
+ */
+#define MESH_CACHE_BVH 0
+#define MESH_CACHE_WIDE_BVH 1
+#define MESH_CACHE_TRIV0 2
+#define MESH_CACHE_TRIV1 3
+#define MESH_CACHE_TRIV2 4
+#define MESH_CACHE_NORMALS 5
+#define MESH_CACHE_COLOURS 6
+#define MESH_CACHE_TRIANGLE_INDICES 7
+#define MESH_CACHE_VERTICES 8
+#define MESH_CACHE_VERTEX_INDICES 9
+#define MESH_CACHE_QUANTIZED_TRIANGLES 10
+#define MESH_CACHE_QUANTIZATION_BLOCKS 11
+#define MESH_CACHE_PACKED_COLOURS 12
+#define MESH_CACHE_COMPRESSED_BVH 13
+#define MESH_CACHE_NUM_SECTIONS 14
+
+#define MESH_CACHE_ALIGNMENT 64
+
+static const char MESH_CACHE_MAGIC[8] = "RTMESH";
+
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t numTriangles;
+    uint32_t geometryLayout;
+    uint32_t numVertices;
+    uint64_t key;
+    uint64_t sectionOffsets[MESH_CACHE_NUM_SECTIONS];
+    uint64_t sectionSizes[MESH_CACHE_NUM_SECTIONS];
+};
+
+/*
+ * Every constant the built mesh depends on, hashed into the cache key
+ */
+struct MeshBuildParameters {
+    uint32_t version = MESH_CACHE_VERSION;
+    int32_t maxBVHDepth = MAX_BVH_DEPTH;
+    int32_t splitMethod = BVH_SPLIT_METHOD;
+    int32_t splitIterations = BVH_SPLIT_ITERATIONS;
+    int32_t splitBins = BVH_SPLIT_BINS;
+    int32_t spatialBins = BVH_SPATIAL_BINS;
+    float duplicationBudget = SBVH_DUPLICATION_BUDGET;
+    float overlapThreshold = SBVH_OVERLAP_THRESHOLD;
+    int32_t plocSearchRadius = PLOC_SEARCH_RADIUS;
+    int32_t optimizeTreelets = BVH_OPTIMIZE_TREELETS;
+    int32_t treeletSize = BVH_TREELET_SIZE;
+    int32_t treeletMinTriangles = BVH_TREELET_MIN_TRIANGLES;
+    int32_t treeletPasses = BVH_TREELET_PASSES;
+    float traversalCost = BVH_TRAVERSAL_COST;
+    float intersectionCost = BVH_INTERSECTION_COST;
+    int32_t layout = BVH_LAYOUT;
+    int32_t width = BVH_WIDTH;
+    int32_t nodeOrder = BVH_NODE_ORDER;
+    int32_t nodeBlockSize = BVH_NODE_BLOCK_SIZE;
+    int32_t geometryLayout = GEOMETRY_LAYOUT;
+    int32_t quantizationBlockSize = QUANTIZATION_BLOCK_SIZE;
+    uint32_t colourSeed = TRIANGLE_COLOUR_SEED;
+    uint32_t nodeSize = sizeof(BVHNode);
+    uint32_t wideNodeSize = sizeof(WideBVHNode);
+    uint32_t compressedNodeSize = sizeof(CompressedBVHNode);
+};
+
+static const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+static const uint64_t FNV_PRIME = 0x100000001b3ull;
+
+static uint64_t hashBytes(const char *data, size_t size, uint64_t hash = FNV_OFFSET_BASIS) {
+    /*
+     * FNV-1a over 8 byte words, then the remaining bytes.
+     */
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * FNV_PRIME;
     }
+    for (; i < size; i++)
+        hash = (hash ^ (uint8_t) data[i]) * FNV_PRIME;
+    return hash;
+}
 
+static uint64_t getMeshCacheKey(TaskPool &pool, const MappedFile &objFile) {
+    /*
+     * Hashes fixed-size chunks of the OBJ file in parallel, then the chunk hashes and the build parameters.
+     * The chunk size does not depend on the number of threads, so neither does the key.
+     */
+    PROFILE_SCOPE("HASH MESH FILE");
+    size_t numChunks = (objFile.getSize() + MESH_HASH_CHUNK_SIZE - 1) / MESH_HASH_CHUNK_SIZE;
+    std::vector<uint64_t> chunkHashes(numChunks);
+    parallelForChunks(pool, 0, (int) numChunks, 1, [&](int, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++) {
+            size_t start = i * MESH_HASH_CHUNK_SIZE;
+            chunkHashes[i] = hashBytes(objFile.getData() + start,
+                                       std::min(MESH_HASH_CHUNK_SIZE, objFile.getSize() - start));
+        }
+    });
+    MeshBuildParameters parameters;
+    uint64_t key = hashBytes((const char *) &parameters, sizeof(parameters));
+    key = hashBytes((const char *) chunkHashes.data(), chunkHashes.size() * sizeof(uint64_t), key);
+    return hashBytes((const char *) &numChunks, sizeof(numChunks), key);
+}
+
+template<typename T>
+static std::span<const T> getSection(const std::byte *data, const MeshCacheHeader &header, int section) {
+    return {(const T *) (data + header.sectionOffsets[section]), header.sectionSizes[section] / sizeof(T)};
+}
+
+static void setMeshSections(MeshData &mesh, const std::byte *data) {
+    MeshCacheHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    mesh.numTriangles = (int) header.numTriangles;
+    mesh.geometryLayout = (int) header.geometryLayout;
+    mesh.bvhNodes = getSection<BVHNode>(data, header, MESH_CACHE_BVH);
+    mesh.wideBVHNodes = getSection<WideBVHNode>(data, header, MESH_CACHE_WIDE_BVH);
+    mesh.compressedBVHNodes = getSection<CompressedBVHNode>(data, header, MESH_CACHE_COMPRESSED_BVH);
+    mesh.triv0 = getSection<glm::vec4>(data, header, MESH_CACHE_TRIV0);
+    mesh.triv1 = getSection<glm::vec4>(data, header, MESH_CACHE_TRIV1);
+    mesh.triv2 = getSection<glm::vec4>(data, header, MESH_CACHE_TRIV2);
+    mesh.triangleNormals = getSection<glm::vec4>(data, header, MESH_CACHE_NORMALS);
+    mesh.triangleColours = getSection<glm::vec4>(data, header, MESH_CACHE_COLOURS);
+    mesh.triangleIndices = getSection<uint32_t>(data, header, MESH_CACHE_TRIANGLE_INDICES);
+    mesh.vertices = getSection<glm::vec3>(data, header, MESH_CACHE_VERTICES);
+    mesh.vertexIndices = getSection<glm::uvec3>(data, header, MESH_CACHE_VERTEX_INDICES);
+    mesh.quantizedTriangles = getSection<QuantizedTriangle>(data, header, MESH_CACHE_QUANTIZED_TRIANGLES);
+    mesh.quantizationBlocks = getSection<QuantizationBlock>(data, header, MESH_CACHE_QUANTIZATION_BLOCKS);
+    mesh.packedColours = getSection<uint32_t>(data, header, MESH_CACHE_PACKED_COLOURS);
+}
+
+static bool setGeometrySectionSizes(MeshCacheHeader &header) {
+    /*
+     * Sizes the geometry sections for the header's layout, triangle count and vertex count,
+     * returning false for an unknown layout.
+     */
+    uint64_t numTriangles = header.numTriangles;
+    for (int i : {MESH_CACHE_TRIV0, MESH_CACHE_TRIV1, MESH_CACHE_TRIV2, MESH_CACHE_NORMALS, MESH_CACHE_COLOURS,
+                  MESH_CACHE_VERTICES, MESH_CACHE_VERTEX_INDICES, MESH_CACHE_QUANTIZED_TRIANGLES,
+                  MESH_CACHE_QUANTIZATION_BLOCKS, MESH_CACHE_PACKED_COLOURS})
+        header.sectionSizes[i] = 0;
+    switch (header.geometryLayout) {
+        case GEOMETRY_LAYOUT_SOUP:
+        case GEOMETRY_LAYOUT_EDGES:
+            for (int i = MESH_CACHE_TRIV0; i <= MESH_CACHE_COLOURS; i++)
+                header.sectionSizes[i] = numTriangles * sizeof(glm::vec4);
+            return true;
+        case GEOMETRY_LAYOUT_INDEXED:
+            header.sectionSizes[MESH_CACHE_VERTICES] = (uint64_t) header.numVertices * sizeof(glm::vec3);
+            header.sectionSizes[MESH_CACHE_VERTEX_INDICES] = numTriangles * sizeof(glm::uvec3);
+            header.sectionSizes[MESH_CACHE_PACKED_COLOURS] = numTriangles * sizeof(uint32_t);
+            return true;
+        case GEOMETRY_LAYOUT_QUANTIZED:
+            header.sectionSizes[MESH_CACHE_QUANTIZED_TRIANGLES] = numTriangles * sizeof(QuantizedTriangle);
+            header.sectionSizes[MESH_CACHE_QUANTIZATION_BLOCKS] =
+                    (numTriangles + QUANTIZATION_BLOCK_SIZE - 1) / QUANTIZATION_BLOCK_SIZE * sizeof(QuantizationBlock);
+            header.sectionSizes[MESH_CACHE_PACKED_COLOURS] = numTriangles * sizeof(uint32_t);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isValidMeshCache(const MappedFile &file, uint64_t key) {
+    /*
+     * Checks that the cache was written by this version for the same key,
+     * and that every section lies inside the file with the size its triangle count implies.
+     */
+    MeshCacheHeader header;
+    if (file.getSize() < sizeof(header))
+        return false;
+    std::memcpy(&header, file.getData(), sizeof(header));
+    if (std::memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != MESH_CACHE_VERSION || header.key != key)
+        return false;
+    for (int i = 0; i < MESH_CACHE_NUM_SECTIONS; i++) {
+        if (header.sectionOffsets[i] % MESH_CACHE_ALIGNMENT != 0 ||
+            header.sectionOffsets[i] + header.sectionSizes[i] > file.getSize())
+            return false;
+    }
+    MeshCacheHeader expected = header;
+    if (!setGeometrySectionSizes(expected) ||
+        std::memcmp(expected.sectionSizes, header.sectionSizes, sizeof(header.sectionSizes)) != 0)
+        return false;
+    return header.sectionSizes[MESH_CACHE_BVH] % sizeof(BVHNode) == 0 &&
+           header.sectionSizes[MESH_CACHE_WIDE_BVH] % sizeof(WideBVHNode) == 0 &&
+           header.sectionSizes[MESH_CACHE_COMPRESSED_BVH] % sizeof(CompressedBVHNode) == 0 &&
+           header.sectionSizes[MESH_CACHE_TRIANGLE_INDICES] % sizeof(uint32_t) == 0;
+}
+
+static MeshData *serializeMesh(TaskPool &pool, const std::vector<glm::vec3> &triangleVertices,
+                               const std::vector<glm::uvec3> &triangles, const std::vector<BVHNode> &bvhNodes,
+                               const std::vector<WideBVHNode> &wideBVHNodes,
+                               const std::vector<uint32_t> &triangleIndices, int geometryLayout, uint64_t key,
+                               size_t bvhNodeCapacity = 0, size_t wideBVHNodeCapacity = 0) {
+    PROFILE_SCOPE("SERIALIZE MESH");
     const int numTriangles = (int) triangles.size();
-    std::vector<glm::vec4> triv0(numTriangles), triv1(numTriangles), triv2(numTriangles);
+    MeshCacheHeader header{};
+    std::memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MESH_CACHE_VERSION;
+    header.numTriangles = (uint32_t) numTriangles;
+    header.geometryLayout = (uint32_t) geometryLayout;
+    header.numVertices = (uint32_t) triangleVertices.size();
+    header.key = key;
+    if (!setGeometrySectionSizes(header))
+        throw std::runtime_error("Unknown geometry layout " + std::to_string(geometryLayout));
+    header.sectionSizes[MESH_CACHE_BVH] = std::max(bvhNodes.size(), bvhNodeCapacity) * sizeof(BVHNode);
+    header.sectionSizes[MESH_CACHE_WIDE_BVH] =
+            std::max(wideBVHNodes.size(), wideBVHNodeCapacity) * sizeof(WideBVHNode);
+    // Compressed nodes mirror the wide ones, with the same capacity
+    if (BVH_LAYOUT == BVH_LAYOUT_COMPRESSED)
+        header.sectionSizes[MESH_CACHE_COMPRESSED_BVH] =
+                header.sectionSizes[MESH_CACHE_WIDE_BVH] / sizeof(WideBVHNode) * sizeof(CompressedBVHNode);
+    header.sectionSizes[MESH_CACHE_TRIANGLE_INDICES] = triangleIndices.size() * sizeof(uint32_t);
+    uint64_t size = sizeof(header);
+    for (int i = 0; i < MESH_CACHE_NUM_SECTIONS; i++) {
+        header.sectionOffsets[i] = (size + MESH_CACHE_ALIGNMENT - 1) / MESH_CACHE_ALIGNMENT * MESH_CACHE_ALIGNMENT;
+        size = header.sectionOffsets[i] + header.sectionSizes[i];
+    }
+
+    auto *mesh = new MeshData{};
+    mesh->buffer.resize(size);
+    std::byte *data = mesh->buffer.data();
+    std::memcpy(data, &header, sizeof(header));
+    std::memcpy(data + header.sectionOffsets[MESH_CACHE_BVH], bvhNodes.data(), bvhNodes.size() * sizeof(BVHNode));
+    std::memcpy(data + header.sectionOffsets[MESH_CACHE_WIDE_BVH], wideBVHNodes.data(),
+                wideBVHNodes.size() * sizeof(WideBVHNode));
+    std::memcpy(data + header.sectionOffsets[MESH_CACHE_TRIANGLE_INDICES], triangleIndices.data(),
+                header.sectionSizes[MESH_CACHE_TRIANGLE_INDICES]);
+    if (BVH_LAYOUT == BVH_LAYOUT_COMPRESSED)
+        compressBVH(wideBVHNodes, {(CompressedBVHNode *) (data + header.sectionOffsets[MESH_CACHE_COMPRESSED_BVH]),
+                                   wideBVHNodes.size()}, &pool);
+    setMeshSections(*mesh, data);
+    writeMeshGeometry(pool, *mesh, triangleVertices, triangles);
+    // Seeded so that every backend, every run and every geometry layout colours the triangles the same way
+    auto *triangleColours = (glm::vec4 *) (data + header.sectionOffsets[MESH_CACHE_COLOURS]);
+    auto *packedColours = (uint32_t *) (data + header.sectionOffsets[MESH_CACHE_PACKED_COLOURS]);
+    const bool packed = !mesh->packedColours.empty();
+    std::mt19937 gen(TRIANGLE_COLOUR_SEED);
+    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
     for (int i = 0; i < numTriangles; i++) {
-        triv0[i] = glm::vec4(triangleVertices[triangles[i].x], 0.0f);
-        triv1[i] = glm::vec4(triangleVertices[triangles[i].y], 0.0f);
-        triv2[i] = glm::vec4(triangleVertices[triangles[i].z], 0.0f);
+        glm::vec4 colour(dist(gen), dist(gen), dist(gen), 1.0f);
+        if (packed)
+            packedColours[i] = glm::packUnorm4x8(colour);
+        else
+            triangleColours[i] = colour;
+    }
+    return mesh;
+}
+
+static MeshData *buildMesh(TaskPool &pool, const std::vector<glm::vec3> &triangleVertices,
+                           std::vector<glm::uvec3> triangles, const BVHBuildOptions &options, int geometryLayout,
+                           uint64_t key, BVHBuildStats *stats = nullptr) {
+    /*
+     * Builds the mesh and serializes it in the cache layout, so that it is used the same way as a mapped cache.
+     */
+    PROFILE_SCOPE("BUILD MESH");
+    std::vector<uint32_t> triangleIndices;
+    std::vector<BVHNode> bvhNodes = orderBVH(generateBVH(triangles, triangleVertices, triangleIndices, options, stats),
+                                             BVH_NODE_ORDER);
+    std::vector<WideBVHNode> wideBVHNodes;
+    if (BVH_LAYOUT != BVH_LAYOUT_BINARY)
+        wideBVHNodes = collapseBVH(bvhNodes, options.printStats);
+    MeshData *mesh = serializeMesh(pool, triangleVertices, triangles, bvhNodes, wideBVHNodes, triangleIndices,
+                                   geometryLayout, key);
+    if (options.printStats && !mesh->compressedBVHNodes.empty())
+        printCompressedBVHStats(mesh->wideBVHNodes, mesh->compressedBVHNodes);
+    return mesh;
+}
+
+MeshData *serializeMesh(const std::vector<glm::vec3> &vertices, const std::vector<glm::uvec3> &triangles,
+                        const std::vector<BVHNode> &bvhNodes, const std::vector<WideBVHNode> &wideBVHNodes,
+                        const std::vector<uint32_t> &triangleIndices, size_t bvhNodeCapacity,
+                        size_t wideBVHNodeCapacity) {
+    TaskPool pool;
+    return serializeMesh(pool, vertices, triangles, bvhNodes, wideBVHNodes, triangleIndices, GEOMETRY_LAYOUT, 0,
+                         bvhNodeCapacity, wideBVHNodeCapacity);
+}
+
+static void writeMeshCache(const MeshData &mesh, const std::string &cachePath) {
+    /*
+     * Writes to a temporary file first, so that an interrupted write never leaves a cache that looks valid.
+     */
+    PROFILE_SCOPE("WRITE MESH CACHE");
+    std::string tempPath = cachePath + ".tmp";
+    {
+        std::ofstream fout(tempPath, std::ios::binary);
+        fout.write((const char *) mesh.buffer.data(), (std::streamsize) mesh.buffer.size());
+        if (!fout) {
+            std::cout << "COULD NOT WRITE MESH CACHE " << cachePath << std::endl;
+            return;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(tempPath, cachePath, error);
+    if (error)
+        std::cout << "COULD NOT WRITE MESH CACHE " << cachePath << ": " << error.message() << std::endl;
+}
+
+MeshData *buildMesh(const ObjContents &contents, const BVHBuildOptions &options, BVHBuildStats *stats,
+                    int geometryLayout) {
+    TaskPool pool;
+    return buildMesh(pool, contents.vertices, contents.triangles, options, geometryLayout, 0, stats);
+}
+
+std::string getMeshCachePath(const std::string &filePath) {
+    return filePath + MESH_CACHE_EXTENSION;
+}
+
+MeshData *loadMesh(const std::string &filePath, MeshLoadStats *stats) {
+    PROFILE_SCOPE("LOAD MESH");
+    auto loadStart = std::chrono::high_resolution_clock::now();
+    TaskPool pool;
+    uint64_t key = getMeshCacheKey(pool, MappedFile(filePath));
+    std::string cachePath = getMeshCachePath(filePath);
+    MeshData *mesh = nullptr;
+    if (std::filesystem::exists(cachePath)) {
+        auto cacheFile = std::make_unique<MappedFile>(cachePath);
+        if (isValidMeshCache(*cacheFile, key)) {
+            mesh = new MeshData{};
+            setMeshSections(*mesh, (const std::byte *) cacheFile->getData());
+            mesh->cacheFile = std::move(cacheFile);
+        } else {
+            std::cout << "MESH CACHE " << cachePath << " IS STALE" << std::endl;
+        }
+    }
+    bool fromCache = mesh != nullptr;
+    if (!fromCache) {
+        ObjContents *contents = readObjContents(filePath);
+        if (contents->triangles.empty()) {
+            delete contents;
+            throw std::runtime_error("No triangles in file: " + filePath);
+        }
+        mesh = buildMesh(pool, contents->vertices, std::move(contents->triangles), {}, GEOMETRY_LAYOUT, key);
+        delete contents;
+        writeMeshCache(*mesh, cachePath);
+    }
+    std::chrono::duration<double, std::milli> loadTime = std::chrono::high_resolution_clock::now() - loadStart;
+    if (stats != nullptr)
+        *stats = {fromCache, loadTime.count()};
+    std::cout << (fromCache ? "WARM" : "COLD") << " MESH LOAD: " << loadTime.count() << " ms ("
+              << mesh->numTriangles << " TRIANGLES, " << (fromCache ? "READ " : "WROTE ") << cachePath << ")"
+              << std::endl;
+    return mesh;
+}
+
+static glm::mat4 getInstanceTransform(glm::vec3 position, glm::vec3 degrees, float scale) {
+    /*
+     * Scales, then rolls about z, pitches about x and yaws about y, then translates.
+     */
+    glm::vec3 radians = glm::radians(degrees);
+    glm::mat4 transform = glm::translate(glm::mat4(1.0f), position);
+    transform = glm::rotate(transform, radians.y, glm::vec3(0.0f, 1.0f, 0.0f));
+    transform = glm::rotate(transform, radians.x, glm::vec3(1.0f, 0.0f, 0.0f));
+    transform = glm::rotate(transform, radians.z, glm::vec3(0.0f, 0.0f, 1.0f));
+    return glm::scale(transform, glm::vec3(scale));
+}
+
+static void readSceneFile(const std::string &filePath, std::vector<std::string> &meshPaths,
+                          std::vector<glm::vec3> &meshEmissions, std::vector<Instance> &instances) {
+    std::ifstream fin(filePath);
+    if (!fin)
+        throw std::runtime_error("Could not open file: " + filePath);
+    std::filesystem::path directory = std::filesystem::path(filePath).parent_path();
+    std::map<std::string, uint32_t> meshIndices;
+    std::string line;
+    for (int lineNumber = 1; std::getline(fin, line); lineNumber++) {
+        std::istringstream iss(line);
+        std::string type, name;
+        if (!(iss >> type) || type.starts_with("#"))
+            continue;
+        bool valid = false;
+        if (type == "mesh") {
+            std::string meshPath;
+            valid = iss >> name >> meshPath && !meshIndices.contains(name);
+            if (valid) {
+                meshIndices[name] = (uint32_t) meshPaths.size();
+                meshPaths.push_back((directory / meshPath).string());
+                meshEmissions.emplace_back(0.0f);
+            }
+        } else if (type == "instance") {
+            glm::vec3 position;
+            valid = iss >> name >> position.x >> position.y >> position.z && meshIndices.contains(name);
+            // The rotation and the scale are optional
+            std::vector<float> values;
+            for (float value; iss >> value;)
+                values.push_back(value);
+            valid = valid && iss.eof() && (values.empty() || values.size() == 3 || values.size() == 4);
+            if (valid) {
+                glm::vec3 degrees = values.empty() ? glm::vec3(0.0f) : glm::vec3(values[0], values[1], values[2]);
+                float scale = values.size() == 4 ? values[3] : 1.0f;
+                instances.push_back({meshIndices[name], getInstanceTransform(position, degrees, scale)});
+            }
+        } else if (type == "emission") {
+            glm::vec3 emission;
+            valid = iss >> name >> emission.r >> emission.g >> emission.b && meshIndices.contains(name) &&
+                    std::min({emission.r, emission.g, emission.b}) >= 0.0f;
+            if (valid)
+                meshEmissions[meshIndices[name]] = emission;
+        }
+        if (!valid)
+            throw std::runtime_error("Malformed line " + std::to_string(lineNumber) + " in file: " + filePath);
+    }
+}
+
+Scene *loadScene(const std::string &filePath, SceneLoadStats *stats) {
+    PROFILE_SCOPE("LOAD SCENE");
+    auto loadStart = std::chrono::high_resolution_clock::now();
+    std::vector<std::string> meshPaths;
+    std::vector<glm::vec3> meshEmissions;
+    std::vector<Instance> instances;
+    if (std::filesystem::path(filePath).extension() == SCENE_FILE_EXTENSION) {
+        readSceneFile(filePath, meshPaths, meshEmissions, instances);
+    } else {
+        meshPaths = {filePath};
+        meshEmissions = {glm::vec3(0.0f)};
+        instances = {{0, glm::mat4(1.0f)}};
+    }
+    SceneLoadStats sceneStats;
+    std::vector<std::unique_ptr<MeshData>> meshes;
+    for (size_t i = 0; i < meshPaths.size(); i++) {
+        MeshLoadStats meshStats;
+        meshes.emplace_back(loadMesh(meshPaths[i], &meshStats));
+        meshes.back()->emission = meshEmissions[i];
+        sceneStats.numMeshesFromCache += meshStats.fromCache;
     }
-    free(contents);
-    return new SceneData{ numTriangles, alignedBVHNodes, triv0, triv1, triv2 };
-}
\ No newline at end of file
+    Scene *scene = createScene(std::move(meshes), std::move(instances));
+    std::chrono::duration<double, std::milli> loadTime = std::chrono::high_resolution_clock::now() - loadStart;
+    sceneStats.loadTimeMs = loadTime.count();
+    if (stats != nullptr)
+        *stats = sceneStats;
+    uint64_t numUniqueTriangles = 0, numInstancedTriangles = 0;
+    for (const std::unique_ptr<MeshData> &mesh : scene->meshes)
+        numUniqueTriangles += mesh->numTriangles;
+    for (const Instance &instance : scene->instances)
+        numInstancedTriangles += scene->meshes[instance.meshIndex]->numTriangles;
+    std::cout << "SCENE LOAD: " << sceneStats.loadTimeMs << " ms (" << scene->meshes.size() << " MESHES, "
+              << numUniqueTriangles << " UNIQUE TRIANGLES, " << scene->instances.size() << " INSTANCES, "
+              << numInstancedTriangles << " INSTANCED TRIANGLES, " << scene->lights.size() << " LIGHTS)" << std::endl;
+    return scene;
+}
@@ -2,18 +2,56 @@
 #define OPENGL_RAYTRACER_SCENE_LOADER_H
 
 #include <glm/glm.hpp>
-#include <vector>
+#include <string>
 
-struct AlignedMat3 {
-    glm::vec4 u, v, w;
+#include "constants.h"
+#include "bvh.h"
+#include "obj-reader.h"
+#include "scene.h"
+
+struct MeshLoadStats {
+    bool fromCache = false;
+    double loadTimeMs = 0.0;
 };
 
-struct SceneData {
-    int numTriangles;
-    std::vector<AlignedMat3> alignedBVHNodes;
-    std::vector<glm::vec4> triv0, triv1, triv2;
+struct SceneLoadStats {
+    int numMeshesFromCache = 0;
+    double loadTimeMs = 0.0;
 };
 
-extern SceneData* loadScene();
+/*
+ * Loads a mesh from its cache next to the OBJ file, or builds it and writes the cache
+ * if the cache is missing or was built from a different OBJ file or different build constants.
+ * Throws if the OBJ file has no triangles.
+ */
+extern MeshData* loadMesh(const std::string& filePath, MeshLoadStats* stats = nullptr);
+
+/*
+ * Builds a mesh from already loaded OBJ contents, without reading or writing a cache.
+ */
+extern MeshData* buildMesh(const ObjContents& contents, const BVHBuildOptions& options = {},
+                           BVHBuildStats* stats = nullptr, int geometryLayout = GEOMETRY_LAYOUT);
+
+/*
+ * Lays out an already built mesh in the cache layout, without a cache file. The BVH sections are padded with
+ * zeroed nodes up to the given capacities, so that a rebuild with more nodes can later be written in place.
+ */
+extern MeshData* serializeMesh(const std::vector<glm::vec3>& vertices, const std::vector<glm::uvec3>& triangles,
+                               const std::vector<BVHNode>& bvhNodes, const std::vector<WideBVHNode>& wideBVHNodes,
+                               const std::vector<uint32_t>& triangleIndices, size_t bvhNodeCapacity = 0,
+                               size_t wideBVHNodeCapacity = 0);
+
+extern std::string getMeshCachePath(const std::string& filePath);
+
+/*
+ * Loads a scene file (ending in SCENE_FILE_EXTENSION), or a single OBJ file as one instance at the origin.
+ * Scene files have one statement per line, with mesh paths relative to the scene file and angles in degrees:
+ *   # comment
+ *   mesh <name> <OBJ file>
+ *   instance <mesh name> <x> <y> <z> [<pitch> <yaw> <roll> [<scale>]]
+ *   emission <mesh name> <r> <g> <b>
+ * Each mesh is loaded once however many instances it has.
+ */
+extern Scene* loadScene(const std::string& filePath = SCENE_FILE_PATH, SceneLoadStats* stats = nullptr);
 
-#endif //OPENGL_RAYTRACER_SCENE_LOADER_H
\ No newline at end of file
+#endif //OPENGL_RAYTRACER_SCENE_LOADER_H
@@ -0,0 +1,126 @@
+#include "scene.h"
+#include "mesh-geometry.h"
+#include "profiler.h"
+
+#include <stdexcept>
+#include <string>
+
+BVHBox getInstanceBounds(const Scene &scene, const Instance &instance) {
+    /*
+     * Transforms the 8 corners of the mesh's root box, giving world bounds that contain the instance.
+     */
+    const BVHNode &root = scene.meshes[instance.meshIndex]->bvhNodes[0];
+    BVHBox bounds{MAX_VERTEX, MIN_VERTEX};
+    for (int i = 0; i < 8; i++) {
+        glm::vec3 corner((i & 1) ? root.maxCorner.x : root.minCorner.x,
+                         (i & 2) ? root.maxCorner.y : root.minCorner.y,
+                         (i & 4) ? root.maxCorner.z : root.minCorner.z);
+        glm::vec3 worldCorner = instance.objectToWorld * glm::vec4(corner, 1.0f);
+        bounds.minCorner = min(bounds.minCorner, worldCorner);
+        bounds.maxCorner = max(bounds.maxCorner, worldCorner);
+    }
+    return bounds;
+}
+
+float getLightLuminance(glm::vec3 emission) {
+    return dot(emission, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+static void buildLights(Scene &scene) {
+    /*
+     * Collects the emissive triangles in world space and builds their alias table with Vose's method:
+     * entries whose power is below the average are topped up from one above it, which becomes their alias.
+     * Lights are numbered in TLAS order, so the table only depends on the scene, not on the order it was built in.
+     */
+    scene.lights.clear();
+    std::vector<float> powers;
+    for (size_t i = 0; i < scene.tlasInstanceIndices.size(); i++) {
+        const Instance &instance = scene.instances[scene.tlasInstanceIndices[i]];
+        const MeshData &mesh = *scene.meshes[instance.meshIndex];
+        if (getLightLuminance(mesh.emission) <= 0.0f)
+            continue;
+        for (int j = 0; j < mesh.numTriangles; j++) {
+            TriangleEdges triangle = getTriangleEdges(mesh, j);
+            SceneLight light{};
+            light.v0 = instance.objectToWorld * glm::vec4(triangle.v0, 1.0f);
+            light.v1 = instance.objectToWorld * glm::vec4(triangle.v0 + triangle.edge1, 1.0f);
+            light.v2 = instance.objectToWorld * glm::vec4(triangle.v0 + triangle.edge2, 1.0f);
+            light.emission = mesh.emission;
+            float area = 0.5f * length(cross(light.v1 - light.v0, light.v2 - light.v0));
+            scene.lights.push_back(light);
+            powers.push_back(getLightLuminance(mesh.emission) * area);
+        }
+    }
+    double totalPower = 0.0;
+    for (float power : powers)
+        totalPower += power;
+    scene.totalLightPower = (float) totalPower;
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < powers.size(); i++) {
+        // Scaled so that the average entry is 1
+        powers[i] = (float) ((double) powers[i] * (double) powers.size() / totalPower);
+        (powers[i] < 1.0f ? small : large).push_back((uint32_t) i);
+    }
+    while (!small.empty() && !large.empty()) {
+        uint32_t lower = small.back(), upper = large.back();
+        small.pop_back();
+        scene.lights[lower].aliasThreshold = powers[lower];
+        scene.lights[lower].alias = upper;
+        powers[upper] -= 1.0f - powers[lower];
+        if (powers[upper] < 1.0f) {
+            large.pop_back();
+            small.push_back(upper);
+        }
+    }
+    // Whatever is left is 1 up to rounding
+    small.insert(small.end(), large.begin(), large.end());
+    for (uint32_t i : small) {
+        scene.lights[i].aliasThreshold = 1.0f;
+        scene.lights[i].alias = i;
+    }
+}
+
+void buildTLAS(Scene &scene, BVHBuildStats *stats) {
+    PROFILE_SCOPE("BUILD TLAS");
+    std::vector<BVHBox> bounds(scene.instances.size());
+    for (size_t i = 0; i < scene.instances.size(); i++)
+        bounds[i] = getInstanceBounds(scene, scene.instances[i]);
+    scene.tlasNodes = generateBVH(*scene.pool, bounds, scene.tlasInstanceIndices,
+                                  {BVH_SPLIT_BINNED, BVH_BUILD_THREADS, false}, stats);
+    scene.tlasInstances.resize(scene.tlasInstanceIndices.size());
+    for (size_t i = 0; i < scene.tlasInstanceIndices.size(); i++) {
+        const Instance &instance = scene.instances[scene.tlasInstanceIndices[i]];
+        const MeshOffsets &offsets = scene.meshOffsets[instance.meshIndex];
+        scene.tlasInstances[i] = {glm::inverse(instance.objectToWorld), offsets.bvhOffset, offsets.wideBVHOffset,
+                                  offsets.triangleIndexOffset, offsets.triangleOffset,
+                                  scene.meshes[instance.meshIndex]->emission, offsets.geometryOffset};
+    }
+    buildLights(scene);
+}
+
+Scene *createScene(std::vector<std::unique_ptr<MeshData>> meshes, std::vector<Instance> instances) {
+    if (instances.empty())
+        throw std::runtime_error("Scene has no instances");
+    auto *scene = new Scene;
+    scene->meshes = std::move(meshes);
+    scene->pool = std::make_unique<TaskPool>(BVH_BUILD_THREADS);
+    MeshOffsets offsets{};
+    for (const std::unique_ptr<MeshData> &mesh : scene->meshes) {
+        scene->meshOffsets.push_back(offsets);
+        offsets.bvhOffset += (uint32_t) mesh->bvhNodes.size();
+        offsets.wideBVHOffset += (uint32_t) mesh->wideBVHNodes.size();
+        offsets.triangleIndexOffset += (uint32_t) mesh->triangleIndices.size();
+        offsets.triangleOffset += (uint32_t) mesh->numTriangles;
+        // At most one of the two is not empty
+        offsets.geometryOffset += (uint32_t) (mesh->vertices.size() + mesh->quantizationBlocks.size());
+    }
+    for (const Instance &instance : instances) {
+        if (instance.meshIndex >= scene->meshes.size()) {
+            delete scene;
+            throw std::runtime_error("Instance of missing mesh " + std::to_string(instance.meshIndex));
+        }
+    }
+    scene->instances = std::move(instances);
+    buildTLAS(*scene);
+    return scene;
+}
@@ -0,0 +1,178 @@
+#ifndef OPENGL_RAYTRACER_SCENE_H
+#define OPENGL_RAYTRACER_SCENE_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <span>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+#include "constants.h"
+#include "bvh.h"
+#include "wide-bvh.h"
+#include "mapped-file.h"
+#include "task-pool.h"
+
+/*
+ * Triangle of GEOMETRY_LAYOUT_QUANTIZED: its vertices' coordinates, v0 then v1 then v2, as 16 bit offsets
+ * on its block's grid. Matches the shader's 5 words per triangle.
+ */
+struct QuantizedTriangle {
+    uint16_t coords[9];
+    uint16_t padding;
+};
+
+static_assert(sizeof(QuantizedTriangle) == 20, "QuantizedTriangle must match the shader's 5 words per triangle");
+
+/*
+ * Grid that QUANTIZATION_BLOCK_SIZE consecutive triangles of GEOMETRY_LAYOUT_QUANTIZED are stored on.
+ * A triangle's vertex is meshMin + step * (gridOrigin + its coordinates). Every block of a mesh shares its meshMin
+ * and step, so a vertex shared by triangles of different blocks decodes to the same point in all of them.
+ * Matches the std430 layout of QuantizationBlock in geometry-common.glsl.
+ */
+struct QuantizationBlock {
+    glm::vec3 meshMin;
+    float step;
+    glm::uvec3 gridOrigin;
+    uint32_t padding;
+};
+
+static_assert(sizeof(QuantizationBlock) == 32, "QuantizationBlock must match the shader's QuantizationBlock");
+
+/*
+ * One OBJ file's triangles and bottom-level BVH, as views into its serialized form (see scene-loader.cpp),
+ * which is either the mapped mesh cache or, right after a build, an in-memory copy of it.
+ * Triangles are in object space, and are shared by every instance of the mesh.
+ * The triangles are stored in one of the GEOMETRY_LAYOUT_* layouts, whose sections are set and the others left empty:
+ *   SOUP: each triangle's vertices in triv0, triv1 and triv2, with its normal and colour
+ *   EDGES: each triangle's first vertex in triv0 and its edges to the other two in triv1 and triv2, which spares
+ *          the intersection test two subtractions, with its normal and colour
+ *   INDEXED: the mesh's vertices once each, vertexIndices holding each triangle's three, and packedColours
+ *   QUANTIZED: quantizedTriangles on the grids of quantizationBlocks, and packedColours
+ */
+struct MeshData {
+    int numTriangles;
+    int geometryLayout;
+    std::span<const BVHNode> bvhNodes;
+    // Only built when BVH_LAYOUT is BVH_LAYOUT_WIDE or BVH_LAYOUT_COMPRESSED
+    std::span<const WideBVHNode> wideBVHNodes;
+    // Only built when BVH_LAYOUT is BVH_LAYOUT_COMPRESSED, one per wide node
+    std::span<const CompressedBVHNode> compressedBVHNodes;
+    // Leaves of both BVH layouts index this list, which holds triangle indices
+    std::span<const uint32_t> triangleIndices;
+    std::span<const glm::vec4> triv0, triv1, triv2;
+    // Unit normals with w = 0, matching the std430 layout of the shader's vec3 array
+    std::span<const glm::vec4> triangleNormals;
+    std::span<const glm::vec4> triangleColours;
+    std::span<const glm::vec3> vertices;
+    std::span<const glm::uvec3> vertexIndices;
+    std::span<const QuantizedTriangle> quantizedTriangles;
+    std::span<const QuantizationBlock> quantizationBlocks;
+    // RGBA8 colours, as packed by packUnorm4x8
+    std::span<const uint32_t> packedColours;
+    // Radiance that every triangle of the mesh emits, from both sides. Set by the scene file, not cached.
+    glm::vec3 emission{0.0f};
+
+    std::unique_ptr<MappedFile> cacheFile;
+    std::vector<std::byte> buffer;
+};
+
+/*
+ * Where a mesh starts in each of the GPU buffers that concatenate the scene's meshes,
+ * counted in elements of that buffer
+ */
+struct MeshOffsets {
+    uint32_t bvhOffset;
+    // Also the offset of the compressed nodes, which have one per wide node
+    uint32_t wideBVHOffset;
+    uint32_t triangleIndexOffset;
+    uint32_t triangleOffset;
+    // Vertices of GEOMETRY_LAYOUT_INDEXED, quantization blocks of GEOMETRY_LAYOUT_QUANTIZED, and 0 otherwise
+    uint32_t geometryOffset;
+};
+
+struct Instance {
+    uint32_t meshIndex;
+    glm::mat4 objectToWorld;
+};
+
+/*
+ * Matches the std430 layout of Instance in raytrace-common.glsl.
+ * Rays are moved into object space with worldToObject, and its transpose takes normals back to world space.
+ */
+struct GPUInstance {
+    glm::mat4 worldToObject;
+    // The mesh's MeshOffsets
+    uint32_t bvhOffset;
+    uint32_t wideBVHOffset;
+    uint32_t triangleIndexOffset;
+    uint32_t triangleOffset;
+    glm::vec3 emission;
+    uint32_t geometryOffset;
+};
+
+static_assert(sizeof(GPUInstance) == 96, "GPUInstance must match the shader's Instance");
+
+/*
+ * Emissive triangle in world space, as one entry of the alias table that picks lights in proportion to their power,
+ * their emission's luminance times their area. Matches the std430 layout of Light in raytrace-common.glsl.
+ * A light is picked by choosing an entry uniformly, then keeping it with probability aliasThreshold
+ * and otherwise taking the entry at alias.
+ */
+struct SceneLight {
+    glm::vec3 v0;
+    float aliasThreshold;
+    glm::vec3 v1;
+    uint32_t alias;
+    glm::vec3 v2;
+    float padding0;
+    glm::vec3 emission;
+    float padding1;
+};
+
+static_assert(sizeof(SceneLight) == 64, "SceneLight must match the shader's Light");
+
+/*
+ * A set of meshes, each with its own bottom-level BVH (BLAS), and instances placing them in the world
+ * under a top-level BVH (TLAS). Memory scales with the unique meshes, not with the number of instances.
+ */
+struct Scene {
+    std::vector<std::unique_ptr<MeshData>> meshes;
+    std::vector<MeshOffsets> meshOffsets;
+    std::vector<Instance> instances;
+    /*
+     * Top-level BVH over the world bounds of the instances, rebuilt by buildTLAS whenever an instance changes.
+     * Its leaves cover ranges of tlasInstances, which holds the instances in leaf order,
+     * and tlasInstanceIndices maps each entry of tlasInstances back to its instance.
+     */
+    std::vector<BVHNode> tlasNodes;
+    std::vector<GPUInstance> tlasInstances;
+    std::vector<uint32_t> tlasInstanceIndices;
+    // Every emissive triangle of every instance, rebuilt with the TLAS
+    std::vector<SceneLight> lights;
+    float totalLightPower = 0.0f;
+    // Builds the TLAS, kept for the scene's lifetime so that rebuilding it every frame starts no threads
+    std::unique_ptr<TaskPool> pool;
+};
+
+/*
+ * Takes ownership of the meshes and builds the TLAS over the instances, of which there must be at least one.
+ */
+extern Scene* createScene(std::vector<std::unique_ptr<MeshData>> meshes, std::vector<Instance> instances);
+
+/*
+ * Rebuilds the TLAS and the light table from the current instance transforms and vertices.
+ * The meshes and their BVHs are left untouched. Builds on the scene's pool, so must run on the thread that
+ * created the scene.
+ */
+extern void buildTLAS(Scene& scene, BVHBuildStats* stats = nullptr);
+
+extern BVHBox getInstanceBounds(const Scene& scene, const Instance& instance);
+
+/*
+ * Luminance of an emission, which weighs the lights' power
+ */
+extern float getLightLuminance(glm::vec3 emission);
+
+#endif //OPENGL_RAYTRACER_SCENE_H
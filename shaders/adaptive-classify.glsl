@@ -0,0 +1,63 @@
+// Adaptive sampling: lists the pixels that have not converged for the megakernel to trace, and carries the
+// accumulated frame of every other pixel over unchanged. Only runs while the camera stands still.
+
+layout(local_size_x = 16, local_size_y = 16) in;
+
+shared uint groupNumPixels;
+shared uint groupListStart;
+
+float getColourVariance(ivec2 screenCoords) {
+    vec3 mean = imageLoad(prevFrame, screenCoords).rgb;
+    vec3 variance = max(imageLoad(prevMoments, screenCoords).rgb - mean * mean, vec3(0.0f));
+    return variance.r + variance.g + variance.b;
+}
+
+/*
+ * Same test as isConverged in cpu-raytrace.cpp: the standard error of the pixel's mean colour, summed over the
+ * channels, falls below the threshold. The variance is averaged over the pixel's 3x3 neighbourhood, as a few
+ * frames of one pixel easily miss its rare bright paths and would stop it early at a wrong colour.
+ */
+bool isConverged(ivec2 screenCoords) {
+    float numFrames = imageLoad(prevFrame, screenCoords).a;
+    if (numFrames >= float(u_AdaptiveMaxFrames)) {
+        return true;
+    }
+    if (numFrames < float(u_AdaptiveWarmupFrames)) {
+        return false;
+    }
+    float variance = 0.0f;
+    float numNeighbours = 0.0f;
+    for (int y = max(screenCoords.y - 1, 0); y <= min(screenCoords.y + 1, int(u_ScreenHeight) - 1); y++) {
+        for (int x = max(screenCoords.x - 1, 0); x <= min(screenCoords.x + 1, int(u_ScreenWidth) - 1); x++) {
+            variance += getColourVariance(ivec2(x, y));
+            numNeighbours += 1.0f;
+        }
+    }
+    variance /= numNeighbours;
+    return sqrt(variance / numFrames) <= u_AdaptiveThreshold;
+}
+
+void main() {
+    if (gl_LocalInvocationIndex == 0u) {
+        groupNumPixels = 0u;
+    }
+    barrier();
+    ivec2 screenCoords = ivec2(gl_GlobalInvocationID.xy);
+    bool onScreen = screenCoords.x < int(u_ScreenWidth) && screenCoords.y < int(u_ScreenHeight);
+    bool traced = onScreen && !isConverged(screenCoords);
+    uint groupIndex = traced ? atomicAdd(groupNumPixels, 1u) : 0u;
+    barrier();
+    // One global atomic per workgroup reserves the group's part of the list
+    if (gl_LocalInvocationIndex == 0u) {
+        groupListStart = atomicAdd(adaptiveDispatchArgs.w, groupNumPixels);
+        atomicMax(adaptiveDispatchArgs.x, (groupListStart + groupNumPixels + 255u) / 256u);
+    }
+    barrier();
+    if (traced) {
+        adaptivePixels[groupListStart + groupIndex] = uint(screenCoords.y) << 16 | uint(screenCoords.x);
+    } else if (onScreen) {
+        imageStore(outputFrame, screenCoords, imageLoad(prevFrame, screenCoords));
+        imageStore(outputDepth, screenCoords, imageLoad(prevDepth, screenCoords));
+        imageStore(outputMoments, screenCoords, imageLoad(prevMoments, screenCoords));
+    }
+}
@@ -0,0 +1,77 @@
+// Denoiser passes 2 onwards: one iteration of the edge-aware à-trous wavelet filter over the prepared colour and
+// variance, with the filter's 5x5 taps u_StepSize pixels apart. Appended to denoise-common.glsl.
+
+uniform int u_StepSize;
+// Set on the last iteration, which multiplies the albedo back in and writes the displayed frame
+uniform uint u_Remodulate;
+
+// Colour divided by the albedo, and the variance of its luminance
+layout(binding = 4) uniform sampler2D inputTexture;
+
+// 1D weights of the B3 spline kernel, by distance from the centre tap
+const float KERNEL[3] = float[](3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f);
+
+/*
+ * The pixel's variance blurred over its 3x3 neighbourhood, which steadies the luminance weights
+ * against the noise of the variance estimate itself.
+ */
+float getFilteredVariance(ivec2 coords) {
+    const float weights[2] = float[](1.0f / 2.0f, 1.0f / 4.0f);
+    float sumVariance = 0.0f, sumWeight = 0.0f;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            ivec2 neighbourCoords = coords + ivec2(dx, dy);
+            if (!isOnScreen(neighbourCoords) || isinf(texelFetch(depthTexture, neighbourCoords, 0).r))
+                continue;
+            float weight = weights[abs(dx)] * weights[abs(dy)];
+            sumVariance += weight * texelFetch(inputTexture, neighbourCoords, 0).a;
+            sumWeight += weight;
+        }
+    }
+    return sumVariance / sumWeight;
+}
+
+void main() {
+    ivec2 coords = ivec2(gl_GlobalInvocationID.xy);
+    if (!isOnScreen(coords)) {
+        return;
+    }
+    vec4 centre = texelFetch(inputTexture, coords, 0);
+    float depth = texelFetch(depthTexture, coords, 0).r;
+    if (isinf(depth)) {
+        imageStore(denoiseOutput, coords, u_Remodulate != 0u ? vec4(centre.rgb, 1.0f) : centre);
+        return;
+    }
+    vec4 guide = texelFetch(guideTexture, coords, 0);
+    vec2 depthGradient = getDepthGradient(coords, depth);
+    float luminance = getLuminance(centre.rgb);
+    // Neighbours whose luminance differs by more than the noise explains are across an edge in the lighting
+    float luminanceScale = u_SigmaLuminance * sqrt(getFilteredVariance(coords)) + 1e-6f;
+    vec3 sumColour = vec3(0.0f);
+    float sumVariance = 0.0f, sumWeight = 0.0f;
+    for (int dy = -2; dy <= 2; dy++) {
+        for (int dx = -2; dx <= 2; dx++) {
+            ivec2 offset = ivec2(dx, dy) * u_StepSize;
+            ivec2 neighbourCoords = coords + offset;
+            if (!isOnScreen(neighbourCoords))
+                continue;
+            float neighbourDepth = texelFetch(depthTexture, neighbourCoords, 0).r;
+            if (isinf(neighbourDepth))
+                continue;
+            vec4 neighbour = texelFetch(inputTexture, neighbourCoords, 0);
+            vec3 neighbourNormal = texelFetch(guideTexture, neighbourCoords, 0).xyz;
+            float weight = KERNEL[abs(dx)] * KERNEL[abs(dy)] *
+                           getEdgeWeight(depth, guide.xyz, depthGradient, offset, neighbourDepth, neighbourNormal) *
+                           exp(-abs(luminance - getLuminance(neighbour.rgb)) / luminanceScale);
+            sumColour += weight * neighbour.rgb;
+            // The filtered colour's variance, as a weighted sum of independent neighbours
+            sumVariance += weight * weight * neighbour.a;
+            sumWeight += weight;
+        }
+    }
+    vec4 result = vec4(sumColour / sumWeight, sumVariance / (sumWeight * sumWeight));
+    if (u_Remodulate != 0u) {
+        result = vec4(result.rgb * getDemodulationAlbedo(guide.w), 1.0f);
+    }
+    imageStore(denoiseOutput, coords, result);
+}
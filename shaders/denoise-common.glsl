@@ -0,0 +1,72 @@
+#version 430
+
+/*
+ * Shared by the denoiser's passes (denoise-prepare.glsl and denoise-atrous.glsl), whose source is appended to this
+ * file's when they are compiled. The passes read the frame and its guides through samplers, as the raytracer leaves
+ * only one image unit free, which they write their result to.
+ */
+
+#define INFINITY 1.0 / 0.0
+
+layout(local_size_x = 16, local_size_y = 16) in;
+
+uniform float u_SigmaLuminance;
+uniform float u_SigmaNormal;
+uniform float u_SigmaDepth;
+// Render resolution of the frame, which only covers the corner of the textures while dynamic resolution scales it down
+uniform ivec2 u_ScreenSize;
+
+// Primary hit distance, INFINITY for the sky, and the guide image the raytracer wrote (see raytrace-common.glsl)
+layout(binding = 1) uniform sampler2D depthTexture;
+layout(binding = 2) uniform sampler2D guideTexture;
+layout(binding = 7, rgba32f) uniform writeonly image2D denoiseOutput;
+
+const vec3 LUMINANCE = vec3(0.2126f, 0.7152f, 0.0722f);
+
+float getLuminance(vec3 colour) {
+    return dot(colour, LUMINANCE);
+}
+
+/*
+ * Albedo that the colour is divided by while it is filtered, so that the filter blurs the lighting but not the
+ * triangles' colours. Near black albedos are raised, as dividing by them would blow up the noise.
+ */
+vec3 getDemodulationAlbedo(float packedAlbedo) {
+    uint bits = uint(packedAlbedo);
+    vec3 albedo = vec3((bits >> 16) & 0xFFu, (bits >> 8) & 0xFFu, bits & 0xFFu) / 255.0f;
+    return max(albedo, vec3(0.01f));
+}
+
+bool isOnScreen(ivec2 coords) {
+    return all(greaterThanEqual(coords, ivec2(0))) && all(lessThan(coords, u_ScreenSize));
+}
+
+/*
+ * Change in depth per pixel along each axis, the smaller of the differences with the pixel's two neighbours
+ * so that a silhouette next to the pixel does not count. 0 on axes where both neighbours are sky or off screen.
+ */
+vec2 getDepthGradient(ivec2 coords, float depth) {
+    vec2 gradient = vec2(INFINITY);
+    const ivec2 neighbours[4] = ivec2[](ivec2(-1, 0), ivec2(1, 0), ivec2(0, -1), ivec2(0, 1));
+    for (int i = 0; i < 4; i++) {
+        ivec2 neighbourCoords = coords + neighbours[i];
+        if (!isOnScreen(neighbourCoords))
+            continue;
+        float neighbourDepth = texelFetch(depthTexture, neighbourCoords, 0).r;
+        if (!isinf(neighbourDepth))
+            gradient[i / 2] = min(gradient[i / 2], abs(neighbourDepth - depth));
+    }
+    return vec2(isinf(gradient.x) ? 0.0f : gradient.x, isinf(gradient.y) ? 0.0f : gradient.y);
+}
+
+/*
+ * How much a neighbour at the given offset belongs to the same surface as the pixel: neighbours whose depth differs
+ * by more than the pixel's depth gradient predicts, or whose normal points elsewhere, are faded out.
+ */
+float getEdgeWeight(float depth, vec3 normal, vec2 depthGradient, ivec2 offset, float neighbourDepth,
+                    vec3 neighbourNormal) {
+    float depthScale = u_SigmaDepth * dot(abs(vec2(offset)), depthGradient) + 1e-3f * depth;
+    float depthWeight = exp(-abs(depth - neighbourDepth) / depthScale);
+    float normalWeight = pow(max(dot(normal, neighbourNormal), 0.0f), u_SigmaNormal);
+    return depthWeight * normalWeight;
+}
@@ -0,0 +1,63 @@
+// Denoiser pass 1: divides the albedo out of the accumulated colour and estimates the variance of its luminance,
+// which the à-trous iterations then filter together. Appended to denoise-common.glsl.
+
+uniform uint u_MinHistory;
+
+layout(binding = 0) uniform sampler2D frameTexture;
+layout(binding = 3) uniform sampler2D momentsTexture;
+
+/*
+ * Variance of the pixel's luminance, from its neighbours on the same surface over a 7x7 window, for pixels whose
+ * few frames of history cannot give their own. The neighbours' colours average as many frames as the pixel's,
+ * so the result is already the variance of the pixel's mean.
+ */
+float getSpatialVariance(ivec2 coords, float depth, vec3 normal) {
+    vec2 depthGradient = getDepthGradient(coords, depth);
+    float sumWeight = 0.0f, sumLuminance = 0.0f, sumLuminanceSquared = 0.0f;
+    for (int dy = -3; dy <= 3; dy++) {
+        for (int dx = -3; dx <= 3; dx++) {
+            ivec2 neighbourCoords = coords + ivec2(dx, dy);
+            if (!isOnScreen(neighbourCoords))
+                continue;
+            float neighbourDepth = texelFetch(depthTexture, neighbourCoords, 0).r;
+            if (isinf(neighbourDepth))
+                continue;
+            vec4 neighbourGuide = texelFetch(guideTexture, neighbourCoords, 0);
+            float weight = getEdgeWeight(depth, normal, depthGradient, ivec2(dx, dy), neighbourDepth,
+                                         neighbourGuide.xyz);
+            vec3 neighbourColour = texelFetch(frameTexture, neighbourCoords, 0).rgb;
+            float luminance = getLuminance(neighbourColour / getDemodulationAlbedo(neighbourGuide.w));
+            sumWeight += weight;
+            sumLuminance += weight * luminance;
+            sumLuminanceSquared += weight * luminance * luminance;
+        }
+    }
+    float meanLuminance = sumLuminance / sumWeight;
+    return max(sumLuminanceSquared / sumWeight - meanLuminance * meanLuminance, 0.0f);
+}
+
+void main() {
+    ivec2 coords = ivec2(gl_GlobalInvocationID.xy);
+    if (!isOnScreen(coords)) {
+        return;
+    }
+    vec4 frame = texelFetch(frameTexture, coords, 0);
+    float depth = texelFetch(depthTexture, coords, 0).r;
+    if (isinf(depth)) {
+        // The sky is never filtered
+        imageStore(denoiseOutput, coords, vec4(frame.rgb, 0.0f));
+        return;
+    }
+    vec4 guide = texelFetch(guideTexture, coords, 0);
+    vec3 albedo = getDemodulationAlbedo(guide.w);
+    // The frame's alpha is its history length
+    float numFrames = max(frame.a, 1.0f);
+    float variance;
+    if (numFrames >= float(u_MinHistory)) {
+        vec3 colourVariance = max(texelFetch(momentsTexture, coords, 0).rgb - frame.rgb * frame.rgb, vec3(0.0f));
+        variance = getLuminance(colourVariance / (albedo * albedo)) / numFrames;
+    } else {
+        variance = getSpatialVariance(coords, depth, guide.xyz);
+    }
+    imageStore(denoiseOutput, coords, vec4(frame.rgb / albedo, variance));
+}
@@ -1,10 +1,32 @@
 #version 430 core
 
 uniform sampler2D outputTexture;
+// Corner of outputTexture that the frame was rendered to, smaller than the screen while dynamic resolution scales it
+uniform ivec2 u_RenderSize;
 
 out vec4 FragColor;
 in vec2 texCoords;
 
+/*
+ * Upscales the rendered corner to the screen, blending the four pixels around each screen pixel's centre.
+ * Pixels past the rendered corner are never read, as they still hold whatever larger frame was rendered last.
+ */
+vec4 upscaleBilinear() {
+    vec2 pixel = texCoords * vec2(u_RenderSize) - 0.5f;
+    ivec2 baseCoords = ivec2(floor(pixel));
+    vec2 fraction = pixel - vec2(baseCoords);
+    ivec2 maxCoords = u_RenderSize - 1;
+    vec4 bottom = mix(texelFetch(outputTexture, clamp(baseCoords, ivec2(0), maxCoords), 0),
+                      texelFetch(outputTexture, clamp(baseCoords + ivec2(1, 0), ivec2(0), maxCoords), 0), fraction.x);
+    vec4 top = mix(texelFetch(outputTexture, clamp(baseCoords + ivec2(0, 1), ivec2(0), maxCoords), 0),
+                   texelFetch(outputTexture, clamp(baseCoords + ivec2(1, 1), ivec2(0), maxCoords), 0), fraction.x);
+    return mix(bottom, top, fraction.y);
+}
+
 void main() {
-    FragColor = texture(outputTexture, texCoords);
-}
\ No newline at end of file
+    if (u_RenderSize == textureSize(outputTexture, 0)) {
+        FragColor = texture(outputTexture, texCoords);
+    } else {
+        FragColor = upscaleBilinear();
+    }
+}
@@ -0,0 +1,108 @@
+#version 430
+
+/*
+ * Triangle storage, shared by the raytracing programs and the primary hit raster, whose sources follow this file's
+ * when they are compiled. GEOMETRY_LAYOUT, inserted after the #version line, is the layout of every mesh
+ * in the scene (see MeshData in scene.h), and only its buffers are declared.
+ */
+
+#define GEOMETRY_LAYOUT_SOUP 1
+#define GEOMETRY_LAYOUT_EDGES 2
+#define GEOMETRY_LAYOUT_INDEXED 3
+#define GEOMETRY_LAYOUT_QUANTIZED 4
+
+// Matches QUANTIZATION_BLOCK_SIZE in constants.h
+#define QUANTIZATION_BLOCK_SIZE 16u
+
+#ifndef GEOMETRY_LAYOUT
+#error "GEOMETRY_LAYOUT must be inserted before compiling"
+#endif
+
+// Layouts that pack the colours and derive the normals from the vertices instead of storing them
+#define COMPACT_GEOMETRY (GEOMETRY_LAYOUT == GEOMETRY_LAYOUT_INDEXED || GEOMETRY_LAYOUT == GEOMETRY_LAYOUT_QUANTIZED)
+
+#if GEOMETRY_LAYOUT == GEOMETRY_LAYOUT_SOUP || GEOMETRY_LAYOUT == GEOMETRY_LAYOUT_EDGES
+// EDGES stores the edges from the first vertex to the other two in triv1 and triv2
+layout(std430, binding = 7) buffer TriV0Buffer { vec4 triv0[]; };
+layout(std430, binding = 8) buffer TriV1Buffer { vec4 triv1[]; };
+layout(std430, binding = 9) buffer TriV2Buffer { vec4 triv2[]; };
+#elif GEOMETRY_LAYOUT == GEOMETRY_LAYOUT_INDEXED
+// 3 floats per vertex, without padding
+layout(std430, binding = 20) buffer VertexBuffer { float vertices[]; };
+// 3 per triangle, counted from the first vertex of the triangle's mesh
+layout(std430, binding = 21) buffer VertexIndexBuffer { uint vertexIndices[]; };
+#elif GEOMETRY_LAYOUT == GEOMETRY_LAYOUT_QUANTIZED
+// 9 grid coordinates of 16 bits per triangle, 2 to a word, padded to 5 words
+layout(std430, binding = 22) buffer QuantizedTriangleBuffer { uint quantizedTriangles[]; };
+
+/*
+ * A triangle's vertex is meshMin + step * (gridOrigin + its coordinates)
+ */
+struct QuantizationBlock {
+    vec3 meshMin;
+    float step;
+    uvec3 gridOrigin;
+    uint padding;
+};
+
+layout(std430, binding = 23) buffer QuantizationBlockBuffer { QuantizationBlock quantizationBlocks[]; };
+#endif
+
+/*
+ * A triangle as the intersection test takes it: its first vertex and its edges to the other two
+ */
+struct Triangle {
+    vec3 v0;
+    vec3 edge1;
+    vec3 edge2;
+};
+
+#if GEOMETRY_LAYOUT == GEOMETRY_LAYOUT_QUANTIZED
+vec3 getQuantizedVertex(QuantizationBlock block, uint triangleIndex, uint corner) {
+    // Coordinate k of a triangle is the low half of its word k / 2 when k is even, and the high half when it is odd
+    uvec3 coords;
+    for (uint axis = 0u; axis < 3u; axis++) {
+        uint k = 3u * corner + axis;
+        coords[axis] = (quantizedTriangles[5u * triangleIndex + k / 2u] >> (16u * (k & 1u))) & 0xFFFFu;
+    }
+    return block.meshMin + block.step * vec3(block.gridOrigin + coords);
+}
+
+QuantizationBlock getQuantizationBlock(uint triangleIndex, uint triangleOffset, uint geometryOffset) {
+    return quantizationBlocks[geometryOffset + (triangleIndex - triangleOffset) / QUANTIZATION_BLOCK_SIZE];
+}
+#endif
+
+/*
+ * Vertex corner (0 to 2) of a triangle. Triangle indices count from the start of the concatenated triangle buffers,
+ * and triangleOffset and geometryOffset locate the triangle's mesh in them (see Instance in raytrace-common.glsl).
+ */
+vec3 getTriangleVertex(uint triangleIndex, uint corner, uint triangleOffset, uint geometryOffset) {
+#if GEOMETRY_LAYOUT == GEOMETRY_LAYOUT_SOUP
+    return (corner == 0u ? triv0[triangleIndex] : corner == 1u ? triv1[triangleIndex] : triv2[triangleIndex]).xyz;
+#elif GEOMETRY_LAYOUT == GEOMETRY_LAYOUT_EDGES
+    vec3 v0 = triv0[triangleIndex].xyz;
+    return corner == 0u ? v0 : v0 + (corner == 1u ? triv1[triangleIndex] : triv2[triangleIndex]).xyz;
+#elif GEOMETRY_LAYOUT == GEOMETRY_LAYOUT_INDEXED
+    uint vertex = 3u * (geometryOffset + vertexIndices[3u * triangleIndex + corner]);
+    return vec3(vertices[vertex], vertices[vertex + 1u], vertices[vertex + 2u]);
+#else
+    return getQuantizedVertex(getQuantizationBlock(triangleIndex, triangleOffset, geometryOffset), triangleIndex,
+                              corner);
+#endif
+}
+
+Triangle getTriangle(uint triangleIndex, uint triangleOffset, uint geometryOffset) {
+#if GEOMETRY_LAYOUT == GEOMETRY_LAYOUT_EDGES
+    return Triangle(triv0[triangleIndex].xyz, triv1[triangleIndex].xyz, triv2[triangleIndex].xyz);
+#elif GEOMETRY_LAYOUT == GEOMETRY_LAYOUT_QUANTIZED
+    QuantizationBlock block = getQuantizationBlock(triangleIndex, triangleOffset, geometryOffset);
+    vec3 a = getQuantizedVertex(block, triangleIndex, 0u);
+    return Triangle(a, getQuantizedVertex(block, triangleIndex, 1u) - a,
+                    getQuantizedVertex(block, triangleIndex, 2u) - a);
+#else
+    vec3 a = getTriangleVertex(triangleIndex, 0u, triangleOffset, geometryOffset);
+    return Triangle(a, getTriangleVertex(triangleIndex, 1u, triangleOffset, geometryOffset) - a,
+                    getTriangleVertex(triangleIndex, 2u, triangleOffset, geometryOffset) - a);
+#endif
+}
@@ -0,0 +1,13 @@
+#version 430 core
+
+// Index of the instance in the instance buffer, as the traced HitInfo.instanceIndex
+uniform uint u_InstanceIndex;
+
+flat in uint triangleIndex;
+
+// Triangle index + 1, so that 0 is left for pixels that no triangle covers, and the instance index
+out uvec2 primaryHit;
+
+void main() {
+    primaryHit = uvec2(triangleIndex + 1u, u_InstanceIndex);
+}
@@ -0,0 +1,20 @@
+/*
+ * Raster pre-pass: draws one instance's triangles into the primary hit buffer, which the raytracer starts paths from
+ * instead of tracing their camera rays. Vertices are read straight from the traced triangle buffers, which
+ * geometry-common.glsl declares before this file, so the raster always sees the same triangles, including the changes
+ * to dynamic meshes.
+ */
+
+uniform mat4 u_ObjectToClip;
+// Where the instance's mesh starts in the triangle buffers
+uniform uint u_TriangleOffset;
+uniform uint u_GeometryOffset;
+
+flat out uint triangleIndex;
+
+void main() {
+    triangleIndex = u_TriangleOffset + uint(gl_VertexID) / 3u;
+    uint corner = uint(gl_VertexID) % 3u;
+    vec3 vertex = getTriangleVertex(triangleIndex, corner, u_TriangleOffset, u_GeometryOffset);
+    gl_Position = u_ObjectToClip * vec4(vertex, 1.0f);
+}
@@ -0,0 +1,939 @@
+/*
+ * Scene buffers, traversal and shading shared by the megakernel (raytrace.glsl) and the wavefront stages,
+ * whose source is appended to this file's when they are compiled, as this file's is to geometry-common.glsl's.
+ * Each program is compiled once per render mode, with #defines inserted after the #version line
+ * (see compileRaytraceProgram in raytrace.cpp) for SHADER_RENDER_MODE and the configuration
+ * that shapes its loops and branches: RAYS_PER_PIXEL, RAY_BOUNCES, BVH_LAYOUT, GEOMETRY_LAYOUT,
+ * NEXT_EVENT_ESTIMATION, BSDF_SAMPLING, SAMPLE_SEQUENCE and PRIMARY_RASTER.
+ */
+
+#define WHITE vec4(1.0f, 1.0f, 1.0f, 1.0f)
+#define BLACK vec4(0.0f, 0.0f, 0.0f, 1.0f)
+#define INFINITY 1.0 / 0.0
+#define MAX_BVH_TRAVERSAL_STACK_SIZE 128
+#define MAX_TLAS_TRAVERSAL_STACK_SIZE 64
+#define BVH_LEAF_BIT 0x80000000u
+#define WIDE_BVH_EMPTY_SLOT 0xFFFFFFFFu
+
+#define RENDER_MODE 1
+#define TRIANGLE_TEST_MODE 2
+#define BOX_TEST_MODE 3
+#define REFLECTIONS_TEST_MODE 4
+
+#define BVH_LAYOUT_BINARY 1
+#define BVH_LAYOUT_WIDE 2
+#define BVH_LAYOUT_COMPRESSED 3
+
+#define BSDF_SAMPLING_UNIFORM 1
+#define BSDF_SAMPLING_COSINE 2
+
+#define SAMPLE_SEQUENCE_RANDOM 1
+#define SAMPLE_SEQUENCE_SOBOL 2
+
+#ifndef SHADER_RENDER_MODE
+#error "SHADER_RENDER_MODE and the configuration #defines must be inserted before compiling"
+#endif
+
+// Only the test modes count box tests, triangle tests and reflections, so the render mode's loops stay lean
+#if SHADER_RENDER_MODE != RENDER_MODE
+#define TEST_COUNTERS
+#endif
+
+uniform float u_ScreenWidth;
+uniform float u_ScreenHeight;
+uniform float u_FOV;
+uniform float u_ViewportDist;
+uniform uint u_TemporalMaxHistory;
+uniform float u_TemporalDepthTolerance;
+uniform float u_AdaptiveThreshold;
+uniform uint u_AdaptiveWarmupFrames;
+uniform uint u_AdaptiveMaxFrames;
+uniform float u_RussianRouletteMaxContinue;
+uniform vec3 cameraPos;
+uniform mat3 cameraRotation;
+// Camera pose of the previous frame, which the accumulated frame was rendered from
+uniform vec3 prevCameraPos;
+uniform mat3 prevCameraRotation;
+// Render resolution of the previous frame, which dynamic resolution may have rendered smaller or larger
+uniform vec2 prevScreenSize;
+// Set when the camera or the render resolution changed since the previous frame
+uniform uint cameraMoved;
+
+uniform uint frameCount;
+
+uint randSeed;
+// Index of the path's sample in its pixel's sequence, and the hash of its pixel that scrambles the sequence
+uint sampleIndex;
+uint sampleSeed;
+
+// BVH leaves cover a range of this list, which holds triangle indices
+layout(std430, binding = 11) buffer TriangleIndexBuffer { uint triangleIndices[]; };
+
+#if COMPACT_GEOMETRY
+// RGBA8 colours, as packed by packUnorm4x8
+layout(std430, binding = 24) buffer PackedColourBuffer {
+    uint packedColours[];
+};
+#else
+layout(std430, binding = 2) buffer NormalsBuffer {
+    vec3 triangleNormals[];
+};
+
+layout(std430, binding = 4) buffer TriangleColourBuffer {
+    vec4 triangleColours[];
+};
+#endif
+
+/*
+ * Interior nodes hold the indices of their two children.
+ * Leaves hold the index of their first triangle and BVH_LEAF_BIT | their triangle count.
+ */
+struct BVHNode {
+    vec3 minCorner;
+    uint leftOrStart;
+    vec3 maxCorner;
+    uint rightOrCount;
+};
+
+layout(std430, binding = 3) buffer BVHBuffer {
+    BVHNode bvh[];
+};
+
+/*
+ * 4-wide node with child bounds stored per axis.
+ * For each child slot, counts is 0 for interior children (children holds the wide node index),
+ * BVH_LEAF_BIT | triangle count for leaves stored inline (children holds the first triangle),
+ * and unused slots, which are always last, hold WIDE_BVH_EMPTY_SLOT in children.
+ */
+struct WideBVHNode {
+    vec4 minX, minY, minZ;
+    vec4 maxX, maxY, maxZ;
+    uvec4 children;
+    uvec4 counts;
+};
+
+#if BVH_LAYOUT == BVH_LAYOUT_COMPRESSED
+/*
+ * Wide node with 8 bit child bounds, decoded into a WideBVHNode as in decodeCompressedBVHNode (wide-bvh.h).
+ * On each axis, a child spans origin + scale * [min, max] with scale the power of two whose biased exponent
+ * is that axis's byte of exponents. quantizedMin and quantizedMax hold one axis per word and one child per byte,
+ * and counts two 16 bit counts per word, 0 for interior children and 0x8000 | triangle count for leaves.
+ */
+struct CompressedBVHNode {
+    vec3 origin;
+    uint exponents;
+    uint quantizedMin[3];
+    uint quantizedMax[3];
+    uint counts[2];
+    uvec4 children;
+};
+
+layout(std430, binding = 25) buffer CompressedBVHBuffer {
+    CompressedBVHNode compressedBVH[];
+};
+#elif BVH_LAYOUT == BVH_LAYOUT_WIDE
+layout(std430, binding = 10) buffer WideBVHBuffer {
+    WideBVHNode wideBVH[];
+};
+#endif
+
+/*
+ * Rays enter an instance's mesh through worldToObject. The mesh buffers above concatenate every mesh,
+ * and the offsets locate the instance's mesh in them. Every triangle of the mesh emits emission from both sides.
+ */
+struct Instance {
+    mat4 worldToObject;
+    uint bvhOffset;
+    uint wideBVHOffset;
+    uint triangleIndexOffset;
+    uint triangleOffset;
+    vec3 emission;
+    // Where the mesh starts in the vertex or quantization block buffer of its geometry layout
+    uint geometryOffset;
+};
+
+// Top-level BVH over the instances, whose leaves cover ranges of the instance buffer
+layout(std430, binding = 12) buffer TLASBuffer {
+    BVHNode tlas[];
+};
+
+layout(std430, binding = 13) buffer InstanceBuffer {
+    Instance instances[];
+};
+
+/*
+ * Emissive triangle in world space, as one entry of an alias table that picks lights in proportion to their power
+ * (see SceneLight in scene.h)
+ */
+struct Light {
+    vec3 v0;
+    float aliasThreshold;
+    vec3 v1;
+    uint alias;
+    vec3 v2;
+    float padding0;
+    vec3 emission;
+    float padding1;
+};
+
+layout(std430, binding = 19) buffer LightBuffer {
+    uint numLights;
+    // Sum over the lights of their emission's luminance times their area
+    float totalLightPower;
+    Light lights[];
+};
+
+layout(binding = 5, rgba32f) uniform image2D outputFrame;
+layout(binding = 6, rgba32f) uniform image2D prevFrame;
+// Distance travelled by each pixel's primary ray, INFINITY for the sky, of this frame and the previous one
+layout(binding = 0, r32f) uniform image2D outputDepth;
+layout(binding = 1, r32f) uniform image2D prevDepth;
+// Second moment of each pixel's colour over its history, from which adaptive sampling estimates its error
+layout(binding = 2, rgba32f) uniform image2D outputMoments;
+layout(binding = 3, rgba32f) uniform image2D prevMoments;
+// Guides of the denoiser: the primary hit's normal, facing the camera, and in w its albedo as a 24 bit integer,
+// 8 bits per channel with red highest, which a float holds exactly
+layout(binding = 4, rgba32f) uniform image2D outputGuide;
+
+#if PRIMARY_RASTER
+// How far past the raster's hit primary rays are traced, relative to its distance
+const float PRIMARY_RASTER_BOUND_MARGIN = 1.001f;
+// Triangle index + 1 and instance index of the triangle the raster pre-pass saw in each pixel, 0 where it saw none.
+// Bound to texture unit PRIMARY_HIT_TEXTURE_UNIT.
+layout(binding = 5) uniform usampler2D primaryHitTexture;
+#endif
+
+/*
+ * Pixels that adaptive sampling still traces, listed by adaptive-classify.glsl. The dispatch arguments cover the
+ * list in workgroups of 256 pixels, and their w component is the list's length.
+ */
+layout(std430, binding = 18) buffer AdaptivePixelBuffer {
+    uvec4 adaptiveDispatchArgs;
+    uint adaptivePixels[];
+};
+
+
+struct HitInfo {
+    float dist;
+    // Index into the concatenated triangle buffers
+    int triangleIndex;
+    int instanceIndex;
+};
+
+struct Ray {
+    vec3 origin, dir, invDir;
+};
+
+#ifdef TEST_COUNTERS
+int numBoxTests = 0;
+int boxTestsMax = 1000;
+vec4 boxTestsColour = vec4(0.0f, 1.0f, 1.0f, 1.0f);
+
+int numTriangleTests = 0;
+int triangleTestsMax = 500;
+vec4 triangleTestsColour = vec4(1.0f, 1.0f, 0.0f, 0.0f);
+
+int numReflections = 0;
+vec4 reflectionTestsColour = vec4(1.0f, 1.0f, 1.0f, 1.0f);
+#endif
+
+// Set while tracing shadow rays, which stop at the first triangle they hit rather than the closest
+bool anyHit = false;
+
+#define PI 3.1415926
+
+const float EPS = 1e-4;
+
+/*
+ * Gets distance the ray has to travel before hitting the triangle
+ * distance = INFINITY if ray does not intersect
+ * Uses well-known Möller-Trumbore algorithm
+ * https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
+ */
+float getRayTriangleDistance(Ray ray, int triangleIndex, Instance instance) {
+#ifdef TEST_COUNTERS
+    numTriangleTests++;
+#endif
+    Triangle triangle = getTriangle(uint(triangleIndex), instance.triangleOffset, instance.geometryOffset);
+    vec3 a = triangle.v0;
+    vec3 edge1 = triangle.edge1;
+    vec3 edge2 = triangle.edge2;
+    vec3 ray_cross_e2 = cross(ray.dir, edge2);
+    float det = dot(edge1, ray_cross_e2);
+
+    if (abs(det) < EPS)
+        return INFINITY;    // This ray is parallel to this triangle.
+
+    float inv_det = 1.0 / det;
+    vec3 s = ray.origin - a;
+    float u = inv_det * dot(s, ray_cross_e2);
+
+    if ((u < 0 && abs(u) > EPS) || (u > 1 && abs(u-1) > EPS))
+        return INFINITY;
+
+    vec3 s_cross_e1 = cross(s, edge1);
+    float v = inv_det * dot(ray.dir, s_cross_e1);
+
+    if ((v < 0 && abs(v) > EPS) || (u + v > 1 && abs(u + v - 1) > EPS))
+        return INFINITY;
+
+    // At this stage we can compute t to find out where the intersection point is on the line.
+    float t = inv_det * dot(edge2, s_cross_e1);
+
+    return t > EPS ? t : INFINITY;
+}
+
+// Thanks to https://tavianator.com/2011/ray_box.html
+float rayBoundingBoxDist(Ray ray, vec3 boxMin, vec3 boxMax) {
+#ifdef TEST_COUNTERS
+    numBoxTests++;
+#endif
+    vec3 tMin = (boxMin - ray.origin) * ray.invDir;
+    vec3 tMax = (boxMax - ray.origin) * ray.invDir;
+    vec3 t1 = min(tMin, tMax);
+    vec3 t2 = max(tMin, tMax);
+    float tNear = max(max(t1.x, t1.y), t1.z);
+    float tFar = min(min(t2.x, t2.y), t2.z);
+
+    bool hit = tFar >= tNear && tFar > EPS;
+    float dst = hit ? tNear > EPS ? tNear : 0 : INFINITY;
+    return dst;
+}
+
+void intersectLeaf(Ray ray, Instance instance, int triangleStart, int triangleEnd, inout HitInfo info) {
+    for (int i = triangleStart; i < triangleEnd; i++) {
+        int triangleIndex = int(instance.triangleOffset + triangleIndices[instance.triangleIndexOffset + i]);
+        float triangleDist = getRayTriangleDistance(ray, triangleIndex, instance);
+        if (triangleDist < info.dist) {
+            info.dist = triangleDist;
+            info.triangleIndex = triangleIndex;
+            if (anyHit) {
+                // Every node left on the traversal stacks is at least 0 away, so they are all skipped
+                info.dist = 0.0f;
+                return;
+            }
+        }
+    }
+}
+
+void intersectMeshBinary(Ray ray, Instance instance, inout HitInfo info) {
+    uint root = instance.bvhOffset;
+    float rootDist = rayBoundingBoxDist(ray, bvh[root].minCorner, bvh[root].maxCorner);
+    if (rootDist >= info.dist) {
+        return;
+    }
+    /* Old code, loop over all triangles
+        for (int i = 0; i < triangles.length(); i++) {
+            float triangleDist = getRayTriangleDistance(ray, i);
+            if (triangleDist < info.dist) {
+                info.dist = triangleDist;
+                info.triangleIndex = i;
+            }
+        }
+        return info;
+    */
+    int stack[MAX_BVH_TRAVERSAL_STACK_SIZE];
+    float dist[MAX_BVH_TRAVERSAL_STACK_SIZE];
+    int i = 0;
+    stack[0] = 0;
+    dist[0] = rootDist;
+    while (i > -1) {
+        int bvhIndex = stack[i];
+        if (dist[i--] >= info.dist) {
+            continue;
+        }
+        BVHNode bvhNode = bvh[root + bvhIndex];
+        if ((bvhNode.rightOrCount & BVH_LEAF_BIT) != 0u) {
+            int triangleStart = int(bvhNode.leftOrStart);
+            int triangleEnd = triangleStart + int(bvhNode.rightOrCount & ~BVH_LEAF_BIT);
+            intersectLeaf(ray, instance, triangleStart, triangleEnd, info);
+        } else {
+            int child1 = int(bvhNode.leftOrStart);
+            int child2 = int(bvhNode.rightOrCount);
+            float d1 = rayBoundingBoxDist(ray, bvh[root + child1].minCorner, bvh[root + child1].maxCorner);
+            float d2 = rayBoundingBoxDist(ray, bvh[root + child2].minCorner, bvh[root + child2].maxCorner);
+            if (d1 < d2) {
+                if (d2 < info.dist) {
+                    stack[++i] = child2;
+                    dist[i] = d2;
+                }
+                if (d1 < info.dist) {
+                    stack[++i] = child1;
+                    dist[i] = d1;
+                }
+            } else {
+                if (d1 < info.dist) {
+                    stack[++i] = child1;
+                    dist[i] = d1;
+                }
+                if (d2 < info.dist) {
+                    stack[++i] = child2;
+                    dist[i] = d2;
+                }
+            }
+        }
+    }
+}
+
+#if BVH_LAYOUT == BVH_LAYOUT_COMPRESSED
+/*
+ * One axis of the four children's bounds. The encoder rounds the bounds outwards for exactly this product and sum,
+ * each rounded on its own, so precise keeps the compiler from contracting them into an FMA or reordering them,
+ * either of which could shrink a decoded box inside the exact one.
+ */
+vec4 decodeChildBounds(float origin, uint quantized, float scale) {
+    precise vec4 bounds = origin + vec4((uvec4(quantized) >> uvec4(0u, 8u, 16u, 24u)) & 0xFFu) * scale;
+    return bounds;
+}
+
+WideBVHNode getWideBVHNode(Instance instance, uint index) {
+    CompressedBVHNode compressed = compressedBVH[instance.wideBVHOffset + index];
+    uvec3 exponents = (uvec3(compressed.exponents) >> uvec3(0u, 8u, 16u)) & 0xFFu;
+    vec3 scale = uintBitsToFloat(exponents << 23u);
+    WideBVHNode node;
+    node.minX = decodeChildBounds(compressed.origin.x, compressed.quantizedMin[0], scale.x);
+    node.minY = decodeChildBounds(compressed.origin.y, compressed.quantizedMin[1], scale.y);
+    node.minZ = decodeChildBounds(compressed.origin.z, compressed.quantizedMin[2], scale.z);
+    node.maxX = decodeChildBounds(compressed.origin.x, compressed.quantizedMax[0], scale.x);
+    node.maxY = decodeChildBounds(compressed.origin.y, compressed.quantizedMax[1], scale.y);
+    node.maxZ = decodeChildBounds(compressed.origin.z, compressed.quantizedMax[2], scale.z);
+    node.children = compressed.children;
+    uvec4 counts = (uvec4(compressed.counts[0], compressed.counts[0], compressed.counts[1], compressed.counts[1]) >>
+                    uvec4(0u, 16u, 0u, 16u)) & 0xFFFFu;
+    // Moves the 16 bit leaf flag up to BVH_LEAF_BIT
+    node.counts = ((counts & 0x8000u) << 16u) | (counts & 0x7FFFu);
+    return node;
+}
+#elif BVH_LAYOUT == BVH_LAYOUT_WIDE
+WideBVHNode getWideBVHNode(Instance instance, uint index) {
+    return wideBVH[instance.wideBVHOffset + index];
+}
+#endif
+
+#if BVH_LAYOUT != BVH_LAYOUT_BINARY
+/*
+ * Traverses the 4-wide BVH, testing the ray against all of a node's child boxes at once
+ * and pushing the hit children so that the nearest one is popped first.
+ * Leaves are stored inline in their parent, so stack entries hold a node or a leaf's triangle range.
+ */
+void intersectMeshWide(Ray ray, Instance instance, inout HitInfo info) {
+    uint stackChild[MAX_BVH_TRAVERSAL_STACK_SIZE];
+    uint stackCount[MAX_BVH_TRAVERSAL_STACK_SIZE];
+    float stackDist[MAX_BVH_TRAVERSAL_STACK_SIZE];
+    int i = 0;
+    stackChild[0] = 0u;
+    stackCount[0] = 0u;
+    stackDist[0] = 0.0f;
+    while (i > -1) {
+        uint child = stackChild[i];
+        uint count = stackCount[i];
+        if (stackDist[i--] >= info.dist) {
+            continue;
+        }
+        if ((count & BVH_LEAF_BIT) != 0u) {
+            intersectLeaf(ray, instance, int(child), int(child + (count & ~BVH_LEAF_BIT)), info);
+            continue;
+        }
+        WideBVHNode node = getWideBVHNode(instance, child);
+        vec4 tMinX = (node.minX - ray.origin.x) * ray.invDir.x;
+        vec4 tMaxX = (node.maxX - ray.origin.x) * ray.invDir.x;
+        vec4 tMinY = (node.minY - ray.origin.y) * ray.invDir.y;
+        vec4 tMaxY = (node.maxY - ray.origin.y) * ray.invDir.y;
+        vec4 tMinZ = (node.minZ - ray.origin.z) * ray.invDir.z;
+        vec4 tMaxZ = (node.maxZ - ray.origin.z) * ray.invDir.z;
+        vec4 tNear = max(max(min(tMinX, tMaxX), min(tMinY, tMaxY)), min(tMinZ, tMaxZ));
+        vec4 tFar = min(min(max(tMinX, tMaxX), max(tMinY, tMaxY)), max(tMinZ, tMaxZ));
+        // Gather the hit children, then insertion sort them by decreasing distance
+        float hitDist[4];
+        uint hitSlot[4];
+        int numHits = 0;
+        for (int slot = 0; slot < 4 && node.children[slot] != WIDE_BVH_EMPTY_SLOT; slot++) {
+#ifdef TEST_COUNTERS
+            numBoxTests++;
+#endif
+            float d = tNear[slot] > EPS ? tNear[slot] : 0;
+            if (tFar[slot] < tNear[slot] || tFar[slot] <= EPS || d >= info.dist)
+                continue;
+            int j = numHits++;
+            for (; j > 0 && hitDist[j - 1] < d; j--) {
+                hitDist[j] = hitDist[j - 1];
+                hitSlot[j] = hitSlot[j - 1];
+            }
+            hitDist[j] = d;
+            hitSlot[j] = uint(slot);
+        }
+        for (int j = 0; j < numHits; j++) {
+            stackChild[++i] = node.children[hitSlot[j]];
+            stackCount[i] = node.counts[hitSlot[j]];
+            stackDist[i] = hitDist[j];
+        }
+    }
+}
+#endif
+
+Ray getObjectRay(Ray ray, Instance instance) {
+    /*
+     * The direction is transformed without normalizing it, so that distances along the object space ray
+     * are the same as along the world space ray and can be compared against info.dist directly.
+     */
+    Ray objectRay;
+    objectRay.origin = (instance.worldToObject * vec4(ray.origin, 1.0f)).xyz;
+    objectRay.dir = mat3(instance.worldToObject) * ray.dir;
+    objectRay.invDir = 1.0f / objectRay.dir;
+    return objectRay;
+}
+
+void intersectInstance(Ray ray, int instanceIndex, inout HitInfo info) {
+    Instance instance = instances[instanceIndex];
+    Ray objectRay = getObjectRay(ray, instance);
+    float prevDist = info.dist;
+#if BVH_LAYOUT == BVH_LAYOUT_BINARY
+    intersectMeshBinary(objectRay, instance, info);
+#else
+    intersectMeshWide(objectRay, instance, info);
+#endif
+    // Instances of the same mesh share triangle indices, so only a nearer hit tells that this instance was hit
+    if (info.dist < prevDist)
+        info.instanceIndex = instanceIndex;
+}
+
+/*
+ * Traverses the top-level BVH like the binary BVH, entering the instances of each leaf it reaches.
+ * Only hits closer than maxDist count, and none is found when info.dist is still maxDist afterwards.
+ */
+HitInfo traceRay(Ray ray, float maxDist) {
+    HitInfo info;
+    info.dist = maxDist;
+    info.triangleIndex = -1;
+    info.instanceIndex = -1;
+    int stack[MAX_TLAS_TRAVERSAL_STACK_SIZE];
+    float dist[MAX_TLAS_TRAVERSAL_STACK_SIZE];
+    int i = 0;
+    stack[0] = 0;
+    dist[0] = rayBoundingBoxDist(ray, tlas[0].minCorner, tlas[0].maxCorner);
+    while (i > -1) {
+        int tlasIndex = stack[i];
+        if (dist[i--] >= info.dist) {
+            continue;
+        }
+        BVHNode node = tlas[tlasIndex];
+        if ((node.rightOrCount & BVH_LEAF_BIT) != 0u) {
+            int instanceStart = int(node.leftOrStart);
+            int instanceEnd = instanceStart + int(node.rightOrCount & ~BVH_LEAF_BIT);
+            for (int j = instanceStart; j < instanceEnd; j++)
+                intersectInstance(ray, j, info);
+            continue;
+        }
+        int child1 = int(node.leftOrStart);
+        int child2 = int(node.rightOrCount);
+        float d1 = rayBoundingBoxDist(ray, tlas[child1].minCorner, tlas[child1].maxCorner);
+        float d2 = rayBoundingBoxDist(ray, tlas[child2].minCorner, tlas[child2].maxCorner);
+        if (d1 < d2) {
+            float d = d1;
+            d1 = d2;
+            d2 = d;
+            int child = child1;
+            child1 = child2;
+            child2 = child;
+        }
+        // Push the further child first so the nearer one is popped next
+        if (d1 < info.dist) {
+            stack[++i] = child1;
+            dist[i] = d1;
+        }
+        if (d2 < info.dist) {
+            stack[++i] = child2;
+            dist[i] = d2;
+        }
+    }
+    return info;
+}
+
+HitInfo getHitInfo(Ray ray) {
+    return traceRay(ray, INFINITY);
+}
+
+#if PRIMARY_RASTER
+uvec2 getRasterHit(ivec2 pixel) {
+    return texelFetch(primaryHitTexture, clamp(pixel, ivec2(0), ivec2(u_ScreenWidth, u_ScreenHeight) - 1), 0).xy;
+}
+#endif
+
+/*
+ * Closest hit of the pixel's camera ray. With the raster pre-pass, the triangle it saw is intersected exactly as
+ * traversal intersects it. Where the four neighbouring pixels saw the same triangle, no edge of it passes within
+ * a pixel, and that hit is taken without traversal. Near edges, a raster can settle ties between adjacent
+ * triangles differently from traversal, and the intersection test's tolerance lets rays hit triangles just outside
+ * their leaf's bounds, so there the ray is traced a little past the raster's distance. Tracing with a bound visits
+ * the same nodes in the same order as tracing without one, only skipping those that start beyond the bound,
+ * and so finds the same hit. Pixels the raster left empty are traced in full, as are those where the bounded trace
+ * finds nothing, whose ray misses the raster's triangle by rounding or only hits it outside its bounds.
+ */
+HitInfo getPrimaryHitInfo(Ray ray, uvec2 pixel) {
+#if PRIMARY_RASTER
+    ivec2 coords = ivec2(pixel);
+    uvec2 rasterHit = getRasterHit(coords);
+    if (rasterHit.x != 0u) {
+        HitInfo info;
+        info.triangleIndex = int(rasterHit.x - 1u);
+        info.instanceIndex = int(rasterHit.y);
+        Instance instance = instances[rasterHit.y];
+        info.dist = getRayTriangleDistance(getObjectRay(ray, instance), info.triangleIndex, instance);
+        if (info.dist != INFINITY) {
+            if (getRasterHit(coords + ivec2(1, 0)) == rasterHit && getRasterHit(coords - ivec2(1, 0)) == rasterHit &&
+                getRasterHit(coords + ivec2(0, 1)) == rasterHit && getRasterHit(coords - ivec2(0, 1)) == rasterHit)
+                return info;
+            info = traceRay(ray, info.dist * PRIMARY_RASTER_BOUND_MARGIN);
+            if (info.triangleIndex != -1)
+                return info;
+        }
+    }
+#endif
+    return getHitInfo(ray);
+}
+
+/*
+ * Whether any triangle lies on the ray closer than maxDist, found with the any-hit variant of the traversal
+ */
+bool isOccluded(Ray ray, float maxDist) {
+    anyHit = true;
+    HitInfo info = traceRay(ray, maxDist);
+    anyHit = false;
+    return info.triangleIndex != -1;
+}
+
+/*
+ * Thanks to Jacob Gordiak for skybox + random direction code and explanation of colour reflection code
+ * https://github.com/jakubg05/Ray-Tracing/blob/main/core/resources/shaders/ComputeRayTracing.comp
+ */
+
+vec3 sampleSkybox(vec3 dir) {
+    vec3 skyGroundColour  = vec3(0.6392156862f, 0.5803921f, 0.6392156862f);
+    vec3 skyColourHorizon = vec3(1.0f, 1.0f, 1.0f);
+    vec3 skyColourZenith  = vec3(0.486274509f, 0.71372549f, 234.0f / 255.0f);
+    float skyGradientT = pow(smoothstep(0.0, 0.4, dir.y), 0.35);
+    float groundToSkyT = smoothstep(-0.01, 0.0, dir.y);
+    vec3 skyGradient = mix(skyColourHorizon.rgb, skyColourZenith.rgb, skyGradientT);
+    skyGradient = mix(skyGroundColour.rgb, skyGradient, groundToSkyT);
+    return skyGradient;
+}
+
+// PCG hash: one step of a linear congruential generator followed by a permutation of its state
+uint hash(uint x) {
+    uint state = x * 747796405u + 2891336453u;
+    uint result = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (result >> 22u) ^ result;
+}
+
+float rand()
+{
+    randSeed = randSeed * 747796405u + 2891336453u;
+    uint result = ((randSeed >> ((randSeed >> 28u) + 4u)) ^ randSeed) * 277803737u;
+    result = (result >> 22u) ^ result;
+    return float(result) / 4294967295.0;
+}
+
+// Laine and Karras' hash, in which every bit only depends on the bits below it
+uint laineKarrasPermutation(uint x, uint seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+/*
+ * Owen scrambling of the bits of x from the highest down (Burley, "Practical Hash-based Owen Scrambling", 2020)
+ */
+uint nestedUniformScramble(uint x, uint seed) {
+    return bitfieldReverse(laineKarrasPermutation(bitfieldReverse(x), seed));
+}
+
+/*
+ * First two dimensions of the Sobol sequence, with their bits reversed. Bit i of the first is bit i of the index,
+ * and of the second the parity of the index bits whose positions contain the bits of i, as its generator matrix is
+ * Pascal's triangle mod 2, which five shifts gather.
+ */
+uvec2 getReversedSobol(uint index) {
+    uint y = index;
+    y ^= (y >> 1) & 0x55555555u;
+    y ^= (y >> 2) & 0x33333333u;
+    y ^= (y >> 4) & 0x0F0F0F0Fu;
+    y ^= (y >> 8) & 0x00FF00FFu;
+    y ^= (y >> 16) & 0x0000FFFFu;
+    return uvec2(index, y);
+}
+
+/*
+ * Two uniform numbers for one decision of the path, numbered by dimension. With the Sobol sequence, a pixel's
+ * samples of each dimension cover the square evenly: the first two Sobol dimensions, with the sample order shuffled
+ * and the points Owen scrambled by a hash of the pixel and dimension so that pixels and dimensions are uncorrelated.
+ */
+vec2 sample2D(uint dimension) {
+    if (SAMPLE_SEQUENCE != SAMPLE_SEQUENCE_SOBOL) {
+        float u = rand();
+        return vec2(u, rand());
+    }
+    uint seed = hash(sampleSeed ^ hash(dimension));
+    uvec2 reversed = getReversedSobol(nestedUniformScramble(sampleIndex, seed));
+    // Owen scrambling the points permutes their reversed bits
+    uint x = bitfieldReverse(laineKarrasPermutation(reversed.x, hash(seed)));
+    uint y = bitfieldReverse(laineKarrasPermutation(reversed.y, hash(seed + 1u)));
+    // The top 24 bits, which floats hold exactly, so that the result stays below 1
+    return vec2(uvec2(x, y) >> 8) / 16777216.0f;
+}
+
+/*
+ * Density per unit solid angle of sampleBsdf's direction that makes the given cosine with the normal
+ */
+float getBsdfPdf(float cosTheta) {
+    return BSDF_SAMPLING == BSDF_SAMPLING_COSINE ? cosTheta / PI : 1.0f / (2.0f * PI);
+}
+
+/*
+ * Samples a direction in the hemisphere around the normal, with a density proportional to its cosine with the normal
+ * or uniform, through an orthonormal basis (Duff et al., "Building an Orthonormal Basis, Revisited", 2017).
+ */
+vec3 sampleBsdf(vec3 normal, vec2 u) {
+    float cosTheta = BSDF_SAMPLING == BSDF_SAMPLING_COSINE ? sqrt(1.0f - u.x) : u.x;
+    float sinTheta = sqrt(max(1.0f - cosTheta * cosTheta, 0.0f));
+    float phi = 2.0f * PI * u.y;
+    float signZ = normal.z >= 0.0f ? 1.0f : -1.0f;
+    float a = -1.0f / (signZ + normal.z);
+    float b = normal.x * normal.y * a;
+    vec3 tangent = vec3(1.0f + signZ * normal.x * normal.x * a, signZ * b, -signZ * normal.x);
+    vec3 bitangent = vec3(b, signZ + normal.y * normal.y * a, -normal.y);
+    return tangent * (sinTheta * cos(phi)) + bitangent * (sinTheta * sin(phi)) + normal * cosTheta;
+}
+
+vec3 getTriangleColour(int triangleIndex) {
+#if COMPACT_GEOMETRY
+    return unpackUnorm4x8(packedColours[triangleIndex]).rgb;
+#else
+    return triangleColours[triangleIndex].rgb;
+#endif
+}
+
+/*
+ * World space normal of the hit triangle, facing against the ray's direction
+ */
+vec3 getHitNormal(HitInfo info, vec3 dir) {
+    // Normals transform by the inverse transpose of the object to world matrix
+    Instance instance = instances[info.instanceIndex];
+#if COMPACT_GEOMETRY
+    Triangle triangle = getTriangle(uint(info.triangleIndex), instance.triangleOffset, instance.geometryOffset);
+    vec3 objectNormal = normalize(cross(triangle.edge1, triangle.edge2));
+#else
+    vec3 objectNormal = triangleNormals[info.triangleIndex];
+#endif
+    vec3 normal = normalize(transpose(mat3(instance.worldToObject)) * objectNormal);
+    if (dot(normal, dir) > 0) {
+        normal = -normal;
+    }
+    return normal;
+}
+
+float getLuminance(vec3 colour) {
+    return dot(colour, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+/*
+ * Density per unit solid angle, seen from dist away, with which sampleLight picks a point on a light whose normal
+ * makes the given cosine with the direction to the point. Lights are picked in proportion to their power and points
+ * uniformly on them, so the density per unit area only depends on the emission.
+ */
+float getLightPdf(vec3 emission, float dist, float cosLight) {
+    return getLuminance(emission) / totalLightPower * dist * dist / cosLight;
+}
+
+/*
+ * Multiple importance sampling weight of a sample drawn with density pdf that the other strategy draws with otherPdf
+ */
+float getPowerHeuristic(float pdf, float otherPdf) {
+    return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}
+
+/*
+ * Next-event estimation: picks a point on a light with the alias table and traces a shadow ray to it, returning the
+ * light reflected towards the ray through the Lambertian BSDF when nothing is in the way. Always takes the same
+ * random numbers, so the paths' random sequences do not depend on the scene's lights.
+ */
+vec3 sampleLight(vec3 position, vec3 normal, vec3 albedo, uint bounce) {
+    float u = rand() * float(numLights);
+    uint lightIndex = min(uint(u), numLights - 1u);
+    if (fract(u) >= lights[lightIndex].aliasThreshold)
+        lightIndex = lights[lightIndex].alias;
+    Light light = lights[lightIndex];
+    vec2 point = sample2D(bounce * 2u);
+    float s = sqrt(point.x);
+    float t = point.y;
+    vec3 lightPos = light.v0 * (1.0f - s) + light.v1 * (s * (1.0f - t)) + light.v2 * (s * t);
+    float dist = length(lightPos - position);
+    Ray shadowRay;
+    shadowRay.origin = position;
+    shadowRay.dir = (lightPos - position) / dist;
+    shadowRay.invDir = 1.0f / shadowRay.dir;
+    float cosSurface = dot(normal, shadowRay.dir);
+    float cosLight = abs(dot(normalize(cross(light.v1 - light.v0, light.v2 - light.v0)), shadowRay.dir));
+    // The shadow ray stops short of the light, which would otherwise occlude itself
+    if (cosSurface <= 0.0f || cosLight <= 0.0f || isOccluded(shadowRay, dist * (1.0f - 1e-3f)))
+        return vec3(0.0f);
+    float lightPdf = getLightPdf(light.emission, dist, cosLight);
+    return albedo / PI * light.emission * cosSurface / lightPdf *
+           getPowerHeuristic(lightPdf, getBsdfPdf(cosSurface));
+}
+
+/*
+ * Advances a path by one bounce: adds the sky on a miss, otherwise adds the hit triangle's emission and a light
+ * sample, bounces the ray off the triangle and applies Russian roulette from the fourth bounce on.
+ * bsdfPdf is the density that the ray's direction was sampled with, which the bounce replaces with its own.
+ * Returns false once the path has ended.
+ */
+bool bouncePath(inout Ray ray, HitInfo info, uint bounce, inout vec3 throughput, inout vec3 radiance,
+                inout float bsdfPdf) {
+    if (info.dist == INFINITY) {
+        radiance += sampleSkybox(ray.dir) * throughput;
+        return false;
+    }
+    vec3 normal = getHitNormal(info, ray.dir);
+    vec3 emission = instances[info.instanceIndex].emission;
+    bool nextEventEstimation = NEXT_EVENT_ESTIMATION != 0 && numLights > 0u;
+    if (emission != vec3(0.0f)) {
+        // Past the camera, the previous hit's light sample may have reached this point as well
+        float weight = 1.0f;
+        if (nextEventEstimation && bounce > 0u)
+            weight = getPowerHeuristic(bsdfPdf, getLightPdf(emission, info.dist, dot(normal, -ray.dir)));
+        radiance += emission * throughput * weight;
+    }
+    ray.origin += ray.dir * info.dist;
+    vec3 albedo = getTriangleColour(info.triangleIndex);
+    if (nextEventEstimation)
+        radiance += sampleLight(ray.origin, normal, albedo, bounce) * throughput;
+    // Diffuse reflection:
+    // ray.dir = normalize(normal - (ray.dir - normal));
+    ray.dir = sampleBsdf(normal, sample2D(bounce * 2u + 1u));
+    ray.invDir = 1.0f / ray.dir;
+    // The Lambertian BSDF, albedo / PI, times the cosine, over the density, which cancel out with cosine sampling
+    float cosTheta = dot(normal, ray.dir);
+    bsdfPdf = getBsdfPdf(cosTheta);
+    throughput *= BSDF_SAMPLING == BSDF_SAMPLING_COSINE ? albedo : albedo / PI * cosTheta / bsdfPdf;
+
+    if (bounce > 2) {
+        // Paths that have lost most of their throughput are likely to end, and the survivors are scaled back up
+        float continueProb = min(max(throughput.r, max(throughput.g, throughput.b)), u_RussianRouletteMaxContinue);
+        if (rand() >= continueProb)
+            return false;
+        throughput /= continueProb;
+    }
+    return true;
+}
+
+float getPixelWidth(float screenWidth) {
+    // tan (FOV / 2) = (viewportWidth / 2) / viewportDist
+    return tan(u_FOV / 2.0f) * u_ViewportDist * 2.0f / screenWidth;
+}
+
+Ray getCameraRay(uvec2 pixel) {
+    float pixelWidth = getPixelWidth(u_ScreenWidth);
+    vec3 dir = cameraRotation * vec3(
+        (pixel.x - u_ScreenWidth / 2.0f) * pixelWidth,
+        (pixel.y - u_ScreenHeight / 2.0f) * pixelWidth,
+        u_ViewportDist
+    );
+    Ray ray;
+    ray.dir = normalize(dir);
+    ray.origin = cameraPos;
+    ray.invDir = 1.0f / ray.dir;
+    return ray;
+}
+
+/*
+ * Stores the pixel's primary hit in the depth and guide images, from which the frame is reprojected and denoised.
+ * Sky pixels get an infinite depth and a zero normal.
+ */
+void storeGuides(ivec2 screenCoords, HitInfo primaryHit, vec3 primaryDir) {
+    imageStore(outputDepth, screenCoords, vec4(primaryHit.dist));
+    vec4 guide = vec4(0.0f);
+    if (primaryHit.dist != INFINITY) {
+        vec3 albedo = getTriangleColour(primaryHit.triangleIndex);
+        uvec3 albedoBits = uvec3(round(clamp(albedo, 0.0f, 1.0f) * 255.0f));
+        float packedAlbedo = float((albedoBits.r << 16) | (albedoBits.g << 8) | albedoBits.b);
+        guide = vec4(getHitNormal(primaryHit, primaryDir), packedAlbedo);
+    }
+    imageStore(outputGuide, screenCoords, guide);
+}
+
+/*
+ * Resamples the previous frame where it saw this pixel's primary hit, by projecting the hit point,
+ * or the ray's direction for the sky, through the previous camera at the previous render resolution.
+ * The four pixels around that point are blended bilinearly, as rounding to the nearest one would let the history
+ * drift behind the camera by up to half a pixel every frame. Pixels whose own primary ray stopped at a different
+ * distance saw another surface, which this pixel's hit was hidden behind (disoccluded), and are left out.
+ * Returns false when none of the four pixels can be used.
+ */
+bool reprojectHistory(ivec2 screenCoords, float primaryDist, out vec4 history, out vec4 historyMoments) {
+    history = vec4(0.0f);
+    historyMoments = vec4(0.0f);
+    Ray ray = getCameraRay(uvec2(screenCoords));
+    bool hitSky = isinf(primaryDist);
+    vec3 hitPos = ray.origin + ray.dir * (hitSky ? 0.0f : primaryDist);
+    vec3 prevView = transpose(prevCameraRotation) * (hitSky ? ray.dir : hitPos - prevCameraPos);
+    if (prevView.z <= 0.0f) {
+        return false;
+    }
+    float expectedDist = length(hitPos - prevCameraPos);
+    vec2 prevPixel = prevView.xy / prevView.z * u_ViewportDist / getPixelWidth(prevScreenSize.x)
+                     + prevScreenSize / 2.0f;
+    ivec2 baseCoords = ivec2(floor(prevPixel));
+    vec2 fraction = prevPixel - vec2(baseCoords);
+    float totalWeight = 0.0f;
+    for (int i = 0; i < 4; i++) {
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        ivec2 prevCoords = baseCoords + offset;
+        if (prevCoords.x < 0 || prevCoords.y < 0 || prevCoords.x >= int(prevScreenSize.x) ||
+            prevCoords.y >= int(prevScreenSize.y)) {
+            continue;
+        }
+        float prevPrimaryDist = imageLoad(prevDepth, prevCoords).r;
+        if (hitSky != isinf(prevPrimaryDist) ||
+            (!hitSky && abs(prevPrimaryDist - expectedDist) > u_TemporalDepthTolerance * expectedDist)) {
+            continue;
+        }
+        vec2 weights = mix(1.0f - fraction, fraction, vec2(offset));
+        float weight = weights.x * weights.y;
+        history += weight * imageLoad(prevFrame, prevCoords);
+        historyMoments += weight * imageLoad(prevMoments, prevCoords);
+        totalWeight += weight;
+    }
+    if (totalWeight < 1e-3f) {
+        return false;
+    }
+    history /= totalWeight;
+    historyMoments /= totalWeight;
+    return true;
+}
+
+/*
+ * Blends this frame's colour into the history reprojected from the previous frame, or in the test modes replaces it
+ * with the counters. The accumulated colour's alpha holds the pixel's history length, the number of frames it averages,
+ * which restarts wherever the history was rejected. While the camera moves, the history is capped at
+ * u_TemporalMaxHistory frames, which bounds how long the blur of resampling it lingers.
+ */
+void storeFrameColour(ivec2 screenCoords, vec4 colour, float primaryDist) {
+    vec4 history = vec4(0.0f), historyMoments = vec4(0.0f);
+    if (frameCount > 0u && reprojectHistory(screenCoords, primaryDist, history, historyMoments) && cameraMoved != 0u) {
+        history.a = min(history.a, float(u_TemporalMaxHistory));
+    }
+    vec4 finalColour = vec4((history.rgb * history.a + colour.rgb) / (history.a + 1.0f), history.a + 1.0f);
+    imageStore(outputMoments, screenCoords,
+               vec4((historyMoments.rgb * history.a + colour.rgb * colour.rgb) / (history.a + 1.0f), 0.0f));
+#if SHADER_RENDER_MODE == TRIANGLE_TEST_MODE
+    finalColour = float(min(triangleTestsMax, numTriangleTests)) / float(triangleTestsMax) * triangleTestsColour;
+#elif SHADER_RENDER_MODE == BOX_TEST_MODE
+    finalColour = float(min(boxTestsMax, numBoxTests)) / float(boxTestsMax) * boxTestsColour;
+#elif SHADER_RENDER_MODE == REFLECTIONS_TEST_MODE
+    finalColour = float(min(RAY_BOUNCES, numReflections)) / float(RAY_BOUNCES) * reflectionTestsColour;
+#endif
+    imageStore(outputFrame, screenCoords, finalColour);
+}
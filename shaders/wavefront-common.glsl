@@ -0,0 +1,57 @@
+// Declarations shared by the wavefront stages, appended to raytrace-common.glsl before each stage's source.
+
+// Matches WAVEFRONT_WORKGROUP_SIZE in constants.h
+#define WAVEFRONT_WORKGROUP_SIZE 64
+#define PATH_DEAD_BIT 0x80000000u
+
+/*
+ * State of one path between stages, at index pixelIndex * RAYS_PER_PIXEL + sample.
+ * bounce counts the path's reflections so far, and has PATH_DEAD_BIT set once the path has ended.
+ */
+struct Path {
+    vec3 origin;
+    uint bounce;
+    vec3 dir;
+    uint randSeed;
+    vec3 throughput;
+    uint numBoxTests;
+    vec3 radiance;
+    uint numTriangleTests;
+    // Density that dir was sampled with, from which the shade stage weighs hitting a light against sampling it
+    float bsdfPdf;
+    // Index of the path's sample in its pixel's sequence
+    uint sampleIndex;
+    uint padding0, padding1;
+};
+
+layout(std430, binding = 14) buffer PathBuffer {
+    Path paths[];
+};
+
+// Closest hit of each path's current ray, written by the extend stage for the shade stage
+layout(std430, binding = 15) buffer HitBuffer {
+    HitInfo hits[];
+};
+
+// Two queues of path indices, u_NumPaths long each: the rays of this bounce and the survivors for the next one
+layout(std430, binding = 16) buffer RayQueueBuffer {
+    uint rayQueue[];
+};
+
+layout(std430, binding = 17) buffer WavefrontCounterBuffer {
+    uint queueSizes[2];
+    // glDispatchComputeIndirect arguments covering each queue, with y and z always 1
+    uvec4 dispatchArgs[2];
+};
+
+uniform uint u_NumPaths;
+// Queue holding this bounce's rays, 0 or 1
+uniform uint u_QueueIndex;
+
+Ray getPathRay(Path path) {
+    Ray ray;
+    ray.origin = path.origin;
+    ray.dir = path.dir;
+    ray.invDir = 1.0f / ray.dir;
+    return ray;
+}
@@ -0,0 +1,40 @@
+// Wavefront stage 4: moves the paths still alive into the other queue and sizes the next bounce's dispatch.
+
+layout(local_size_x = WAVEFRONT_WORKGROUP_SIZE) in;
+
+shared uint aliveScan[WAVEFRONT_WORKGROUP_SIZE];
+shared uint groupQueueStart;
+
+void main() {
+    /*
+     * A prefix sum over the workgroup gives each survivor its place, so a group reserves its whole range
+     * with one atomic, and neighbouring paths, whose rays tend to be coherent, stay next to each other.
+     */
+    uint slot = gl_GlobalInvocationID.x;
+    uint localIndex = gl_LocalInvocationID.x;
+    uint nextQueue = 1u - u_QueueIndex;
+    uint pathIndex = 0u;
+    bool alive = false;
+    if (slot < queueSizes[u_QueueIndex]) {
+        pathIndex = rayQueue[u_QueueIndex * u_NumPaths + slot];
+        alive = (paths[pathIndex].bounce & PATH_DEAD_BIT) == 0u;
+    }
+    aliveScan[localIndex] = alive ? 1u : 0u;
+    barrier();
+    for (uint offset = 1u; offset < WAVEFRONT_WORKGROUP_SIZE; offset <<= 1) {
+        uint value = localIndex >= offset ? aliveScan[localIndex - offset] : 0u;
+        barrier();
+        aliveScan[localIndex] += value;
+        barrier();
+    }
+    if (localIndex == WAVEFRONT_WORKGROUP_SIZE - 1) {
+        uint numAlive = aliveScan[localIndex];
+        groupQueueStart = atomicAdd(queueSizes[nextQueue], numAlive);
+        uint queueEnd = groupQueueStart + numAlive;
+        atomicMax(dispatchArgs[nextQueue].x, (queueEnd + WAVEFRONT_WORKGROUP_SIZE - 1) / WAVEFRONT_WORKGROUP_SIZE);
+    }
+    barrier();
+    if (alive) {
+        rayQueue[nextQueue * u_NumPaths + groupQueueStart + aliveScan[localIndex] - 1u] = pathIndex;
+    }
+}
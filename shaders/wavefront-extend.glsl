@@ -0,0 +1,24 @@
+// Wavefront stage 2: finds the closest hit of every queued ray. Only traversal runs here, so invocations
+// stay busy with the same kind of work.
+
+layout(local_size_x = WAVEFRONT_WORKGROUP_SIZE) in;
+
+void main() {
+    uint slot = gl_GlobalInvocationID.x;
+    if (slot >= queueSizes[u_QueueIndex]) {
+        return;
+    }
+    uint pathIndex = rayQueue[u_QueueIndex * u_NumPaths + slot];
+    Ray ray = getPathRay(paths[pathIndex]);
+    if (paths[pathIndex].bounce == 0u) {
+        uint pixelIndex = pathIndex / RAYS_PER_PIXEL;
+        uvec2 screenCoords = uvec2(pixelIndex % uint(u_ScreenWidth), pixelIndex / uint(u_ScreenWidth));
+        hits[pathIndex] = getPrimaryHitInfo(ray, screenCoords);
+    } else {
+        hits[pathIndex] = getHitInfo(ray);
+    }
+#ifdef TEST_COUNTERS
+    paths[pathIndex].numBoxTests += uint(numBoxTests);
+    paths[pathIndex].numTriangleTests += uint(numTriangleTests);
+#endif
+}
@@ -0,0 +1,27 @@
+// Wavefront stage 1: starts one path per sample at the camera and queues every path for the first bounce.
+
+layout(local_size_x = WAVEFRONT_WORKGROUP_SIZE) in;
+
+void main() {
+    uint pathIndex = gl_GlobalInvocationID.x;
+    if (pathIndex >= u_NumPaths) {
+        return;
+    }
+    uint pixelIndex = pathIndex / RAYS_PER_PIXEL;
+    uint sampleIndex = pathIndex % RAYS_PER_PIXEL;
+    Ray ray = getCameraRay(uvec2(pixelIndex % uint(u_ScreenWidth), pixelIndex / uint(u_ScreenWidth)));
+    Path path;
+    path.origin = ray.origin;
+    path.bounce = 0u;
+    path.dir = ray.dir;
+    // The first sample of a pixel draws the same random numbers as the megakernel's first ray
+    path.randSeed = (pixelIndex + frameCount * 745621) ^ (sampleIndex * 0x9E3779B9u);
+    path.throughput = vec3(1.0f);
+    path.numBoxTests = 0u;
+    path.radiance = vec3(0.0f);
+    path.numTriangleTests = 0u;
+    path.bsdfPdf = 0.0f;
+    path.sampleIndex = frameCount * RAYS_PER_PIXEL + sampleIndex;
+    paths[pathIndex] = path;
+    rayQueue[pathIndex] = pathIndex;
+}
@@ -0,0 +1,23 @@
+// Wavefront stage 5: averages each pixel's samples once every path has ended and stores the frame.
+
+layout(local_size_x = 16, local_size_y = 16) in;
+
+void main() {
+    if (gl_GlobalInvocationID.x >= u_ScreenWidth || gl_GlobalInvocationID.y >= u_ScreenHeight) {
+        return;
+    }
+    uint pixelIndex = uint(gl_GlobalInvocationID.y * u_ScreenWidth + gl_GlobalInvocationID.x);
+    vec4 colour = BLACK;
+    for (uint i = 0u; i < RAYS_PER_PIXEL; i++) {
+        Path path = paths[pixelIndex * RAYS_PER_PIXEL + i];
+        colour += vec4(path.radiance, 1.0f);
+#ifdef TEST_COUNTERS
+        numBoxTests += int(path.numBoxTests);
+        numTriangleTests += int(path.numTriangleTests);
+        numReflections += int(path.bounce & ~PATH_DEAD_BIT);
+#endif
+    }
+    colour /= float(RAYS_PER_PIXEL);
+    float primaryDist = imageLoad(outputDepth, ivec2(gl_GlobalInvocationID.xy)).r;
+    storeFrameColour(ivec2(gl_GlobalInvocationID.xy), colour, primaryDist);
+}
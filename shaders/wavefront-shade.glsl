@@ -0,0 +1,33 @@
+// Wavefront stage 3: bounces every queued path off its hit, or ends it, exactly as the megakernel's getColour.
+
+layout(local_size_x = WAVEFRONT_WORKGROUP_SIZE) in;
+
+void main() {
+    uint slot = gl_GlobalInvocationID.x;
+    if (slot >= queueSizes[u_QueueIndex]) {
+        return;
+    }
+    uint pathIndex = rayQueue[u_QueueIndex * u_NumPaths + slot];
+    Path path = paths[pathIndex];
+    Ray ray = getPathRay(path);
+    randSeed = path.randSeed;
+    sampleSeed = hash(pathIndex / RAYS_PER_PIXEL);
+    sampleIndex = path.sampleIndex;
+    if (path.bounce == 0u && pathIndex % RAYS_PER_PIXEL == 0u) {
+        // The depth is kept for the resolve stage's reprojection
+        uint pixelIndex = pathIndex / RAYS_PER_PIXEL;
+        ivec2 screenCoords = ivec2(pixelIndex % uint(u_ScreenWidth), pixelIndex / uint(u_ScreenWidth));
+        storeGuides(screenCoords, hits[pathIndex], ray.dir);
+    }
+    if (bouncePath(ray, hits[pathIndex], path.bounce, path.throughput, path.radiance, path.bsdfPdf)) {
+        path.bounce++;
+        if (path.bounce >= RAY_BOUNCES)
+            path.bounce |= PATH_DEAD_BIT;
+    } else {
+        path.bounce |= PATH_DEAD_BIT;
+    }
+    path.origin = ray.origin;
+    path.dir = ray.dir;
+    path.randSeed = randSeed;
+    paths[pathIndex] = path;
+}
@@ -0,0 +1,125 @@
+#include "task-pool.h"
+
+#include <algorithm>
+
+static thread_local const TaskPool *currentPool = nullptr;
+static thread_local int currentWorkerIndex = 0;
+
+TaskPool::TaskPool(int numThreads) {
+    if (numThreads <= 0)
+        numThreads = (int) std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < numThreads; i++)
+        queues.push_back(std::make_unique<WorkQueue>());
+    for (int i = 1; i < numThreads; i++)
+        workers.emplace_back(&TaskPool::workerLoop, this, i);
+}
+
+TaskPool::~TaskPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    sleepCondition.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+int TaskPool::getWorkerIndex() const {
+    // Threads that do not belong to this pool share queue 0 with the pool's owner
+    return currentPool == this ? currentWorkerIndex : 0;
+}
+
+void TaskPool::submit(std::function<void()> task) {
+    WorkQueue &queue = *queues[getWorkerIndex()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        numPendingTasks++;
+    }
+    sleepCondition.notify_one();
+}
+
+bool TaskPool::popTask(int workerIndex, std::function<void()> &task) {
+    {
+        WorkQueue &own = *queues[workerIndex];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            numPendingTasks--;
+            return true;
+        }
+    }
+    for (int i = 1; i < (int) queues.size(); i++) {
+        WorkQueue &victim = *queues[(workerIndex + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            numPendingTasks--;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TaskPool::runPendingTask() {
+    std::function<void()> task;
+    if (!popTask(getWorkerIndex(), task))
+        return false;
+    task();
+    return true;
+}
+
+void TaskPool::workerLoop(int workerIndex) {
+    currentPool = this;
+    currentWorkerIndex = workerIndex;
+    std::function<void()> task;
+    while (true) {
+        if (popTask(workerIndex, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepCondition.wait(lock, [this] { return stopping || numPendingTasks > 0; });
+        if (stopping)
+            return;
+    }
+}
+
+void TaskGroup::run(std::function<void()> task) {
+    numRunning++;
+    pool.submit([this, task = std::move(task)] {
+        task();
+        numRunning--;
+    });
+}
+
+void TaskGroup::wait() {
+    while (numRunning > 0) {
+        if (!pool.runPendingTask())
+            std::this_thread::yield();
+    }
+}
+
+int getNumChunks(TaskPool &pool, int start, int end, int minChunkSize) {
+    return std::clamp((end - start) / std::max(1, minChunkSize), 1, 4 * pool.getNumThreads());
+}
+
+void parallelForChunks(TaskPool &pool, int start, int end, int minChunkSize,
+                       const std::function<void(int, int, int)> &fn) {
+    int numChunks = getNumChunks(pool, start, end, minChunkSize);
+    int chunkSize = (end - start + numChunks - 1) / numChunks;
+    TaskGroup group(pool);
+    for (int chunk = 1; chunk < numChunks; chunk++) {
+        int chunkStart = start + chunk * chunkSize;
+        int chunkEnd = std::min(end, chunkStart + chunkSize);
+        group.run([&fn, chunk, chunkStart, chunkEnd] { fn(chunk, chunkStart, chunkEnd); });
+    }
+    fn(0, start, std::min(end, start + chunkSize));
+    group.wait();
+}
@@ -0,0 +1,81 @@
+#ifndef OPENGL_RAYTRACER_TASK_POOL_H
+#define OPENGL_RAYTRACER_TASK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Work-stealing thread pool.
+ * Every worker owns a deque: it pushes and pops its own tasks at the back (depth-first),
+ * while idle workers steal from the front of other deques (breadth-first, i.e. the largest tasks).
+ * The thread that constructs the pool acts as worker 0 whenever it waits on a TaskGroup,
+ * so a pool of N threads spawns N - 1 background workers.
+ */
+class TaskPool {
+public:
+    explicit TaskPool(int numThreads = 0);
+    ~TaskPool();
+
+    TaskPool(const TaskPool &) = delete;
+    TaskPool &operator=(const TaskPool &) = delete;
+
+    int getNumThreads() const { return (int) queues.size(); }
+
+    void submit(std::function<void()> task);
+
+    // Runs one pending task on the calling thread, returning false if there was none.
+    bool runPendingTask();
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<int> numPendingTasks = 0;
+    std::atomic<bool> stopping = false;
+    std::mutex sleepMutex;
+    std::condition_variable sleepCondition;
+
+    int getWorkerIndex() const;
+    bool popTask(int workerIndex, std::function<void()> &task);
+    void workerLoop(int workerIndex);
+};
+
+/*
+ * A set of tasks that can be waited on together.
+ * wait() executes pending tasks on the calling thread instead of blocking it,
+ * so tasks may fork and wait on nested groups without starving the pool.
+ */
+class TaskGroup {
+public:
+    explicit TaskGroup(TaskPool &pool) : pool(pool) {}
+    ~TaskGroup() { wait(); }
+
+    void run(std::function<void()> task);
+    void wait();
+
+private:
+    TaskPool &pool;
+    std::atomic<int> numRunning = 0;
+};
+
+/*
+ * Splits [start, end) into chunks of at least minChunkSize and runs fn(chunkIndex, chunkStart, chunkEnd)
+ * for each chunk in parallel. Chunk boundaries depend only on the range, the chunk size and the
+ * number of threads in the pool, so per-chunk results can be merged deterministically.
+ */
+extern int getNumChunks(TaskPool &pool, int start, int end, int minChunkSize);
+
+extern void parallelForChunks(TaskPool &pool, int start, int end, int minChunkSize,
+                              const std::function<void(int, int, int)> &fn);
+
+#endif //OPENGL_RAYTRACER_TASK_POOL_H
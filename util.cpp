@@ -26,10 +26,25 @@ std::string loadShaderCodeFromFile(const std::string& filePath) {
 }
 
 GLuint importAndCompileShader(const std::string& path, GLenum shaderType) {
-    std::string shaderCode = loadShaderCodeFromFile(path);
-    const char *shaderSource = shaderCode.c_str();
+    return importAndCompileShader(std::vector<std::string>{path}, shaderType);
+}
+
+GLuint importAndCompileShader(const std::vector<std::string>& paths, GLenum shaderType, const std::string& defines) {
+    std::vector<std::string> shaderCode;
+    std::vector<const char *> shaderSources;
+    for (const std::string &path : paths)
+        shaderCode.push_back(loadShaderCodeFromFile(path));
+    if (!defines.empty()) {
+        // Nothing but comments may precede #version, so the defines follow the end of its line
+        size_t versionEnd = shaderCode.front().find('\n', shaderCode.front().find("#version"));
+        if (versionEnd == std::string::npos)
+            throw std::runtime_error("No #version line to insert shader defines after in: " + paths.front());
+        shaderCode.front().insert(versionEnd + 1, defines);
+    }
+    for (const std::string &code : shaderCode)
+        shaderSources.push_back(code.c_str());
     GLuint shader = glCreateShader(shaderType);
-    glShaderSource(shader, 1, &shaderSource, nullptr);
+    glShaderSource(shader, (GLsizei) shaderSources.size(), shaderSources.data(), nullptr);
     glCompileShader(shader);
     int success;
     char infoLog[512];
@@ -40,3 +55,10 @@ GLuint importAndCompileShader(const std::string& path, GLenum shaderType) {
     }
     return shader;
 }
+
+std::string getShaderDefines(const std::vector<std::pair<std::string, int>>& defines) {
+    std::string lines;
+    for (const auto &[name, value] : defines)
+        lines += "#define " + name + " " + std::to_string(value) + "\n";
+    return lines;
+}
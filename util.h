@@ -1,6 +1,10 @@
 #ifndef OPENGL_RAYTRACER_UTIL_H
 #define OPENGL_RAYTRACER_UTIL_H
 #pragma once
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "glad/glad.h"
 
 extern void checkGLError(const std::string& label);
@@ -9,6 +13,17 @@ extern std::string loadShaderCodeFromFile(const std::string& filePath);
 
 extern GLuint importAndCompileShader(const std::string& path, GLenum shaderType);
 
+/*
+ * Compiles the concatenation of several source files, the first of which holds the #version line.
+ * defines, a block of #define lines, is inserted right after that line, so that variants of the same source
+ * can be compiled with different constants.
+ */
+extern GLuint importAndCompileShader(const std::vector<std::string>& paths, GLenum shaderType,
+                                     const std::string& defines = "");
+
+// #define lines for importAndCompileShader, one per name and value
+extern std::string getShaderDefines(const std::vector<std::pair<std::string, int>>& defines);
+
 template<typename... Args>
 GLuint generateProgram(Args... shaders) {
     GLuint program = glCreateProgram();
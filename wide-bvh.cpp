@@ -0,0 +1,288 @@
+#include "wide-bvh.h"
+
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <cmath>
+
+#include "task-pool.h"
+#include "profiler.h"
+
+struct WideBVHBuildState {
+    std::span<const BVHNode> binaryNodes;
+    std::vector<WideBVHNode> &nodes;
+    WideBVHStats &stats;
+    float costSum = 0.0f;
+};
+
+static void setChildBounds(WideBVHNode &node, int slot, glm::vec3 minCorner, glm::vec3 maxCorner) {
+    node.minX[slot] = minCorner.x;
+    node.minY[slot] = minCorner.y;
+    node.minZ[slot] = minCorner.z;
+    node.maxX[slot] = maxCorner.x;
+    node.maxY[slot] = maxCorner.y;
+    node.maxZ[slot] = maxCorner.z;
+}
+
+static void setChildBounds(WideBVHNode &node, int slot, const BVHNode &child) {
+    setChildBounds(node, slot, child.minCorner, child.maxCorner);
+}
+
+static std::vector<uint32_t> getWideChildren(std::span<const BVHNode> binaryNodes, uint32_t binaryIndex) {
+    /*
+     * Picks the binary nodes that become the children of a wide node, starting from the binary node's
+     * own children and repeatedly pulling up the grandchildren of one of them.
+     * Pulling up a child removes its traversal step, which the SAH weights by the child's surface area,
+     * so the interior child with the largest surface area is opened first.
+     */
+    const BVHNode &node = binaryNodes[binaryIndex];
+    if (node.isLeaf())
+        return {binaryIndex};
+    std::vector<uint32_t> children = {node.leftOrStart, node.rightOrCount};
+    while (children.size() < BVH_WIDTH) {
+        const int numChildren = (int) children.size();
+        int best = -1;
+        float bestArea = -1.0f;
+        for (int i = 0; i < numChildren; i++) {
+            const BVHNode &child = binaryNodes[children[i]];
+            float area = getSA(child.minCorner, child.maxCorner);
+            if (!child.isLeaf() && area > bestArea) {
+                best = i;
+                bestArea = area;
+            }
+        }
+        if (best == -1)
+            break;
+        const BVHNode &opened = binaryNodes[children[best]];
+        children[best] = opened.leftOrStart;
+        children.push_back(opened.rightOrCount);
+    }
+    return children;
+}
+
+static uint32_t collapseBVHNode(WideBVHBuildState &state, uint32_t binaryIndex, int depth) {
+    auto index = (uint32_t) state.nodes.size();
+    state.nodes.emplace_back();
+    state.stats.depth = std::max(state.stats.depth, depth);
+    const BVHNode &binaryNode = state.binaryNodes[binaryIndex];
+    state.costSum += BVH_TRAVERSAL_COST * getSA(binaryNode.minCorner, binaryNode.maxCorner);
+    std::vector<uint32_t> children = getWideChildren(state.binaryNodes, binaryIndex);
+    state.stats.averageChildren += (float) children.size();
+    const int numChildren = (int) children.size();
+    WideBVHNode node;
+    for (int slot = 0; slot < BVH_WIDTH; slot++) {
+        if (slot >= numChildren) {
+            setChildBounds(node, slot, {MAX_VERTEX, 0, MAX_VERTEX, 0});
+            node.children[slot] = WIDE_BVH_EMPTY_SLOT;
+            node.counts[slot] = 0;
+            continue;
+        }
+        const BVHNode &child = state.binaryNodes[children[slot]];
+        setChildBounds(node, slot, child);
+        if (child.isLeaf()) {
+            node.children[slot] = child.leftOrStart;
+            node.counts[slot] = child.rightOrCount;
+            state.stats.numLeaves++;
+            state.costSum += BVH_INTERSECTION_COST * (float) child.getTriangleCount() *
+                             getSA(child.minCorner, child.maxCorner);
+        } else {
+            node.children[slot] = collapseBVHNode(state, children[slot], depth + 1);
+            node.counts[slot] = 0;
+        }
+    }
+    state.nodes[index] = node;
+    return index;
+}
+
+std::vector<WideBVHNode> collapseBVH(std::span<const BVHNode> binaryNodes, bool printStats, WideBVHStats *stats) {
+    PROFILE_SCOPE("COLLAPSE BVH");
+    std::vector<WideBVHNode> nodes;
+    WideBVHStats wideStats;
+    WideBVHBuildState state{binaryNodes, nodes, wideStats};
+    collapseBVHNode(state, 0, 0);
+    wideStats.numNodes = (int) nodes.size();
+    wideStats.averageChildren /= (float) wideStats.numNodes;
+    wideStats.sahCost = state.costSum / getSA(binaryNodes[0].minCorner, binaryNodes[0].maxCorner);
+    if (stats != nullptr)
+        *stats = wideStats;
+    if (printStats) {
+        std::cout << "GENERATED " << wideStats.numNodes << " WIDE BVH NODES ("
+                  << wideStats.numNodes * sizeof(WideBVHNode) / 1024 << " KB)" << std::endl;
+        std::cout << "WIDE BVH WIDTH: " << BVH_WIDTH << std::endl;
+        std::cout << "WIDE BVH DEPTH: " << wideStats.depth << std::endl;
+        std::cout << "WIDE BVH AVERAGE CHILDREN: " << wideStats.averageChildren << std::endl;
+        std::cout << "WIDE BVH SAH COST: " << wideStats.sahCost << std::endl;
+    }
+    return nodes;
+}
+
+void refitWideBVH(std::span<WideBVHNode> nodes, std::span<const uint32_t> triangleIndices,
+                  const std::vector<glm::uvec3> &triangleVertexIndices, const std::vector<glm::vec3> &vertices,
+                  TaskPool *pool) {
+    /*
+     * Leaf slots are refit in parallel from their triangles, then a backwards serial pass
+     * sets every interior slot to the union of its child node's slots.
+     */
+    auto refitLeaves = [&](int, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++) {
+            for (int slot = 0; slot < BVH_WIDTH; slot++) {
+                uint32_t count = nodes[i].counts[slot];
+                if (nodes[i].children[slot] == WIDE_BVH_EMPTY_SLOT || (count & BVH_LEAF_BIT) == 0)
+                    continue;
+                glm::vec3 minCorner = MAX_VERTEX, maxCorner = MIN_VERTEX;
+                uint32_t start = nodes[i].children[slot];
+                for (uint32_t j = start; j < start + (count & ~BVH_LEAF_BIT); j++) {
+                    const glm::uvec3 &triangle = triangleVertexIndices[triangleIndices[j]];
+                    for (int k = 0; k < 3; k++) {
+                        minCorner = min(minCorner, vertices[triangle[k]]);
+                        maxCorner = max(maxCorner, vertices[triangle[k]]);
+                    }
+                }
+                setChildBounds(nodes[i], slot, minCorner, maxCorner);
+            }
+        }
+    };
+    if (pool != nullptr)
+        parallelForChunks(*pool, 0, (int) nodes.size(), BVH_PARALLEL_CHUNK_SIZE / BVH_WIDTH, refitLeaves);
+    else
+        refitLeaves(0, 0, (int) nodes.size());
+    for (int i = (int) nodes.size() - 1; i >= 0; i--) {
+        for (int slot = 0; slot < BVH_WIDTH; slot++) {
+            if (nodes[i].children[slot] == WIDE_BVH_EMPTY_SLOT || nodes[i].counts[slot] != 0)
+                continue;
+            const WideBVHNode &child = nodes[nodes[i].children[slot]];
+            glm::vec3 minCorner = MAX_VERTEX, maxCorner = MIN_VERTEX;
+            for (int childSlot = 0; childSlot < BVH_WIDTH; childSlot++) {
+                if (child.children[childSlot] == WIDE_BVH_EMPTY_SLOT)
+                    continue;
+                minCorner = min(minCorner, glm::vec3(child.minX[childSlot], child.minY[childSlot],
+                                                     child.minZ[childSlot]));
+                maxCorner = max(maxCorner, glm::vec3(child.maxX[childSlot], child.maxY[childSlot],
+                                                     child.maxZ[childSlot]));
+            }
+            setChildBounds(nodes[i], slot, minCorner, maxCorner);
+        }
+    }
+}
+
+static bool reachesMax(float origin, float max, uint32_t exponent) {
+    return origin + 255.0f * std::bit_cast<float>(exponent << 23) >= max;
+}
+
+static uint32_t getQuantizationExponent(float origin, float max) {
+    /*
+     * Smallest normal power of two scale whose 255 steps from the origin reach max, as the decoder rounds them,
+     * returned as the scale's biased exponent. frexp gives the exponent of the exact scale, which rounding
+     * can leave one step off either way.
+     */
+    int exponent;
+    std::frexp(((double) max - (double) origin) / 255.0, &exponent);
+    auto biased = (uint32_t) std::clamp(exponent + 127, 1, 254);
+    while (biased > 1 && reachesMax(origin, max, biased - 1))
+        biased--;
+    while (biased < 254 && !reachesMax(origin, max, biased))
+        biased++;
+    return biased;
+}
+
+static CompressedBVHNode compressBVHNode(const WideBVHNode &node) {
+    /*
+     * Rounds each child's bounds outwards to the grid, then steps any coordinate that float rounding still left
+     * inside the exact box one further out, so that decoding never shrinks a box.
+     */
+    CompressedBVHNode compressedNode{};
+    int numChildren = 0;
+    while (numChildren < BVH_WIDTH && node.children[numChildren] != WIDE_BVH_EMPTY_SLOT)
+        numChildren++;
+    glm::vec3 minCorner = MAX_VERTEX, maxCorner = MIN_VERTEX;
+    for (int slot = 0; slot < numChildren; slot++) {
+        minCorner = min(minCorner, glm::vec3(node.minX[slot], node.minY[slot], node.minZ[slot]));
+        maxCorner = max(maxCorner, glm::vec3(node.maxX[slot], node.maxY[slot], node.maxZ[slot]));
+    }
+    compressedNode.origin = minCorner;
+    for (int axis = 0; axis < 3; axis++) {
+        const glm::vec4 &childMins = axis == 0 ? node.minX : axis == 1 ? node.minY : node.minZ;
+        const glm::vec4 &childMaxes = axis == 0 ? node.maxX : axis == 1 ? node.maxY : node.maxZ;
+        const float origin = minCorner[axis];
+        uint32_t exponent = getQuantizationExponent(origin, maxCorner[axis]);
+        compressedNode.exponents |= exponent << (8 * axis);
+        const float scale = std::bit_cast<float>(exponent << 23);
+        for (int slot = 0; slot < numChildren; slot++) {
+            auto min = (uint32_t) std::clamp(std::floor(((double) childMins[slot] - origin) / scale), 0.0, 255.0);
+            while (min > 0 && origin + (float) min * scale > childMins[slot])
+                min--;
+            auto max = (uint32_t) std::clamp(std::ceil(((double) childMaxes[slot] - origin) / scale), 0.0, 255.0);
+            while (max < 255 && origin + (float) max * scale < childMaxes[slot])
+                max++;
+            compressedNode.quantizedMin[axis] |= min << (8 * slot);
+            compressedNode.quantizedMax[axis] |= max << (8 * slot);
+        }
+    }
+    for (int slot = 0; slot < BVH_WIDTH; slot++) {
+        uint32_t count = (node.counts[slot] & BVH_LEAF_BIT) != 0 ?
+                         COMPRESSED_BVH_LEAF_BIT | (node.counts[slot] & ~BVH_LEAF_BIT) : 0;
+        compressedNode.counts[slot / 2] |= count << (16 * (slot % 2));
+    }
+    compressedNode.children = node.children;
+    return compressedNode;
+}
+
+void compressBVH(std::span<const WideBVHNode> nodes, std::span<CompressedBVHNode> compressedNodes, TaskPool *pool) {
+    PROFILE_SCOPE("COMPRESS BVH");
+    for (const WideBVHNode &node : nodes) {
+        for (int slot = 0; slot < BVH_WIDTH; slot++) {
+            uint32_t count = node.counts[slot] & ~BVH_LEAF_BIT;
+            if (node.children[slot] != WIDE_BVH_EMPTY_SLOT && count > COMPRESSED_BVH_MAX_LEAF_SIZE)
+                throw std::runtime_error("Leaf of " + std::to_string(count) +
+                                         " triangles is too large for a compressed BVH node");
+        }
+    }
+    auto compressNodes = [&](int, int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++)
+            compressedNodes[i] = compressBVHNode(nodes[i]);
+    };
+    if (pool != nullptr)
+        parallelForChunks(*pool, 0, (int) nodes.size(), BVH_PARALLEL_CHUNK_SIZE / BVH_WIDTH, compressNodes);
+    else
+        compressNodes(0, 0, (int) nodes.size());
+}
+
+CompressedBVHValidation validateCompressedBVH(std::span<const WideBVHNode> nodes,
+                                              std::span<const CompressedBVHNode> compressedNodes) {
+    CompressedBVHValidation validation;
+    double areaRatioSum = 0.0;
+    int numAreas = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const WideBVHNode &node = nodes[i];
+        WideBVHNode decoded = decodeCompressedBVHNode(compressedNodes[i]);
+        for (int slot = 0; slot < BVH_WIDTH; slot++) {
+            if (node.children[slot] == WIDE_BVH_EMPTY_SLOT && decoded.children[slot] == WIDE_BVH_EMPTY_SLOT)
+                continue;
+            validation.numChildren++;
+            glm::vec3 exactMin(node.minX[slot], node.minY[slot], node.minZ[slot]);
+            glm::vec3 exactMax(node.maxX[slot], node.maxY[slot], node.maxZ[slot]);
+            glm::vec3 decodedMin(decoded.minX[slot], decoded.minY[slot], decoded.minZ[slot]);
+            glm::vec3 decodedMax(decoded.maxX[slot], decoded.maxY[slot], decoded.maxZ[slot]);
+            bool contains = all(lessThanEqual(decodedMin, exactMin)) && all(greaterThanEqual(decodedMax, exactMax));
+            if (!contains || decoded.children[slot] != node.children[slot] || decoded.counts[slot] != node.counts[slot])
+                validation.numInvalidChildren++;
+            float exactArea = getSA(exactMin, exactMax);
+            if (exactArea > 0.0f) {
+                areaRatioSum += getSA(decodedMin, decodedMax) / exactArea;
+                numAreas++;
+            }
+        }
+    }
+    validation.averageAreaRatio = numAreas == 0 ? 1.0f : (float) (areaRatioSum / numAreas);
+    return validation;
+}
+
+void printCompressedBVHStats(std::span<const WideBVHNode> nodes, std::span<const CompressedBVHNode> compressedNodes) {
+    CompressedBVHValidation validation = validateCompressedBVH(nodes, compressedNodes);
+    std::cout << "GENERATED " << compressedNodes.size() << " COMPRESSED BVH NODES ("
+              << compressedNodes.size_bytes() / 1024 << " KB)" << std::endl;
+    std::cout << "COMPRESSED BVH AVERAGE AREA RATIO: " << validation.averageAreaRatio << std::endl;
+    std::cout << "COMPRESSED BVH INVALID CHILDREN: " << validation.numInvalidChildren << " OF "
+              << validation.numChildren << std::endl;
+}
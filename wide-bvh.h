@@ -0,0 +1,140 @@
+#ifndef OPENGL_RAYTRACER_WIDE_BVH_H
+#define OPENGL_RAYTRACER_WIDE_BVH_H
+
+#include "glm/glm.hpp"
+
+#include <vector>
+#include <span>
+#include <bit>
+#include <cstdint>
+
+#include "bvh.h"
+
+#define WIDE_BVH_EMPTY_SLOT 0xFFFFFFFFu
+
+/*
+ * 4-wide node, matching the std430 layout of WideBVHNode in raytrace-common.glsl.
+ * Child bounds are stored per axis (SoA), so one ray can be tested against all four child boxes at once.
+ * For each child slot, counts is 0 for interior children (children holds the wide node index),
+ * BVH_LEAF_BIT | triangle count for leaves stored inline (children holds the first triangle),
+ * and unused slots, which are always last, hold WIDE_BVH_EMPTY_SLOT in children.
+ */
+struct WideBVHNode {
+    glm::vec4 minX, minY, minZ;
+    glm::vec4 maxX, maxY, maxZ;
+    glm::uvec4 children;
+    glm::uvec4 counts;
+};
+
+static_assert(sizeof(WideBVHNode) == 32 * BVH_WIDTH, "WideBVHNode must match the shader's wide node");
+
+// Leaf flag of a child's 16 bit count in a CompressedBVHNode, the rest of which is the leaf's triangle count
+#define COMPRESSED_BVH_LEAF_BIT 0x8000u
+#define COMPRESSED_BVH_MAX_LEAF_SIZE 0x7FFFu
+
+/*
+ * Half-size wide node, matching the std430 layout of CompressedBVHNode in raytrace-common.glsl, with the same children
+ * as the WideBVHNode at the same index. Child bounds are 8 bit coordinates on a grid over the node's bounds:
+ * on each axis, a child spans origin + scale * [min, max], where scale is the power of two whose IEEE biased exponent
+ * is that axis's byte of exponents. The coordinates are rounded outwards, so the decoded boxes contain the exact ones.
+ * quantizedMin and quantizedMax hold one axis per word and one child per byte, lowest byte first.
+ * counts packs two 16 bit counts per word: 0 for interior children and COMPRESSED_BVH_LEAF_BIT | triangle count
+ * for leaves. children is the same as in WideBVHNode.
+ */
+struct CompressedBVHNode {
+    glm::vec3 origin;
+    uint32_t exponents;
+    uint32_t quantizedMin[3];
+    uint32_t quantizedMax[3];
+    uint32_t counts[2];
+    glm::uvec4 children;
+};
+
+static_assert(sizeof(CompressedBVHNode) == 64, "CompressedBVHNode must match the shader's compressed node");
+
+struct WideBVHStats {
+    int numNodes = 0;
+    int numLeaves = 0;
+    int depth = 0;
+    float averageChildren = 0.0f;
+    float sahCost = 0.0f;
+};
+
+/*
+ * Collapses a binary BVH into a BVH_WIDTH-wide one, with the root at index 0.
+ * Leaf ranges are unchanged, so the triangle order of the binary build still applies.
+ */
+extern std::vector<WideBVHNode> collapseBVH(std::span<const BVHNode> binaryNodes, bool printStats = true,
+                                            WideBVHStats* stats = nullptr);
+
+/*
+ * Wide counterpart of refitBVH: recomputes every child's bounds from moved vertices in O(n),
+ * keeping the tree's topology. Relies on children coming after their parents, as collapseBVH writes them.
+ */
+extern void refitWideBVH(std::span<WideBVHNode> nodes, std::span<const uint32_t> triangleIndices,
+                         const std::vector<glm::uvec3>& triangleVertexIndices, const std::vector<glm::vec3>& vertices,
+                         TaskPool* pool = nullptr);
+
+/*
+ * Encodes every wide node into the compressed node at the same index, in parallel when a pool is given.
+ * Throws if a leaf has more triangles than a compressed count holds.
+ */
+extern void compressBVH(std::span<const WideBVHNode> nodes, std::span<CompressedBVHNode> compressedNodes,
+                        TaskPool* pool = nullptr);
+
+/*
+ * A compressed child's count in the form of WideBVHNode's counts
+ */
+inline uint32_t getCompressedChildCount(const CompressedBVHNode& node, int slot) {
+    uint32_t count = (node.counts[slot / 2] >> (16 * (slot % 2))) & 0xFFFFu;
+    // Moves the leaf flag up to BVH_LEAF_BIT, leaving interior children's counts at 0
+    return ((count & COMPRESSED_BVH_LEAF_BIT) << 16) | (count & COMPRESSED_BVH_MAX_LEAF_SIZE);
+}
+
+/*
+ * Expands a compressed node back into a wide node, with each child's box as traversal decodes it.
+ * Inline, since the CPU raytracer decodes every node it visits.
+ */
+inline WideBVHNode decodeCompressedBVHNode(const CompressedBVHNode& compressedNode) {
+    WideBVHNode node;
+    glm::vec3 scale;
+    for (int axis = 0; axis < 3; axis++)
+        scale[axis] = std::bit_cast<float>(((compressedNode.exponents >> (8 * axis)) & 0xFFu) << 23);
+    for (int slot = 0; slot < BVH_WIDTH; slot++) {
+        glm::vec3 minCorner, maxCorner;
+        for (int axis = 0; axis < 3; axis++) {
+            auto min = (float) ((compressedNode.quantizedMin[axis] >> (8 * slot)) & 0xFFu);
+            auto max = (float) ((compressedNode.quantizedMax[axis] >> (8 * slot)) & 0xFFu);
+            minCorner[axis] = compressedNode.origin[axis] + min * scale[axis];
+            maxCorner[axis] = compressedNode.origin[axis] + max * scale[axis];
+        }
+        node.minX[slot] = minCorner.x;
+        node.minY[slot] = minCorner.y;
+        node.minZ[slot] = minCorner.z;
+        node.maxX[slot] = maxCorner.x;
+        node.maxY[slot] = maxCorner.y;
+        node.maxZ[slot] = maxCorner.z;
+        node.counts[slot] = getCompressedChildCount(compressedNode, slot);
+    }
+    node.children = compressedNode.children;
+    return node;
+}
+
+struct CompressedBVHValidation {
+    // Children whose decoded box does not contain their exact box, or whose child index or count changed
+    int numInvalidChildren = 0;
+    int numChildren = 0;
+    // Mean ratio of the decoded to the exact surface area of the children's boxes
+    float averageAreaRatio = 0.0f;
+};
+
+/*
+ * Checks every compressed node against the wide node it was encoded from
+ */
+extern CompressedBVHValidation validateCompressedBVH(std::span<const WideBVHNode> nodes,
+                                                     std::span<const CompressedBVHNode> compressedNodes);
+
+extern void printCompressedBVHStats(std::span<const WideBVHNode> nodes,
+                                    std::span<const CompressedBVHNode> compressedNodes);
+
+#endif //OPENGL_RAYTRACER_WIDE_BVH_H